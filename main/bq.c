@@ -12,30 +12,528 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
+#include <sys/param.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "freertos/queue.h"
 #include "esp_console.h"
 #include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_rom_sys.h"
+#include "nvs.h"
 #include "argtable3/argtable3.h"
 #include "bq.h"
+#include "bq_anomaly.h"
+#include "bq_capture.h"
+#include "bq_coop.h"
+#include "bq_forensics.h"
+#include "bq_health.h"
+#include "bq_history.h"
+#include "bq_ocv.h"
+#include "bq_poll.h"
+#include "bq_soc.h"
+#include "bq_sync.h"
+#include "bq_telem.h"
+#include "i2c.h"
+#include "smbus.h"
+#include "timebase.h"
 
-#define COUNT(x) (sizeof(x) / sizeof((x)[0]))
+// ──────────────────────────────────────────────────────────────────────────────
+//  Configuration
+// ──────────────────────────────────────────────────────────────────────────────
+
+static const char *TAG = "bq";
+
+/// Retry budget when the gauge answered the previous access (busy / stretching)
+#define BQ_BUSY_BUDGET_MS 40
+
+/// NVS location of the pack table
+#define BQ_PACK_NVS_NAMESPACE "bq_pack"
+#define BQ_PACK_NVS_KEY "packs"
+
+/// Pack slots; addr == 0 marks an unused slot. Slot 0 defaults to the gauge
+/// directly on the bus so a single-pack setup needs no configuration.
+static bq_dev_t s_bq_packs[BQ_MAX_PACKS] = {
+    [0] = {
+        .addr = BQ40Z555_I2C_ADDR,
+        .mux_channel = -1,
+        .wake_delay_ms = BQ_RETRY_DELAY_MIN_MS,
+    },
+};
+/// Pack used by the interactive commands (bq_show, bq_lifetime, ...)
+static int s_bq_selected = 0;
+/// Channel currently enabled on the mux, -1 = none (power-up state), -2 = unknown
+static int8_t s_mux_channel = -1;
 
 // ──────────────────────────────────────────────────────────────────────────────
-//  Utility
+//  Sleep/wake-aware access policy
 // ──────────────────────────────────────────────────────────────────────────────
-static inline uint16_t le16(const uint8_t *p)
+static void bq_delay_ms(uint32_t ms)
+{
+    /* vTaskDelay() would round sub-tick waits down to zero */
+    if (ms < portTICK_PERIOD_MS)
+    {
+        esp_rom_delay_us(ms * 1000);
+    }
+    else
+    {
+        vTaskDelay(pdMS_TO_TICKS(ms));
+    }
+}
+
+/* Route the bus to the pack's mux channel; the caller holds the bus lock. */
+static int bq_mux_select(const bq_dev_t *dev)
+{
+    if (dev->mux_channel == s_mux_channel)
+    {
+        return 0;
+    }
+
+    /* direct packs get all channels switched off so muxed twins don't collide */
+    uint8_t mask = dev->mux_channel < 0 ? 0 : (uint8_t)(1u << dev->mux_channel);
+    int err = i2c_write(BQ_MUX_I2C_ADDR, &mask, sizeof(mask));
+    s_mux_channel = err ? -2 : dev->mux_channel;
+    return err;
+}
+
+/* One attempt at the `n` transactions of `x`, back to back with the bus held */
+static int bq_xfer_once(bq_dev_t *dev, smbus_xfer_t *x, int n)
+{
+    i2c_lock();
+    int err = bq_mux_select(dev);
+    for (int i = 0; i < n && !err; i++)
+    {
+        x[i].addr = dev->addr;
+        err = smbus_run(&x[i]);
+    }
+    i2c_unlock();
+    if (err == ESP_ERR_INVALID_CRC)
+    {
+        dev->pec_errors++;
+    }
+    return err;
+}
+
+/* Address-only access: wakes a sleeping gauge, ESP_FAIL if nothing acknowledges the address */
+static int bq_wake(bq_dev_t *dev)
+{
+    smbus_xfer_t x = {0};
+
+    dev->wakes++;
+    i2c_lock();
+    int err = bq_mux_select(dev);
+    if (!err)
+    {
+        err = smbus_quick(&x, dev->addr);
+    }
+    i2c_unlock();
+    return err;
+}
+
+/**
+ * @brief Run the `n` SMBus transactions of `x`, waking the gauge if needed.
+ *
+ * Each attempt runs all of them with the bus held, so nothing gets in
+ * between e.g. a sub-command write and the read of its response; the bus is
+ * free again during the retry delays and a retry starts over with `x[0]`. A NACK triggers an address-only wake access, then the transfer is retried
+ * after a delay that starts at the learned wake time and doubles up to
+ * BQ_RETRY_DELAY_MAX_MS. A timeout (clock stretched too long) or a bad PEC
+ * means the gauge is there and busy, so it is only retried. A gauge that
+ * still does not acknowledge its address once it had a retry delay to wake
+ * up is given up on at once. A gauge that was answering a moment ago only
+ * gets a short busy budget; an unresponsive one fails fast so queued reads
+ * are not each burning a timeout.
+ */
+static int bq_xfer_seq(bq_dev_t *dev, smbus_xfer_t *x, int n)
+{
+    for (int i = 0; i < n; i++)
+    {
+        x[i].pec = dev->pec;
+    }
+    dev->accesses++;
+    int err = bq_xfer_once(dev, x, n);
+    if (!err)
+    {
+        dev->state = BQ_STATE_AWAKE;
+        return 0;
+    }
+    dev->nacks++;
+
+    if (dev->state == BQ_STATE_UNRESPONSIVE)
+    {
+        return err;
+    }
+
+    int64_t budget_us = (dev->state == BQ_STATE_AWAKE ? BQ_BUSY_BUDGET_MS : BQ_WAKE_BUDGET_MS) * 1000LL;
+    int64_t start = esp_timer_get_time();
+    uint32_t delay = dev->wake_delay_ms;
+    int retries = 0;
+
+    /* a sleeping gauge may NACK its address until this woke it */
+    if (err == ESP_FAIL)
+    {
+        bq_wake(dev);
+    }
+
+    while (err && esp_timer_get_time() - start + delay * 1000LL <= budget_us)
+    {
+        bq_delay_ms(delay);
+        retries++;
+        err = bq_xfer_once(dev, x, n);
+        if (!err)
+        {
+            break;
+        }
+        dev->nacks++;
+        /* NACKed again: busy with data flash if the address is acknowledged, absent if not */
+        if (err == ESP_FAIL && bq_wake(dev) == ESP_FAIL)
+        {
+            break;
+        }
+        delay = MIN(delay * 2, BQ_RETRY_DELAY_MAX_MS);
+    }
+
+    if (err)
+    {
+        dev->state = BQ_STATE_UNRESPONSIVE;
+        dev->failures++;
+        return err;
+    }
+
+    /* Learn the wake time: probe a bit earlier next time if the first retry
+     * already worked, otherwise start with what was needed now. */
+    if (retries == 1)
+    {
+        uint32_t wake_ms = dev->wake_delay_ms;
+        dev->wake_delay_ms = MAX(BQ_RETRY_DELAY_MIN_MS, wake_ms - wake_ms / 4);
+    }
+    else
+    {
+        uint32_t waited_ms = (uint32_t)((esp_timer_get_time() - start) / 1000);
+        dev->wake_delay_ms = MIN(MAX(waited_ms, BQ_RETRY_DELAY_MIN_MS), BQ_RETRY_DELAY_MAX_MS);
+    }
+    dev->state = BQ_STATE_AWAKE;
+    return 0;
+}
+
+static int bq_xfer(bq_dev_t *dev, smbus_xfer_t *x)
+{
+    return bq_xfer_seq(dev, x, 1);
+}
+
+/**
+ * @brief Read SBS command `cmd` (see bq_xfer() for the retry policy).
+ *
+ * `rlen` 1 or 2 is a read byte / word; anything longer is a block read,
+ * returned as on the wire: the count byte followed by `rlen` - 1 bytes.
+ */
+int bq_read(bq_dev_t *dev, uint8_t cmd, uint8_t *rdata, size_t rlen)
+{
+    smbus_xfer_t x = {.cmd = cmd};
+
+    if (!rlen || rlen > 1 + SMBUS_BLOCK_MAX)
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    if (rlen <= 2)
+    {
+        x.op = rlen == 1 ? SMBUS_READ_BYTE : SMBUS_READ_WORD;
+    }
+    else
+    {
+        x.op = SMBUS_BLOCK_READ;
+        x.rmax = (uint8_t)(rlen - 1);
+    }
+
+    int err = bq_xfer(dev, &x);
+    if (err)
+    {
+        return err;
+    }
+    if (x.op == SMBUS_BLOCK_READ)
+    {
+        rdata[0] = x.rlen;
+        memcpy(&rdata[1], x.rdata, rlen - 1);
+    }
+    else
+    {
+        memcpy(rdata, x.rdata, rlen);
+    }
+    return 0;
+}
+
+/**
+ * @brief Write `len` bytes to SBS command `cmd`: a write byte / word for 1
+ *        or 2 bytes, a block write (with count byte) otherwise.
+ */
+int bq_write(bq_dev_t *dev, uint8_t cmd, const uint8_t *data, size_t len)
+{
+    smbus_xfer_t x = {.cmd = cmd};
+
+    if (!len || len > SMBUS_BLOCK_MAX)
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    x.op = len == 1 ? SMBUS_WRITE_BYTE : len == 2 ? SMBUS_WRITE_WORD : SMBUS_BLOCK_WRITE;
+    x.wlen = (uint8_t)len;
+    memcpy(x.wdata, data, len);
+    return bq_xfer(dev, &x);
+}
+
+/**
+ * @brief SBS block read in a single transaction.
+ *
+ * Reads the length byte and up to `max` payload bytes at once instead of
+ * fetching the length first. `data` receives the payload, `len` its length
+ * as reported by the gauge (clipped to `max`).
+ */
+int bq_read_block(bq_dev_t *dev, uint8_t cmd, uint8_t *data, size_t max, uint8_t *len)
 {
-    return (uint16_t)p[0] | ((uint16_t)p[1] << 8);
+    smbus_xfer_t x = {.op = SMBUS_BLOCK_READ, .cmd = cmd};
+
+    x.rmax = (uint8_t)MIN(max, SMBUS_BLOCK_MAX);
+    int err = bq_xfer(dev, &x);
+    if (err)
+    {
+        return err;
+    }
+
+    *len = x.rlen;
+    memcpy(data, x.rdata, x.rlen);
+    return 0;
 }
 
 // ──────────────────────────────────────────────────────────────────────────────
-//  Configuration
+//  Pipelined reads
 // ──────────────────────────────────────────────────────────────────────────────
+typedef struct
+{
+    i2c_xfer_t xfer;
+    uint8_t buf[BQ_PIPE_MAX_LEN];
+} bq_pipe_slot_t;
 
-static const char *TAG = "bq";
+/* Runs in the I2C worker with the bus held */
+static int bq_pipe_prepare(void *ctx)
+{
+    return bq_mux_select(ctx);
+}
+
+/**
+ * @brief Queue a single SBS read on the I2C worker, without retries.
+ *
+ * Fills in the transfer, leaving `done`, `ctx` and `notify` as set by the
+ * caller. The mux channel of `dev` is selected right before the transfer.
+ * The worker's raw write-read carries no PEC, so with PEC on the read goes
+ * through bq_read() here instead and the transfer completes before this
+ * returns, `done` and `notify` included.
+ */
+int bq_read_submit(bq_dev_t *dev, i2c_xfer_t *x, uint8_t cmd, uint8_t *rdata, size_t rlen)
+{
+    if (dev->pec)
+    {
+        x->err = bq_read(dev, cmd, rdata, rlen);
+        if (x->done)
+        {
+            x->done(x);
+        }
+        __atomic_store_n(&x->busy, false, __ATOMIC_RELEASE);
+        if (x->notify)
+        {
+            xTaskNotifyGiveIndexed(x->notify, I2C_NOTIFY_INDEX);
+        }
+        return ESP_OK;
+    }
+
+    x->addr = dev->addr;
+    x->wbuf[0] = cmd;
+    x->wdata = x->wbuf;
+    x->wlen = 1;
+    x->rdata = rdata;
+    x->rlen = rlen;
+    x->prepare = bq_pipe_prepare;
+    x->prepare_ctx = dev;
+    dev->accesses++;
+    return i2c_submit(x);
+}
+
+static void bq_pipe_submit(bq_dev_t *dev, bq_pipe_slot_t *slot, uint8_t cmd, uint8_t len)
+{
+    i2c_xfer_t *x = &slot->xfer;
+
+    memset(x, 0, sizeof(*x));
+    x->notify = xTaskGetCurrentTaskHandle();
+    bq_read_submit(dev, x, cmd, slot->buf, MIN(len, sizeof(slot->buf)));
+}
+
+/**
+ * @brief Read a list of SBS commands, decoding each response while the next
+ *        ones are already on the bus.
+ *
+ * Up to BQ_PIPE_DEPTH reads are queued to the I2C worker ahead of the one
+ * handed to `fn`. A read that fails is repeated through bq_read(), so wake-up
+ * and retry work as usual. `fn` returns false to stop; reads still in flight
+ * are drained before returning. Returns the number of failed reads.
+ */
+int bq_read_pipelined(bq_dev_t *dev, const uint8_t *cmds, const uint8_t *lens, int count, bq_read_cb_t fn, void *ctx)
+{
+    bq_pipe_slot_t slots[BQ_PIPE_DEPTH];
+    uint8_t resp[BQ_PIPE_MAX_LEN];
+    int queued = 0;
+    int failed = 0;
+    int i;
+
+    for (; queued < count && queued < BQ_PIPE_DEPTH; queued++)
+    {
+        bq_pipe_submit(dev, &slots[queued], cmds[queued], lens[queued]);
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        bq_pipe_slot_t *slot = &slots[i % BQ_PIPE_DEPTH];
+        size_t len = MIN(lens[i], sizeof(resp));
+        int err = i2c_wait(&slot->xfer);
+
+        if (!err)
+        {
+            dev->state = BQ_STATE_AWAKE;
+            memcpy(resp, slot->buf, len);
+        }
+        else if (dev->pec)
+        {
+            /* already read through bq_read(), retries included */
+            memset(resp, 0, len);
+        }
+        else
+        {
+            dev->nacks++;
+            memset(resp, 0, len);
+            err = bq_read(dev, cmds[i], resp, len);
+        }
+        /* the slot is free again, keep the bus busy while `fn` decodes */
+        if (queued < count)
+        {
+            bq_pipe_submit(dev, slot, cmds[queued], lens[queued]);
+            queued++;
+        }
+
+        failed += err != 0;
+        if (!fn(i, err, resp, len, ctx))
+        {
+            i++;
+            break;
+        }
+    }
+
+    for (; i < queued; i++)
+    {
+        i2c_wait(&slots[i % BQ_PIPE_DEPTH].xfer);
+    }
+    return failed;
+}
+
+/**
+ * @brief ManufacturerAccess() block read.
+ *
+ * Writes the sub-command word to ManufacturerAccess() (0x00) and reads the
+ * response block from ManufacturerData() (0x23), as one bq_xfer_seq() pair.
+ */
+int bq_mac_read(bq_dev_t *dev, uint16_t subcmd, uint8_t *data, size_t max, uint8_t *len)
+{
+    smbus_xfer_t x[2] = {
+        {.op = SMBUS_WRITE_WORD, .cmd = BQ40Z555_CMD_MANUFACTURER_ACCESS, .wlen = 2},
+        {.op = SMBUS_BLOCK_READ, .cmd = BQ40Z555_CMD_MANUFACTURER_DATA, .rmax = (uint8_t)MIN(max, SMBUS_BLOCK_MAX)},
+    };
+
+    x[0].wdata[0] = (uint8_t)(subcmd & 0xFF);
+    x[0].wdata[1] = (uint8_t)(subcmd >> 8);
+    int err = bq_xfer_seq(dev, x, 2);
+    if (err)
+    {
+        return err;
+    }
+
+    *len = x[1].rlen;
+    memcpy(data, x[1].rdata, x[1].rlen);
+    return 0;
+}
+
+/**
+ * @brief ManufacturerBlockAccess() read.
+ *
+ * Block write of the sub-command to 0x44, then a block read of 0x44 whose
+ * payload starts with the echoed sub-command, as one bq_xfer_seq() pair.
+ * Returns ESP_ERR_INVALID_RESPONSE when the echo does not match, e.g. on
+ * gauges without this command.
+ */
+int bq_mba_read(bq_dev_t *dev, uint16_t subcmd, uint8_t *data, size_t max, uint8_t *len)
+{
+    /* a block write, bq_write() would send the two bytes as a write word */
+    smbus_xfer_t x[2] = {
+        {.op = SMBUS_BLOCK_WRITE, .cmd = BQ40Z555_CMD_MANUFACTURER_BLOCK_ACCESS, .wlen = 2},
+        {.op = SMBUS_BLOCK_READ, .cmd = BQ40Z555_CMD_MANUFACTURER_BLOCK_ACCESS, .rmax = SMBUS_BLOCK_MAX},
+    };
+
+    x[0].wdata[0] = (uint8_t)(subcmd & 0xFF);
+    x[0].wdata[1] = (uint8_t)(subcmd >> 8);
+    int err = bq_xfer_seq(dev, x, 2);
+    if (err)
+    {
+        return err;
+    }
+    if (x[1].rlen < 2 || x[1].rdata[0] != x[0].wdata[0] || x[1].rdata[1] != x[0].wdata[1])
+    {
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+
+    *len = (uint8_t)MIN(x[1].rlen - 2, max);
+    memcpy(data, &x[1].rdata[2], *len);
+    return 0;
+}
+
+bq_dev_t *bq_default_dev(void)
+{
+    return &s_bq_packs[s_bq_selected];
+}
+
+/**
+ * @brief Pack in slot `idx`, or NULL if the slot is not configured.
+ */
+bq_dev_t *bq_pack(int idx)
+{
+    if (idx < 0 || idx >= BQ_MAX_PACKS || !s_bq_packs[idx].addr)
+    {
+        return NULL;
+    }
+    return &s_bq_packs[idx];
+}
+
+/**
+ * @brief Make sure the gauge answers before a batch of queued reads.
+ *
+ * Probes OperationStatus with the full wake budget and records whether the
+ * SLEEP bit was set. Returns 0 when the gauge is responsive.
+ */
+int bq_ensure_awake(bq_dev_t *dev)
+{
+    uint8_t resp[1 + 4] = {0};
+
+    dev->state = BQ_STATE_UNKNOWN;
+    int err = bq_read(dev, BQ40Z555_CMD_OPERATION_STATUS, resp, sizeof(resp));
+    if (err)
+    {
+        ESP_LOGE(TAG, "Gauge 0x%02X not responding (err=%d)", dev->addr, err);
+        return err;
+    }
 
-// Declaration of BSP helper (implemented elsewhere)
-int i2c_write_read(uint8_t addr, const uint8_t *wdata, size_t wlen,
-                   uint8_t *rdata, size_t rlen);
+    uint32_t op = le32(&resp[1]);
+    dev->sleep_seen = (op & BQ40Z555_OPSTATUS_SLEEP) != 0;
+    if (dev->sleep_seen)
+    {
+        ESP_LOGI(TAG, "Gauge 0x%02X reports SLEEP, woken for access", dev->addr);
+    }
+    return 0;
+}
 
 // ──────────────────────────────────────────────────────────────────────────────
 //  SafetyAlert() bit descriptions (global, can be shared by other tables)
@@ -286,48 +784,91 @@ static const bq_bit_desc_t BITS_BATTERY_STATUS[] = {
     {14, 1, .desc = "TCA", .long_desc = "Terminate Charge Alarm"},
     {15, 1, .desc = "OCA", .long_desc = "Overcharged Alarm"}};
 
+// ──────────────────────────────────────────────────────────────────────────────
+//  Per-type decoders and formatters
+// ──────────────────────────────────────────────────────────────────────────────
+/*
+ * Each table entry gets its read length, decoder and formatter through one
+ * of the BQ_<type> macros, so printing a response is two indirect calls
+ * without looking at the type again. Integer WORDs are printed unscaled.
+ */
+static void bq_decode_word(const bq_entry *e, const uint8_t *resp, size_t rlen, bq_value_t *out);
+static void bq_decode_scaled(const bq_entry *e, const uint8_t *resp, size_t rlen, bq_value_t *out);
+static void bq_decode_block(const bq_entry *e, const uint8_t *resp, size_t rlen, bq_value_t *out);
+static void bq_format_float(const bq_entry *e, const bq_value_t *v);
+static void bq_format_int(const bq_entry *e, const bq_value_t *v);
+static void bq_format_hex(const bq_entry *e, const bq_value_t *v);
+static void bq_format_ascii(const bq_entry *e, const bq_value_t *v);
+static void bq_format_block_hex(const bq_entry *e, const bq_value_t *v);
+static void bq_format_bits(const bq_entry *e, const bq_value_t *v);
+
+#define BQ_WORD_FLOAT .type = BQ40Z555_TYPE_WORD_FLOAT, .read_len = 2, .decode = bq_decode_scaled, .format = bq_format_float
+#define BQ_WORD_INTEGER .type = BQ40Z555_TYPE_WORD_INTEGER, .read_len = 2, .decode = bq_decode_word, .format = bq_format_int
+#define BQ_WORD_HEX .type = BQ40Z555_TYPE_WORD_HEX, .read_len = 2, .decode = bq_decode_word, .format = bq_format_hex
+#define BQ_BLOCK_ASCII .type = BQ40Z555_TYPE_BLOCK_ASCII, .read_len = BQ_PIPE_MAX_LEN, .decode = bq_decode_block, .format = bq_format_ascii
+#define BQ_BLOCK_HEX .type = BQ40Z555_TYPE_BLOCK_HEX, .read_len = BQ_PIPE_MAX_LEN, .decode = bq_decode_block, .format = bq_format_block_hex
+#define BQ_BLOCK_BITS .type = BQ40Z555_TYPE_BLOCK_BITS, .read_len = BQ_PIPE_MAX_LEN, .decode = bq_decode_block, .format = bq_format_bits
+
 static const bq_entry bq_commands[] = {
-    {BQ40Z555_CMD_SERIAL_NUMBER, "SerialNumber", "", 0.0f, 1.0f, .type = BQ40Z555_TYPE_WORD_INTEGER},
-    {BQ40Z555_CMD_MANUFACTURER_NAME, "ManufacturerName", "", 0.0f, 1.0f, .type = BQ40Z555_TYPE_BLOCK_ASCII},
-    {BQ40Z555_CMD_DEVICE_NAME, "DeviceName", "", 0.0f, 1.0f, .type = BQ40Z555_TYPE_BLOCK_ASCII},
-    {BQ40Z555_CMD_DEVICE_CHEMISTRY, "DeviceChemistry", "", 0.0f, 1.0f, .type = BQ40Z555_TYPE_BLOCK_ASCII},
-    {BQ40Z555_CMD_MANUFACTURER_DATA, "ManufacturerData", "", 0.0f, 1.0f, .type = BQ40Z555_TYPE_BLOCK_ASCII},
-    {BQ40Z555_CMD_MANUFACTURER_DATE, "ManufacturerDate", "", 0.0f, 1.0f, .type = BQ40Z555_TYPE_WORD_HEX},
-    {BQ40Z555_CMD_VOLTAGE, "Voltage", "V", 0.0f, 0.001f, .type = BQ40Z555_TYPE_WORD_FLOAT},            // mV → V
-    {BQ40Z555_CMD_TEMPERATURE, "Temperature", "°C", -273.15f, 0.1f, .type = BQ40Z555_TYPE_WORD_FLOAT}, // 0.1 K → °C
-    {BQ40Z555_CMD_CURRENT, "Current", "A", 0.0f, 0.001f, .type = BQ40Z555_TYPE_WORD_FLOAT},
-    {BQ40Z555_CMD_CELL_VOLTAGE1, "Cell1Voltage", "V", 0.0f, 0.001f, .type = BQ40Z555_TYPE_WORD_FLOAT},
-    {BQ40Z555_CMD_CELL_VOLTAGE2, "Cell2Voltage", "V", 0.0f, 0.001f, .type = BQ40Z555_TYPE_WORD_FLOAT},
-    {BQ40Z555_CMD_CELL_VOLTAGE3, "Cell3Voltage", "V", 0.0f, 0.001f, .type = BQ40Z555_TYPE_WORD_FLOAT},
-    {BQ40Z555_CMD_CELL_VOLTAGE4, "Cell4Voltage", "V", 0.0f, 0.001f, .type = BQ40Z555_TYPE_WORD_FLOAT},
-    {BQ40Z555_CMD_CYCLE_COUNT, "CycleCount", "cycles", 0.0f, 1.0f, .type = BQ40Z555_TYPE_WORD_INTEGER},
-    {BQ40Z555_CMD_CHARGING_VOLTAGE, "ChargingVoltage", "V", 0.0f, 0.001f, .type = BQ40Z555_TYPE_WORD_FLOAT},
-    {BQ40Z555_CMD_DESIGN_VOLTAGE, "DesignVoltage", "V", 0.0f, 0.001f, .type = BQ40Z555_TYPE_WORD_FLOAT},
-    {BQ40Z555_CMD_MIN_SYS_V, "MinSystemVoltage", "V", 0.0f, 0.001f, .type = BQ40Z555_TYPE_WORD_FLOAT},
-    {BQ40Z555_CMD_AVERAGE_CURRENT, "AverageCurrent", "A", 0.0f, 0.001f, .type = BQ40Z555_TYPE_WORD_FLOAT},
-    {BQ40Z555_CMD_CHARGING_CURRENT, "ChargingCurrent", "A", 0.0f, 0.001f, .type = BQ40Z555_TYPE_WORD_FLOAT},
-    {BQ40Z555_CMD_TURBO_CURRENT, "TurboCurrent", "A", 0.0f, 0.001f, .type = BQ40Z555_TYPE_WORD_FLOAT},
-    {BQ40Z555_CMD_RELATIVE_STATE_OF_CHARGE, "RelativeSoC", "%", 0.0f, 1.0f, .type = BQ40Z555_TYPE_WORD_INTEGER},
-    {BQ40Z555_CMD_ABSOLUTE_STATE_OF_CHARGE, "AbsoluteSoC", "%", 0.0f, 1.0f, .type = BQ40Z555_TYPE_WORD_INTEGER},
-    {BQ40Z555_CMD_STATE_OF_HEALTH, "State of Health", "%", 0.0f, 1.0f, .type = BQ40Z555_TYPE_WORD_INTEGER},
-    {BQ40Z555_CMD_REMAINING_CAPACITY, "RemainingCapacity", "mAh", 0.0f, 1.0f, .type = BQ40Z555_TYPE_WORD_INTEGER},
-    {BQ40Z555_CMD_FULL_CHARGE_CAPACITY, "FullChargeCapacity", "mAh", 0.0f, 1.0f, .type = BQ40Z555_TYPE_WORD_INTEGER},
-    {BQ40Z555_CMD_DESIGN_CAPACITY, "DesignCapacity", "mAh", 0.0f, 1.0f, .type = BQ40Z555_TYPE_WORD_INTEGER},
-    {BQ40Z555_CMD_RUN_TIME_TO_EMPTY, "RunTimeToEmpty", "min", 0.0f, 1.0f, .type = BQ40Z555_TYPE_WORD_INTEGER},
-    {BQ40Z555_CMD_AVERAGE_TIME_TO_EMPTY, "AvgTimeToEmpty", "min", 0.0f, 1.0f, .type = BQ40Z555_TYPE_WORD_INTEGER},
-    {BQ40Z555_CMD_AVERAGE_TIME_TO_FULL, "AvgTimeToFull", "min", 0.0f, 1.0f, .type = BQ40Z555_TYPE_WORD_INTEGER},
-    {BQ40Z555_CMD_BATTERY_STATUS, "BatteryStatus", "", .type = BQ40Z555_TYPE_BLOCK_BITS, .bits = BITS_BATTERY_STATUS, .bits_count = COUNT(BITS_BATTERY_STATUS)},
-    {BQ40Z555_CMD_SAFETY_ALERT, "SafetyAlert", "", .type = BQ40Z555_TYPE_BLOCK_BITS, .bits = SAFETY_ALERT_BITS, .bits_count = COUNT(SAFETY_ALERT_BITS)},
-    {BQ40Z555_CMD_SAFETY_STATUS, "SafetyStatus", .type = BQ40Z555_TYPE_BLOCK_BITS, .bits = BITS_SAFETY_STATUS, .bits_count = COUNT(BITS_SAFETY_STATUS)},
-    {BQ40Z555_CMD_PF_ALERT, "PFAlert", .type = BQ40Z555_TYPE_BLOCK_BITS, .bits = BITS_PF_ALERT, .bits_count = COUNT(BITS_PF_ALERT)},
-    {BQ40Z555_CMD_PF_STATUS, "PFStatus", .type = BQ40Z555_TYPE_BLOCK_BITS, .bits = BITS_PF_STATUS, .bits_count = COUNT(BITS_PF_STATUS)},
-    {BQ40Z555_CMD_OPERATION_STATUS, "OperationStatus", .type = BQ40Z555_TYPE_BLOCK_BITS, .bits = BITS_OPERATION_STATUS, .bits_count = COUNT(BITS_OPERATION_STATUS)},
-    {BQ40Z555_CMD_CHARGING_STATUS, "ChargingStatus", .type = BQ40Z555_TYPE_BLOCK_BITS, .bits = BITS_CHARGING_STATUS, .bits_count = COUNT(BITS_CHARGING_STATUS)},
-    {BQ40Z555_CMD_GAUGING_STATUS, "GaugingStatus", .type = BQ40Z555_TYPE_BLOCK_BITS, .bits = BITS_GAUGING_STATUS, .bits_count = COUNT(BITS_GAUGING_STATUS)},
-    {BQ40Z555_CMD_MANUFACTURING_STATUS, "ManufacturingStatus", .type = BQ40Z555_TYPE_BLOCK_BITS, .bits = BITS_MANUFACTURING_STATUS, .bits_count = COUNT(BITS_MANUFACTURING_STATUS)},
+    {BQ40Z555_CMD_SERIAL_NUMBER, "SerialNumber", "", 0.0f, 1.0f, BQ_WORD_INTEGER},
+    {BQ40Z555_CMD_MANUFACTURER_NAME, "ManufacturerName", "", 0.0f, 1.0f, BQ_BLOCK_ASCII},
+    {BQ40Z555_CMD_DEVICE_NAME, "DeviceName", "", 0.0f, 1.0f, BQ_BLOCK_ASCII},
+    {BQ40Z555_CMD_DEVICE_CHEMISTRY, "DeviceChemistry", "", 0.0f, 1.0f, BQ_BLOCK_ASCII},
+    {BQ40Z555_CMD_MANUFACTURER_DATA, "ManufacturerData", "", 0.0f, 1.0f, BQ_BLOCK_ASCII},
+    {BQ40Z555_CMD_MANUFACTURER_DATE, "ManufacturerDate", "", 0.0f, 1.0f, BQ_WORD_HEX},
+    {BQ40Z555_CMD_VOLTAGE, "Voltage", "V", 0.0f, 0.001f, BQ_WORD_FLOAT},            // mV → V
+    {BQ40Z555_CMD_TEMPERATURE, "Temperature", "°C", -273.15f, 0.1f, BQ_WORD_FLOAT}, // 0.1 K → °C
+    {BQ40Z555_CMD_CURRENT, "Current", "A", 0.0f, 0.001f, BQ_WORD_FLOAT},
+    {BQ40Z555_CMD_CELL_VOLTAGE1, "Cell1Voltage", "V", 0.0f, 0.001f, BQ_WORD_FLOAT},
+    {BQ40Z555_CMD_CELL_VOLTAGE2, "Cell2Voltage", "V", 0.0f, 0.001f, BQ_WORD_FLOAT},
+    {BQ40Z555_CMD_CELL_VOLTAGE3, "Cell3Voltage", "V", 0.0f, 0.001f, BQ_WORD_FLOAT},
+    {BQ40Z555_CMD_CELL_VOLTAGE4, "Cell4Voltage", "V", 0.0f, 0.001f, BQ_WORD_FLOAT},
+    {BQ40Z555_CMD_CYCLE_COUNT, "CycleCount", "cycles", 0.0f, 1.0f, BQ_WORD_INTEGER},
+    {BQ40Z555_CMD_CHARGING_VOLTAGE, "ChargingVoltage", "V", 0.0f, 0.001f, BQ_WORD_FLOAT},
+    {BQ40Z555_CMD_DESIGN_VOLTAGE, "DesignVoltage", "V", 0.0f, 0.001f, BQ_WORD_FLOAT},
+    {BQ40Z555_CMD_MIN_SYS_V, "MinSystemVoltage", "V", 0.0f, 0.001f, BQ_WORD_FLOAT},
+    {BQ40Z555_CMD_AVERAGE_CURRENT, "AverageCurrent", "A", 0.0f, 0.001f, BQ_WORD_FLOAT},
+    {BQ40Z555_CMD_CHARGING_CURRENT, "ChargingCurrent", "A", 0.0f, 0.001f, BQ_WORD_FLOAT},
+    {BQ40Z555_CMD_TURBO_CURRENT, "TurboCurrent", "A", 0.0f, 0.001f, BQ_WORD_FLOAT},
+    {BQ40Z555_CMD_RELATIVE_STATE_OF_CHARGE, "RelativeSoC", "%", 0.0f, 1.0f, BQ_WORD_INTEGER},
+    {BQ40Z555_CMD_ABSOLUTE_STATE_OF_CHARGE, "AbsoluteSoC", "%", 0.0f, 1.0f, BQ_WORD_INTEGER},
+    {BQ40Z555_CMD_STATE_OF_HEALTH, "State of Health", "%", 0.0f, 1.0f, BQ_WORD_INTEGER},
+    {BQ40Z555_CMD_REMAINING_CAPACITY, "RemainingCapacity", "mAh", 0.0f, 1.0f, BQ_WORD_INTEGER},
+    {BQ40Z555_CMD_FULL_CHARGE_CAPACITY, "FullChargeCapacity", "mAh", 0.0f, 1.0f, BQ_WORD_INTEGER},
+    {BQ40Z555_CMD_DESIGN_CAPACITY, "DesignCapacity", "mAh", 0.0f, 1.0f, BQ_WORD_INTEGER},
+    {BQ40Z555_CMD_RUN_TIME_TO_EMPTY, "RunTimeToEmpty", "min", 0.0f, 1.0f, BQ_WORD_INTEGER},
+    {BQ40Z555_CMD_AVERAGE_TIME_TO_EMPTY, "AvgTimeToEmpty", "min", 0.0f, 1.0f, BQ_WORD_INTEGER},
+    {BQ40Z555_CMD_AVERAGE_TIME_TO_FULL, "AvgTimeToFull", "min", 0.0f, 1.0f, BQ_WORD_INTEGER},
+    {BQ40Z555_CMD_BATTERY_STATUS, "BatteryStatus", "", BQ_BLOCK_BITS, .bits = BITS_BATTERY_STATUS, .bits_count = COUNT(BITS_BATTERY_STATUS)},
+    {BQ40Z555_CMD_SAFETY_ALERT, "SafetyAlert", "", BQ_BLOCK_BITS, .bits = SAFETY_ALERT_BITS, .bits_count = COUNT(SAFETY_ALERT_BITS)},
+    {BQ40Z555_CMD_SAFETY_STATUS, "SafetyStatus", BQ_BLOCK_BITS, .bits = BITS_SAFETY_STATUS, .bits_count = COUNT(BITS_SAFETY_STATUS)},
+    {BQ40Z555_CMD_PF_ALERT, "PFAlert", BQ_BLOCK_BITS, .bits = BITS_PF_ALERT, .bits_count = COUNT(BITS_PF_ALERT)},
+    {BQ40Z555_CMD_PF_STATUS, "PFStatus", BQ_BLOCK_BITS, .bits = BITS_PF_STATUS, .bits_count = COUNT(BITS_PF_STATUS)},
+    {BQ40Z555_CMD_OPERATION_STATUS, "OperationStatus", BQ_BLOCK_BITS, .bits = BITS_OPERATION_STATUS, .bits_count = COUNT(BITS_OPERATION_STATUS)},
+    {BQ40Z555_CMD_CHARGING_STATUS, "ChargingStatus", BQ_BLOCK_BITS, .bits = BITS_CHARGING_STATUS, .bits_count = COUNT(BITS_CHARGING_STATUS)},
+    {BQ40Z555_CMD_GAUGING_STATUS, "GaugingStatus", BQ_BLOCK_BITS, .bits = BITS_GAUGING_STATUS, .bits_count = COUNT(BITS_GAUGING_STATUS)},
+    {BQ40Z555_CMD_MANUFACTURING_STATUS, "ManufacturingStatus", BQ_BLOCK_BITS, .bits = BITS_MANUFACTURING_STATUS, .bits_count = COUNT(BITS_MANUFACTURING_STATUS)},
 
 };
 
+const bq_entry *bq_entries(size_t *count)
+{
+    *count = COUNT(bq_commands);
+    return bq_commands;
+}
+
+const bq_entry *bq_find_entry(uint8_t reg)
+{
+    for (int pos = 0; pos < COUNT(bq_commands); pos++)
+    {
+        if (bq_commands[pos].reg == reg)
+        {
+            return &bq_commands[pos];
+        }
+    }
+    return NULL;
+}
+
 // ──────────────────────────────────────────────────────────────────────────────
 //  Bit-extraction helper
 // ──────────────────────────────────────────────────────────────────────────────
@@ -395,136 +936,263 @@ static int bq_print_bits_from_buffer(const bq_entry *e,
 }
 
 /**
- * @brief Fetch an SBS WORD and print it.
- *
- * Prints a single line:   "<name>: <value> <unit>".
- * Returns 0 on success or the I²C error code.
+ * @brief Compact one-line form: "<name>: 0x…  FLAG(long desc) …" listing only
+ *        set flags and non-zero multi-bit fields.
  */
-int bq_generic_dump(const bq_entry *entry)
+void bq_print_active_bits(const bq_entry *e, const uint8_t *data, size_t data_len)
 {
-    if (!entry)
-        return ESP_ERR_INVALID_ARG;
-
-    uint8_t cmd = entry->reg;
-
-    switch (entry->type)
+    uint32_t raw = 0;
+    for (size_t i = 0; i < data_len && i < 4; ++i)
     {
-    case BQ40Z555_TYPE_BLOCK_BITS:
+        raw |= (uint32_t)data[i] << (8 * i);
+    }
+
+    printf("%-32s: 0x%08" PRIX32, e->name, raw);
+    int active = 0;
+    for (size_t i = 0; i < e->bits_count; ++i)
     {
-        uint8_t resp_len[1] = {0};
-        int err = i2c_write_read(BQ40Z555_I2C_ADDR, &cmd, sizeof(cmd), resp_len, sizeof(resp_len));
-        if (err)
+        const bq_bit_desc_t *d = &e->bits[i];
+        uint32_t field = bq_extract_bits(data, data_len, d->bit, d->width);
+        if (!field)
         {
-            ESP_LOGE(TAG, "%s: i2c_write_read failed (err=%d)", entry->name, err);
-            return err;
+            continue;
         }
-
-        uint8_t len = resp_len[0];
-        uint8_t resp_data[256];
-        err = i2c_write_read(BQ40Z555_I2C_ADDR, &cmd, sizeof(cmd), resp_data, 1 + len);
-        if (err)
+        if (d->width == 1)
         {
-            ESP_LOGE(TAG, "%s: i2c_write_read failed (err=%d)", entry->name, err);
-            return err;
+            printf(" \033[32m%s\033[0m(%s)", d->desc, d->long_desc ? d->long_desc : "");
         }
-
-        bq_print_bits_from_buffer(entry, &resp_data[1], len);
-
-        break;
-    }
-    case BQ40Z555_TYPE_BLOCK_ASCII:
-    case BQ40Z555_TYPE_BLOCK_HEX:
-    {
-        uint8_t resp_len[1] = {0};
-        int err = i2c_write_read(BQ40Z555_I2C_ADDR, &cmd, sizeof(cmd), resp_len, sizeof(resp_len));
-        if (err)
+        else
         {
-            ESP_LOGE(TAG, "%s: i2c_write_read failed (err=%d)", entry->name, err);
-            return err;
+            printf(" %s=%" PRIu32, d->desc, field);
         }
+        active++;
+    }
+    printf("%s\n", active ? "" : " (none)");
+}
 
-        uint8_t len = resp_len[0];
-        uint8_t resp_data[256];
-        err = i2c_write_read(BQ40Z555_I2C_ADDR, &cmd, sizeof(cmd), resp_data, 1 + len);
-        if (err)
-        {
-            ESP_LOGE(TAG, "%s: i2c_write_read failed (err=%d)", entry->name, err);
-            return err;
-        }
+/**
+ * @brief Print the acquisition time stamp that heads every dump.
+ *
+ * Monotonic µs since boot plus the SNTP-disciplined wall clock, so dumps from
+ * different packs and stations can be lined up afterwards.
+ */
+static void bq_print_timestamp(void)
+{
+    tb_stamp_t ts;
+    char iso[40];
 
-        for (int pos = 0; pos < len; pos++)
-        {
-            if (resp_data[1 + pos] < 0x20 || resp_data[1 + pos] >= 0x80)
-            {
-                resp_data[1 + pos] = '.';
-            }
-        }
-        switch (entry->type)
-        {
-        case BQ40Z555_TYPE_BLOCK_ASCII:
-        {
-            printf("%-32s: '%.*s' %s\n", entry->name, len, &resp_data[1], entry->unit);
-            break;
-        }
-        case BQ40Z555_TYPE_BLOCK_HEX:
-        {
-            printf("%-32s: '", entry->name);
-            for (int pos = 0; pos < len; pos++)
-            {
-                char tmp_buf[4];
-                sprintf(tmp_buf, "%02X ", resp_data[1 + pos]);
-                printf("%s", tmp_buf);
-            }
-            printf("' %s\n", entry->unit);
-            break;
-        }
-        default:
-            break;
-        }
+    tb_now(&ts);
+    tb_format(ts.wall_us, iso, sizeof(iso));
+    printf("%-32s: %s (mono %" PRId64 " us)\n", "Timestamp", iso, ts.mono_us);
+}
 
-        break;
+static void bq_decode_word(const bq_entry *e, const uint8_t *resp, size_t rlen, bq_value_t *out)
+{
+    (void)e;
+    (void)rlen;
+    out->raw = (uint16_t)resp[0] | ((uint16_t)resp[1] << 8);
+}
+
+static void bq_decode_scaled(const bq_entry *e, const uint8_t *resp, size_t rlen, bq_value_t *out)
+{
+    (void)rlen;
+    uint16_t raw = (uint16_t)resp[0] | ((uint16_t)resp[1] << 8);
+    out->val = raw * e->scaling + e->offset;
+}
+
+static void bq_decode_block(const bq_entry *e, const uint8_t *resp, size_t rlen, bq_value_t *out)
+{
+    (void)e;
+    out->block.data = &resp[1];
+    out->block.len = (uint8_t)MIN(resp[0], rlen - 1);
+}
+
+static void bq_format_float(const bq_entry *e, const bq_value_t *v)
+{
+    printf("%-32s: %02.3f %s\n", e->name, v->val, e->unit);
+}
+
+static void bq_format_int(const bq_entry *e, const bq_value_t *v)
+{
+    printf("%-32s: %u %s\n", e->name, v->raw, e->unit);
+}
+
+static void bq_format_hex(const bq_entry *e, const bq_value_t *v)
+{
+    printf("%-32s: 0x%08X %s\n", e->name, v->raw, e->unit);
+}
+
+static void bq_format_ascii(const bq_entry *e, const bq_value_t *v)
+{
+    char text[BQ_PIPE_MAX_LEN];
+
+    for (int pos = 0; pos < v->block.len; pos++)
+    {
+        uint8_t c = v->block.data[pos];
+        text[pos] = (c < 0x20 || c >= 0x80) ? '.' : (char)c;
     }
-    case BQ40Z555_TYPE_WORD_HEX:
-    case BQ40Z555_TYPE_WORD_FLOAT:
-    case BQ40Z555_TYPE_WORD_INTEGER:
+    printf("%-32s: '%.*s' %s\n", e->name, v->block.len, text, e->unit);
+}
+
+static void bq_format_block_hex(const bq_entry *e, const bq_value_t *v)
+{
+    printf("%-32s: '", e->name);
+    for (int pos = 0; pos < v->block.len; pos++)
     {
-        uint8_t resp[2] = {0};
-        int err = i2c_write_read(BQ40Z555_I2C_ADDR, &cmd, sizeof(cmd), resp, sizeof(resp));
-        if (err)
-        {
-            ESP_LOGE(TAG, "%s: i2c_write_read failed (err=%d)", entry->name, err);
-            return err;
-        }
+        printf("%02X ", v->block.data[pos]);
+    }
+    printf("' %s\n", e->unit);
+}
 
-        uint16_t raw = (uint16_t)resp[0] | ((uint16_t)resp[1] << 8);
+static void bq_format_bits(const bq_entry *e, const bq_value_t *v)
+{
+    bq_print_bits_from_buffer(e, v->block.data, v->block.len);
+}
 
-        switch (entry->type)
-        {
-        case BQ40Z555_TYPE_WORD_HEX:
-        {
-            printf("%-32s: 0x%08X %s\n", entry->name, raw, entry->unit);
-            break;
-        }
-        case BQ40Z555_TYPE_WORD_FLOAT:
-        {
-            float val = raw * entry->scaling + entry->offset;
-            printf("%-32s: %02.3f %s\n", entry->name, val, entry->unit);
-            break;
-        }
-        case BQ40Z555_TYPE_WORD_INTEGER:
+// ──────────────────────────────────────────────────────────────────────────────
+//  Decoders for entries described at runtime (bq_entry_bind)
+// ──────────────────────────────────────────────────────────────────────────────
+/* Registers of other devices may be a single byte, big endian or signed */
+static uint16_t bq_entry_word(const bq_entry *e, const uint8_t *resp, size_t rlen)
+{
+    if (rlen < 2)
+    {
+        return resp[0];
+    }
+    if (e->flags & BQ_ENTRY_BIG_ENDIAN)
+    {
+        return ((uint16_t)resp[0] << 8) | resp[1];
+    }
+    return (uint16_t)resp[0] | ((uint16_t)resp[1] << 8);
+}
+
+static int32_t bq_entry_signed(uint16_t raw, size_t rlen)
+{
+    return rlen < 2 ? (int8_t)raw : (int16_t)raw;
+}
+
+static void bq_decode_word_ext(const bq_entry *e, const uint8_t *resp, size_t rlen, bq_value_t *out)
+{
+    out->raw = bq_entry_word(e, resp, rlen);
+}
+
+static void bq_decode_signed(const bq_entry *e, const uint8_t *resp, size_t rlen, bq_value_t *out)
+{
+    out->sval = bq_entry_signed(bq_entry_word(e, resp, rlen), rlen);
+}
+
+static void bq_decode_scaled_ext(const bq_entry *e, const uint8_t *resp, size_t rlen, bq_value_t *out)
+{
+    uint16_t raw = bq_entry_word(e, resp, rlen);
+    float x = (e->flags & BQ_ENTRY_SIGNED) ? (float)bq_entry_signed(raw, rlen) : (float)raw;
+    out->val = x * e->scaling + e->offset;
+}
+
+/* Fixed-size register without SBS length byte; big endian ones are flipped for the bit decoder */
+static void bq_decode_raw_block(const bq_entry *e, const uint8_t *resp, size_t rlen, bq_value_t *out)
+{
+    out->block.data = resp;
+    out->block.len = (uint8_t)rlen;
+    if ((e->flags & BQ_ENTRY_BIG_ENDIAN) && rlen <= sizeof(out->block.swapped))
+    {
+        for (size_t pos = 0; pos < rlen; pos++)
         {
-            float val = raw * entry->scaling + entry->offset;
-            printf("%-32s: %d %s\n", entry->name, (int)val, entry->unit);
-            break;
+            out->block.swapped[pos] = resp[rlen - 1 - pos];
         }
-        default:
-            break;
-        }
-        break;
+        out->block.data = out->block.swapped;
     }
+}
+
+static void bq_format_signed(const bq_entry *e, const bq_value_t *v)
+{
+    printf("%-32s: %" PRId32 " %s\n", e->name, v->sval, e->unit);
+}
+
+/**
+ * @brief Pick decoder and formatter of an entry built at runtime from its
+ *        type and flags. A read_len of 0 becomes the SBS default.
+ */
+void bq_entry_bind(bq_entry *e)
+{
+    bq_decode_fn block = (e->flags & BQ_ENTRY_RAW_BLOCK) ? bq_decode_raw_block : bq_decode_block;
+    bool word = true;
+
+    switch (e->type)
+    {
+    case BQ40Z555_TYPE_WORD_FLOAT:
+        e->decode = bq_decode_scaled_ext;
+        e->format = bq_format_float;
+        break;
+    case BQ40Z555_TYPE_WORD_INTEGER:
+        e->decode = (e->flags & BQ_ENTRY_SIGNED) ? bq_decode_signed : bq_decode_word_ext;
+        e->format = (e->flags & BQ_ENTRY_SIGNED) ? bq_format_signed : bq_format_int;
+        break;
+    case BQ40Z555_TYPE_BLOCK_ASCII:
+        e->decode = block;
+        e->format = bq_format_ascii;
+        word = false;
+        break;
+    case BQ40Z555_TYPE_BLOCK_HEX:
+        e->decode = block;
+        e->format = bq_format_block_hex;
+        word = false;
+        break;
+    case BQ40Z555_TYPE_BLOCK_BITS:
+        e->decode = block;
+        e->format = bq_format_bits;
+        word = false;
+        break;
     default:
+        e->decode = bq_decode_word_ext;
+        e->format = bq_format_hex;
         break;
     }
+    if (!e->read_len)
+    {
+        e->read_len = word ? 2 : BQ_PIPE_MAX_LEN;
+    }
+}
+
+/* Bytes read for an entry: the word, or length byte plus the longest SBS block */
+uint8_t bq_entry_read_len(const bq_entry *entry)
+{
+    return entry->read_len;
+}
+
+/**
+ * @brief Print the response of `entry`, read with bq_entry_read_len() bytes.
+ *
+ * Prints a single line:   "<name>: <value> <unit>".
+ */
+void bq_print_entry(const bq_entry *entry, const uint8_t *resp, size_t rlen)
+{
+    bq_value_t v;
+
+    entry->decode(entry, resp, rlen, &v);
+    entry->format(entry, &v);
+}
+
+/**
+ * @brief Fetch an SBS entry and print it.
+ *
+ * Blocks are read together with their length byte in one transaction.
+ * Returns 0 on success or the I²C error code.
+ */
+int bq_generic_dump(bq_dev_t *dev, const bq_entry *entry)
+{
+    uint8_t resp[BQ_PIPE_MAX_LEN] = {0};
+
+    if (!entry)
+        return ESP_ERR_INVALID_ARG;
+
+    uint8_t rlen = bq_entry_read_len(entry);
+    int err = bq_read(dev, entry->reg, resp, rlen);
+    if (err)
+    {
+        ESP_LOGE(TAG, "%s: i2c_write_read failed (err=%d)", entry->name, err);
+        return err;
+    }
+    bq_print_entry(entry, resp, rlen);
     return 0;
 }
 
@@ -549,7 +1217,7 @@ int bq_generic_dump(const bq_entry *entry)
  *  Block 2 (0x61) - no voltage/current *word* fields; printed raw.
  *  Block 3 (0x62) - time counters only; printed raw.
  */
-int bq_print_lifetime_block_decoded(int n)
+int bq_print_lifetime_block_decoded(bq_dev_t *dev, int n)
 {
     if (n < 1 || n > 3)
     {
@@ -559,85 +1227,305 @@ int bq_print_lifetime_block_decoded(int n)
 
     uint8_t cmd = (uint8_t)(BQ40Z555_CMD_LIFETIME_DATA1 + (n - 1));
 
-    uint8_t resp_len[1] = {0};
-    int err = i2c_write_read(BQ40Z555_I2C_ADDR, &cmd, sizeof(cmd), resp_len, sizeof(resp_len));
+    uint8_t data[SMBUS_BLOCK_MAX] = {0};
+    uint8_t len = 0;
+    int err = bq_read_block(dev, cmd, data, sizeof(data), &len);
     if (err)
     {
         ESP_LOGE(TAG, "LifetimeData%d: i2c I/O err %d", n, err);
         return err;
     }
 
-    uint8_t len = resp_len[0];
-
-    uint8_t resp[256] = {0};
-
-    err = i2c_write_read(BQ40Z555_I2C_ADDR, &cmd, sizeof(cmd), resp, 1 + len);
-    if (err)
-    {
-        ESP_LOGE(TAG, "LifetimeData%d: i2c I/O err %d", n, err);
-        return err;
-    }
+    bq_print_lifetime_from_buffer(n, data, len);
+    return 0;
+}
 
-    if (n == 1)
+/**
+ * @brief Print an already fetched Lifetime Data block (payload without length byte).
+ */
+void bq_print_lifetime_from_buffer(int n, const uint8_t *data, size_t len)
+{
+    if (n == 1 && len >= 25)
     {
-        int offset = 1;
+        int offset = 0;
         puts("LifetimeData1 decoded (voltages in V, currents in A):");
         for (int i = 0; i < 4; ++i)
         {
-            float v = le16(&resp[offset]) / 1000.0f; // mV → V
+            float v = le16(&data[offset]) / 1000.0f; // mV → V
             printf("  Max Cell Voltage  %d: %.3f V\n", i + 1, v);
             offset += 2;
         }
         for (int i = 0; i < 4; ++i)
         {
-            float v = le16(&resp[offset]) / 1000.0f;
+            float v = le16(&data[offset]) / 1000.0f;
             printf("  Min Cell Voltage  %d: %.3f V\n", i + 1, v);
             offset += 2;
         }
-        printf("  Max Δ Cell Voltage : %.3f V\n", le16(&resp[offset]) / 1000.0f);
+        printf("  Max Δ Cell Voltage : %.3f V\n", le16(&data[offset]) / 1000.0f);
         offset += 2;
-        printf("  Max Charge Current : %.3f A\n", le16(&resp[offset]) / 1000.0f);
+        printf("  Max Charge Current : %.3f A\n", le16(&data[offset]) / 1000.0f);
         offset += 2;
-        printf("  Max Disch  Current : %.3f A\n", le16(&resp[offset]) / 1000.0f);
+        printf("  Max Disch  Current : %.3f A\n", le16(&data[offset]) / 1000.0f);
         offset += 2;
-        printf("  Max Avg   Current  : %.3f A\n", le16(&resp[offset]) / 1000.0f);
+        printf("  Max Avg   Current  : %.3f A\n", le16(&data[offset]) / 1000.0f);
         offset += 2;
-        printf("  Max Avg Disch Power: %d W\n", resp[offset]);
-        offset += 1;
-        return 0;
+        printf("  Max Avg Disch Power: %d W\n", data[offset]);
+        return;
     }
 
     // Blocks 2 & 3: show raw words for reference
     printf("LifetimeData%d raw words:\n", n);
     for (int i = 0; i < len; ++i)
     {
-        printf("  0x%02x: 0x%02X\n", i, resp[1 + i]);
+        printf("  0x%02x: 0x%02X\n", i, data[i]);
     }
-    return 0;
 }
 
 // ──────────────────────────────────────────────────────────────────────────────
-//  Voltage command implementation
+//  bq_show: acquisition and render stages
 // ──────────────────────────────────────────────────────────────────────────────
-
-/**
- * @brief Read pack voltage from the BQ40Z555.
- *
- * The SBS Voltage() command returns a *word* (little-endian 16 bit) that
- * represents the pack voltage in millivolts. We issue a single-byte write of
- * `0x09`, then read back two bytes and assemble them into a host-endian `uint16_t`.
+/*
+ * The acquisition stage reads all entries back to back into a raw snapshot,
+ * the render stage formats a complete snapshot. With repeated dumps the two
+ * run in different tasks on two snapshot buffers, so snapshot N+1 is on the
+ * bus while N is printed and every printed snapshot comes from one pass.
  */
-static int cmd_bq_dump(int argc, char **argv)
+#define BQ_SHOW_MAX_COUNT 1000
+
+typedef struct
+{
+    tb_stamp_t ts;       ///< start of the acquisition
+    uint32_t acquire_us; ///< first to last read
+    bool aborted;        ///< gauge went silent, later entries are missing
+    int16_t err[COUNT(bq_commands)];
+    uint8_t data[COUNT(bq_commands)][BQ_PIPE_MAX_LEN];
+} bq_snapshot_t;
+
+static struct
+{
+    bq_snapshot_t buf[2];
+    SemaphoreHandle_t free;  ///< snapshot buffers the acquisition may fill
+    QueueHandle_t ready;     ///< filled buffer index, -1 = acquisition finished
+    bq_dev_t *dev;
+    int count;
+    uint32_t interval_ms;
+} s_show;
+
+static bool bq_snapshot_store(int idx, int err, const uint8_t *data, size_t len, void *ctx)
+{
+    bq_snapshot_t *snap = ctx;
+    bq_dev_t *dev = s_show.dev;
+
+    snap->err[idx] = (int16_t)err;
+    memcpy(snap->data[idx], data, MIN(len, sizeof(snap->data[idx])));
+
+    /* a single unsupported command is fine, a gauge gone silent is not */
+    if (err && dev->state == BQ_STATE_UNRESPONSIVE && bq_ensure_awake(dev))
+    {
+        snap->aborted = true;
+        return false;
+    }
+    return true;
+}
+
+static void bq_snapshot_acquire(bq_dev_t *dev, bq_snapshot_t *snap)
 {
-    (void)argc;
-    (void)argv; // Unused
+    static uint8_t cmds[COUNT(bq_commands)];
+    static uint8_t lens[COUNT(bq_commands)];
 
     for (int pos = 0; pos < COUNT(bq_commands); pos++)
     {
-        bq_generic_dump(&bq_commands[pos]);
+        cmds[pos] = bq_commands[pos].reg;
+        lens[pos] = bq_entry_read_len(&bq_commands[pos]);
+        snap->err[pos] = ESP_ERR_INVALID_STATE;
     }
+    snap->aborted = false;
+    tb_now(&snap->ts);
+    bq_read_pipelined(dev, cmds, lens, COUNT(bq_commands), bq_snapshot_store, snap);
+    snap->acquire_us = (uint32_t)(tb_mono_us() - snap->ts.mono_us);
+}
 
-    return 0;
+static void bq_snapshot_render(const bq_dev_t *dev, const bq_snapshot_t *snap)
+{
+    char iso[40];
+
+    tb_format(snap->ts.wall_us, iso, sizeof(iso));
+    printf("%-32s: %s (mono %" PRId64 " us, read in %" PRIu32 " us)\n", "Timestamp", iso, snap->ts.mono_us,
+           snap->acquire_us);
+    for (int pos = 0; pos < COUNT(bq_commands); pos++)
+    {
+        const bq_entry *entry = &bq_commands[pos];
+        if (!snap->err[pos])
+        {
+            bq_print_entry(entry, snap->data[pos], bq_entry_read_len(entry));
+        }
+        else if (!snap->aborted || snap->err[pos] != ESP_ERR_INVALID_STATE)
+        {
+            ESP_LOGE(TAG, "%s: i2c_write_read failed (err=%d)", entry->name, snap->err[pos]);
+        }
+    }
+    if (snap->aborted)
+    {
+        printf("Gauge at 0x%02X stopped responding, dump aborted\n", dev->addr);
+    }
+}
+
+static void bq_show_acquire_task(void *arg)
+{
+    (void)arg;
+    TickType_t last_wake = xTaskGetTickCount();
+
+    for (int n = 0; n < s_show.count; n++)
+    {
+        int idx = n & 1;
+
+        xSemaphoreTake(s_show.free, portMAX_DELAY);
+        bq_snapshot_acquire(s_show.dev, &s_show.buf[idx]);
+        xQueueSend(s_show.ready, &idx, portMAX_DELAY);
+        if (s_show.buf[idx].aborted)
+        {
+            break;
+        }
+        if (s_show.interval_ms && n + 1 < s_show.count)
+        {
+            vTaskDelayUntil(&last_wake, pdMS_TO_TICKS(s_show.interval_ms));
+        }
+    }
+
+    int done = -1;
+    xQueueSend(s_show.ready, &done, portMAX_DELAY);
+    vTaskDelete(NULL);
+}
+
+static struct
+{
+    struct arg_int *count;
+    struct arg_int *interval;
+    struct arg_int *bench;
+    struct arg_end *end;
+} bq_show_args;
+
+/* Decode every entry of a snapshot `rounds` times, without printing */
+static void bq_snapshot_bench(const bq_snapshot_t *snap, int rounds)
+{
+    bq_value_t v;
+    volatile uint32_t sink = 0;
+    int decoded = 0;
+
+    int64_t start = esp_timer_get_time();
+    for (int round = 0; round < rounds; round++)
+    {
+        for (int pos = 0; pos < COUNT(bq_commands); pos++)
+        {
+            const bq_entry *entry = &bq_commands[pos];
+            if (snap->err[pos])
+            {
+                continue;
+            }
+            entry->decode(entry, snap->data[pos], entry->read_len, &v);
+            sink += v.raw;
+            decoded++;
+        }
+    }
+    int64_t elapsed = esp_timer_get_time() - start;
+    (void)sink;
+
+    if (!decoded)
+    {
+        printf("Nothing decoded\n");
+        return;
+    }
+    printf("Decoded %d entries in %" PRId64 " us: %" PRId64 " ns per entry, %" PRId64 " us per snapshot\n", decoded,
+           elapsed, elapsed * 1000 / decoded, elapsed / rounds);
+}
+
+static int cmd_bq_dump(int argc, char **argv)
+{
+    int nerrors = arg_parse(argc, argv, (void **)&bq_show_args);
+    if (nerrors != 0)
+    {
+        arg_print_errors(stderr, bq_show_args.end, argv[0]);
+        return 1;
+    }
+
+    bq_dev_t *dev = bq_default_dev();
+    int count = bq_show_args.count->count ? bq_show_args.count->ival[0] : 1;
+    int interval = bq_show_args.interval->count ? bq_show_args.interval->ival[0] : 0;
+    if (count < 1 || count > BQ_SHOW_MAX_COUNT || interval < 0)
+    {
+        printf("Count must be 1..%d, interval >= 0\n", BQ_SHOW_MAX_COUNT);
+        return 1;
+    }
+
+    /* defer the queued reads until the gauge answers instead of failing each one */
+    if (bq_ensure_awake(dev))
+    {
+        bq_print_timestamp();
+        printf("Gauge at 0x%02X not responding\n", dev->addr);
+        return 1;
+    }
+
+    if (bq_show_args.bench->count)
+    {
+        int rounds = bq_show_args.bench->ival[0];
+        if (rounds < 1)
+        {
+            printf("Rounds must be >= 1\n");
+            return 1;
+        }
+        s_show.dev = dev;
+        bq_snapshot_acquire(dev, &s_show.buf[0]);
+        bq_snapshot_bench(&s_show.buf[0], rounds);
+        return s_show.buf[0].aborted;
+    }
+
+    if (count == 1)
+    {
+        s_show.dev = dev;
+        bq_snapshot_acquire(dev, &s_show.buf[0]);
+        bq_snapshot_render(dev, &s_show.buf[0]);
+        return s_show.buf[0].aborted;
+    }
+
+    if (!s_show.free)
+    {
+        s_show.free = xSemaphoreCreateCounting(2, 2);
+        s_show.ready = xQueueCreate(3, sizeof(int));
+    }
+    s_show.dev = dev;
+    s_show.count = count;
+    s_show.interval_ms = (uint32_t)interval;
+    xQueueReset(s_show.ready);
+    while (uxSemaphoreGetCount(s_show.free) < 2)
+    {
+        xSemaphoreGive(s_show.free);
+    }
+
+    int64_t start = esp_timer_get_time();
+    uint64_t bus_us = 0;
+    int rendered = 0;
+    bool aborted = false;
+    xTaskCreate(bq_show_acquire_task, "bq_show", 4096, NULL, uxTaskPriorityGet(NULL), NULL);
+    for (;;)
+    {
+        int idx;
+        xQueueReceive(s_show.ready, &idx, portMAX_DELAY);
+        if (idx < 0)
+        {
+            break;
+        }
+        printf("\n");
+        bq_snapshot_render(dev, &s_show.buf[idx]);
+        bus_us += s_show.buf[idx].acquire_us;
+        aborted |= s_show.buf[idx].aborted;
+        rendered++;
+        xSemaphoreGive(s_show.free);
+    }
+
+    uint32_t total_ms = (uint32_t)((esp_timer_get_time() - start) / 1000);
+    printf("\n%d snapshots in %" PRIu32 " ms, %" PRIu32 " ms each (reading %" PRIu32 " ms)\n", rendered, total_ms,
+           total_ms / rendered, (uint32_t)(bus_us / 1000 / rendered));
+    return aborted;
 }
 static int cmd_bq_lifetime(int argc, char **argv)
 {
@@ -646,20 +1534,252 @@ static int cmd_bq_lifetime(int argc, char **argv)
     {
         block = atoi(argv[1]);
     }
-    return bq_print_lifetime_block_decoded(block);
+    bq_dev_t *dev = bq_default_dev();
+    bq_print_timestamp();
+    if (bq_ensure_awake(dev))
+    {
+        printf("Gauge at 0x%02X not responding\n", dev->addr);
+        return 1;
+    }
+    return bq_print_lifetime_block_decoded(dev, block);
+}
+static struct
+{
+    struct arg_int *pec;
+    struct arg_end *end;
+} bq_access_args;
+
+static int cmd_bq_access(int argc, char **argv)
+{
+    int nerrors = arg_parse(argc, argv, (void **)&bq_access_args);
+    if (nerrors != 0)
+    {
+        arg_print_errors(stderr, bq_access_args.end, argv[0]);
+        return 1;
+    }
+
+    static const char *const state_names[] = {"unknown", "awake", "unresponsive"};
+    bq_dev_t *dev = bq_default_dev();
+
+    if (bq_access_args.pec->count)
+    {
+        dev->pec = bq_access_args.pec->ival[0] != 0;
+    }
+
+    printf("%-20s: 0x%02X\n", "Address", dev->addr);
+    printf("%-20s: %s\n", "State", state_names[dev->state]);
+    printf("%-20s: %s\n", "Sleep on last probe", dev->sleep_seen ? "yes" : "no");
+    printf("%-20s: %u ms\n", "Learned wake delay", dev->wake_delay_ms);
+    printf("%-20s: %" PRIu32 "\n", "Reads", dev->accesses);
+    printf("%-20s: %" PRIu32 "\n", "NACK/timeouts", dev->nacks);
+    printf("%-20s: %" PRIu32 "\n", "Wake accesses", dev->wakes);
+    printf("%-20s: %" PRIu32 "\n", "Failed reads", dev->failures);
+    printf("%-20s: %s\n", "PEC", dev->pec ? "on" : "off");
+    printf("%-20s: %" PRIu32 "\n", "PEC errors", dev->pec_errors);
+    return 0;
 }
+// ──────────────────────────────────────────────────────────────────────────────
+//  Pack table
+// ──────────────────────────────────────────────────────────────────────────────
+typedef struct
+{
+    uint8_t addr;
+    int8_t mux_channel;
+} bq_pack_cfg_t;
+
+static void bq_pack_load(void)
+{
+    bq_pack_cfg_t cfg[BQ_MAX_PACKS];
+    size_t len = sizeof(cfg);
+    nvs_handle_t handle;
+
+    if (nvs_open(BQ_PACK_NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK)
+    {
+        return;
+    }
+    esp_err_t err = nvs_get_blob(handle, BQ_PACK_NVS_KEY, cfg, &len);
+    nvs_close(handle);
+    if (err != ESP_OK || len != sizeof(cfg))
+    {
+        return;
+    }
+
+    for (int i = 0; i < BQ_MAX_PACKS; i++)
+    {
+        s_bq_packs[i] = (bq_dev_t){
+            .addr = cfg[i].addr,
+            .mux_channel = cfg[i].mux_channel,
+            .wake_delay_ms = BQ_RETRY_DELAY_MIN_MS,
+        };
+    }
+
+    /* select the first configured pack, fall back to the default gauge */
+    for (s_bq_selected = 0; s_bq_selected < BQ_MAX_PACKS && !s_bq_packs[s_bq_selected].addr; s_bq_selected++)
+    {
+    }
+    if (s_bq_selected == BQ_MAX_PACKS)
+    {
+        s_bq_selected = 0;
+        s_bq_packs[0].addr = BQ40Z555_I2C_ADDR;
+        s_bq_packs[0].mux_channel = -1;
+    }
+}
+
+static esp_err_t bq_pack_save(void)
+{
+    bq_pack_cfg_t cfg[BQ_MAX_PACKS];
+    nvs_handle_t handle;
+
+    for (int i = 0; i < BQ_MAX_PACKS; i++)
+    {
+        cfg[i].addr = s_bq_packs[i].addr;
+        cfg[i].mux_channel = s_bq_packs[i].mux_channel;
+    }
+
+    esp_err_t err = nvs_open(BQ_PACK_NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if (err != ESP_OK)
+    {
+        return err;
+    }
+    err = nvs_set_blob(handle, BQ_PACK_NVS_KEY, cfg, sizeof(cfg));
+    if (err == ESP_OK)
+    {
+        err = nvs_commit(handle);
+    }
+    nvs_close(handle);
+    return err;
+}
+
+static struct
+{
+    struct arg_int *add;
+    struct arg_int *mux;
+    struct arg_int *slot;
+    struct arg_int *del;
+    struct arg_int *sel;
+    struct arg_end *end;
+} bq_pack_args;
+
+static int cmd_bq_pack(int argc, char **argv)
+{
+    int nerrors = arg_parse(argc, argv, (void **)&bq_pack_args);
+    if (nerrors != 0)
+    {
+        arg_print_errors(stderr, bq_pack_args.end, argv[0]);
+        return 1;
+    }
+
+    if ((bq_pack_args.mux->count || bq_pack_args.slot->count) && !bq_pack_args.add->count)
+    {
+        printf("-m and -i only apply to a pack added with -a\n");
+        return 1;
+    }
+
+    bool changed = false;
+
+    if (bq_pack_args.add->count)
+    {
+        int addr = bq_pack_args.add->ival[0];
+        int mux = bq_pack_args.mux->count ? bq_pack_args.mux->ival[0] : -1;
+        int slot = -1;
+
+        if (addr < 0x08 || addr > 0x77 || addr == BQ_MUX_I2C_ADDR || mux < -1 || mux > 7)
+        {
+            printf("Invalid address 0x%02X or mux channel %d\n", addr, mux);
+            return 1;
+        }
+        if (bq_pack_args.slot->count)
+        {
+            slot = bq_pack_args.slot->ival[0];
+        }
+        else
+        {
+            for (int i = 0; i < BQ_MAX_PACKS && slot < 0; i++)
+            {
+                slot = s_bq_packs[i].addr ? -1 : i;
+            }
+        }
+        if (slot < 0 || slot >= BQ_MAX_PACKS)
+        {
+            printf("No free pack slot (max %d)\n", BQ_MAX_PACKS);
+            return 1;
+        }
+        /* the poller may be accessing the slot */
+        i2c_lock();
+        s_bq_packs[slot] = (bq_dev_t){
+            .addr = (uint8_t)addr,
+            .mux_channel = (int8_t)mux,
+            .wake_delay_ms = BQ_RETRY_DELAY_MIN_MS,
+        };
+        i2c_unlock();
+        changed = true;
+    }
+
+    if (bq_pack_args.del->count)
+    {
+        int slot = bq_pack_args.del->ival[0];
+        if (!bq_pack(slot) || slot == s_bq_selected)
+        {
+            printf("Slot %d not configured or currently selected\n", slot);
+            return 1;
+        }
+        i2c_lock();
+        s_bq_packs[slot].addr = 0;
+        i2c_unlock();
+        changed = true;
+    }
+
+    if (bq_pack_args.sel->count)
+    {
+        int slot = bq_pack_args.sel->ival[0];
+        if (!bq_pack(slot))
+        {
+            printf("Slot %d not configured\n", slot);
+            return 1;
+        }
+        s_bq_selected = slot;
+    }
+
+    if (changed && bq_pack_save() != ESP_OK)
+    {
+        printf("Failed to store pack table\n");
+    }
+
+    printf("Slot  Addr  Mux\n");
+    for (int i = 0; i < BQ_MAX_PACKS; i++)
+    {
+        const bq_dev_t *dev = bq_pack(i);
+        if (!dev)
+        {
+            continue;
+        }
+        char mux[4] = "-";
+        if (dev->mux_channel >= 0)
+        {
+            snprintf(mux, sizeof(mux), "%d", dev->mux_channel);
+        }
+        printf("%c%-3d  0x%02X  %s\n", i == s_bq_selected ? '*' : ' ', i, dev->addr, mux);
+    }
+    return 0;
+}
+
 // ──────────────────────────────────────────────────────────────────────────────
 //  Command registration helper
 // ──────────────────────────────────────────────────────────────────────────────
 
 void register_bq_commands(void)
 {
+    bq_show_args.count = arg_int0("n", "count", "<n>", "Dump n snapshots, each read while the previous one is printed");
+    bq_show_args.interval = arg_int0("i", "interval", "<ms>", "Minimum time between snapshots (default: as fast as the bus allows)");
+    bq_show_args.bench = arg_int0(NULL, "bench", "<rounds>", "Read one snapshot and time decoding it <rounds> times, without printing");
+    bq_show_args.end = arg_end(3);
+
     const esp_console_cmd_t dump_cmd = {
         .command = "bq_show",
         .help = "Read all known fields",
         .hint = NULL,
         .func = &cmd_bq_dump,
-        .argtable = NULL,
+        .argtable = &bq_show_args,
     };
 
     ESP_ERROR_CHECK(esp_console_cmd_register(&dump_cmd));
@@ -671,9 +1791,46 @@ void register_bq_commands(void)
         .argtable = NULL, // simple argv parsing
     };
     ESP_ERROR_CHECK(esp_console_cmd_register(&lifetime_cmd));
+    bq_access_args.pec = arg_int0("P", "pec", "<0|1>", "Append / check SMBus PEC on the selected pack");
+    bq_access_args.end = arg_end(1);
+    const esp_console_cmd_t access_cmd = {
+        .command = "bq_access",
+        .help = "Show gauge access statistics (sleep/wake, NACK retries, PEC)",
+        .hint = NULL,
+        .func = &cmd_bq_access,
+        .argtable = &bq_access_args,
+    };
+    ESP_ERROR_CHECK(esp_console_cmd_register(&access_cmd));
+
+    bq_pack_args.add = arg_int0("a", "add", "<addr>", "Add a pack at this SMBus address");
+    bq_pack_args.mux = arg_int0("m", "mux", "<ch>", "Mux channel of the added pack (default: direct)");
+    bq_pack_args.slot = arg_int0("i", "slot", "<slot>", "Slot for the added pack (default: first free)");
+    bq_pack_args.del = arg_int0("d", "del", "<slot>", "Remove a pack");
+    bq_pack_args.sel = arg_int0("s", "select", "<slot>", "Pack used by bq_show, bq_lifetime, ...");
+    bq_pack_args.end = arg_end(5);
+    const esp_console_cmd_t pack_cmd = {
+        .command = "bq_pack",
+        .help = "List or configure the packs (address, mux channel) on the bus",
+        .hint = NULL,
+        .func = &cmd_bq_pack,
+        .argtable = &bq_pack_args,
+    };
+    ESP_ERROR_CHECK(esp_console_cmd_register(&pack_cmd));
 }
 
 void bq_start(void)
 {
+    bq_pack_load();
     register_bq_commands();
+    register_bq_forensics_commands();
+    bq_soc_start();
+    bq_ocv_start(); /* after bq_soc, so a learned table overrides the reset on attach */
+    bq_history_start();
+    bq_health_start();
+    bq_anomaly_start();
+    bq_capture_start();
+    bq_sync_start();
+    bq_coop_start();
+    bq_telem_start();
+    bq_poll_start();
 }
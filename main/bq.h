@@ -1,5 +1,13 @@
 #pragma once
 
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+/// Number of elements of an array
+#define COUNT(x) (sizeof(x) / sizeof((x)[0]))
+
 // ──────────────────────────────────────────────────────────────────────────────
 //  Generic WORD helper
 // ──────────────────────────────────────────────────────────────────────────────
@@ -12,6 +20,17 @@
  * `bq_generic_word()` to fetch/print it – or use it inside console commands.
  */
 
+/// Little-endian WORD / DWORD as they come in gauge responses
+static inline uint16_t le16(const uint8_t *p)
+{
+    return (uint16_t)p[0] | ((uint16_t)p[1] << 8);
+}
+
+static inline uint32_t le32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
 typedef enum
 {
     BQ40Z555_TYPE_BYTE = 0,
@@ -42,6 +61,32 @@ typedef struct {
 } bq_bit_desc_t;
 
 
+/**
+ * Decoded response of an entry: the raw WORD, the scaled value, or the
+ * payload of a block (pointing into the response buffer).
+ */
+typedef union
+{
+    uint16_t raw;
+    int32_t sval;
+    float val;
+    struct
+    {
+        const uint8_t *data;
+        uint8_t len;
+        uint8_t swapped[4]; ///< byte-reversed copy of short big endian registers
+    } block;
+} bq_value_t;
+
+/// bq_entry flags for registers of devices other than the gauge
+#define BQ_ENTRY_SIGNED 0x01     ///< two's complement WORD (or byte)
+#define BQ_ENTRY_BIG_ENDIAN 0x02 ///< MSB first
+#define BQ_ENTRY_RAW_BLOCK 0x04  ///< block of read_len bytes without SBS length byte
+
+struct bq_entry;
+typedef void (*bq_decode_fn)(const struct bq_entry *e, const uint8_t *resp, size_t rlen, bq_value_t *out);
+typedef void (*bq_format_fn)(const struct bq_entry *e, const bq_value_t *v);
+
 typedef struct bq_entry
 {
     uint8_t reg;      ///< SBS command code (0x00‑0xFF)
@@ -52,6 +97,10 @@ typedef struct bq_entry
     bq_data_type type;
     const bq_bit_desc_t *bits;
     uint8_t bits_count;
+    uint8_t read_len;    ///< bytes read: the WORD, or length byte + longest block
+    uint8_t flags;       ///< BQ_ENTRY_*, 0 for the SBS table
+    bq_decode_fn decode; ///< response → value, chosen with the type
+    bq_format_fn format; ///< value → "<name>: <value> <unit>" line(s)
 } bq_entry;
 
 #define BQ40Z555_CMD_MANUFACTURER_ACCESS 0x00
@@ -87,6 +136,7 @@ typedef struct bq_entry
 #define BQ40Z555_CMD_DEVICE_NAME 0x21
 #define BQ40Z555_CMD_DEVICE_CHEMISTRY 0x22
 #define BQ40Z555_CMD_MANUFACTURER_DATA 0x23
+#define BQ40Z555_CMD_MANUFACTURER_BLOCK_ACCESS 0x44
 #define BQ40Z555_CMD_AUTHENTICATE 0x2F
 #define BQ40Z555_CMD_CELL_VOLTAGE4 0x3C // Cell 3 → index order per TI
 #define BQ40Z555_CMD_CELL_VOLTAGE3 0x3D
@@ -128,4 +178,104 @@ typedef struct bq_entry
 #define BQ40Z555_I2C_ADDR 0x0B
 #endif
 
+/// Number of packs (address / mux channel pairs) the station can handle
+#define BQ_MAX_PACKS 8
+
+/// TCA9548A‑style I²C multiplexer used to reach packs with the same address
+#define BQ_MUX_I2C_ADDR 0x70
+
+/// OperationStatus() bit that is set while the gauge is in SLEEP mode
+#define BQ40Z555_OPSTATUS_SLEEP (1UL << 15)
+/// OperationStatus() SafetyStatus / PFStatus active flags
+#define BQ40Z555_OPSTATUS_SS (1UL << 11)
+#define BQ40Z555_OPSTATUS_PF (1UL << 12)
+/// OperationStatus() discharge / charge FET enabled
+#define BQ40Z555_OPSTATUS_DSG (1UL << 1)
+#define BQ40Z555_OPSTATUS_CHG (1UL << 2)
+/// BatteryStatus() fully charged / fully discharged flags
+#define BQ40Z555_BATTSTATUS_FC (1U << 5)
+#define BQ40Z555_BATTSTATUS_FD (1U << 4)
+/// BatteryStatus() discharging or relaxing, cleared while charging
+#define BQ40Z555_BATTSTATUS_DSG (1U << 6)
+
+/// Data flash address of the Black Box Recorder row, read through
+/// ManufacturerAccess(). Check it against the data flash map of the TRM for
+/// the firmware revision at hand; `bq_forensics -b` overrides it.
+#define BQ40Z555_DF_BLACK_BOX 0x4280
+
+/// First retry delay after a NACK / timeout, doubled up to the max per retry
+#define BQ_RETRY_DELAY_MIN_MS 2
+#define BQ_RETRY_DELAY_MAX_MS 32
+/// Total time a single access may spend waking / retrying the gauge
+#define BQ_WAKE_BUDGET_MS 250
+
+// ──────────────────────────────────────────────────────────────────────────────
+//  Device access context
+// ──────────────────────────────────────────────────────────────────────────────
+/**
+ * One gauge on the bus together with its sleep/wake access policy state.
+ *
+ * The BQ40Z555 NACKs (or stretches the clock) while it is in SLEEP or busy
+ * updating data flash. Every access therefore goes through `bq_read()`, which
+ * issues a wake access on a NACK and retries with a short delay that adapts
+ * to how long the gauge needed the last time. An address that stays NACKed
+ * after that fails at once, a clock-stretch timeout is retried.
+ */
+typedef enum
+{
+    BQ_STATE_UNKNOWN = 0,
+    BQ_STATE_AWAKE,
+    BQ_STATE_UNRESPONSIVE,
+} bq_state_t;
+
+/// `addr` and `mux_channel` change only with the bus lock held. The rest is
+/// updated by whoever accesses the pack (poller, console, I2C worker) and is
+/// atomic for that.
+typedef struct bq_dev
+{
+    uint8_t addr;                   ///< 7‑bit SMBus address
+    int8_t mux_channel;             ///< TCA9548A channel the pack sits behind, -1 = directly on the bus
+    _Atomic bq_state_t state;       ///< result of the last access
+    _Atomic uint16_t wake_delay_ms; ///< learned first retry delay
+    atomic_bool sleep_seen;         ///< OperationStatus reported SLEEP on the last probe
+    _Atomic uint32_t accesses;      ///< SBS reads issued
+    _Atomic uint32_t nacks;         ///< failed transactions (NACK or timeout)
+    _Atomic uint32_t wakes;         ///< wake accesses issued
+    _Atomic uint32_t failures;      ///< reads that failed after all retries
+    atomic_bool pec;                ///< append / check the SMBus packet error code
+    _Atomic uint32_t pec_errors;    ///< transactions whose PEC did not match
+} bq_dev_t;
+
+bq_dev_t *bq_default_dev(void);
+bq_dev_t *bq_pack(int idx);
+int bq_read(bq_dev_t *dev, uint8_t cmd, uint8_t *rdata, size_t rlen);
+int bq_write(bq_dev_t *dev, uint8_t cmd, const uint8_t *data, size_t len);
+int bq_read_block(bq_dev_t *dev, uint8_t cmd, uint8_t *data, size_t max, uint8_t *len);
+int bq_mac_read(bq_dev_t *dev, uint16_t subcmd, uint8_t *data, size_t max, uint8_t *len);
+int bq_mba_read(bq_dev_t *dev, uint16_t subcmd, uint8_t *data, size_t max, uint8_t *len);
+int bq_ensure_awake(bq_dev_t *dev);
+int bq_generic_dump(bq_dev_t *dev, const bq_entry *entry);
+
+/// Reads kept in flight by bq_read_pipelined(), and the longest read (length byte + 32)
+#define BQ_PIPE_DEPTH 4
+#define BQ_PIPE_MAX_LEN 33
+
+/// Called in order for every read of bq_read_pipelined(); return false to stop
+typedef bool (*bq_read_cb_t)(int idx, int err, const uint8_t *data, size_t len, void *ctx);
+int bq_read_pipelined(bq_dev_t *dev, const uint8_t *cmds, const uint8_t *lens, int count, bq_read_cb_t fn, void *ctx);
+
+struct i2c_xfer;
+int bq_read_submit(bq_dev_t *dev, struct i2c_xfer *xfer, uint8_t cmd, uint8_t *rdata, size_t rlen);
+
+// ──────────────────────────────────────────────────────────────────────────────
+//  Table access and decoding helpers
+// ──────────────────────────────────────────────────────────────────────────────
+const bq_entry *bq_entries(size_t *count);
+const bq_entry *bq_find_entry(uint8_t reg);
+uint8_t bq_entry_read_len(const bq_entry *entry);
+void bq_print_entry(const bq_entry *entry, const uint8_t *resp, size_t rlen);
+void bq_entry_bind(bq_entry *e);
+void bq_print_active_bits(const bq_entry *e, const uint8_t *data, size_t data_len);
+void bq_print_lifetime_from_buffer(int n, const uint8_t *data, size_t len);
+
 void bq_start();
@@ -0,0 +1,340 @@
+// bq_anomaly.c – streaming anomaly detection on the polled gauge signals
+//
+// Per pack and signal the detector keeps an EWMA mean and variance, the last
+// value and a report hold-off: a few floats, no history. Variance checks are
+// done on squared deviations so the per-sample path needs no sqrt; only a
+// report computes the z-score.
+//
+// SPDX-License-Identifier: MIT
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <inttypes.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_console.h"
+#include "esp_log.h"
+#include "port.h"
+#include "argtable3/argtable3.h"
+#include "bq.h"
+#include "bq_anomaly.h"
+#include "bq_poll.h"
+#include "bq_telem.h"
+
+// ──────────────────────────────────────────────────────────────────────────────
+//  Configuration
+// ──────────────────────────────────────────────────────────────────────────────
+
+static const char *TAG = "bq_anomaly";
+
+/// Samples before a pack's statistics are trusted
+#define BQ_ANOMALY_WARMUP 100
+/// Minimum time between two reports of the same signal
+#define BQ_ANOMALY_HOLDOFF_US (10 * 1000000LL)
+/// Voltage checks only apply while the current changed less than this
+#define BQ_ANOMALY_RATE_GATE_MA 100
+/// Samples further apart than this are not used for rates
+#define BQ_ANOMALY_MAX_DT_US 2000000LL
+/// Reported anomalies kept for `bq_anomaly`
+#define BQ_ANOMALY_LOG_SIZE 16
+#define BQ_ANOMALY_CELL_MIN_MV 1000
+
+enum
+{
+    BQ_SIG_VOLTAGE = 0,
+    BQ_SIG_TEMP,
+    BQ_SIG_CELL1,
+    BQ_SIG_RES1 = BQ_SIG_CELL1 + BQ_POLL_CELLS,
+    BQ_SIG_COUNT = BQ_SIG_RES1 + BQ_POLL_CELLS,
+};
+
+typedef struct
+{
+    const char *name;
+    const char *unit;
+    float scale;        ///< raw → display unit
+    float alpha;        ///< EWMA weight
+    float sigma_floor;  ///< raw units, keeps quantized flat signals from scoring huge z
+    float z_limit;      ///< 0 = no z-score check
+    float rate_limit;   ///< raw units per second, 0 = none
+    float abs_limit;    ///< |value| limit in raw units, 0 = none
+    bool current_gated; ///< z-score and rate only checked while the current is steady, a step moves the mean
+} bq_signal_desc_t;
+
+#define BQ_SIG_CELL(n) {"Cell" #n, "V", 0.001f, 1.0f / 64, 5.0f, 6.0f, 100.0f, 0.0f, true}
+#define BQ_SIG_RES(n) {"Residual" #n, "mV", 1.0f, 1.0f / 4096, 2.0f, 5.0f, 0.0f, 50.0f, false}
+
+static const bq_signal_desc_t s_signals[BQ_SIG_COUNT] = {
+    [BQ_SIG_VOLTAGE] = {"Voltage", "V", 0.001f, 1.0f / 64, 10.0f, 6.0f, 200.0f, 0.0f, true},
+    [BQ_SIG_TEMP] = {"Temperature", "K", 0.1f, 1.0f / 256, 2.0f, 6.0f, 10.0f, 0.0f, false},
+    [BQ_SIG_CELL1 + 0] = BQ_SIG_CELL(1),
+    [BQ_SIG_CELL1 + 1] = BQ_SIG_CELL(2),
+    [BQ_SIG_CELL1 + 2] = BQ_SIG_CELL(3),
+    [BQ_SIG_CELL1 + 3] = BQ_SIG_CELL(4),
+    [BQ_SIG_RES1 + 0] = BQ_SIG_RES(1),
+    [BQ_SIG_RES1 + 1] = BQ_SIG_RES(2),
+    [BQ_SIG_RES1 + 2] = BQ_SIG_RES(3),
+    [BQ_SIG_RES1 + 3] = BQ_SIG_RES(4),
+};
+
+typedef struct
+{
+    bool init;
+    float mean;
+    float var;
+    float prev;
+    int64_t holdoff_until_us;
+} bq_signal_state_t;
+
+typedef struct
+{
+    bq_signal_state_t sig[BQ_SIG_COUNT];
+    uint32_t samples;
+    uint32_t anomalies;
+    int16_t prev_ma;
+    int64_t prev_us;
+    uint64_t cycles_sum;
+    uint32_t cycles_max;
+} bq_anomaly_pack_t;
+
+static bq_anomaly_pack_t s_anomaly[BQ_MAX_PACKS];
+
+static bq_anomaly_t s_log[BQ_ANOMALY_LOG_SIZE];
+static uint32_t s_log_total;
+static portMUX_TYPE s_log_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static const char *const s_kind_names[] = {"z-score", "rate", "limit"};
+
+const char *bq_anomaly_signal_name(uint8_t signal)
+{
+    return signal < BQ_SIG_COUNT ? s_signals[signal].name : "?";
+}
+
+// ──────────────────────────────────────────────────────────────────────────────
+//  Detector
+// ──────────────────────────────────────────────────────────────────────────────
+static void bq_anomaly_report(bq_anomaly_pack_t *p, const bq_sample_t *s, int signal, bq_anomaly_kind_t kind,
+                              float value, float score)
+{
+    const bq_signal_desc_t *d = &s_signals[signal];
+    bq_signal_state_t *st = &p->sig[signal];
+    bq_anomaly_t a = {
+        .kind = kind,
+        .signal = (uint8_t)signal,
+        .value = value,
+        .mean = st->mean,
+        .sigma = sqrtf(st->var),
+        .score = score,
+        .sample = *s,
+    };
+
+    if (s->ts.mono_us < st->holdoff_until_us)
+    {
+        return;
+    }
+    st->holdoff_until_us = s->ts.mono_us + BQ_ANOMALY_HOLDOFF_US;
+    p->anomalies++;
+
+    taskENTER_CRITICAL(&s_log_lock);
+    s_log[s_log_total % BQ_ANOMALY_LOG_SIZE] = a;
+    s_log_total++;
+    taskEXIT_CRITICAL(&s_log_lock);
+
+    ESP_LOGW(TAG, "Pack %u %s %s %.2f: %.3f %s (mean %.3f, σ %.3f) | %.3f V %.3f A %.1f K", s->pack, d->name,
+             s_kind_names[kind], score, value * d->scale, d->unit, a.mean * d->scale, a.sigma * d->scale,
+             s->voltage_mv / 1000.0f, s->current_ma / 1000.0f, s->temp_dk / 10.0f);
+    bq_telem_event(&s->ts, s->pack, BQ_TELEM_EV_ANOMALY, "%s %s %.2f", d->name, s_kind_names[kind], score);
+}
+
+static void bq_anomaly_signal(bq_anomaly_pack_t *p, const bq_sample_t *s, int signal, float x, float dt,
+                              bool current_steady)
+{
+    const bq_signal_desc_t *d = &s_signals[signal];
+    bq_signal_state_t *st = &p->sig[signal];
+
+    if (!st->init)
+    {
+        st->init = true;
+        st->mean = x;
+        st->var = d->sigma_floor * d->sigma_floor;
+        st->prev = x;
+        return;
+    }
+
+    /* the IR drop of a load step is no anomaly: carry the mean along with it */
+    bool stepped = d->current_gated && !current_steady;
+    if (stepped)
+    {
+        st->mean += x - st->prev;
+    }
+
+    float dev = x - st->mean;
+    if (p->samples >= BQ_ANOMALY_WARMUP)
+    {
+        float var = st->var > d->sigma_floor * d->sigma_floor ? st->var : d->sigma_floor * d->sigma_floor;
+        if (d->z_limit > 0.0f && !stepped && dev * dev > d->z_limit * d->z_limit * var)
+        {
+            bq_anomaly_report(p, s, signal, BQ_ANOMALY_ZSCORE, x, dev / sqrtf(var));
+        }
+        if (d->rate_limit > 0.0f && dt > 0.0f && !stepped)
+        {
+            float rate = (x - st->prev) / dt;
+            if (fabsf(rate) > d->rate_limit)
+            {
+                bq_anomaly_report(p, s, signal, BQ_ANOMALY_RATE, x, rate * d->scale);
+            }
+        }
+        if (d->abs_limit > 0.0f && fabsf(x) > d->abs_limit)
+        {
+            bq_anomaly_report(p, s, signal, BQ_ANOMALY_LIMIT, x, (fabsf(x) - d->abs_limit) * d->scale);
+        }
+    }
+
+    st->mean += d->alpha * dev;
+    st->var = (1.0f - d->alpha) * (st->var + d->alpha * dev * dev);
+    st->prev = x;
+}
+
+static void bq_anomaly_on_sample(const bq_sample_t *s, void *ctx)
+{
+    (void)ctx;
+    uint32_t t0 = port_cycles();
+    bq_anomaly_pack_t *p = &s_anomaly[s->pack];
+    int64_t dt_us = s->ts.mono_us - p->prev_us;
+    float dt = p->samples && dt_us > 0 && dt_us < BQ_ANOMALY_MAX_DT_US ? dt_us * 1e-6f : 0.0f;
+    bool steady = abs(s->current_ma - p->prev_ma) < BQ_ANOMALY_RATE_GATE_MA;
+    uint32_t sum = 0;
+    int cells = 0;
+
+    bq_anomaly_signal(p, s, BQ_SIG_VOLTAGE, s->voltage_mv, dt, steady);
+    bq_anomaly_signal(p, s, BQ_SIG_TEMP, s->temp_dk, dt, steady);
+    for (int i = 0; i < BQ_POLL_CELLS; i++)
+    {
+        if (s->cell_mv[i] >= BQ_ANOMALY_CELL_MIN_MV)
+        {
+            bq_anomaly_signal(p, s, BQ_SIG_CELL1 + i, s->cell_mv[i], dt, steady);
+            sum += s->cell_mv[i];
+            cells++;
+        }
+    }
+    /* residual against the siblings, meaningful with two cells or more */
+    if (cells > 1)
+    {
+        float mean = (float)sum / cells;
+        for (int i = 0; i < BQ_POLL_CELLS; i++)
+        {
+            if (s->cell_mv[i] >= BQ_ANOMALY_CELL_MIN_MV)
+            {
+                bq_anomaly_signal(p, s, BQ_SIG_RES1 + i, s->cell_mv[i] - mean, dt, steady);
+            }
+        }
+    }
+
+    p->samples++;
+    p->prev_ma = s->current_ma;
+    p->prev_us = s->ts.mono_us;
+
+    uint32_t cycles = port_cycles() - t0;
+    p->cycles_sum += cycles;
+    if (cycles > p->cycles_max)
+    {
+        p->cycles_max = cycles;
+    }
+}
+
+static void bq_anomaly_on_attach(int pack, const bq_pack_info_t *info, void *ctx)
+{
+    (void)info;
+    (void)ctx;
+    memset(&s_anomaly[pack], 0, sizeof(s_anomaly[pack]));
+}
+
+// ──────────────────────────────────────────────────────────────────────────────
+//  Console command
+// ──────────────────────────────────────────────────────────────────────────────
+static struct
+{
+    struct arg_lit *clear;
+    struct arg_end *end;
+} bq_anomaly_args;
+
+static int cmd_bq_anomaly(int argc, char **argv)
+{
+    int nerrors = arg_parse(argc, argv, (void **)&bq_anomaly_args);
+    if (nerrors != 0)
+    {
+        arg_print_errors(stderr, bq_anomaly_args.end, argv[0]);
+        return 1;
+    }
+    if (bq_anomaly_args.clear->count)
+    {
+        taskENTER_CRITICAL(&s_log_lock);
+        s_log_total = 0;
+        taskEXIT_CRITICAL(&s_log_lock);
+        return 0;
+    }
+
+    printf("Pack  Samples   Anomalies  CPU/sample\n");
+    for (int idx = 0; idx < BQ_MAX_PACKS; idx++)
+    {
+        const bq_anomaly_pack_t *p = &s_anomaly[idx];
+        if (!bq_pack(idx) || !p->samples)
+        {
+            continue;
+        }
+        printf("%-4d  %-8" PRIu32 "  %-9" PRIu32 "  %" PRIu32 " us (max %" PRIu32 " us)%s\n", idx, p->samples,
+               p->anomalies, (uint32_t)(p->cycles_sum / p->samples) / PORT_CPU_MHZ,
+               p->cycles_max / PORT_CPU_MHZ, p->samples < BQ_ANOMALY_WARMUP ? "  warming up" : "");
+    }
+
+    printf("\nRecent anomalies, newest first:\n");
+    taskENTER_CRITICAL(&s_log_lock);
+    uint32_t total = s_log_total;
+    taskEXIT_CRITICAL(&s_log_lock);
+    for (uint32_t n = 0; n < total && n < BQ_ANOMALY_LOG_SIZE; n++)
+    {
+        bq_anomaly_t a;
+        char when[32];
+
+        taskENTER_CRITICAL(&s_log_lock);
+        a = s_log[(total - 1 - n) % BQ_ANOMALY_LOG_SIZE];
+        taskEXIT_CRITICAL(&s_log_lock);
+
+        const bq_signal_desc_t *d = &s_signals[a.signal];
+        tb_format(a.sample.ts.wall_us, when, sizeof(when));
+        printf("%-24s  pack %u  %-11s %-7s %+8.2f  value %.3f %s, mean %.3f, σ %.3f\n", when, a.sample.pack, d->name,
+               s_kind_names[a.kind], a.score, a.value * d->scale, d->unit, a.mean * d->scale, a.sigma * d->scale);
+        printf("%24s  %.3f V  %.3f A  %.1f K  cells %u/%u/%u/%u mV  BatteryStatus %04X  OperationStatus %08" PRIX32
+               "\n",
+               "", a.sample.voltage_mv / 1000.0f, a.sample.current_ma / 1000.0f, a.sample.temp_dk / 10.0f,
+               a.sample.cell_mv[0], a.sample.cell_mv[1], a.sample.cell_mv[2], a.sample.cell_mv[3],
+               a.sample.battery_status, a.sample.operation_status);
+    }
+    if (!total)
+    {
+        printf("  none\n");
+    }
+    return 0;
+}
+
+void bq_anomaly_start(void)
+{
+    if (bq_poll_add_sink(bq_anomaly_on_sample, NULL) || bq_poll_add_attach_sink(bq_anomaly_on_attach, NULL))
+    {
+        ESP_LOGE(TAG, "No free poller sink");
+        return;
+    }
+
+    bq_anomaly_args.clear = arg_lit0("c", "clear", "Clear the list of recent anomalies");
+    bq_anomaly_args.end = arg_end(1);
+
+    const esp_console_cmd_t anomaly_cmd = {
+        .command = "bq_anomaly",
+        .help = "Show anomalies found by the streaming detectors (z-score, cell residual, rate of change)",
+        .hint = NULL,
+        .func = &cmd_bq_anomaly,
+        .argtable = &bq_anomaly_args,
+    };
+    ESP_ERROR_CHECK(esp_console_cmd_register(&anomaly_cmd));
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdint.h>
+#include "bq_poll.h"
+
+// ──────────────────────────────────────────────────────────────────────────────
+//  Streaming anomaly detection
+// ──────────────────────────────────────────────────────────────────────────────
+/**
+ * Runs on every poller sample with fixed per-pack state:
+ *   - EWMA mean / variance per signal, flagged by z-score
+ *   - each cell's residual against the mean of its siblings, tracked with a
+ *     slow EWMA (drift) and an absolute limit
+ *   - rate-of-change limits; cell / pack voltage steps only count while the
+ *     current stayed constant, so load steps are not reported
+ */
+
+typedef enum
+{
+    BQ_ANOMALY_ZSCORE = 0,
+    BQ_ANOMALY_RATE,
+    BQ_ANOMALY_LIMIT,
+} bq_anomaly_kind_t;
+
+typedef struct
+{
+    bq_anomaly_kind_t kind;
+    uint8_t signal;     ///< index into the signal table, see bq_anomaly_signal_name()
+    float value;
+    float mean;
+    float sigma;
+    float score;        ///< z-score, rate per second or limit excess
+    bq_sample_t sample; ///< full sample the anomaly was found in
+} bq_anomaly_t;
+
+const char *bq_anomaly_signal_name(uint8_t signal);
+void bq_anomaly_start(void);
@@ -0,0 +1,861 @@
+// bq_capture.c – oscilloscope style pre-trigger capture of the polled samples
+//
+// The poller sink only writes the sample into the pack's ring and publishes
+// it with a release store of the head counter; it never waits for the
+// capture task. The capture task follows the head, evaluates the triggers on
+// each new sample and, once `post` samples followed a trigger, copies the
+// window out of the ring. Samples the producer overwrote while being copied
+// are detected from the head counter afterwards and dropped.
+//
+// SPDX-License-Identifier: MIT
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+#include <stdatomic.h>
+#include <inttypes.h>
+#include <sys/param.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_console.h"
+#include "esp_log.h"
+#include "nvs.h"
+#include "argtable3/argtable3.h"
+#include "bq.h"
+#include "bq_capture.h"
+#include "bq_history.h"
+#include "bq_poll.h"
+#include "flog.h"
+#include "timebase.h"
+
+// ──────────────────────────────────────────────────────────────────────────────
+//  Configuration
+// ──────────────────────────────────────────────────────────────────────────────
+
+static const char *TAG = "bq_capture";
+
+#define BQ_CAPTURE_PARTITION "capture"
+#define BQ_CAPTURE_INDEX_SLOTS 64
+#define BQ_CAPTURE_NVS_NAMESPACE "bq_capture"
+/// Ring entries per pack, power of two; samples are variably spaced, see bq_poll.c
+#define BQ_CAPTURE_RING 128
+#define BQ_CAPTURE_PRE_DEFAULT 64
+#define BQ_CAPTURE_POST_DEFAULT 32
+#define BQ_CAPTURE_MAX_TRIGGERS 8
+#define BQ_CAPTURE_TASK_PERIOD_MS 20
+/// Minimum time between two captures of the same pack
+#define BQ_CAPTURE_HOLDOFF_MS 5000
+#define BQ_CAPTURE_VERSION 1
+#define BQ_CAPTURE_SPEC_LEN 24
+
+/// Triggers used until `bq_capture -t` configures others
+static const char *const s_default_triggers[] = {"SS", "PF"};
+
+typedef enum
+{
+    BQ_TRIG_BIT = 0,
+    BQ_TRIG_ABOVE,
+    BQ_TRIG_BELOW,
+} bq_trigger_kind_t;
+
+enum
+{
+    BQ_CAP_VOLTAGE = 0,
+    BQ_CAP_CURRENT,
+    BQ_CAP_TEMP,
+    BQ_CAP_CELL1,
+    BQ_CAP_CELLMIN = BQ_CAP_CELL1 + 4,
+    BQ_CAP_CELLMAX,
+    BQ_CAP_SIGNALS,
+};
+
+static const char *const s_signal_names[BQ_CAP_SIGNALS] = {
+    "voltage", "current", "temp", "cell1", "cell2", "cell3", "cell4", "cellmin", "cellmax",
+};
+
+/// Status words a bit trigger can look at, first match wins for bare names
+static const uint8_t s_status_regs[] = {
+    BQ40Z555_CMD_SAFETY_ALERT,
+    BQ40Z555_CMD_SAFETY_STATUS,
+    BQ40Z555_CMD_OPERATION_STATUS,
+    BQ40Z555_CMD_BATTERY_STATUS,
+};
+
+typedef struct
+{
+    char spec[BQ_CAPTURE_SPEC_LEN];
+    bq_trigger_kind_t kind;
+    uint8_t reg;     ///< BQ_TRIG_BIT: status register
+    uint32_t mask;   ///< BQ_TRIG_BIT: bit in that register
+    uint8_t signal;  ///< thresholds: BQ_CAP_*
+    int32_t level;   ///< thresholds: raw units of the signal
+} bq_trigger_t;
+
+/// Stored window, followed by `count` samples
+typedef struct
+{
+    uint8_t version;
+    uint8_t pack;
+    uint16_t count;
+    uint16_t trigger_pos; ///< index of the trigger sample in the window
+    uint16_t serial;
+    uint16_t mfg_date;
+    uint16_t reserved;
+    int64_t wall_us;      ///< wall clock of the trigger sample
+    char trigger[BQ_CAPTURE_SPEC_LEN];
+} bq_capture_hdr_t;
+
+typedef struct
+{
+    bq_capture_sample_t slot[BQ_CAPTURE_RING];
+    atomic_uint_least32_t head; ///< samples written so far
+    atomic_bool reset;          ///< set on attach, consumer restarts from head
+    uint16_t serial;
+    uint16_t mfg_date;
+} bq_capture_ring_t;
+
+/// Consumer side, only touched by the capture task
+typedef struct
+{
+    uint32_t tail;
+    bool have_prev;
+    bq_capture_sample_t prev;
+    bool pending;
+    uint32_t trigger_idx;
+    int64_t trigger_wall_us;
+    char trigger[BQ_CAPTURE_SPEC_LEN];
+    uint32_t holdoff_until_ms;
+    bool holdoff;
+    uint32_t captures;
+    uint32_t lost;
+} bq_capture_pack_t;
+
+static bq_capture_ring_t *s_ring[BQ_MAX_PACKS];
+static bq_capture_pack_t s_pack[BQ_MAX_PACKS];
+static atomic_bool s_force[BQ_MAX_PACKS];
+
+static bq_trigger_t s_triggers[BQ_CAPTURE_MAX_TRIGGERS];
+static int s_trigger_count;
+static uint16_t s_pre = BQ_CAPTURE_PRE_DEFAULT;
+static uint16_t s_post = BQ_CAPTURE_POST_DEFAULT;
+static SemaphoreHandle_t s_cfg_lock;
+
+static flog_t s_capture;
+static bool s_capture_ok;
+
+// ──────────────────────────────────────────────────────────────────────────────
+//  Producer (poller task)
+// ──────────────────────────────────────────────────────────────────────────────
+static void bq_capture_on_sample(const bq_sample_t *s, void *ctx)
+{
+    (void)ctx;
+    bq_capture_ring_t *r = s_ring[s->pack];
+
+    if (!r)
+    {
+        return;
+    }
+
+    uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    bq_capture_sample_t *c = &r->slot[head % BQ_CAPTURE_RING];
+
+    c->t_ms = (uint32_t)(s->ts.mono_us / 1000);
+    c->voltage_mv = s->voltage_mv;
+    c->current_ma = s->current_ma;
+    c->temp_dk = s->temp_dk;
+    memcpy(c->cell_mv, s->cell_mv, sizeof(c->cell_mv));
+    c->battery_status = s->battery_status;
+    c->operation_status = s->operation_status;
+    c->safety_alert = s->safety_alert;
+    c->safety_status = s->safety_status;
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
+
+static void bq_capture_on_attach(int pack, const bq_pack_info_t *info, void *ctx)
+{
+    (void)ctx;
+
+    if (!info)
+    {
+        return;
+    }
+    if (!s_ring[pack])
+    {
+        /* allocated once and never freed, the capture task may hold it */
+        bq_capture_ring_t *r = calloc(1, sizeof(*r));
+        if (!r)
+        {
+            ESP_LOGE(TAG, "No memory for the ring of pack %d", pack);
+            return;
+        }
+        s_ring[pack] = r;
+    }
+    s_ring[pack]->serial = info->serial;
+    s_ring[pack]->mfg_date = info->mfg_date;
+    atomic_store(&s_ring[pack]->reset, true);
+}
+
+// ──────────────────────────────────────────────────────────────────────────────
+//  Triggers
+// ──────────────────────────────────────────────────────────────────────────────
+static uint32_t bq_capture_status(const bq_capture_sample_t *c, uint8_t reg)
+{
+    switch (reg)
+    {
+    case BQ40Z555_CMD_SAFETY_ALERT:
+        return c->safety_alert;
+    case BQ40Z555_CMD_SAFETY_STATUS:
+        return c->safety_status;
+    case BQ40Z555_CMD_OPERATION_STATUS:
+        return c->operation_status;
+    default:
+        return c->battery_status;
+    }
+}
+
+static int32_t bq_capture_signal(const bq_capture_sample_t *c, int signal)
+{
+    int32_t lo = INT32_MAX;
+    int32_t hi = 0;
+
+    switch (signal)
+    {
+    case BQ_CAP_VOLTAGE:
+        return c->voltage_mv;
+    case BQ_CAP_CURRENT:
+        return c->current_ma;
+    case BQ_CAP_TEMP:
+        return c->temp_dk;
+    case BQ_CAP_CELLMIN:
+    case BQ_CAP_CELLMAX:
+        for (int i = 0; i < 4; i++)
+        {
+            if (c->cell_mv[i])
+            {
+                lo = MIN(lo, c->cell_mv[i]);
+                hi = MAX(hi, c->cell_mv[i]);
+            }
+        }
+        return signal == BQ_CAP_CELLMIN ? (lo == INT32_MAX ? 0 : lo) : hi;
+    default:
+        return c->cell_mv[signal - BQ_CAP_CELL1];
+    }
+}
+
+static bool bq_capture_active(const bq_trigger_t *t, const bq_capture_sample_t *c)
+{
+    switch (t->kind)
+    {
+    case BQ_TRIG_BIT:
+        return (bq_capture_status(c, t->reg) & t->mask) != 0;
+    case BQ_TRIG_ABOVE:
+        return bq_capture_signal(c, t->signal) > t->level;
+    default:
+        return bq_capture_signal(c, t->signal) < t->level;
+    }
+}
+
+static bool bq_capture_find_bit(const char *reg_name, const char *bit_name, bq_trigger_t *t)
+{
+    for (size_t i = 0; i < sizeof(s_status_regs); i++)
+    {
+        const bq_entry *e = bq_find_entry(s_status_regs[i]);
+        if (!e || (reg_name && strcasecmp(reg_name, e->name)))
+        {
+            continue;
+        }
+        for (size_t b = 0; b < e->bits_count; b++)
+        {
+            if (e->bits[b].width == 1 && !strcasecmp(e->bits[b].desc, bit_name))
+            {
+                t->kind = BQ_TRIG_BIT;
+                t->reg = e->reg;
+                t->mask = 1UL << e->bits[b].bit;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Parse "NAME", "Register.NAME", "signal<level" or "signal>level".
+ */
+static bool bq_capture_parse(const char *spec, bq_trigger_t *t)
+{
+    char name[BQ_CAPTURE_SPEC_LEN];
+    const char *op = strpbrk(spec, "<>");
+    size_t len = op ? (size_t)(op - spec) : strlen(spec);
+
+    if (!len || len >= sizeof(name) || strlen(spec) >= sizeof(t->spec))
+    {
+        return false;
+    }
+    memset(t, 0, sizeof(*t));
+    strcpy(t->spec, spec);
+    memcpy(name, spec, len);
+    name[len] = '\0';
+
+    if (!op)
+    {
+        char *dot = strchr(name, '.');
+        if (dot)
+        {
+            *dot = '\0';
+            return bq_capture_find_bit(name, dot + 1, t);
+        }
+        return bq_capture_find_bit(NULL, name, t);
+    }
+
+    char *end;
+    long level = strtol(op + 1, &end, 0);
+    if (end == op + 1 || *end)
+    {
+        return false;
+    }
+    for (int i = 0; i < BQ_CAP_SIGNALS; i++)
+    {
+        if (!strcasecmp(name, s_signal_names[i]))
+        {
+            t->kind = *op == '>' ? BQ_TRIG_ABOVE : BQ_TRIG_BELOW;
+            t->signal = (uint8_t)i;
+            /* temperature is given in °C, sampled in 0.1 K */
+            t->level = i == BQ_CAP_TEMP ? (int32_t)(level * 10 + 2732) : (int32_t)level;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Index of the trigger that became active between `prev` and `cur`, -1 if none.
+ */
+static int bq_capture_eval(const bq_capture_sample_t *prev, const bq_capture_sample_t *cur)
+{
+    for (int i = 0; i < s_trigger_count; i++)
+    {
+        if (bq_capture_active(&s_triggers[i], cur) && !bq_capture_active(&s_triggers[i], prev))
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// ──────────────────────────────────────────────────────────────────────────────
+//  Persistence
+// ──────────────────────────────────────────────────────────────────────────────
+static void bq_capture_save_cfg(void)
+{
+    nvs_handle_t handle;
+    char list[BQ_CAPTURE_MAX_TRIGGERS * BQ_CAPTURE_SPEC_LEN] = "";
+
+    for (int i = 0; i < s_trigger_count; i++)
+    {
+        if (i)
+        {
+            strcat(list, ",");
+        }
+        strcat(list, s_triggers[i].spec);
+    }
+
+    if (nvs_open(BQ_CAPTURE_NVS_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK)
+    {
+        ESP_LOGW(TAG, "Failed to open NVS for writing");
+        return;
+    }
+    nvs_set_str(handle, "triggers", list);
+    nvs_set_u16(handle, "pre", s_pre);
+    nvs_set_u16(handle, "post", s_post);
+    if (nvs_commit(handle) != ESP_OK)
+    {
+        ESP_LOGW(TAG, "Failed to save settings");
+    }
+    nvs_close(handle);
+}
+
+static void bq_capture_add_trigger(const char *spec)
+{
+    if (s_trigger_count >= BQ_CAPTURE_MAX_TRIGGERS)
+    {
+        ESP_LOGW(TAG, "Too many triggers, '%s' ignored", spec);
+        return;
+    }
+    if (!bq_capture_parse(spec, &s_triggers[s_trigger_count]))
+    {
+        ESP_LOGW(TAG, "Unknown trigger '%s'", spec);
+        return;
+    }
+    s_trigger_count++;
+}
+
+static void bq_capture_load_cfg(void)
+{
+    nvs_handle_t handle;
+    char list[BQ_CAPTURE_MAX_TRIGGERS * BQ_CAPTURE_SPEC_LEN];
+    size_t len = sizeof(list);
+    bool have_list = false;
+
+    if (nvs_open(BQ_CAPTURE_NVS_NAMESPACE, NVS_READONLY, &handle) == ESP_OK)
+    {
+        have_list = nvs_get_str(handle, "triggers", list, &len) == ESP_OK;
+        nvs_get_u16(handle, "pre", &s_pre);
+        nvs_get_u16(handle, "post", &s_post);
+        nvs_close(handle);
+    }
+
+    s_trigger_count = 0;
+    if (!have_list)
+    {
+        for (size_t i = 0; i < sizeof(s_default_triggers) / sizeof(s_default_triggers[0]); i++)
+        {
+            bq_capture_add_trigger(s_default_triggers[i]);
+        }
+        return;
+    }
+    for (char *save, *tok = strtok_r(list, ",", &save); tok; tok = strtok_r(NULL, ",", &save))
+    {
+        bq_capture_add_trigger(tok);
+    }
+}
+
+/// Window length the partition can hold in one record
+static uint16_t bq_capture_max_window(void)
+{
+    uint32_t max = s_capture_ok ? flog_max_record(&s_capture) : 4000;
+    uint32_t n = (max - sizeof(bq_capture_hdr_t)) / sizeof(bq_capture_sample_t);
+    return (uint16_t)MIN(n, BQ_CAPTURE_RING - 1);
+}
+
+// ──────────────────────────────────────────────────────────────────────────────
+//  Consumer (capture task)
+// ──────────────────────────────────────────────────────────────────────────────
+static void bq_capture_save(int pack, bq_capture_ring_t *r, bq_capture_pack_t *p)
+{
+    uint32_t first = p->trigger_idx >= s_pre ? p->trigger_idx - s_pre : 0;
+    uint32_t last = p->trigger_idx + s_post;
+    uint32_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+
+    /* the slot at `head` is the next one the producer writes, skip it too */
+    if (head >= BQ_CAPTURE_RING && first <= head - BQ_CAPTURE_RING)
+    {
+        first = head - BQ_CAPTURE_RING + 1;
+    }
+    if (first > p->trigger_idx)
+    {
+        p->lost++;
+        return;
+    }
+
+    uint16_t count = (uint16_t)(last - first + 1);
+    bq_capture_hdr_t *rec = malloc(sizeof(*rec) + count * sizeof(bq_capture_sample_t));
+    if (!rec)
+    {
+        p->lost++;
+        return;
+    }
+    bq_capture_sample_t *samples = (bq_capture_sample_t *)(rec + 1);
+    for (uint32_t i = 0; i < count; i++)
+    {
+        samples[i] = r->slot[(first + i) % BQ_CAPTURE_RING];
+    }
+
+    /* drop whatever the producer overwrote while we were copying */
+    atomic_thread_fence(memory_order_acquire);
+    head = atomic_load_explicit(&r->head, memory_order_acquire);
+    uint32_t skip = 0;
+    if (head >= BQ_CAPTURE_RING && first <= head - BQ_CAPTURE_RING)
+    {
+        skip = head - BQ_CAPTURE_RING + 1 - first;
+    }
+    if (first + skip > p->trigger_idx)
+    {
+        free(rec);
+        p->lost++;
+        return;
+    }
+    if (skip)
+    {
+        memmove(samples, samples + skip, (count - skip) * sizeof(bq_capture_sample_t));
+        count -= skip;
+        first += skip;
+    }
+
+    memset(rec, 0, sizeof(*rec));
+    rec->version = BQ_CAPTURE_VERSION;
+    rec->pack = (uint8_t)pack;
+    rec->count = count;
+    rec->trigger_pos = (uint16_t)(p->trigger_idx - first);
+    rec->serial = r->serial;
+    rec->mfg_date = r->mfg_date;
+    rec->wall_us = p->trigger_wall_us;
+    strcpy(rec->trigger, p->trigger);
+
+    esp_err_t err = s_capture_ok ? flog_append(&s_capture, bq_history_key(r->serial, r->mfg_date), rec,
+                                               sizeof(*rec) + count * sizeof(bq_capture_sample_t))
+                                 : ESP_ERR_INVALID_STATE;
+    if (err == ESP_OK)
+    {
+        p->captures++;
+        ESP_LOGI(TAG, "Pack %d: '%s' captured, %u samples (%u before)", pack, rec->trigger, count, rec->trigger_pos);
+    }
+    else
+    {
+        p->lost++;
+        ESP_LOGW(TAG, "Pack %d: capture of '%s' not stored: %s", pack, rec->trigger, esp_err_to_name(err));
+    }
+    free(rec);
+}
+
+static void bq_capture_arm(bq_capture_pack_t *p, uint32_t idx, uint32_t t_ms, const char *name)
+{
+    uint32_t now_ms = (uint32_t)(tb_mono_us() / 1000);
+
+    p->pending = true;
+    p->trigger_idx = idx;
+    p->trigger_wall_us = tb_wall_from_mono(tb_mono_us() - (int64_t)(uint32_t)(now_ms - t_ms) * 1000);
+    snprintf(p->trigger, sizeof(p->trigger), "%s", name);
+}
+
+static void bq_capture_run(int pack, bq_capture_ring_t *r, bq_capture_pack_t *p)
+{
+    if (atomic_exchange(&r->reset, false))
+    {
+        memset(p, 0, offsetof(bq_capture_pack_t, captures));
+        p->tail = atomic_load_explicit(&r->head, memory_order_acquire);
+    }
+
+    uint32_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+    if (head - p->tail >= BQ_CAPTURE_RING)
+    {
+        /* fell behind by a whole ring, resynchronize */
+        p->tail = head - BQ_CAPTURE_RING / 2;
+        p->have_prev = false;
+    }
+
+    if (atomic_exchange(&s_force[pack], false) && !p->pending && head)
+    {
+        bq_capture_arm(p, head - 1, r->slot[(head - 1) % BQ_CAPTURE_RING].t_ms, "manual");
+    }
+
+    xSemaphoreTake(s_cfg_lock, portMAX_DELAY);
+    while (p->tail != head)
+    {
+        bq_capture_sample_t cur = r->slot[p->tail % BQ_CAPTURE_RING];
+
+        if (p->holdoff && (int32_t)(cur.t_ms - p->holdoff_until_ms) >= 0)
+        {
+            p->holdoff = false;
+        }
+        if (!p->pending && !p->holdoff && p->have_prev)
+        {
+            int t = bq_capture_eval(&p->prev, &cur);
+            if (t >= 0)
+            {
+                bq_capture_arm(p, p->tail, cur.t_ms, s_triggers[t].spec);
+            }
+        }
+        p->prev = cur;
+        p->have_prev = true;
+        p->tail++;
+    }
+
+    if (p->pending && head - p->trigger_idx > s_post)
+    {
+        bq_capture_save(pack, r, p);
+        p->pending = false;
+        p->holdoff = true;
+        p->holdoff_until_ms = p->prev.t_ms + BQ_CAPTURE_HOLDOFF_MS;
+    }
+    xSemaphoreGive(s_cfg_lock);
+}
+
+static void bq_capture_task(void *arg)
+{
+    (void)arg;
+    TickType_t last_wake = xTaskGetTickCount();
+
+    while (1)
+    {
+        for (int pack = 0; pack < BQ_MAX_PACKS; pack++)
+        {
+            if (s_ring[pack])
+            {
+                bq_capture_run(pack, s_ring[pack], &s_pack[pack]);
+            }
+        }
+        vTaskDelayUntil(&last_wake, pdMS_TO_TICKS(BQ_CAPTURE_TASK_PERIOD_MS));
+    }
+}
+
+// ──────────────────────────────────────────────────────────────────────────────
+//  Display
+// ──────────────────────────────────────────────────────────────────────────────
+typedef struct
+{
+    uint32_t seq;
+    bool found;
+} bq_capture_show_t;
+
+static void bq_capture_print_hdr(uint32_t seq, const bq_capture_hdr_t *h)
+{
+    char when[32];
+
+    tb_format(h->wall_us, when, sizeof(when));
+    printf("%6" PRIu32 "  %04X%04X  %4u  %-24s  %-16s  %5u  %5u\n", seq, h->serial, h->mfg_date, h->pack, when,
+           h->trigger, h->trigger_pos, h->count - h->trigger_pos - 1);
+}
+
+static void bq_capture_print_legend(void)
+{
+    printf("%6s  %-8s  %4s  %-24s  %-16s  %5s  %5s\n", "Seq", "Key", "Pack", "Triggered", "Trigger", "Pre", "Post");
+}
+
+static bool bq_capture_list(uint32_t key, uint32_t seq, const void *data, uint16_t len, void *ctx)
+{
+    (void)key;
+    (void)ctx;
+    const bq_capture_hdr_t *h = data;
+
+    if (len >= sizeof(*h) && h->version == BQ_CAPTURE_VERSION)
+    {
+        bq_capture_print_hdr(seq, h);
+    }
+    return true;
+}
+
+static void bq_capture_print_status(const char *name, uint32_t value)
+{
+    if (value)
+    {
+        printf(" %s=%08" PRIX32, name, value);
+    }
+}
+
+static bool bq_capture_show(uint32_t key, uint32_t seq, const void *data, uint16_t len, void *ctx)
+{
+    (void)key;
+    bq_capture_show_t *show = ctx;
+    const bq_capture_hdr_t *h = data;
+
+    if (seq != show->seq)
+    {
+        return true;
+    }
+    show->found = true;
+    if (len < sizeof(*h) || h->version != BQ_CAPTURE_VERSION ||
+        len < sizeof(*h) + h->count * sizeof(bq_capture_sample_t))
+    {
+        printf("Capture %" PRIu32 " is damaged\n", seq);
+        return false;
+    }
+
+    const bq_capture_sample_t *s = (const bq_capture_sample_t *)(h + 1);
+    const bq_capture_sample_t *t = &s[h->trigger_pos];
+    bq_capture_print_legend();
+    bq_capture_print_hdr(seq, h);
+    printf("\n%8s  %6s  %7s  %6s  %-23s  %s\n", "t [ms]", "V [mV]", "I [mA]", "T [°C]", "Cells [mV]", "Status");
+    for (int i = 0; i < h->count; i++)
+    {
+        printf("%c%7" PRId32 "  %6u  %7d  %6.1f  %5u %5u %5u %5u  BS=%04X", i == h->trigger_pos ? '>' : ' ',
+               (int32_t)(s[i].t_ms - t->t_ms), s[i].voltage_mv, s[i].current_ma, (s[i].temp_dk - 2731.5f) / 10.0f,
+               s[i].cell_mv[0], s[i].cell_mv[1], s[i].cell_mv[2], s[i].cell_mv[3], s[i].battery_status);
+        printf(" OS=%08" PRIX32, s[i].operation_status);
+        bq_capture_print_status("SA", s[i].safety_alert);
+        bq_capture_print_status("SS", s[i].safety_status);
+        printf("\n");
+    }
+    return false;
+}
+
+// ──────────────────────────────────────────────────────────────────────────────
+//  Console command
+// ──────────────────────────────────────────────────────────────────────────────
+static struct
+{
+    struct arg_str *trigger;
+    struct arg_lit *clear;
+    struct arg_int *pre;
+    struct arg_int *post;
+    struct arg_lit *list;
+    struct arg_int *show;
+    struct arg_lit *fire;
+    struct arg_int *slot;
+    struct arg_lit *erase;
+    struct arg_end *end;
+} bq_capture_args;
+
+static void bq_capture_print_triggers(void)
+{
+    printf("Window: %u samples before, %u after the trigger (max %u in total)\n", s_pre, s_post,
+           bq_capture_max_window());
+    printf("Triggers:");
+    for (int i = 0; i < s_trigger_count; i++)
+    {
+        printf(" %s", s_triggers[i].spec);
+    }
+    printf("%s\n", s_trigger_count ? "" : " none");
+
+    for (int pack = 0; pack < BQ_MAX_PACKS; pack++)
+    {
+        bq_capture_ring_t *r = s_ring[pack];
+        if (r)
+        {
+            printf("Pack %d (%04X%04X): %" PRIu32 " samples, %" PRIu32 " captures, %" PRIu32 " lost%s\n", pack,
+                   r->serial, r->mfg_date, (uint32_t)atomic_load(&r->head), s_pack[pack].captures,
+                   s_pack[pack].lost, s_pack[pack].pending ? ", triggered" : "");
+        }
+    }
+}
+
+static int cmd_bq_capture(int argc, char **argv)
+{
+    int nerrors = arg_parse(argc, argv, (void **)&bq_capture_args);
+    if (nerrors != 0)
+    {
+        arg_print_errors(stderr, bq_capture_args.end, argv[0]);
+        return 1;
+    }
+
+    if (bq_capture_args.list->count || bq_capture_args.show->count || bq_capture_args.erase->count)
+    {
+        if (!s_capture_ok)
+        {
+            printf("Capture partition '%s' not available\n", BQ_CAPTURE_PARTITION);
+            return 1;
+        }
+        if (bq_capture_args.erase->count)
+        {
+            esp_err_t err = flog_erase(&s_capture);
+            printf("Captures erased: %s\n", esp_err_to_name(err));
+            return err != ESP_OK;
+        }
+
+        uint32_t max = flog_max_record(&s_capture);
+        void *buf = malloc(max);
+        if (!buf)
+        {
+            printf("Out of memory\n");
+            return 1;
+        }
+        if (bq_capture_args.show->count)
+        {
+            bq_capture_show_t show = {.seq = (uint32_t)bq_capture_args.show->ival[0]};
+            flog_scan(&s_capture, buf, max, bq_capture_show, &show);
+            if (!show.found)
+            {
+                printf("No capture %" PRIu32 "\n", show.seq);
+            }
+        }
+        else
+        {
+            bq_capture_print_legend();
+            int n = flog_scan(&s_capture, buf, max, bq_capture_list, NULL);
+            printf("%d captures\n", n);
+        }
+        free(buf);
+        return 0;
+    }
+
+    if (bq_capture_args.fire->count)
+    {
+        int pack = bq_capture_args.slot->count ? bq_capture_args.slot->ival[0] : 0;
+        if (pack < 0 || pack >= BQ_MAX_PACKS || !s_ring[pack])
+        {
+            printf("Pack %d has no samples\n", pack);
+            return 1;
+        }
+        atomic_store(&s_force[pack], true);
+        printf("Capture of pack %d triggered\n", pack);
+        return 0;
+    }
+
+    bool changed = false;
+    xSemaphoreTake(s_cfg_lock, portMAX_DELAY);
+    if (bq_capture_args.clear->count)
+    {
+        s_trigger_count = 0;
+        changed = true;
+    }
+    for (int i = 0; i < bq_capture_args.trigger->count; i++)
+    {
+        bq_trigger_t t;
+        if (s_trigger_count >= BQ_CAPTURE_MAX_TRIGGERS)
+        {
+            printf("At most %d triggers\n", BQ_CAPTURE_MAX_TRIGGERS);
+            break;
+        }
+        if (!bq_capture_parse(bq_capture_args.trigger->sval[i], &t))
+        {
+            printf("Unknown trigger '%s'\n", bq_capture_args.trigger->sval[i]);
+            continue;
+        }
+        s_triggers[s_trigger_count++] = t;
+        changed = true;
+    }
+    if (bq_capture_args.pre->count || bq_capture_args.post->count)
+    {
+        int pre = bq_capture_args.pre->count ? bq_capture_args.pre->ival[0] : s_pre;
+        int post = bq_capture_args.post->count ? bq_capture_args.post->ival[0] : s_post;
+        if (pre < 0 || post < 0 || pre + post + 1 > bq_capture_max_window())
+        {
+            printf("Window must fit %u samples\n", bq_capture_max_window());
+        }
+        else
+        {
+            s_pre = (uint16_t)pre;
+            s_post = (uint16_t)post;
+            changed = true;
+        }
+    }
+    xSemaphoreGive(s_cfg_lock);
+
+    if (changed)
+    {
+        bq_capture_save_cfg();
+    }
+    bq_capture_print_triggers();
+    return 0;
+}
+
+void bq_capture_start(void)
+{
+    s_cfg_lock = xSemaphoreCreateMutex();
+    s_capture_ok = flog_open(&s_capture, BQ_CAPTURE_PARTITION, BQ_CAPTURE_INDEX_SLOTS) == ESP_OK;
+    bq_capture_load_cfg();
+    if (s_pre + s_post + 1 > bq_capture_max_window())
+    {
+        s_pre = BQ_CAPTURE_PRE_DEFAULT;
+        s_post = BQ_CAPTURE_POST_DEFAULT;
+    }
+
+    if (bq_poll_add_sink(bq_capture_on_sample, NULL) || bq_poll_add_attach_sink(bq_capture_on_attach, NULL))
+    {
+        ESP_LOGE(TAG, "No free poller sink");
+    }
+    xTaskCreate(bq_capture_task, "bq_capture", 4096, NULL, 3, NULL);
+
+    bq_capture_args.trigger = arg_strn("t", "trigger", "<spec>", 0, BQ_CAPTURE_MAX_TRIGGERS,
+                                       "Add a trigger: status bit (COV, SafetyStatus.OCD) or threshold (current<-5000, cell2>4250, temp>60)");
+    bq_capture_args.clear = arg_lit0("c", "clear", "Remove all triggers");
+    bq_capture_args.pre = arg_int0(NULL, "pre", "<n>", "Samples kept before the trigger");
+    bq_capture_args.post = arg_int0(NULL, "post", "<n>", "Samples recorded after the trigger");
+    bq_capture_args.list = arg_lit0("l", "list", "List stored captures");
+    bq_capture_args.show = arg_int0("s", "show", "<seq>", "Show a stored capture");
+    bq_capture_args.fire = arg_lit0(NULL, "fire", "Trigger a capture now");
+    bq_capture_args.slot = arg_int0("p", "pack", "<slot>", "Pack slot for --fire (default: 0)");
+    bq_capture_args.erase = arg_lit0(NULL, "erase", "Erase all stored captures");
+    bq_capture_args.end = arg_end(9);
+
+    const esp_console_cmd_t capture_cmd = {
+        .command = "bq_capture",
+        .help = "Configure triggers and show the samples captured around safety events",
+        .hint = NULL,
+        .func = &cmd_bq_capture,
+        .argtable = &bq_capture_args,
+    };
+    ESP_ERROR_CHECK(esp_console_cmd_register(&capture_cmd));
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdint.h>
+
+// ──────────────────────────────────────────────────────────────────────────────
+//  Pre‑trigger capture
+// ──────────────────────────────────────────────────────────────────────────────
+/**
+ * Every poller sample is pushed into a per-pack single-producer /
+ * single-consumer ring without locks. A capture task evaluates the triggers
+ * on the ring and, when one fires, freezes `pre` samples before and `post`
+ * samples after it into a window that is stored in the "capture" partition.
+ *
+ * Triggers are a status bit name from the bit tables of BatteryStatus(),
+ * SafetyAlert(), SafetyStatus() or OperationStatus() (e.g. "COV", or
+ * "SafetyStatus.OCD" where names are ambiguous), firing on the rising edge,
+ * or a threshold crossing such as "current<-5000" or "cell2>4250" (mV, mA,
+ * °C).
+ */
+
+typedef struct
+{
+    uint32_t t_ms;             ///< monotonic time, ms
+    uint16_t voltage_mv;
+    int16_t current_ma;
+    uint16_t temp_dk;
+    uint16_t cell_mv[4];
+    uint16_t battery_status;
+    uint32_t operation_status;
+    uint32_t safety_alert;
+    uint32_t safety_status;
+} bq_capture_sample_t;
+
+void bq_capture_start(void);
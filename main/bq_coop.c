@@ -0,0 +1,436 @@
+// bq_coop.c – cooperative gauge operations on a single worker task
+//
+// Every operation is a protothread with its whole state in one pool entry:
+// the resume point, loop counters, the I2C transfer and its response buffer.
+// An operation queues one SBS read through the I2C worker and yields until
+// the transfer is done; meanwhile the worker task runs the other operations,
+// so their reads line up on the bus back to back. A gauge that NACKs is
+// retried after a yield with the same growing delay bq_read() uses, instead
+// of blocking the task in a delay.
+//
+// SPDX-License-Identifier: MIT
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <sys/param.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_console.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "argtable3/argtable3.h"
+#include "bq.h"
+#include "bq_coop.h"
+#include "i2c.h"
+#include "pt.h"
+
+// ──────────────────────────────────────────────────────────────────────────────
+//  Configuration
+// ──────────────────────────────────────────────────────────────────────────────
+
+static const char *TAG = "bq_coop";
+
+#define BQ_COOP_TASK_STACK 4096
+/// Same as the console, below the poller
+#define BQ_COOP_TASK_PRIO 2
+/// Worker tick while an operation waits for a delay to pass
+#define BQ_COOP_TICK_MS 10
+
+typedef enum
+{
+    BQ_COOP_FREE = 0,
+    BQ_COOP_SETUP,  ///< claimed by a submitter, not yet visible to the worker
+    BQ_COOP_ACTIVE,
+} bq_coop_state_t;
+
+typedef struct
+{
+    pt_t pt;
+    uint8_t state;        ///< bq_coop_state_t, handed over atomically
+    uint8_t kind;         ///< bq_coop_kind_t
+    uint8_t pack;
+    uint8_t retry_ms;     ///< next retry delay after a failed read
+    uint16_t step;        ///< register / block index of the current pass
+    uint16_t pass;
+    uint16_t repeat;
+    uint16_t interval_ms;
+    uint16_t reads;
+    uint16_t errors;
+    int64_t start_us;     ///< start of the current pass
+    int64_t deadline_us;  ///< retries of the current read give up here
+    int64_t wake_us;      ///< waiting until this time, 0 = not waiting
+    int32_t values[4];    ///< poll results
+    i2c_xfer_t xfer;
+    uint8_t buf[BQ_PIPE_MAX_LEN];
+} bq_coop_op_t;
+
+static bq_coop_op_t s_ops[BQ_COOP_MAX_OPS];
+static TaskHandle_t s_task;
+static volatile bool s_cancel;
+
+static struct
+{
+    uint32_t ops;         ///< operations finished
+    uint32_t reads;
+    uint32_t errors;
+    uint32_t max_active;  ///< most operations in flight at once
+    uint32_t runs;        ///< protothread calls
+} s_stats;
+
+static const uint8_t s_poll_cmds[] = {
+    BQ40Z555_CMD_VOLTAGE,
+    BQ40Z555_CMD_CURRENT,
+    BQ40Z555_CMD_RELATIVE_STATE_OF_CHARGE,
+    BQ40Z555_CMD_TEMPERATURE,
+};
+
+static const char *const s_kind_names[] = {"dump", "lifetime", "poll"};
+
+// ──────────────────────────────────────────────────────────────────────────────
+//  Reads
+// ──────────────────────────────────────────────────────────────────────────────
+static void bq_coop_submit_read(bq_coop_op_t *op, uint8_t cmd, uint8_t len)
+{
+    memset(&op->xfer, 0, sizeof(op->xfer));
+    op->xfer.notify = s_task;
+    bq_read_submit(bq_pack(op->pack), &op->xfer, cmd, op->buf, MIN(len, sizeof(op->buf)));
+}
+
+/* A failed read either schedules a retry (true) or counts as given up */
+static bool bq_coop_retry(bq_coop_op_t *op)
+{
+    bq_dev_t *dev = bq_pack(op->pack);
+    int64_t now = esp_timer_get_time();
+
+    if (dev)
+    {
+        dev->nacks++;
+    }
+    if (!dev || now + op->retry_ms * 1000LL > op->deadline_us)
+    {
+        if (dev)
+        {
+            dev->failures++;
+            dev->state = BQ_STATE_UNRESPONSIVE;
+        }
+        return false;
+    }
+    op->wake_us = now + op->retry_ms * 1000LL;
+    op->retry_ms = MIN(op->retry_ms * 2, BQ_RETRY_DELAY_MAX_MS);
+    return true;
+}
+
+/**
+ * Read `cmd` into op->buf, yielding while the transfer is on the bus and
+ * between retries. Leaves the result in op->xfer.err. Must be used directly
+ * in the protothread body.
+ */
+#define BQ_COOP_READ(op, cmd, len)                                                     \
+    do                                                                                 \
+    {                                                                                  \
+        (op)->retry_ms = BQ_RETRY_DELAY_MIN_MS;                                        \
+        (op)->deadline_us = esp_timer_get_time() + BQ_WAKE_BUDGET_MS * 1000LL;         \
+        for (;;)                                                                       \
+        {                                                                              \
+            bq_coop_submit_read((op), (cmd), (len));                                   \
+            PT_WAIT_UNTIL(&(op)->pt, !__atomic_load_n(&(op)->xfer.busy, __ATOMIC_ACQUIRE)); \
+            if (!(op)->xfer.err || !bq_coop_retry(op))                                 \
+                break;                                                                 \
+            PT_WAIT_UNTIL(&(op)->pt, esp_timer_get_time() >= (op)->wake_us);           \
+            (op)->wake_us = 0;                                                         \
+        }                                                                              \
+        (op)->reads++;                                                                 \
+        if ((op)->xfer.err)                                                            \
+            (op)->errors++;                                                            \
+    } while (0)
+
+// ──────────────────────────────────────────────────────────────────────────────
+//  Operations
+// ──────────────────────────────────────────────────────────────────────────────
+static void bq_coop_print_dump(const bq_coop_op_t *op, const bq_entry *entry)
+{
+    printf("[p%d] ", op->pack);
+    if (op->xfer.err)
+    {
+        printf("%-32s: read failed (err=%d)\n", entry->name, op->xfer.err);
+        return;
+    }
+    bq_print_entry(entry, op->buf, bq_entry_read_len(entry));
+}
+
+static void bq_coop_print_lifetime(const bq_coop_op_t *op)
+{
+    printf("[p%d] LifetimeData%d\n", op->pack, op->step + 1);
+    if (op->xfer.err)
+    {
+        printf("  read failed (err=%d)\n", op->xfer.err);
+        return;
+    }
+    bq_print_lifetime_from_buffer(op->step + 1, &op->buf[1], MIN(op->buf[0], sizeof(op->buf) - 1));
+}
+
+static void bq_coop_print_poll(const bq_coop_op_t *op)
+{
+    printf("[p%d] %6" PRId32 " mV %6" PRId32 " mA %3" PRId32 " %% %5.1f C\n", op->pack, op->values[0],
+           op->values[1], op->values[2], op->values[3] / 10.0f - 273.15f);
+}
+
+static PT_THREAD(bq_coop_run(bq_coop_op_t *op))
+{
+    size_t count;
+    const bq_entry *entries = bq_entries(&count);
+
+    PT_BEGIN(&op->pt);
+
+    for (op->pass = 0; op->pass < op->repeat; op->pass++)
+    {
+        if (op->pass)
+        {
+            op->wake_us = op->start_us + op->interval_ms * 1000LL;
+            PT_WAIT_UNTIL(&op->pt, esp_timer_get_time() >= op->wake_us);
+            op->wake_us = 0;
+        }
+        op->start_us = esp_timer_get_time();
+
+        if (op->kind == BQ_COOP_DUMP)
+        {
+            for (op->step = 0; op->step < count; op->step++)
+            {
+                BQ_COOP_READ(op, entries[op->step].reg, bq_entry_read_len(&entries[op->step]));
+                bq_coop_print_dump(op, &entries[op->step]);
+            }
+        }
+        else if (op->kind == BQ_COOP_LIFETIME)
+        {
+            for (op->step = 0; op->step < 3; op->step++)
+            {
+                BQ_COOP_READ(op, BQ40Z555_CMD_LIFETIME_DATA1 + op->step, BQ_PIPE_MAX_LEN);
+                bq_coop_print_lifetime(op);
+            }
+        }
+        else
+        {
+            for (op->step = 0; op->step < COUNT(s_poll_cmds); op->step++)
+            {
+                BQ_COOP_READ(op, s_poll_cmds[op->step], 2);
+                uint16_t raw = (uint16_t)op->buf[0] | ((uint16_t)op->buf[1] << 8);
+                op->values[op->step] = s_poll_cmds[op->step] == BQ40Z555_CMD_CURRENT ? (int16_t)raw : raw;
+            }
+            bq_coop_print_poll(op);
+        }
+    }
+
+    PT_END(&op->pt);
+}
+
+// ──────────────────────────────────────────────────────────────────────────────
+//  Worker
+// ──────────────────────────────────────────────────────────────────────────────
+static void bq_coop_finish(bq_coop_op_t *op)
+{
+    ESP_LOGI(TAG, "pack %d %s done: %u reads, %u errors, %u passes", op->pack, s_kind_names[op->kind], op->reads,
+             op->errors, op->pass);
+    s_stats.ops++;
+    s_stats.reads += op->reads;
+    s_stats.errors += op->errors;
+    __atomic_store_n(&op->state, BQ_COOP_FREE, __ATOMIC_RELEASE);
+}
+
+static void bq_coop_task(void *arg)
+{
+    (void)arg;
+
+    for (;;)
+    {
+        bool timed = false;
+        uint32_t active = 0;
+
+        for (int pos = 0; pos < BQ_COOP_MAX_OPS; pos++)
+        {
+            bq_coop_op_t *op = &s_ops[pos];
+
+            if (__atomic_load_n(&op->state, __ATOMIC_ACQUIRE) != BQ_COOP_ACTIVE)
+            {
+                continue;
+            }
+            /* a transfer on the bus still owns the struct, cancel after it */
+            bool busy = __atomic_load_n(&op->xfer.busy, __ATOMIC_ACQUIRE);
+            if ((s_cancel || !bq_pack(op->pack)) && !busy)
+            {
+                bq_coop_finish(op);
+                continue;
+            }
+
+            s_stats.runs++;
+            if (PT_DONE(bq_coop_run(op)))
+            {
+                bq_coop_finish(op);
+                continue;
+            }
+            active++;
+            timed |= op->wake_us != 0;
+        }
+        if (active > s_stats.max_active)
+        {
+            s_stats.max_active = active;
+        }
+        if (!active)
+        {
+            s_cancel = false;
+        }
+
+        /* transfer completions and new work both come in on the I2C index */
+        ulTaskNotifyTakeIndexed(I2C_NOTIFY_INDEX, pdTRUE, timed ? pdMS_TO_TICKS(BQ_COOP_TICK_MS) : portMAX_DELAY);
+    }
+}
+
+int bq_coop_submit(bq_coop_kind_t kind, int pack, uint16_t repeat, uint16_t interval_ms)
+{
+    if (!bq_pack(pack))
+    {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    for (int pos = 0; pos < BQ_COOP_MAX_OPS; pos++)
+    {
+        bq_coop_op_t *op = &s_ops[pos];
+        uint8_t expected = BQ_COOP_FREE;
+
+        if (!__atomic_compare_exchange_n(&op->state, &expected, BQ_COOP_SETUP, false, __ATOMIC_ACQUIRE,
+                                         __ATOMIC_RELAXED))
+        {
+            continue;
+        }
+        memset(op, 0, sizeof(*op));
+        op->state = BQ_COOP_SETUP;
+        PT_INIT(&op->pt);
+        op->kind = (uint8_t)kind;
+        op->pack = (uint8_t)pack;
+        op->repeat = MAX(repeat, 1);
+        op->interval_ms = interval_ms;
+        __atomic_store_n(&op->state, BQ_COOP_ACTIVE, __ATOMIC_RELEASE);
+        xTaskNotifyGiveIndexed(s_task, I2C_NOTIFY_INDEX);
+        return 0;
+    }
+    return ESP_ERR_NO_MEM;
+}
+
+// ──────────────────────────────────────────────────────────────────────────────
+//  Console command
+// ──────────────────────────────────────────────────────────────────────────────
+static struct
+{
+    struct arg_str *op;
+    struct arg_int *pack;
+    struct arg_int *repeat;
+    struct arg_int *interval;
+    struct arg_lit *stop;
+    struct arg_end *end;
+} bq_coop_args;
+
+static int cmd_bq_coop(int argc, char **argv)
+{
+    int nerrors = arg_parse(argc, argv, (void **)&bq_coop_args);
+    if (nerrors != 0)
+    {
+        arg_print_errors(stderr, bq_coop_args.end, argv[0]);
+        return 1;
+    }
+
+    if (bq_coop_args.stop->count)
+    {
+        s_cancel = true;
+        xTaskNotifyGiveIndexed(s_task, I2C_NOTIFY_INDEX);
+        printf("Cancelling all operations\n");
+        return 0;
+    }
+
+    if (bq_coop_args.op->count)
+    {
+        int kind = -1;
+        for (int pos = 0; pos < COUNT(s_kind_names); pos++)
+        {
+            if (!strcmp(bq_coop_args.op->sval[0], s_kind_names[pos]))
+            {
+                kind = pos;
+            }
+        }
+        if (kind < 0)
+        {
+            printf("Unknown operation '%s' (dump, lifetime, poll)\n", bq_coop_args.op->sval[0]);
+            return 1;
+        }
+        int repeat = bq_coop_args.repeat->count ? bq_coop_args.repeat->ival[0] : 1;
+        int interval = bq_coop_args.interval->count ? bq_coop_args.interval->ival[0] : 0;
+        if (repeat < 1 || repeat > 10000 || interval < 0 || interval > 60000)
+        {
+            printf("Repeat must be 1..10000, interval 0..60000 ms\n");
+            return 1;
+        }
+
+        int queued = 0;
+        for (int idx = 0; idx < BQ_MAX_PACKS; idx++)
+        {
+            bool wanted = !bq_coop_args.pack->count;
+            for (int pos = 0; pos < bq_coop_args.pack->count; pos++)
+            {
+                wanted |= bq_coop_args.pack->ival[pos] == idx;
+            }
+            if (!wanted || !bq_pack(idx))
+            {
+                continue;
+            }
+            int err = bq_coop_submit((bq_coop_kind_t)kind, idx, (uint16_t)repeat, (uint16_t)interval);
+            if (err)
+            {
+                printf("Pack %d: %s\n", idx, esp_err_to_name(err));
+                continue;
+            }
+            queued++;
+        }
+        printf("Queued %s on %d pack(s)\n", s_kind_names[kind], queued);
+        return queued ? 0 : 1;
+    }
+
+    printf("%-20s: %d x %u bytes\n", "Operation pool", BQ_COOP_MAX_OPS, (unsigned)sizeof(bq_coop_op_t));
+    printf("%-20s: %" PRIu32 " (max %" PRIu32 " in flight)\n", "Finished", s_stats.ops, s_stats.max_active);
+    printf("%-20s: %" PRIu32 " (%" PRIu32 " failed), %" PRIu32 " runs\n", "Reads", s_stats.reads, s_stats.errors,
+           s_stats.runs);
+    for (int pos = 0; pos < BQ_COOP_MAX_OPS; pos++)
+    {
+        const bq_coop_op_t *op = &s_ops[pos];
+        if (__atomic_load_n(&op->state, __ATOMIC_ACQUIRE) != BQ_COOP_ACTIVE)
+        {
+            continue;
+        }
+        printf("  pack %d %-8s pass %u/%u step %u, %u reads, %u errors%s\n", op->pack, s_kind_names[op->kind],
+               op->pass + 1, op->repeat, op->step, op->reads, op->errors, op->wake_us ? ", waiting" : "");
+    }
+    return 0;
+}
+
+void bq_coop_start(void)
+{
+    if (xTaskCreate(bq_coop_task, "bq_coop", BQ_COOP_TASK_STACK, NULL, BQ_COOP_TASK_PRIO, &s_task) != pdPASS)
+    {
+        ESP_LOGE(TAG, "Failed to start the worker");
+        return;
+    }
+
+    bq_coop_args.op = arg_str0(NULL, NULL, "<dump|lifetime|poll>", "Operation to queue on the packs");
+    bq_coop_args.pack = arg_intn("p", "pack", "<slot>", 0, BQ_MAX_PACKS, "Pack slot(s), default all attached packs");
+    bq_coop_args.repeat = arg_int0("n", "count", "<n>", "Run it n times per pack");
+    bq_coop_args.interval = arg_int0("i", "interval", "<ms>", "Minimum time between runs");
+    bq_coop_args.stop = arg_lit0(NULL, "stop", "Cancel all queued operations");
+    bq_coop_args.end = arg_end(5);
+
+    const esp_console_cmd_t coop_cmd = {
+        .command = "bq_coop",
+        .help = "Run dumps, lifetime reads or polls of many packs interleaved on one worker task; without an operation show the queue",
+        .hint = NULL,
+        .func = &cmd_bq_coop,
+        .argtable = &bq_coop_args,
+    };
+    ESP_ERROR_CHECK(esp_console_cmd_register(&coop_cmd));
+}
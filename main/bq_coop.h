@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "bq.h"
+
+// ──────────────────────────────────────────────────────────────────────────────
+//  Cooperative gauge operations
+// ──────────────────────────────────────────────────────────────────────────────
+/**
+ * Gauge operations written as protothreads (see pt.h) and run by a single
+ * worker task. Each operation yields while its I2C transfer is on the bus or
+ * while it waits for a sleeping gauge, so dumps, lifetime reads and polls of
+ * many packs interleave on the bus without a task and stack per pack.
+ *
+ * An in-flight operation costs one bq_coop_op_t from a fixed pool.
+ */
+
+#define BQ_COOP_MAX_OPS 16
+
+typedef enum
+{
+    BQ_COOP_DUMP = 0, ///< all known registers, like bq_show
+    BQ_COOP_LIFETIME, ///< LifetimeData1..3, like bq_lifetime
+    BQ_COOP_POLL,     ///< Voltage, Current, RSOC and Temperature
+} bq_coop_kind_t;
+
+/**
+ * Queue an operation on pack `pack`, repeated `repeat` times at least
+ * `interval_ms` apart. Returns 0, ESP_ERR_NOT_FOUND for an unknown pack or
+ * ESP_ERR_NO_MEM when the pool is exhausted.
+ */
+int bq_coop_submit(bq_coop_kind_t kind, int pack, uint16_t repeat, uint16_t interval_ms);
+
+void bq_coop_start(void);
@@ -0,0 +1,335 @@
+// bq_forensics.c – one-shot permanent-failure capture for the BQ40Z555
+//
+// `bq_forensics` reads every register that explains a permanent failure in
+// the tightest possible back-to-back sequence (no console output in between),
+// then decodes the raw record into one report and stores it in NVS keyed by
+// the pack's SerialNumber and ManufacturerDate.
+//
+// SPDX-License-Identifier: MIT
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "esp_console.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "nvs.h"
+#include "nvs_flash.h"
+#include "argtable3/argtable3.h"
+#include "bq.h"
+#include "bq_forensics.h"
+#include "timebase.h"
+
+#define BQ_PF_NVS_NAMESPACE "bq_pf"
+#define BQ_PF_KEY_LEN 9 /* "SSSSDDDD" + NUL */
+
+static const char *TAG = "bq_pf";
+
+static struct
+{
+    struct arg_int *bbr_addr;
+    struct arg_lit *list;
+    struct arg_str *show;
+    struct arg_end *end_arg;
+} bq_forensics_args;
+
+static void bq_pf_key(const bq_pf_record_t *rec, char key[BQ_PF_KEY_LEN])
+{
+    snprintf(key, BQ_PF_KEY_LEN, "%04X%04X", rec->serial, rec->mfg_date);
+}
+
+// ──────────────────────────────────────────────────────────────────────────────
+//  Capture
+// ──────────────────────────────────────────────────────────────────────────────
+static int bq_pf_read_status(bq_dev_t *dev, uint8_t cmd, uint8_t out[4])
+{
+    uint8_t len = 0;
+    int err = bq_read_block(dev, cmd, out, 4, &len);
+    if (err)
+    {
+        return err;
+    }
+    return len == 4 ? 0 : ESP_ERR_INVALID_SIZE;
+}
+
+/**
+ * @brief Fill `rec` from the gauge. Only raw bytes are collected here; every
+ *        block is a single SMBus transaction and nothing is printed until the
+ *        whole sequence is done.
+ */
+static void bq_pf_capture(bq_dev_t *dev, uint16_t bbr_addr, bq_pf_record_t *rec)
+{
+    uint8_t word[2];
+
+    memset(rec, 0, sizeof(*rec));
+    rec->version = BQ_PF_RECORD_VERSION;
+    rec->bbr_addr = bbr_addr;
+
+    /* identity does not drift, read it before the timed sequence */
+    if (!bq_read(dev, BQ40Z555_CMD_SERIAL_NUMBER, word, sizeof(word)))
+    {
+        rec->serial = le16(word);
+    }
+    if (!bq_read(dev, BQ40Z555_CMD_MANUFACTURER_DATE, word, sizeof(word)))
+    {
+        rec->mfg_date = le16(word);
+    }
+
+    tb_now(&rec->ts);
+
+    if (!bq_pf_read_status(dev, BQ40Z555_CMD_OPERATION_STATUS, rec->operation_status))
+    {
+        rec->valid |= BQ_PF_VALID_OPERATION;
+    }
+    if (!bq_pf_read_status(dev, BQ40Z555_CMD_SAFETY_STATUS, rec->safety_status))
+    {
+        rec->valid |= BQ_PF_VALID_SAFETY;
+    }
+    if (!bq_pf_read_status(dev, BQ40Z555_CMD_PF_ALERT, rec->pf_alert))
+    {
+        rec->valid |= BQ_PF_VALID_PF_ALERT;
+    }
+    if (!bq_pf_read_status(dev, BQ40Z555_CMD_PF_STATUS, rec->pf_status))
+    {
+        rec->valid |= BQ_PF_VALID_PF_STATUS;
+    }
+    for (int n = 0; n < 3; n++)
+    {
+        if (!bq_read_block(dev, BQ40Z555_CMD_LIFETIME_DATA1 + n, rec->lifetime[n], BQ_PF_BLOCK_MAX, &rec->lifetime_len[n]))
+        {
+            rec->valid |= BQ_PF_VALID_LIFETIME1 << n;
+        }
+    }
+    /* ManufacturerBlockAccess() tells a wrong answer by its echo; ManufacturerAccess() on gauges without it */
+    int err = bq_mba_read(dev, bbr_addr, rec->bbr, sizeof(rec->bbr), &rec->bbr_len);
+    if (err == ESP_ERR_INVALID_RESPONSE)
+    {
+        err = bq_mac_read(dev, bbr_addr, rec->bbr, sizeof(rec->bbr), &rec->bbr_len);
+    }
+    if (!err)
+    {
+        rec->valid |= BQ_PF_VALID_BLACK_BOX;
+    }
+
+    rec->capture_us = (uint32_t)(esp_timer_get_time() - rec->ts.mono_us);
+}
+
+// ──────────────────────────────────────────────────────────────────────────────
+//  Report
+// ──────────────────────────────────────────────────────────────────────────────
+static void bq_pf_print_status(uint8_t reg, const char *name, bool valid, const uint8_t data[4])
+{
+    const bq_entry *e = bq_find_entry(reg);
+
+    if (!valid || !e)
+    {
+        printf("%-32s: not read\n", name);
+        return;
+    }
+    bq_print_active_bits(e, data, 4);
+}
+
+static void bq_pf_print(const bq_pf_record_t *rec)
+{
+    char iso[40];
+    tb_format(rec->ts.wall_us, iso, sizeof(iso));
+
+    /* SBS ManufacturerDate: (year - 1980) * 512 + month * 32 + day */
+    printf("PF forensic report, pack serial %u (0x%04X), manufactured %04u-%02u-%02u\n",
+           rec->serial, rec->serial,
+           1980 + (rec->mfg_date >> 9), (rec->mfg_date >> 5) & 0x0F, rec->mfg_date & 0x1F);
+    printf("%-32s: %s (mono %" PRId64 " us)\n", "Captured", iso, rec->ts.mono_us);
+    printf("%-32s: %" PRIu32 " us\n", "Capture duration", rec->capture_us);
+
+    bq_pf_print_status(BQ40Z555_CMD_PF_ALERT, "PFAlert", rec->valid & BQ_PF_VALID_PF_ALERT, rec->pf_alert);
+    bq_pf_print_status(BQ40Z555_CMD_PF_STATUS, "PFStatus", rec->valid & BQ_PF_VALID_PF_STATUS, rec->pf_status);
+    bq_pf_print_status(BQ40Z555_CMD_SAFETY_STATUS, "SafetyStatus", rec->valid & BQ_PF_VALID_SAFETY, rec->safety_status);
+    bq_pf_print_status(BQ40Z555_CMD_OPERATION_STATUS, "OperationStatus", rec->valid & BQ_PF_VALID_OPERATION, rec->operation_status);
+
+    for (int n = 0; n < 3; n++)
+    {
+        if (rec->valid & (BQ_PF_VALID_LIFETIME1 << n))
+        {
+            bq_print_lifetime_from_buffer(n + 1, rec->lifetime[n], rec->lifetime_len[n]);
+        }
+        else
+        {
+            printf("LifetimeData%d: not read\n", n + 1);
+        }
+    }
+
+    if (rec->valid & BQ_PF_VALID_BLACK_BOX)
+    {
+        printf("Black box recorder (DF 0x%04X, %u bytes):\n", rec->bbr_addr, rec->bbr_len);
+        for (int pos = 0; pos < rec->bbr_len; pos += 16)
+        {
+            printf("  %04X:", rec->bbr_addr + pos);
+            for (int i = pos; i < pos + 16 && i < rec->bbr_len; i++)
+            {
+                printf(" %02X", rec->bbr[i]);
+            }
+            printf("\n");
+        }
+    }
+    else
+    {
+        printf("Black box recorder (DF 0x%04X): not read (sealed?)\n", rec->bbr_addr);
+    }
+}
+
+// ──────────────────────────────────────────────────────────────────────────────
+//  Storage (NVS, one record per pack)
+// ──────────────────────────────────────────────────────────────────────────────
+static int bq_pf_save(const bq_pf_record_t *rec)
+{
+    char key[BQ_PF_KEY_LEN];
+    nvs_handle_t handle;
+
+    bq_pf_key(rec, key);
+    esp_err_t err = nvs_open(BQ_PF_NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "NVS open failed: %s", esp_err_to_name(err));
+        return err;
+    }
+    err = nvs_set_blob(handle, key, rec, sizeof(*rec));
+    if (err == ESP_OK)
+    {
+        err = nvs_commit(handle);
+    }
+    nvs_close(handle);
+
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Saving report '%s' failed: %s", key, esp_err_to_name(err));
+        return err;
+    }
+    printf("Report saved as '%s'\n", key);
+    return 0;
+}
+
+static int bq_pf_load(const char *key, bq_pf_record_t *rec)
+{
+    nvs_handle_t handle;
+    size_t len = sizeof(*rec);
+
+    esp_err_t err = nvs_open(BQ_PF_NVS_NAMESPACE, NVS_READONLY, &handle);
+    if (err != ESP_OK)
+    {
+        return err;
+    }
+    err = nvs_get_blob(handle, key, rec, &len);
+    nvs_close(handle);
+
+    if (err == ESP_OK && (len != sizeof(*rec) || rec->version != BQ_PF_RECORD_VERSION))
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    return err;
+}
+
+static int bq_pf_list(void)
+{
+    nvs_iterator_t it = NULL;
+    int count = 0;
+
+    esp_err_t err = nvs_entry_find(NVS_DEFAULT_PART_NAME, BQ_PF_NVS_NAMESPACE, NVS_TYPE_BLOB, &it);
+    while (err == ESP_OK)
+    {
+        nvs_entry_info_t info;
+        bq_pf_record_t rec;
+        char iso[40];
+
+        nvs_entry_info(it, &info);
+        if (bq_pf_load(info.key, &rec) == ESP_OK)
+        {
+            tb_format(rec.ts.wall_us, iso, sizeof(iso));
+            printf("  %s  serial %5u  %s  PFStatus 0x%08" PRIX32 "\n", info.key, rec.serial, iso,
+                   (uint32_t)le16(&rec.pf_status[0]) | ((uint32_t)le16(&rec.pf_status[2]) << 16));
+            count++;
+        }
+        err = nvs_entry_next(&it);
+    }
+    nvs_release_iterator(it);
+
+    printf("%d stored report(s)\n", count);
+    return 0;
+}
+
+// ──────────────────────────────────────────────────────────────────────────────
+//  Console command
+// ──────────────────────────────────────────────────────────────────────────────
+static int cmd_bq_forensics(int argc, char **argv)
+{
+    int nerrors = arg_parse(argc, argv, (void **)&bq_forensics_args);
+    if (nerrors != 0)
+    {
+        arg_print_errors(stderr, bq_forensics_args.end_arg, argv[0]);
+        return 1;
+    }
+
+    if (bq_forensics_args.list->count)
+    {
+        return bq_pf_list();
+    }
+
+    bq_pf_record_t *rec = malloc(sizeof(*rec));
+    if (!rec)
+    {
+        ESP_LOGE(TAG, "Failed to allocate report buffer.");
+        return 1;
+    }
+
+    if (bq_forensics_args.show->count)
+    {
+        const char *key = bq_forensics_args.show->sval[0];
+        int err = bq_pf_load(key, rec);
+        if (err)
+        {
+            printf("No stored report '%s' (%s)\n", key, esp_err_to_name(err));
+        }
+        else
+        {
+            bq_pf_print(rec);
+        }
+        free(rec);
+        return err ? 1 : 0;
+    }
+
+    bq_dev_t *dev = bq_default_dev();
+    uint16_t bbr_addr = bq_forensics_args.bbr_addr->count ? (uint16_t)bq_forensics_args.bbr_addr->ival[0] : BQ40Z555_DF_BLACK_BOX;
+
+    /* wake first so the timed sequence is not stretched by the wake-up */
+    if (bq_ensure_awake(dev))
+    {
+        printf("Gauge at 0x%02X not responding\n", dev->addr);
+        free(rec);
+        return 1;
+    }
+
+    bq_pf_capture(dev, bbr_addr, rec);
+    bq_pf_print(rec);
+    int err = bq_pf_save(rec);
+
+    free(rec);
+    return err ? 1 : 0;
+}
+
+void register_bq_forensics_commands(void)
+{
+    bq_forensics_args.bbr_addr = arg_int0("b", "bbr", "<df_addr>", "Black box recorder data flash address (default 0x4280)");
+    bq_forensics_args.list = arg_lit0("l", "list", "List stored reports");
+    bq_forensics_args.show = arg_str0("s", "show", "<key>", "Print a stored report (key as shown by --list)");
+    bq_forensics_args.end_arg = arg_end(3);
+
+    const esp_console_cmd_t forensics_cmd = {
+        .command = "bq_forensics",
+        .help = "Capture PF/safety status, lifetime data and black box in one go, print and store the report",
+        .hint = NULL,
+        .func = &cmd_bq_forensics,
+        .argtable = &bq_forensics_args,
+    };
+    ESP_ERROR_CHECK(esp_console_cmd_register(&forensics_cmd));
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdint.h>
+#include "timebase.h"
+
+/*
+ * Permanent-failure forensic capture.
+ *
+ * All state that explains a PF (status/alert registers, lifetime blocks and
+ * the black box recorder) is read back-to-back into one raw record first and
+ * only decoded afterwards, so the report is a consistent snapshot. The record
+ * is stored in NVS keyed by SerialNumber/ManufacturerDate.
+ */
+
+#define BQ_PF_RECORD_VERSION 1
+#define BQ_PF_BLOCK_MAX 32
+
+/* bits of bq_pf_record_t.valid */
+#define BQ_PF_VALID_OPERATION (1u << 0)
+#define BQ_PF_VALID_SAFETY (1u << 1)
+#define BQ_PF_VALID_PF_ALERT (1u << 2)
+#define BQ_PF_VALID_PF_STATUS (1u << 3)
+#define BQ_PF_VALID_LIFETIME1 (1u << 4) /* + n - 1 for block n */
+#define BQ_PF_VALID_BLACK_BOX (1u << 7)
+
+typedef struct
+{
+    uint8_t version;
+    uint8_t valid;
+    uint16_t serial;
+    uint16_t mfg_date;
+    uint16_t bbr_addr;
+    tb_stamp_t ts;
+    uint32_t capture_us; /* duration of the back-to-back read sequence */
+
+    uint8_t operation_status[4];
+    uint8_t safety_status[4];
+    uint8_t pf_alert[4];
+    uint8_t pf_status[4];
+
+    uint8_t lifetime_len[3];
+    uint8_t lifetime[3][BQ_PF_BLOCK_MAX];
+
+    uint8_t bbr_len;
+    uint8_t bbr[BQ_PF_BLOCK_MAX];
+} bq_pf_record_t;
+
+void register_bq_forensics_commands(void);
@@ -0,0 +1,311 @@
+// bq_health.c – per-pack health score and fleet ranking
+//
+// Slow inputs (SOH, capacities, lifetime extremes, safety state at insertion)
+// are read once when a pack attaches or come with the poller's info refresh;
+// fast inputs (cell imbalance, safety flag edges, DCIR from current steps)
+// are folded in per sample. The score is recomputed on each sample from the
+// cached inputs, so `bq_rank` only sorts cached values and never touches the
+// bus.
+//
+// SPDX-License-Identifier: MIT
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_console.h"
+#include "esp_log.h"
+#include "argtable3/argtable3.h"
+#include "bq.h"
+#include "bq_health.h"
+#include "bq_poll.h"
+
+// ──────────────────────────────────────────────────────────────────────────────
+//  Scoring parameters
+// ──────────────────────────────────────────────────────────────────────────────
+
+static const char *TAG = "bq_health";
+
+/// Component weights, renormalized when DCIR is unknown
+#define BQ_HEALTH_W_SOH 0.30f
+#define BQ_HEALTH_W_CAPACITY 0.25f
+#define BQ_HEALTH_W_BALANCE 0.15f
+#define BQ_HEALTH_W_LIFETIME 0.10f
+#define BQ_HEALTH_W_SAFETY 0.15f
+#define BQ_HEALTH_W_DCIR 0.05f
+
+/// Imbalance up to this is perfect, at BAD it scores 0
+#define BQ_HEALTH_IMBALANCE_OK_MV 10
+#define BQ_HEALTH_IMBALANCE_BAD_MV 200
+/// Lifetime cell voltages outside this window cost points
+#define BQ_HEALTH_CELL_HIGH_MV 4250
+#define BQ_HEALTH_CELL_LOW_MV 3000
+/// Points lost per safety event
+#define BQ_HEALTH_SAFETY_PENALTY 25
+/// Reference DCIR per cell; 3x the reference scores 0
+#define BQ_HEALTH_DCIR_REF_MOHM 50.0f
+/// Minimum current step between two samples for a DCIR estimate
+#define BQ_HEALTH_DCIR_STEP_MA 500
+#define BQ_HEALTH_DCIR_MAX_DT_US 1000000LL
+
+/// BatteryStatus() alarms counted as safety events: OCA, TCA, OTA, TDA
+#define BQ_HEALTH_ALARM_MASK 0xD800
+#define BQ_HEALTH_CELL_MIN_MV 1000
+
+typedef struct
+{
+    bq_health_t h;
+    bool have_prev;
+    bq_sample_t prev;
+    uint16_t last_alarms;
+    uint32_t last_op;
+    int cells;
+} bq_health_pack_t;
+
+static bq_health_pack_t s_health[BQ_MAX_PACKS];
+static portMUX_TYPE s_health_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static float bq_health_clamp(float v)
+{
+    return v < 0.0f ? 0.0f : (v > 100.0f ? 100.0f : v);
+}
+
+// ──────────────────────────────────────────────────────────────────────────────
+//  Scoring
+// ──────────────────────────────────────────────────────────────────────────────
+static void bq_health_score(bq_health_t *h, const bq_pack_info_t *info, int cells)
+{
+    h->soh_score = info->soh;
+    h->capacity_score = info->design_capacity_mah
+                            ? bq_health_clamp(info->full_charge_capacity_mah * 100.0f / info->design_capacity_mah)
+                            : h->soh_score;
+    h->balance_score = bq_health_clamp(100.0f - (float)((int)h->imbalance_mv - BQ_HEALTH_IMBALANCE_OK_MV) * 100.0f /
+                                                    (BQ_HEALTH_IMBALANCE_BAD_MV - BQ_HEALTH_IMBALANCE_OK_MV));
+
+    float lifetime = 100.0f;
+    if (h->lifetime_max_mv > BQ_HEALTH_CELL_HIGH_MV)
+    {
+        lifetime -= (h->lifetime_max_mv - BQ_HEALTH_CELL_HIGH_MV) / 2.0f;
+    }
+    if (h->lifetime_min_mv && h->lifetime_min_mv < BQ_HEALTH_CELL_LOW_MV)
+    {
+        lifetime -= (BQ_HEALTH_CELL_LOW_MV - h->lifetime_min_mv) / 10.0f;
+    }
+    h->lifetime_score = bq_health_clamp(lifetime);
+    h->safety_score = bq_health_clamp(100.0f - (float)h->safety_events * BQ_HEALTH_SAFETY_PENALTY);
+
+    float weights = BQ_HEALTH_W_SOH + BQ_HEALTH_W_CAPACITY + BQ_HEALTH_W_BALANCE + BQ_HEALTH_W_LIFETIME +
+                    BQ_HEALTH_W_SAFETY;
+    float sum = BQ_HEALTH_W_SOH * h->soh_score + BQ_HEALTH_W_CAPACITY * h->capacity_score +
+                BQ_HEALTH_W_BALANCE * h->balance_score + BQ_HEALTH_W_LIFETIME * h->lifetime_score +
+                BQ_HEALTH_W_SAFETY * h->safety_score;
+
+    h->dcir_score = -1.0f;
+    if (h->dcir_mohm > 0.0f && cells > 0)
+    {
+        float ref = BQ_HEALTH_DCIR_REF_MOHM * cells;
+        h->dcir_score = bq_health_clamp(100.0f - (h->dcir_mohm - ref) * 100.0f / (2.0f * ref));
+        sum += BQ_HEALTH_W_DCIR * h->dcir_score;
+        weights += BQ_HEALTH_W_DCIR;
+    }
+    h->score = sum / weights;
+}
+
+// ──────────────────────────────────────────────────────────────────────────────
+//  Poller sinks
+// ──────────────────────────────────────────────────────────────────────────────
+static void bq_health_on_sample(const bq_sample_t *s, void *ctx)
+{
+    (void)ctx;
+    bq_health_pack_t *p = &s_health[s->pack];
+    const bq_pack_info_t *info = bq_poll_info(s->pack);
+    uint16_t lo = UINT16_MAX;
+    uint16_t hi = 0;
+    int cells = 0;
+
+    if (!info || !p->h.valid)
+    {
+        return;
+    }
+
+    bq_health_t h = p->h;
+    for (int i = 0; i < BQ_POLL_CELLS; i++)
+    {
+        if (s->cell_mv[i] >= BQ_HEALTH_CELL_MIN_MV)
+        {
+            lo = s->cell_mv[i] < lo ? s->cell_mv[i] : lo;
+            hi = s->cell_mv[i] > hi ? s->cell_mv[i] : hi;
+            cells++;
+        }
+    }
+    h.imbalance_mv = cells ? hi - lo : 0;
+
+    /* count rising edges only, a latched flag is one event */
+    uint16_t alarms = s->battery_status & BQ_HEALTH_ALARM_MASK;
+    uint32_t op = s->operation_status & (BQ40Z555_OPSTATUS_SS | BQ40Z555_OPSTATUS_PF);
+    if (p->have_prev && ((alarms & ~p->last_alarms) || (op & ~p->last_op)))
+    {
+        h.safety_events++;
+    }
+    p->last_alarms = alarms;
+    p->last_op = op;
+
+    /* DCIR from a current step between two close samples: R = dV / dI in mΩ, current positive when charging */
+    if (p->have_prev && s->ts.mono_us - p->prev.ts.mono_us < BQ_HEALTH_DCIR_MAX_DT_US)
+    {
+        int di = s->current_ma - p->prev.current_ma;
+        int dv = s->voltage_mv - p->prev.voltage_mv;
+        if (abs(di) >= BQ_HEALTH_DCIR_STEP_MA)
+        {
+            float r = dv * 1000.0f / di;
+            if (r > 1.0f && r < 2000.0f)
+            {
+                h.dcir_mohm = h.dcir_mohm > 0.0f ? h.dcir_mohm + (r - h.dcir_mohm) / 8.0f : r;
+            }
+        }
+    }
+    p->prev = *s;
+    p->have_prev = true;
+    p->cells = cells;
+
+    bq_health_score(&h, info, cells);
+    h.updates++;
+
+    taskENTER_CRITICAL(&s_health_lock);
+    p->h = h;
+    taskEXIT_CRITICAL(&s_health_lock);
+}
+
+/* Runs in the poller task: read the slow inputs once per insertion */
+static void bq_health_on_attach(int pack, const bq_pack_info_t *info, void *ctx)
+{
+    (void)ctx;
+    bq_health_pack_t fresh = {0};
+    bq_dev_t *dev = bq_pack(pack);
+
+    if (info && dev)
+    {
+        uint8_t buf[32];
+        uint8_t len = 0;
+
+        fresh.h.valid = true;
+        fresh.h.serial = info->serial;
+        fresh.h.mfg_date = info->mfg_date;
+
+        if (!bq_read_block(dev, BQ40Z555_CMD_LIFETIME_DATA1, buf, sizeof(buf), &len) && len >= 16)
+        {
+            fresh.h.lifetime_min_mv = UINT16_MAX;
+            for (int i = 0; i < 4; i++)
+            {
+                uint16_t max_mv = le16(&buf[2 * i]);
+                uint16_t min_mv = le16(&buf[8 + 2 * i]);
+                fresh.h.lifetime_max_mv = max_mv > fresh.h.lifetime_max_mv ? max_mv : fresh.h.lifetime_max_mv;
+                if (min_mv && min_mv < fresh.h.lifetime_min_mv)
+                {
+                    fresh.h.lifetime_min_mv = min_mv;
+                }
+            }
+            if (fresh.h.lifetime_min_mv == UINT16_MAX)
+            {
+                fresh.h.lifetime_min_mv = 0;
+            }
+        }
+        /* a pack arriving with SafetyStatus set counts as one event */
+        if (!bq_read_block(dev, BQ40Z555_CMD_SAFETY_STATUS, buf, 4, &len) && len == 4 &&
+            (buf[0] | buf[1] | buf[2] | buf[3]))
+        {
+            fresh.h.safety_events = 1;
+        }
+        bq_health_score(&fresh.h, info, 0);
+    }
+
+    taskENTER_CRITICAL(&s_health_lock);
+    s_health[pack] = fresh;
+    taskEXIT_CRITICAL(&s_health_lock);
+}
+
+bool bq_health_get(int pack, bq_health_t *out)
+{
+    if (pack < 0 || pack >= BQ_MAX_PACKS)
+    {
+        return false;
+    }
+    taskENTER_CRITICAL(&s_health_lock);
+    *out = s_health[pack].h;
+    taskEXIT_CRITICAL(&s_health_lock);
+    return out->valid;
+}
+
+// ──────────────────────────────────────────────────────────────────────────────
+//  Ranking command
+// ──────────────────────────────────────────────────────────────────────────────
+typedef struct
+{
+    int pack;
+    bq_health_t h;
+} bq_rank_entry_t;
+
+static int bq_rank_cmp(const void *a, const void *b)
+{
+    float sa = ((const bq_rank_entry_t *)a)->h.score;
+    float sb = ((const bq_rank_entry_t *)b)->h.score;
+    return (sa > sb) - (sa < sb);
+}
+
+static int cmd_bq_rank(int argc, char **argv)
+{
+    (void)argc;
+    (void)argv;
+    bq_rank_entry_t entries[BQ_MAX_PACKS];
+    int n = 0;
+
+    for (int idx = 0; idx < BQ_MAX_PACKS; idx++)
+    {
+        if (bq_health_get(idx, &entries[n].h))
+        {
+            entries[n++].pack = idx;
+        }
+    }
+    if (!n)
+    {
+        printf("No attached packs\n");
+        return 0;
+    }
+
+    /* worst first: that is the pack to pull */
+    qsort(entries, n, sizeof(entries[0]), bq_rank_cmp);
+
+    printf("Rank  Pack  Serial/Date  Score  SOH  Capacity  Balance  Lifetime  Safety  DCIR\n");
+    for (int i = 0; i < n; i++)
+    {
+        const bq_health_t *h = &entries[i].h;
+        char dcir[24] = "-";
+        if (h->dcir_score >= 0.0f)
+        {
+            snprintf(dcir, sizeof(dcir), "%.0f (%.0f mΩ)", h->dcir_score, h->dcir_mohm);
+        }
+        printf("%-4d  %-4d  %04X/%04X    %5.1f  %3.0f  %8.0f  %3.0f (%u mV)  %8.0f  %3.0f (%" PRIu32 ")  %s\n", i + 1,
+               entries[i].pack, h->serial, h->mfg_date, h->score, h->soh_score, h->capacity_score, h->balance_score,
+               h->imbalance_mv, h->lifetime_score, h->safety_score, h->safety_events, dcir);
+    }
+    return 0;
+}
+
+void bq_health_start(void)
+{
+    if (bq_poll_add_sink(bq_health_on_sample, NULL) || bq_poll_add_attach_sink(bq_health_on_attach, NULL))
+    {
+        ESP_LOGE(TAG, "No free poller sink");
+        return;
+    }
+
+    const esp_console_cmd_t rank_cmd = {
+        .command = "bq_rank",
+        .help = "Rank attached packs by health score, worst first (cached, no bus access)",
+        .hint = NULL,
+        .func = &cmd_bq_rank,
+        .argtable = NULL,
+    };
+    ESP_ERROR_CHECK(esp_console_cmd_register(&rank_cmd));
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// ──────────────────────────────────────────────────────────────────────────────
+//  Pack health score
+// ──────────────────────────────────────────────────────────────────────────────
+/**
+ * One 0..100 score per pack (100 = as new), updated on every poller sample
+ * from cached per-pack inputs. Component scores are kept for the ranking.
+ * DCIR is estimated from current steps between consecutive samples and only
+ * contributes once a step was seen.
+ */
+
+typedef struct
+{
+    bool valid;
+    uint16_t serial;
+    uint16_t mfg_date;
+    float score;
+    float soh_score;      ///< StateOfHealth()
+    float capacity_score; ///< FullChargeCapacity() / DesignCapacity()
+    float balance_score;  ///< present cell imbalance
+    float lifetime_score; ///< lifetime max / min cell voltage
+    float safety_score;   ///< safety events seen
+    float dcir_score;     ///< < 0 while DCIR is unknown
+    uint16_t imbalance_mv;
+    uint16_t lifetime_max_mv;
+    uint16_t lifetime_min_mv;
+    uint32_t safety_events;
+    float dcir_mohm;      ///< 0 while unknown
+    uint32_t updates;
+} bq_health_t;
+
+bool bq_health_get(int pack, bq_health_t *out);
+void bq_health_start(void);
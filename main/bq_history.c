@@ -0,0 +1,415 @@
+// bq_history.c – per-pack service history in a log-structured flash store
+//
+// Each diagnostic session appends one bq_history_rec_t to the "history"
+// partition (see flog.c). The RAM index maps serial + date to the newest
+// record and records link back to their predecessors, so the history of an
+// inserted pack is found by reading just its own records.
+//
+// Attach events are queued to a small task: recording a session means a
+// dozen gauge reads and a flash write that may erase a sector, too long to
+// hold up the poller.
+//
+// SPDX-License-Identifier: MIT
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <sys/param.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "esp_console.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "argtable3/argtable3.h"
+#include "bq.h"
+#include "bq_history.h"
+#include "bq_poll.h"
+#include "flog.h"
+#include "timebase.h"
+
+// ──────────────────────────────────────────────────────────────────────────────
+//  Configuration
+// ──────────────────────────────────────────────────────────────────────────────
+
+static const char *TAG = "bq_history";
+
+#define BQ_HISTORY_PARTITION "history"
+/// Index slots, enough for a few hundred different packs
+#define BQ_HISTORY_INDEX_SLOTS 512
+/// Re-inserting the same pack within this time does not start a new session
+#define BQ_HISTORY_MIN_INTERVAL_US (10 * 60 * 1000000LL)
+/// Sessions shown per pack
+#define BQ_HISTORY_SHOW_MAX 16
+/// Attach events waiting for the history task
+#define BQ_HISTORY_QUEUE_LEN BQ_MAX_PACKS
+#define BQ_HISTORY_TASK_STACK 4096
+#define BQ_HISTORY_TASK_PRIO 2
+
+static flog_t s_history;
+static bool s_history_ok;
+
+/// Last session recorded per slot, to debounce flaky contacts
+static struct
+{
+    uint32_t key;
+    int64_t mono_us;
+} s_last_session[BQ_MAX_PACKS];
+
+/// What the attach sink queues for the task
+typedef struct
+{
+    int pack;
+    uint32_t key;
+} bq_history_attach_t;
+
+static QueueHandle_t s_queue;
+
+// ──────────────────────────────────────────────────────────────────────────────
+//  Session capture
+// ──────────────────────────────────────────────────────────────────────────────
+static int bq_history_word(bq_dev_t *dev, uint8_t cmd, uint16_t *value)
+{
+    uint8_t buf[2];
+    int err = bq_read(dev, cmd, buf, sizeof(buf));
+    if (!err)
+    {
+        *value = le16(buf);
+    }
+    return err;
+}
+
+static int bq_history_dword(bq_dev_t *dev, uint8_t cmd, uint32_t *value)
+{
+    uint8_t buf[4];
+    uint8_t len = 0;
+    int err = bq_read_block(dev, cmd, buf, sizeof(buf), &len);
+    if (!err)
+    {
+        *value = len == sizeof(buf) ? le32(buf) : 0;
+    }
+    return err;
+}
+
+/**
+ * @brief Read a session summary from the gauge and append it to the history.
+ */
+int bq_history_record(bq_dev_t *dev, bq_history_rec_t *rec)
+{
+    tb_stamp_t ts;
+    uint16_t soh = 0;
+    uint8_t lt[32];
+    uint8_t lt_len = 0;
+
+    memset(rec, 0, sizeof(*rec));
+    rec->version = BQ_HISTORY_VERSION;
+    tb_now(&ts);
+    rec->wall_us = ts.wall_us;
+
+    int err = bq_history_word(dev, BQ40Z555_CMD_SERIAL_NUMBER, &rec->serial);
+    err = err ? err : bq_history_word(dev, BQ40Z555_CMD_MANUFACTURER_DATE, &rec->mfg_date);
+    err = err ? err : bq_history_word(dev, BQ40Z555_CMD_STATE_OF_HEALTH, &soh);
+    err = err ? err : bq_history_word(dev, BQ40Z555_CMD_CYCLE_COUNT, &rec->cycle_count);
+    err = err ? err : bq_history_word(dev, BQ40Z555_CMD_DESIGN_CAPACITY, &rec->design_capacity_mah);
+    err = err ? err : bq_history_word(dev, BQ40Z555_CMD_FULL_CHARGE_CAPACITY, &rec->full_charge_capacity_mah);
+    err = err ? err : bq_history_word(dev, BQ40Z555_CMD_BATTERY_STATUS, &rec->battery_status);
+    err = err ? err : bq_history_dword(dev, BQ40Z555_CMD_SAFETY_STATUS, &rec->safety_status);
+    err = err ? err : bq_history_dword(dev, BQ40Z555_CMD_PF_STATUS, &rec->pf_status);
+    err = err ? err : bq_history_dword(dev, BQ40Z555_CMD_OPERATION_STATUS, &rec->operation_status);
+    if (err)
+    {
+        return err;
+    }
+    rec->soh = (uint8_t)MIN(soh, 100);
+
+    /* lifetime extremes, layout as decoded in bq_print_lifetime_from_buffer() */
+    if (!bq_read_block(dev, BQ40Z555_CMD_LIFETIME_DATA1, lt, sizeof(lt), &lt_len) && lt_len >= 24)
+    {
+        rec->min_cell_mv = UINT16_MAX;
+        for (int i = 0; i < 4; i++)
+        {
+            uint16_t max_mv = le16(&lt[2 * i]);
+            uint16_t min_mv = le16(&lt[8 + 2 * i]);
+            rec->max_cell_mv = MAX(rec->max_cell_mv, max_mv);
+            if (min_mv)
+            {
+                rec->min_cell_mv = MIN(rec->min_cell_mv, min_mv);
+            }
+        }
+        if (rec->min_cell_mv == UINT16_MAX)
+        {
+            rec->min_cell_mv = 0;
+        }
+        rec->max_delta_cell_mv = le16(&lt[16]);
+        rec->max_charge_ma = le16(&lt[18]);
+        rec->max_discharge_ma = le16(&lt[20]);
+    }
+
+    if (!s_history_ok)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+    return flog_append(&s_history, bq_history_key(rec->serial, rec->mfg_date), rec, sizeof(*rec));
+}
+
+// ──────────────────────────────────────────────────────────────────────────────
+//  Lookup and display
+// ──────────────────────────────────────────────────────────────────────────────
+typedef struct
+{
+    bq_history_rec_t recs[BQ_HISTORY_SHOW_MAX];
+    int count;
+} bq_history_view_t;
+
+static bool bq_history_collect(uint32_t key, uint32_t seq, const void *data, uint16_t len, void *ctx)
+{
+    (void)key;
+    (void)seq;
+    bq_history_view_t *view = ctx;
+
+    if (len < sizeof(bq_history_rec_t) || ((const bq_history_rec_t *)data)->version != BQ_HISTORY_VERSION)
+    {
+        return true;
+    }
+    memcpy(&view->recs[view->count++], data, sizeof(bq_history_rec_t));
+    return view->count < BQ_HISTORY_SHOW_MAX;
+}
+
+static int bq_history_lookup(uint32_t key, bq_history_view_t *view, uint32_t *lookup_us)
+{
+    bq_history_rec_t buf;
+    int64_t start = esp_timer_get_time();
+
+    view->count = 0;
+    flog_find(&s_history, key, &buf, sizeof(buf), bq_history_collect, view);
+    *lookup_us = (uint32_t)(esp_timer_get_time() - start);
+    return view->count;
+}
+
+static void bq_history_print_rec(const bq_history_rec_t *r)
+{
+    char when[32];
+
+    tb_format(r->wall_us, when, sizeof(when));
+    printf("%-24s  %6u  %3u%%  %5u/%-5u  %4u/%-4u  %s%s\n", when, r->cycle_count, r->soh, r->full_charge_capacity_mah,
+           r->design_capacity_mah, r->max_cell_mv, r->min_cell_mv, r->pf_status ? "PF " : "",
+           r->safety_status ? "SAFETY" : "");
+}
+
+/* Wear between the oldest and the newest session shown */
+static void bq_history_print_trend(const bq_history_view_t *view)
+{
+    const bq_history_rec_t *newest = &view->recs[0];
+    const bq_history_rec_t *oldest = &view->recs[view->count - 1];
+    int cycles = newest->cycle_count - oldest->cycle_count;
+    int fcc = newest->full_charge_capacity_mah - oldest->full_charge_capacity_mah;
+
+    printf("Trend over %d sessions: FCC %+d mAh, SOH %+d %%, %d cycles", view->count, fcc,
+           newest->soh - oldest->soh, cycles);
+    if (cycles > 0)
+    {
+        printf(" (%+.1f mAh / 100 cycles)", fcc * 100.0f / cycles);
+    }
+    printf("\n");
+}
+
+static void bq_history_show(uint32_t key)
+{
+    bq_history_view_t view;
+    uint32_t lookup_us;
+
+    if (!bq_history_lookup(key, &view, &lookup_us))
+    {
+        printf("No history for %08" PRIX32 " (lookup %" PRIu32 " us)\n", key, lookup_us);
+        return;
+    }
+
+    printf("History of %08" PRIX32 ", newest first (lookup %" PRIu32 " us):\n", key, lookup_us);
+    printf("%-24s  %6s  %4s  %11s  %9s  %s\n", "Session", "Cycles", "SOH", "FCC/Design", "Cell max/min", "Flags");
+    for (int i = 0; i < view.count; i++)
+    {
+        bq_history_print_rec(&view.recs[i]);
+    }
+    bq_history_print_trend(&view);
+}
+
+static bool bq_history_list(uint32_t key, uint32_t seq, const void *data, uint16_t len, void *ctx)
+{
+    (void)seq;
+    (void)ctx;
+
+    if (len >= sizeof(bq_history_rec_t) && ((const bq_history_rec_t *)data)->version == BQ_HISTORY_VERSION)
+    {
+        printf("%08" PRIX32 "  ", key);
+        bq_history_print_rec(data);
+    }
+    return true;
+}
+
+// ──────────────────────────────────────────────────────────────────────────────
+//  Pack insertion
+// ──────────────────────────────────────────────────────────────────────────────
+static void bq_history_attached(int pack, uint32_t key)
+{
+    bq_history_view_t view;
+    bq_history_rec_t rec;
+    uint32_t lookup_us;
+    int64_t now = esp_timer_get_time();
+
+    if (bq_history_lookup(key, &view, &lookup_us))
+    {
+        const bq_history_rec_t *last = &view.recs[0];
+        ESP_LOGI(TAG, "Pack %d (%08" PRIX32 "): %d earlier sessions, last %u cycles, FCC %u mAh, SOH %u %% (%" PRIu32 " us)",
+                 pack, key, view.count, last->cycle_count, last->full_charge_capacity_mah, last->soh, lookup_us);
+    }
+    else
+    {
+        ESP_LOGI(TAG, "Pack %d (%08" PRIX32 "): first visit", pack, key);
+    }
+
+    if (s_last_session[pack].key == key && now - s_last_session[pack].mono_us < BQ_HISTORY_MIN_INTERVAL_US)
+    {
+        return;
+    }
+    bq_dev_t *dev = bq_pack(pack);
+    if (dev && !bq_history_record(dev, &rec))
+    {
+        s_last_session[pack].key = key;
+        s_last_session[pack].mono_us = now;
+    }
+}
+
+static void bq_history_task(void *arg)
+{
+    (void)arg;
+    bq_history_attach_t ev;
+
+    for (;;)
+    {
+        if (xQueueReceive(s_queue, &ev, portMAX_DELAY) == pdTRUE)
+        {
+            bq_history_attached(ev.pack, ev.key);
+        }
+    }
+}
+
+/// Poller sink: hand the pack to the history task without waiting
+static void bq_history_on_attach(int pack, const bq_pack_info_t *info, void *ctx)
+{
+    (void)ctx;
+    if (!info || !s_history_ok)
+    {
+        return;
+    }
+    bq_history_attach_t ev = {.pack = pack, .key = bq_history_key(info->serial, info->mfg_date)};
+    if (xQueueSend(s_queue, &ev, 0) != pdTRUE)
+    {
+        ESP_LOGW(TAG, "Pack %d: history busy, session not recorded", pack);
+    }
+}
+
+// ──────────────────────────────────────────────────────────────────────────────
+//  Console command
+// ──────────────────────────────────────────────────────────────────────────────
+static struct
+{
+    struct arg_int *slot;
+    struct arg_str *key;
+    struct arg_lit *record;
+    struct arg_lit *list;
+    struct arg_lit *erase;
+    struct arg_end *end;
+} bq_history_args;
+
+static int cmd_bq_history(int argc, char **argv)
+{
+    int nerrors = arg_parse(argc, argv, (void **)&bq_history_args);
+    if (nerrors != 0)
+    {
+        arg_print_errors(stderr, bq_history_args.end, argv[0]);
+        return 1;
+    }
+    if (!s_history_ok)
+    {
+        printf("History partition '%s' not available\n", BQ_HISTORY_PARTITION);
+        return 1;
+    }
+
+    if (bq_history_args.erase->count)
+    {
+        esp_err_t err = flog_erase(&s_history);
+        printf("History erased: %s\n", esp_err_to_name(err));
+        return err != ESP_OK;
+    }
+    if (bq_history_args.list->count)
+    {
+        bq_history_rec_t buf;
+        printf("%-8s  %-24s  %6s  %4s  %11s  %9s  %s\n", "Key", "Session", "Cycles", "SOH", "FCC/Design", "Cell max/min",
+               "Flags");
+        int n = flog_scan(&s_history, &buf, sizeof(buf), bq_history_list, NULL);
+        printf("%d sessions of %" PRIu32 " packs\n", n, s_history.keys);
+        return 0;
+    }
+    if (bq_history_args.key->count)
+    {
+        uint32_t key = (uint32_t)strtoul(bq_history_args.key->sval[0], NULL, 16);
+        bq_history_show(key);
+        return 0;
+    }
+
+    bq_dev_t *dev = bq_history_args.slot->count ? bq_pack(bq_history_args.slot->ival[0]) : bq_default_dev();
+    if (!dev)
+    {
+        printf("Pack slot not configured\n");
+        return 1;
+    }
+
+    uint16_t serial = 0;
+    uint16_t date = 0;
+    if (bq_ensure_awake(dev) || bq_history_word(dev, BQ40Z555_CMD_SERIAL_NUMBER, &serial) ||
+        bq_history_word(dev, BQ40Z555_CMD_MANUFACTURER_DATE, &date))
+    {
+        printf("Gauge at 0x%02X not responding\n", dev->addr);
+        return 1;
+    }
+
+    if (bq_history_args.record->count)
+    {
+        bq_history_rec_t rec;
+        int err = bq_history_record(dev, &rec);
+        printf("Session recorded: %s\n", esp_err_to_name(err));
+    }
+    bq_history_show(bq_history_key(serial, date));
+    return 0;
+}
+
+void bq_history_start(void)
+{
+    s_history_ok = flog_open(&s_history, BQ_HISTORY_PARTITION, BQ_HISTORY_INDEX_SLOTS) == ESP_OK;
+    s_queue = xQueueCreate(BQ_HISTORY_QUEUE_LEN, sizeof(bq_history_attach_t));
+    if (!s_queue || bq_poll_add_attach_sink(bq_history_on_attach, NULL))
+    {
+        ESP_LOGE(TAG, "No queue or free poller sink");
+    }
+    else
+    {
+        xTaskCreate(bq_history_task, "bq_history", BQ_HISTORY_TASK_STACK, NULL, BQ_HISTORY_TASK_PRIO, NULL);
+    }
+
+    bq_history_args.slot = arg_int0("p", "pack", "<slot>", "Pack slot (default: selected pack)");
+    bq_history_args.key = arg_str0("k", "key", "<SSSSDDDD>", "Show the history of serial SSSS / date DDDD (hex)");
+    bq_history_args.record = arg_lit0("r", "record", "Record a session for the pack now");
+    bq_history_args.list = arg_lit0("l", "list", "List all stored sessions");
+    bq_history_args.erase = arg_lit0(NULL, "erase", "Erase the whole history");
+    bq_history_args.end = arg_end(5);
+
+    const esp_console_cmd_t history_cmd = {
+        .command = "bq_history",
+        .help = "Show the service history of a pack (keyed by serial number and manufacture date)",
+        .hint = NULL,
+        .func = &cmd_bq_history,
+        .argtable = &bq_history_args,
+    };
+    ESP_ERROR_CHECK(esp_console_cmd_register(&history_cmd));
+}
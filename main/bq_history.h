@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdint.h>
+#include "bq.h"
+
+// ──────────────────────────────────────────────────────────────────────────────
+//  Per‑pack service history
+// ──────────────────────────────────────────────────────────────────────────────
+/**
+ * One summary per diagnostic session (pack insertion or `bq_history -r`),
+ * appended to the "history" flash partition and keyed by
+ * SerialNumber() << 16 | ManufacturerDate().
+ */
+
+#define BQ_HISTORY_VERSION 1
+
+typedef struct
+{
+    uint8_t version;
+    uint8_t soh;                      ///< StateOfHealth() in %
+    uint16_t cycle_count;
+    uint16_t serial;
+    uint16_t mfg_date;
+    int64_t wall_us;                  ///< session time, 0 if the clock was not synced
+    uint16_t design_capacity_mah;
+    uint16_t full_charge_capacity_mah;
+    uint16_t battery_status;
+    uint16_t max_cell_mv;             ///< lifetime extremes from LifetimeData1()
+    uint16_t min_cell_mv;
+    uint16_t max_delta_cell_mv;
+    uint16_t max_charge_ma;
+    uint16_t max_discharge_ma;
+    uint32_t safety_status;
+    uint32_t pf_status;
+    uint32_t operation_status;
+} bq_history_rec_t;
+
+static inline uint32_t bq_history_key(uint16_t serial, uint16_t mfg_date)
+{
+    return ((uint32_t)serial << 16) | mfg_date;
+}
+
+int bq_history_record(bq_dev_t *dev, bq_history_rec_t *rec);
+void bq_history_start(void);
@@ -0,0 +1,382 @@
+// bq_ocv.c – learn the OCV‑SOC curve of each pack from relaxation periods
+//
+// Runs as a poller sink on the samples that are read anyway:
+//   - FullyCharged / FullyDischarged edges in BatteryStatus() anchor the
+//     charge counter at 100 % / 0 %, Current() is integrated from there
+//   - once the current stayed below BQ_OCV_REST_MA for BQ_OCV_RELAX_MIN the
+//     mean cell voltage is taken as OCV and averaged into the 5 % bin of
+//     the counted SOC (one point per rest period)
+//   - the bins are saved in NVS keyed by serial + date and handed to the
+//     SOC filter as OCV table
+//
+// SPDX-License-Identifier: MIT
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_console.h"
+#include "esp_log.h"
+#include "nvs.h"
+#include "argtable3/argtable3.h"
+#include "bq.h"
+#include "bq_poll.h"
+#include "bq_soc.h"
+#include "bq_ocv.h"
+
+// ──────────────────────────────────────────────────────────────────────────────
+//  Configuration
+// ──────────────────────────────────────────────────────────────────────────────
+
+static const char *TAG = "bq_ocv";
+
+#define BQ_OCV_NVS_NAMESPACE "bq_ocv"
+/// Below this current the pack counts as resting
+#define BQ_OCV_REST_MA 20
+/// Rest time until the cell voltage is taken as OCV
+#define BQ_OCV_RELAX_MIN 30
+/// Learned bins needed before the table replaces the default curve
+#define BQ_OCV_MIN_BINS 3
+/// Samples further apart than this break the charge count
+#define BQ_OCV_MAX_GAP_US 5000000LL
+#define BQ_OCV_CELL_MIN_MV 1000
+
+typedef struct
+{
+    bool attached;
+    char key[9];
+    bq_ocv_bins_t bins;
+    bool anchored;      ///< charge count started from FC or FD
+    float soc;          ///< counted SOC, 0..1
+    uint16_t last_flags;
+    int64_t last_us;
+    uint32_t rest_ms;
+    bool recorded;      ///< point taken in the current rest period
+    uint32_t points;    ///< points learned since attach
+} bq_ocv_pack_t;
+
+static bq_ocv_pack_t s_ocv[BQ_MAX_PACKS];
+static portMUX_TYPE s_ocv_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static struct
+{
+    struct arg_int *slot;
+    struct arg_lit *clear;
+    struct arg_end *end;
+} bq_ocv_args;
+
+// ──────────────────────────────────────────────────────────────────────────────
+//  Table construction
+// ──────────────────────────────────────────────────────────────────────────────
+/**
+ * @brief Turn learned bins into a full OCV table.
+ *
+ * Unlearned bins follow the shape of the default curve, shifted to meet the
+ * learned neighbours (offset interpolated between them, held constant beyond
+ * the outermost ones). The result is forced to be non-decreasing.
+ *
+ * @return false while fewer than BQ_OCV_MIN_BINS bins are learned.
+ */
+bool bq_ocv_build_table(const bq_ocv_bins_t *bins, bq_ocv_table_t *table)
+{
+    const bq_ocv_table_t *def = bq_soc_default_ocv();
+    int learned = 0;
+    int prev = -1;
+
+    for (int k = 0; k < BQ_OCV_POINTS; k++)
+    {
+        learned += bins->count[k] ? 1 : 0;
+    }
+    if (learned < BQ_OCV_MIN_BINS)
+    {
+        return false;
+    }
+
+    for (int k = 0; k < BQ_OCV_POINTS; k++)
+    {
+        if (bins->count[k])
+        {
+            table->mv[k] = bins->mv[k];
+            prev = k;
+            continue;
+        }
+
+        int next = k + 1;
+        while (next < BQ_OCV_POINTS && !bins->count[next])
+        {
+            next++;
+        }
+
+        int off_prev = prev >= 0 ? bins->mv[prev] - def->mv[prev] : 0;
+        int off_next = next < BQ_OCV_POINTS ? bins->mv[next] - def->mv[next] : off_prev;
+        if (prev < 0)
+        {
+            off_prev = off_next;
+        }
+        int offset = off_prev;
+        if (prev >= 0 && next < BQ_OCV_POINTS)
+        {
+            offset = off_prev + (off_next - off_prev) * (k - prev) / (next - prev);
+        }
+        table->mv[k] = (uint16_t)(def->mv[k] + offset);
+    }
+
+    for (int k = 1; k < BQ_OCV_POINTS; k++)
+    {
+        if (table->mv[k] < table->mv[k - 1])
+        {
+            table->mv[k] = table->mv[k - 1];
+        }
+    }
+    return true;
+}
+
+static void bq_ocv_apply(int pack)
+{
+    bq_ocv_table_t table;
+    bq_soc_set_ocv(pack, bq_ocv_build_table(&s_ocv[pack].bins, &table) ? &table : NULL);
+}
+
+// ──────────────────────────────────────────────────────────────────────────────
+//  Persistence
+// ──────────────────────────────────────────────────────────────────────────────
+static void bq_ocv_load(bq_ocv_pack_t *p)
+{
+    nvs_handle_t handle;
+    size_t len = sizeof(p->bins);
+
+    memset(&p->bins, 0, sizeof(p->bins));
+    if (nvs_open(BQ_OCV_NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK)
+    {
+        return;
+    }
+    if (nvs_get_blob(handle, p->key, &p->bins, &len) != ESP_OK || len != sizeof(p->bins))
+    {
+        memset(&p->bins, 0, sizeof(p->bins));
+    }
+    nvs_close(handle);
+}
+
+static void bq_ocv_save(const bq_ocv_pack_t *p)
+{
+    nvs_handle_t handle;
+
+    if (nvs_open(BQ_OCV_NVS_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK)
+    {
+        return;
+    }
+    if (nvs_set_blob(handle, p->key, &p->bins, sizeof(p->bins)) != ESP_OK || nvs_commit(handle) != ESP_OK)
+    {
+        ESP_LOGW(TAG, "Failed to store OCV bins of %s", p->key);
+    }
+    nvs_close(handle);
+}
+
+// ──────────────────────────────────────────────────────────────────────────────
+//  Poller sinks
+// ──────────────────────────────────────────────────────────────────────────────
+static void bq_ocv_on_attach(int pack, const bq_pack_info_t *info, void *ctx)
+{
+    (void)ctx;
+    bq_ocv_pack_t *p = &s_ocv[pack];
+
+    taskENTER_CRITICAL(&s_ocv_lock);
+    p->attached = false;
+    taskEXIT_CRITICAL(&s_ocv_lock);
+    if (!info)
+    {
+        return;
+    }
+
+    bq_ocv_pack_t fresh = {0};
+    snprintf(fresh.key, sizeof(fresh.key), "%04X%04X", info->serial, info->mfg_date);
+    bq_ocv_load(&fresh);
+    fresh.attached = true;
+
+    taskENTER_CRITICAL(&s_ocv_lock);
+    *p = fresh;
+    taskEXIT_CRITICAL(&s_ocv_lock);
+    bq_ocv_apply(pack);
+}
+
+static void bq_ocv_on_sample(const bq_sample_t *s, void *ctx)
+{
+    (void)ctx;
+    bq_ocv_pack_t *p = &s_ocv[s->pack];
+    const bq_pack_info_t *info = bq_poll_info(s->pack);
+    uint32_t sum = 0;
+    int cells = 0;
+
+    if (!p->attached || !info)
+    {
+        return;
+    }
+
+    int64_t dt_us = p->last_us ? s->ts.mono_us - p->last_us : 0;
+    uint16_t rising = s->battery_status & ~p->last_flags;
+    p->last_us = s->ts.mono_us;
+    p->last_flags = s->battery_status;
+
+    if (dt_us < 0 || dt_us > BQ_OCV_MAX_GAP_US)
+    {
+        p->anchored = false;
+        dt_us = 0;
+    }
+
+    /* charge counter, anchored at the full / empty edges */
+    if (rising & BQ40Z555_BATTSTATUS_FC)
+    {
+        p->anchored = true;
+        p->soc = 1.0f;
+    }
+    else if (rising & BQ40Z555_BATTSTATUS_FD)
+    {
+        p->anchored = true;
+        p->soc = 0.0f;
+    }
+    else if (p->anchored)
+    {
+        uint32_t cap_mah = info->full_charge_capacity_mah ? info->full_charge_capacity_mah : info->design_capacity_mah;
+        if (!cap_mah)
+        {
+            p->anchored = false;
+        }
+        else
+        {
+            p->soc += s->current_ma * 0.001f * (dt_us * 1e-6f) / (cap_mah * 3.6f);
+            p->soc = p->soc < 0.0f ? 0.0f : (p->soc > 1.0f ? 1.0f : p->soc);
+        }
+    }
+
+    /* relaxation detection */
+    if (abs(s->current_ma) >= BQ_OCV_REST_MA)
+    {
+        p->rest_ms = 0;
+        p->recorded = false;
+        return;
+    }
+    p->rest_ms += (uint32_t)(dt_us / 1000);
+    if (p->recorded || !p->anchored || p->rest_ms < BQ_OCV_RELAX_MIN * 60 * 1000UL)
+    {
+        return;
+    }
+
+    for (int i = 0; i < BQ_POLL_CELLS; i++)
+    {
+        if (s->cell_mv[i] >= BQ_OCV_CELL_MIN_MV)
+        {
+            sum += s->cell_mv[i];
+            cells++;
+        }
+    }
+    if (!cells)
+    {
+        return;
+    }
+
+    int bin = (int)(p->soc * (BQ_OCV_POINTS - 1) + 0.5f);
+    uint16_t mv = (uint16_t)(sum / cells);
+
+    taskENTER_CRITICAL(&s_ocv_lock);
+    uint8_t n = p->bins.count[bin];
+    p->bins.mv[bin] = (uint16_t)(((uint32_t)p->bins.mv[bin] * n + mv) / (n + 1));
+    p->bins.count[bin] = n < UINT8_MAX ? n + 1 : n;
+    p->recorded = true;
+    p->points++;
+    taskEXIT_CRITICAL(&s_ocv_lock);
+
+    ESP_LOGI(TAG, "Pack %d: OCV %u mV at %d %% SOC (%u samples)", s->pack, mv, bin * 100 / (BQ_OCV_POINTS - 1),
+             p->bins.count[bin]);
+    /* one flash write per rest period, well within the poll budget */
+    bq_ocv_save(p);
+    bq_ocv_apply(s->pack);
+}
+
+// ──────────────────────────────────────────────────────────────────────────────
+//  Console command
+// ──────────────────────────────────────────────────────────────────────────────
+static int cmd_bq_ocv(int argc, char **argv)
+{
+    int nerrors = arg_parse(argc, argv, (void **)&bq_ocv_args);
+    if (nerrors != 0)
+    {
+        arg_print_errors(stderr, bq_ocv_args.end, argv[0]);
+        return 1;
+    }
+
+    int slot = bq_ocv_args.slot->count ? bq_ocv_args.slot->ival[0] : 0;
+    if (slot < 0 || slot >= BQ_MAX_PACKS)
+    {
+        printf("Invalid slot %d\n", slot);
+        return 1;
+    }
+
+    bq_ocv_pack_t p;
+    taskENTER_CRITICAL(&s_ocv_lock);
+    if (bq_ocv_args.clear->count && s_ocv[slot].attached)
+    {
+        memset(&s_ocv[slot].bins, 0, sizeof(s_ocv[slot].bins));
+    }
+    p = s_ocv[slot];
+    taskEXIT_CRITICAL(&s_ocv_lock);
+
+    if (!p.attached)
+    {
+        printf("Pack %d not attached\n", slot);
+        return 1;
+    }
+    if (bq_ocv_args.clear->count)
+    {
+        bq_ocv_save(&p);
+        bq_ocv_apply(slot);
+    }
+
+    bq_ocv_table_t table;
+    bool usable = bq_ocv_build_table(&p.bins, &table);
+    const bq_ocv_table_t *def = bq_soc_default_ocv();
+
+    printf("%-20s: %s\n", "Pack", p.key);
+    printf("%-20s: %s\n", "Charge count", p.anchored ? "anchored" : "waiting for full charge / discharge");
+    if (p.anchored)
+    {
+        printf("%-20s: %.1f %%\n", "Counted SOC", p.soc * 100.0f);
+    }
+    printf("%-20s: %" PRIu32 " s (OCV after %d min)\n", "Rest time", p.rest_ms / 1000, BQ_OCV_RELAX_MIN);
+    printf("%-20s: %" PRIu32 "\n", "Points this session", p.points);
+    printf("%-20s: %s\n", "Table", usable ? "learned" : "default (too few bins)");
+    printf("\n SOC  Learned  Count  Default  Table\n");
+    for (int k = 0; k < BQ_OCV_POINTS; k++)
+    {
+        char learned[8] = "-";
+        if (p.bins.count[k])
+        {
+            snprintf(learned, sizeof(learned), "%u", p.bins.mv[k]);
+        }
+        printf("%3d%%  %7s  %5u  %7u  %5u\n", k * 100 / (BQ_OCV_POINTS - 1), learned, p.bins.count[k], def->mv[k],
+               usable ? table.mv[k] : def->mv[k]);
+    }
+    return 0;
+}
+
+void bq_ocv_start(void)
+{
+    if (bq_poll_add_sink(bq_ocv_on_sample, NULL) || bq_poll_add_attach_sink(bq_ocv_on_attach, NULL))
+    {
+        ESP_LOGE(TAG, "No free poller sink");
+        return;
+    }
+
+    bq_ocv_args.slot = arg_int0("p", "pack", "<slot>", "Pack slot (default 0)");
+    bq_ocv_args.clear = arg_lit0(NULL, "clear", "Forget the learned curve of this pack");
+    bq_ocv_args.end = arg_end(2);
+
+    const esp_console_cmd_t ocv_cmd = {
+        .command = "bq_ocv",
+        .help = "Show the OCV-SOC curve learned from relaxation periods",
+        .hint = NULL,
+        .func = &cmd_bq_ocv,
+        .argtable = &bq_ocv_args,
+    };
+    ESP_ERROR_CHECK(esp_console_cmd_register(&ocv_cmd));
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "bq_soc.h"
+
+// ──────────────────────────────────────────────────────────────────────────────
+//  OCV‑SOC curve learner
+// ──────────────────────────────────────────────────────────────────────────────
+/**
+ * Learns the per-cell OCV(SOC) curve of each pack from the poller samples,
+ * without extra bus reads. The SOC axis is charge counted from the last
+ * fully charged / fully discharged event; whenever the pack has relaxed at
+ * (near) zero current the mean cell voltage is averaged into the matching
+ * 5 % bin. The bins are stored per pack (serial + date) in NVS and, once
+ * enough of them are filled, turned into the OCV table the SOC filter uses.
+ */
+
+typedef struct
+{
+    uint16_t mv[BQ_OCV_POINTS];   ///< averaged relaxed cell voltage per bin
+    uint8_t count[BQ_OCV_POINTS]; ///< samples in the bin, 0 = not learned
+} bq_ocv_bins_t;
+
+bool bq_ocv_build_table(const bq_ocv_bins_t *bins, bq_ocv_table_t *table);
+void bq_ocv_start(void);
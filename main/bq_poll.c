@@ -0,0 +1,744 @@
+// bq_poll.c – background sampling of all configured BQ40Z555 packs
+//
+// One task walks the pack table, reads the fast-changing SBS words of every
+// attached pack that is due and fans the sample out to the registered sinks
+// (SOC estimator, loggers, ...). Packs are attached once they answer and
+// their serial number, date and capacities are known; a pack that stops
+// answering is detached and retried at a slow rate.
+//
+// Each pack has its own interval. A transient (fast current or voltage
+// change, charge state or FET flip) drops it to the minimum, steady samples
+// let it grow geometrically up to the maximum. The bus time the packs ask
+// for is summed up and all intervals are stretched alike when it exceeds the
+// budget.
+//
+// SPDX-License-Identifier: MIT
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_console.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "nvs.h"
+#include "argtable3/argtable3.h"
+#include "bq.h"
+#include "bq_poll.h"
+
+// ──────────────────────────────────────────────────────────────────────────────
+//  Configuration
+// ──────────────────────────────────────────────────────────────────────────────
+
+static const char *TAG = "bq_poll";
+
+#define BQ_POLL_NVS_NAMESPACE "bq_poll"
+#define BQ_POLL_NVS_KEY_ENABLED "enabled"
+#define BQ_POLL_NVS_KEY_PERIOD "period_ms"
+#define BQ_POLL_NVS_KEY_ADAPTIVE "adaptive"
+#define BQ_POLL_NVS_KEY_MIN "min_ms"
+#define BQ_POLL_NVS_KEY_MAX "max_ms"
+#define BQ_POLL_NVS_KEY_BUDGET "budget"
+
+/// A current or voltage change is a transient above both the step and the rate
+#define BQ_POLL_STEP_MA 30
+#define BQ_POLL_RATE_MA_S 1000
+#define BQ_POLL_STEP_MV 10
+#define BQ_POLL_RATE_MV_S 100
+/// Above this current the pack is in use and sampled at least every max/4
+#define BQ_POLL_ACTIVE_MA 50
+/// Interval growth per steady sample, in 1/8
+#define BQ_POLL_BACKOFF_8TH 10
+/// Window over which the effective sample rate is measured
+#define BQ_POLL_RATE_WINDOW_US 2000000LL
+
+/// How often a missing pack is looked for
+#define BQ_POLL_ATTACH_INTERVAL_MS 2000
+/// How often serial / capacities of an attached pack are re-read
+#define BQ_POLL_INFO_INTERVAL_MS 10000
+
+#define BQ_POLL_TASK_STACK 6144
+#define BQ_POLL_TASK_PRIO 4
+
+// ──────────────────────────────────────────────────────────────────────────────
+//  State
+// ──────────────────────────────────────────────────────────────────────────────
+typedef struct
+{
+    bool attached;
+    bool have_sample;
+    bq_pack_info_t info;
+    bq_sample_t last;
+    int64_t next_attach_us;
+    int64_t next_info_us;
+    int64_t next_sample_us;
+    uint32_t interval_ms;  ///< wanted by the signal dynamics
+    uint32_t read_us_avg;  ///< bus time per sample, for the budget
+    uint32_t transients;
+    uint32_t window_samples;
+    uint32_t rate_mhz;     ///< measured sample rate in mHz
+    uint32_t samples;
+    uint32_t errors;
+} bq_poll_pack_t;
+
+static struct
+{
+    bq_sample_sink_t fn;
+    void *ctx;
+} s_sinks[BQ_POLL_MAX_SINKS];
+static int s_sink_count;
+
+static struct
+{
+    bq_attach_sink_t fn;
+    void *ctx;
+} s_attach_sinks[BQ_POLL_MAX_SINKS];
+static int s_attach_sink_count;
+
+static bq_poll_pack_t s_packs[BQ_MAX_PACKS];
+static portMUX_TYPE s_poll_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static bool s_enabled = true;
+static uint32_t s_period_ms = BQ_POLL_PERIOD_MS;
+static bool s_adaptive = true;
+static uint32_t s_min_ms = BQ_POLL_MIN_MS;
+static uint32_t s_max_ms = BQ_POLL_MAX_MS;
+static uint32_t s_budget_pct = BQ_POLL_BUDGET_PCT;
+/// Bus time all packs ask for, in 0.1 %, and the resulting interval stretch in 1/256
+static uint32_t s_demand_permille;
+static uint32_t s_stretch_256 = 256;
+static int64_t s_window_start_us;
+static uint32_t s_window_busy_us;
+static uint32_t s_bus_load_permille;
+static uint32_t s_cycles;
+static uint32_t s_overruns;
+static uint32_t s_cycle_us;
+static uint32_t s_cycle_us_max;
+
+// ──────────────────────────────────────────────────────────────────────────────
+//  Sink registry
+// ──────────────────────────────────────────────────────────────────────────────
+int bq_poll_add_sink(bq_sample_sink_t fn, void *ctx)
+{
+    if (s_sink_count >= BQ_POLL_MAX_SINKS)
+    {
+        return -1;
+    }
+    s_sinks[s_sink_count].fn = fn;
+    s_sinks[s_sink_count].ctx = ctx;
+    s_sink_count++;
+    return 0;
+}
+
+int bq_poll_add_attach_sink(bq_attach_sink_t fn, void *ctx)
+{
+    if (s_attach_sink_count >= BQ_POLL_MAX_SINKS)
+    {
+        return -1;
+    }
+    s_attach_sinks[s_attach_sink_count].fn = fn;
+    s_attach_sinks[s_attach_sink_count].ctx = ctx;
+    s_attach_sink_count++;
+    return 0;
+}
+
+static void bq_poll_notify_attach(int pack, const bq_pack_info_t *info)
+{
+    for (int i = 0; i < s_attach_sink_count; i++)
+    {
+        s_attach_sinks[i].fn(pack, info, s_attach_sinks[i].ctx);
+    }
+}
+
+/**
+ * @brief Identity of the pack in slot `pack`, NULL while it is not attached.
+ */
+const bq_pack_info_t *bq_poll_info(int pack)
+{
+    if (pack < 0 || pack >= BQ_MAX_PACKS || !s_packs[pack].attached)
+    {
+        return NULL;
+    }
+    return &s_packs[pack].info;
+}
+
+/**
+ * @brief Copy the most recent sample of `pack`. Does not touch the bus.
+ */
+bool bq_poll_last(int pack, bq_sample_t *out)
+{
+    bool valid = false;
+
+    if (pack < 0 || pack >= BQ_MAX_PACKS)
+    {
+        return false;
+    }
+    taskENTER_CRITICAL(&s_poll_lock);
+    if (s_packs[pack].attached && s_packs[pack].have_sample)
+    {
+        *out = s_packs[pack].last;
+        valid = true;
+    }
+    taskEXIT_CRITICAL(&s_poll_lock);
+    return valid;
+}
+
+// ──────────────────────────────────────────────────────────────────────────────
+//  Bus access
+// ──────────────────────────────────────────────────────────────────────────────
+static int bq_poll_read_word(bq_dev_t *dev, uint8_t cmd, uint16_t *value)
+{
+    uint8_t buf[2];
+    int err = bq_read(dev, cmd, buf, sizeof(buf));
+    if (!err)
+    {
+        *value = le16(buf);
+    }
+    return err;
+}
+
+static int bq_poll_read_info(bq_dev_t *dev, bq_pack_info_t *info)
+{
+    int err = bq_poll_read_word(dev, BQ40Z555_CMD_SERIAL_NUMBER, &info->serial);
+    err = err ? err : bq_poll_read_word(dev, BQ40Z555_CMD_MANUFACTURER_DATE, &info->mfg_date);
+    err = err ? err : bq_poll_read_word(dev, BQ40Z555_CMD_DESIGN_CAPACITY, &info->design_capacity_mah);
+    err = err ? err : bq_poll_read_word(dev, BQ40Z555_CMD_FULL_CHARGE_CAPACITY, &info->full_charge_capacity_mah);
+    err = err ? err : bq_poll_read_word(dev, BQ40Z555_CMD_CYCLE_COUNT, &info->cycle_count);
+    uint16_t soh = 0;
+    err = err ? err : bq_poll_read_word(dev, BQ40Z555_CMD_STATE_OF_HEALTH, &soh);
+    info->soh = (uint8_t)(soh > 100 ? 100 : soh);
+    return err;
+}
+
+/* Sample registers in read order, 2 = word, 5 = 4 byte status block */
+static const uint8_t s_sample_cmds[] = {
+    BQ40Z555_CMD_VOLTAGE,
+    BQ40Z555_CMD_CURRENT,
+    BQ40Z555_CMD_TEMPERATURE,
+    BQ40Z555_CMD_CELL_VOLTAGE1,
+    BQ40Z555_CMD_CELL_VOLTAGE2,
+    BQ40Z555_CMD_CELL_VOLTAGE3,
+    BQ40Z555_CMD_CELL_VOLTAGE4,
+    BQ40Z555_CMD_RELATIVE_STATE_OF_CHARGE,
+    BQ40Z555_CMD_BATTERY_STATUS,
+    BQ40Z555_CMD_OPERATION_STATUS,
+    BQ40Z555_CMD_SAFETY_ALERT,
+    BQ40Z555_CMD_SAFETY_STATUS,
+};
+static const uint8_t s_sample_lens[COUNT(s_sample_cmds)] = {2, 2, 2, 2, 2, 2, 2, 2, 2, 5, 5, 5};
+
+/* Decodes response `idx` while the next ones are on the bus; stops at the first error */
+static bool bq_poll_decode(int idx, int err, const uint8_t *data, size_t len, void *ctx)
+{
+    bq_sample_t *s = ctx;
+
+    if (err)
+    {
+        return false;
+    }
+
+    uint16_t word = le16(data);
+    uint32_t dword = len >= 5 ? le32(&data[1]) : 0;
+    switch (s_sample_cmds[idx])
+    {
+    case BQ40Z555_CMD_VOLTAGE:
+        s->voltage_mv = word;
+        break;
+    case BQ40Z555_CMD_CURRENT:
+        s->current_ma = (int16_t)word;
+        break;
+    case BQ40Z555_CMD_TEMPERATURE:
+        s->temp_dk = word;
+        break;
+    case BQ40Z555_CMD_RELATIVE_STATE_OF_CHARGE:
+        s->rsoc = (uint8_t)word;
+        break;
+    case BQ40Z555_CMD_BATTERY_STATUS:
+        s->battery_status = word;
+        break;
+    case BQ40Z555_CMD_OPERATION_STATUS:
+        s->operation_status = dword;
+        break;
+    case BQ40Z555_CMD_SAFETY_ALERT:
+        s->safety_alert = dword;
+        break;
+    case BQ40Z555_CMD_SAFETY_STATUS:
+        s->safety_status = dword;
+        break;
+    default:
+        /* CellVoltage1..4() count down from 0x3F */
+        s->cell_mv[BQ40Z555_CMD_CELL_VOLTAGE1 - s_sample_cmds[idx]] = word;
+        break;
+    }
+    return true;
+}
+
+static int bq_poll_read_sample(bq_dev_t *dev, bq_sample_t *s)
+{
+    tb_now(&s->ts);
+    int failed = bq_read_pipelined(dev, s_sample_cmds, s_sample_lens, COUNT(s_sample_cmds), bq_poll_decode, s);
+    s->read_us = (uint32_t)(tb_mono_us() - s->ts.mono_us);
+    return failed ? ESP_FAIL : 0;
+}
+
+// ──────────────────────────────────────────────────────────────────────────────
+//  Attach / detach
+// ──────────────────────────────────────────────────────────────────────────────
+static void bq_poll_detach(int idx, const char *why)
+{
+    bq_poll_pack_t *p = &s_packs[idx];
+
+    if (!p->attached)
+    {
+        return;
+    }
+    ESP_LOGI(TAG, "Pack %d detached (%s)", idx, why);
+    taskENTER_CRITICAL(&s_poll_lock);
+    p->attached = false;
+    p->have_sample = false;
+    taskEXIT_CRITICAL(&s_poll_lock);
+    bq_poll_notify_attach(idx, NULL);
+}
+
+static void bq_poll_try_attach(int idx, bq_dev_t *dev, int64_t now)
+{
+    bq_poll_pack_t *p = &s_packs[idx];
+    bq_pack_info_t info;
+
+    if (now < p->next_attach_us)
+    {
+        return;
+    }
+    p->next_attach_us = now + BQ_POLL_ATTACH_INTERVAL_MS * 1000LL;
+
+    /* one full wake attempt, then fail fast until the next attach interval */
+    dev->state = BQ_STATE_UNKNOWN;
+    if (bq_poll_read_info(dev, &info))
+    {
+        return;
+    }
+
+    p->info = info;
+    p->next_info_us = now + BQ_POLL_INFO_INTERVAL_MS * 1000LL;
+    p->attached = true;
+    ESP_LOGI(TAG, "Pack %d attached: 0x%02X serial %04X date %04X, %u/%u mAh", idx, dev->addr, info.serial,
+             info.mfg_date, info.full_charge_capacity_mah, info.design_capacity_mah);
+    bq_poll_notify_attach(idx, &p->info);
+}
+
+/* Catch pack swaps between two samples and follow FullChargeCapacity() updates */
+static void bq_poll_refresh_info(int idx, bq_dev_t *dev, int64_t now)
+{
+    bq_poll_pack_t *p = &s_packs[idx];
+    bq_pack_info_t info;
+
+    if (now < p->next_info_us)
+    {
+        return;
+    }
+    p->next_info_us = now + BQ_POLL_INFO_INTERVAL_MS * 1000LL;
+
+    if (bq_poll_read_info(dev, &info))
+    {
+        return;
+    }
+    if (info.serial != p->info.serial || info.mfg_date != p->info.mfg_date)
+    {
+        bq_poll_detach(idx, "pack swapped");
+        p->next_attach_us = 0;
+        return;
+    }
+    p->info = info;
+}
+
+// ──────────────────────────────────────────────────────────────────────────────
+//  Poll task
+// ──────────────────────────────────────────────────────────────────────────────
+static uint32_t bq_poll_tick_ms(void)
+{
+    return s_adaptive ? s_min_ms : s_period_ms;
+}
+
+/**
+ * @brief Interval the signal dynamics ask for after `s`, compared to the previous sample.
+ */
+static uint32_t bq_poll_wanted_interval(bq_poll_pack_t *p, const bq_sample_t *s)
+{
+    if (!s_adaptive)
+    {
+        return s_period_ms;
+    }
+    if (!p->have_sample)
+    {
+        return s_min_ms;
+    }
+
+    const bq_sample_t *prev = &p->last;
+    int64_t dt_ms = (s->ts.mono_us - prev->ts.mono_us) / 1000;
+    int32_t di = abs(s->current_ma - prev->current_ma);
+    int32_t dv = abs((int32_t)s->voltage_mv - (int32_t)prev->voltage_mv);
+    bool flipped = ((s->battery_status ^ prev->battery_status) & BQ40Z555_BATTSTATUS_DSG) ||
+                   ((s->operation_status ^ prev->operation_status) & (BQ40Z555_OPSTATUS_DSG | BQ40Z555_OPSTATUS_CHG));
+
+    if (dt_ms < 1)
+    {
+        dt_ms = 1;
+    }
+    if (flipped || (di > BQ_POLL_STEP_MA && di * 1000 > BQ_POLL_RATE_MA_S * dt_ms) ||
+        (dv > BQ_POLL_STEP_MV && dv * 1000 > BQ_POLL_RATE_MV_S * dt_ms))
+    {
+        p->transients++;
+        return s_min_ms;
+    }
+
+    /* in use (charging or load current): never slower than a quarter of the maximum */
+    uint32_t ceiling = s_max_ms;
+    if (abs(s->current_ma) > BQ_POLL_ACTIVE_MA || !(s->battery_status & BQ40Z555_BATTSTATUS_DSG))
+    {
+        ceiling = s_max_ms / 4 > s_min_ms ? s_max_ms / 4 : s_min_ms;
+    }
+    uint32_t interval = (p->interval_ms * BQ_POLL_BACKOFF_8TH + 7) / 8;
+    if (interval > ceiling)
+    {
+        interval = ceiling;
+    }
+    return interval < s_min_ms ? s_min_ms : interval;
+}
+
+/*
+ * Sum up the bus time every pack asks for at its wanted interval and derive
+ * one stretch factor for all of them so the total stays within the budget.
+ */
+static void bq_poll_budget(void)
+{
+    uint64_t demand = 0;
+
+    for (int idx = 0; idx < BQ_MAX_PACKS; idx++)
+    {
+        const bq_poll_pack_t *p = &s_packs[idx];
+        if (p->attached && p->interval_ms)
+        {
+            demand += (uint64_t)p->read_us_avg * 1000 / (p->interval_ms * 1000ULL);
+        }
+    }
+    s_demand_permille = (uint32_t)demand;
+    s_stretch_256 = 256;
+    if (s_adaptive && demand > s_budget_pct * 10)
+    {
+        s_stretch_256 = (uint32_t)(demand * 256 / (s_budget_pct * 10));
+    }
+}
+
+/* Effective rates and bus load over the last window */
+static void bq_poll_measure(int64_t now)
+{
+    int64_t elapsed = now - s_window_start_us;
+
+    if (elapsed < BQ_POLL_RATE_WINDOW_US)
+    {
+        return;
+    }
+    for (int idx = 0; idx < BQ_MAX_PACKS; idx++)
+    {
+        bq_poll_pack_t *p = &s_packs[idx];
+        p->rate_mhz = (uint32_t)(p->window_samples * 1000000000ULL / (uint64_t)elapsed);
+        p->window_samples = 0;
+    }
+    s_bus_load_permille = (uint32_t)(s_window_busy_us * 1000ULL / (uint64_t)elapsed);
+    s_window_busy_us = 0;
+    s_window_start_us = now;
+}
+
+static void bq_poll_pack(int idx, int64_t now)
+{
+    bq_poll_pack_t *p = &s_packs[idx];
+    bq_dev_t *dev = bq_pack(idx);
+    bq_sample_t sample = {.pack = (uint8_t)idx};
+
+    if (!dev)
+    {
+        bq_poll_detach(idx, "removed");
+        return;
+    }
+    if (!p->attached)
+    {
+        bq_poll_try_attach(idx, dev, now);
+        p->interval_ms = s_min_ms;
+        p->next_sample_us = now;
+        return;
+    }
+    /* half a tick early is on time, the task wakes with some jitter */
+    if (now + bq_poll_tick_ms() * 500LL < p->next_sample_us)
+    {
+        return;
+    }
+
+    if (bq_poll_read_sample(dev, &sample))
+    {
+        p->errors++;
+        p->next_sample_us = now + p->interval_ms * 1000LL;
+        if (dev->state == BQ_STATE_UNRESPONSIVE)
+        {
+            bq_poll_detach(idx, "not responding");
+            p->next_attach_us = now + BQ_POLL_ATTACH_INTERVAL_MS * 1000LL;
+        }
+        return;
+    }
+
+    p->interval_ms = bq_poll_wanted_interval(p, &sample);
+    uint32_t effective_ms = (uint32_t)((uint64_t)p->interval_ms * s_stretch_256 / 256);
+    sample.interval_ms = (uint16_t)(effective_ms > UINT16_MAX ? UINT16_MAX : effective_ms);
+    p->next_sample_us = now + effective_ms * 1000LL;
+    p->read_us_avg = p->read_us_avg ? (p->read_us_avg * 7 + sample.read_us) / 8 : sample.read_us;
+    p->window_samples++;
+    s_window_busy_us += sample.read_us;
+
+    taskENTER_CRITICAL(&s_poll_lock);
+    p->last = sample;
+    p->have_sample = true;
+    p->samples++;
+    taskEXIT_CRITICAL(&s_poll_lock);
+
+    for (int i = 0; i < s_sink_count; i++)
+    {
+        s_sinks[i].fn(&sample, s_sinks[i].ctx);
+    }
+
+    bq_poll_refresh_info(idx, dev, now);
+}
+
+static void bq_poll_task(void *arg)
+{
+    (void)arg;
+    TickType_t last_wake = xTaskGetTickCount();
+
+    s_window_start_us = esp_timer_get_time();
+    for (;;)
+    {
+        TickType_t period = pdMS_TO_TICKS(bq_poll_tick_ms());
+        if (period < 1)
+        {
+            period = 1;
+        }
+        if (xTaskGetTickCount() - last_wake > period)
+        {
+            /* don't try to catch up on missed cycles, just start over */
+            s_overruns++;
+            last_wake = xTaskGetTickCount();
+        }
+        vTaskDelayUntil(&last_wake, period);
+
+        if (!s_enabled)
+        {
+            continue;
+        }
+
+        int64_t start = esp_timer_get_time();
+        for (int idx = 0; idx < BQ_MAX_PACKS; idx++)
+        {
+            bq_poll_pack(idx, start);
+        }
+        bq_poll_budget();
+        bq_poll_measure(start);
+        s_cycle_us = (uint32_t)(esp_timer_get_time() - start);
+        if (s_cycle_us > s_cycle_us_max)
+        {
+            s_cycle_us_max = s_cycle_us;
+        }
+        s_cycles++;
+    }
+}
+
+// ──────────────────────────────────────────────────────────────────────────────
+//  Console command
+// ──────────────────────────────────────────────────────────────────────────────
+static struct
+{
+    struct arg_lit *on;
+    struct arg_lit *off;
+    struct arg_int *period;
+    struct arg_lit *adaptive;
+    struct arg_int *min;
+    struct arg_int *max;
+    struct arg_int *budget;
+    struct arg_end *end;
+} bq_poll_args;
+
+static void bq_poll_save(void)
+{
+    nvs_handle_t handle;
+    if (nvs_open(BQ_POLL_NVS_NAMESPACE, NVS_READWRITE, &handle) == ESP_OK)
+    {
+        nvs_set_u8(handle, BQ_POLL_NVS_KEY_ENABLED, s_enabled);
+        nvs_set_u32(handle, BQ_POLL_NVS_KEY_PERIOD, s_period_ms);
+        nvs_set_u8(handle, BQ_POLL_NVS_KEY_ADAPTIVE, s_adaptive);
+        nvs_set_u32(handle, BQ_POLL_NVS_KEY_MIN, s_min_ms);
+        nvs_set_u32(handle, BQ_POLL_NVS_KEY_MAX, s_max_ms);
+        nvs_set_u32(handle, BQ_POLL_NVS_KEY_BUDGET, s_budget_pct);
+        nvs_commit(handle);
+        nvs_close(handle);
+    }
+}
+
+static void bq_poll_load(void)
+{
+    nvs_handle_t handle;
+    if (nvs_open(BQ_POLL_NVS_NAMESPACE, NVS_READONLY, &handle) == ESP_OK)
+    {
+        uint8_t flag;
+        uint32_t value;
+        if (nvs_get_u8(handle, BQ_POLL_NVS_KEY_ENABLED, &flag) == ESP_OK)
+        {
+            s_enabled = flag != 0;
+        }
+        if (nvs_get_u32(handle, BQ_POLL_NVS_KEY_PERIOD, &value) == ESP_OK && value >= 10)
+        {
+            s_period_ms = value;
+        }
+        if (nvs_get_u8(handle, BQ_POLL_NVS_KEY_ADAPTIVE, &flag) == ESP_OK)
+        {
+            s_adaptive = flag != 0;
+        }
+        if (nvs_get_u32(handle, BQ_POLL_NVS_KEY_MIN, &value) == ESP_OK && value >= 10)
+        {
+            s_min_ms = value;
+        }
+        if (nvs_get_u32(handle, BQ_POLL_NVS_KEY_MAX, &value) == ESP_OK && value >= s_min_ms)
+        {
+            s_max_ms = value;
+        }
+        if (nvs_get_u32(handle, BQ_POLL_NVS_KEY_BUDGET, &value) == ESP_OK && value >= 1 && value <= 100)
+        {
+            s_budget_pct = value;
+        }
+        nvs_close(handle);
+    }
+}
+
+static int cmd_bq_poll(int argc, char **argv)
+{
+    int nerrors = arg_parse(argc, argv, (void **)&bq_poll_args);
+    if (nerrors != 0)
+    {
+        arg_print_errors(stderr, bq_poll_args.end, argv[0]);
+        return 1;
+    }
+
+    bool changed = false;
+    if (bq_poll_args.on->count || bq_poll_args.off->count)
+    {
+        s_enabled = bq_poll_args.on->count > 0;
+        changed = true;
+    }
+    if (bq_poll_args.period->count)
+    {
+        int period = bq_poll_args.period->ival[0];
+        if (period < 10 || period > 60000)
+        {
+            printf("Interval must be 10..60000 ms\n");
+            return 1;
+        }
+        s_period_ms = (uint32_t)period;
+        s_adaptive = false;
+        changed = true;
+    }
+    if (bq_poll_args.adaptive->count)
+    {
+        s_adaptive = true;
+        changed = true;
+    }
+    if (bq_poll_args.min->count || bq_poll_args.max->count)
+    {
+        int min = bq_poll_args.min->count ? bq_poll_args.min->ival[0] : (int)s_min_ms;
+        int max = bq_poll_args.max->count ? bq_poll_args.max->ival[0] : (int)s_max_ms;
+        if (min < 10 || max < min || max > 60000)
+        {
+            printf("Need 10 <= min <= max <= 60000 ms\n");
+            return 1;
+        }
+        s_min_ms = (uint32_t)min;
+        s_max_ms = (uint32_t)max;
+        changed = true;
+    }
+    if (bq_poll_args.budget->count)
+    {
+        int budget = bq_poll_args.budget->ival[0];
+        if (budget < 1 || budget > 100)
+        {
+            printf("Budget must be 1..100 %%\n");
+            return 1;
+        }
+        s_budget_pct = (uint32_t)budget;
+        changed = true;
+    }
+    if (changed)
+    {
+        bq_poll_save();
+    }
+
+    printf("%-20s: %s\n", "Polling", s_enabled ? "on" : "off");
+    if (s_adaptive)
+    {
+        printf("%-20s: adaptive, %" PRIu32 "..%" PRIu32 " ms\n", "Interval", s_min_ms, s_max_ms);
+    }
+    else
+    {
+        printf("%-20s: fixed, %" PRIu32 " ms\n", "Interval", s_period_ms);
+    }
+    printf("%-20s: %" PRIu32 " %%, asked %" PRIu32 ".%" PRIu32 " %%, used %" PRIu32 ".%" PRIu32 " %% (stretch x%" PRIu32
+           ".%02" PRIu32 ")\n",
+           "Bus budget", s_budget_pct, s_demand_permille / 10, s_demand_permille % 10, s_bus_load_permille / 10,
+           s_bus_load_permille % 10, s_stretch_256 / 256, (s_stretch_256 % 256) * 100 / 256);
+    printf("%-20s: %" PRIu32 " (overruns %" PRIu32 ")\n", "Cycles", s_cycles, s_overruns);
+    printf("%-20s: %" PRIu32 " us (max %" PRIu32 " us)\n", "Cycle time", s_cycle_us, s_cycle_us_max);
+    printf("\nPack  Serial  Date  Samples   Errors  Read us  Interval  Rate      Transients  Voltage  Current\n");
+    for (int idx = 0; idx < BQ_MAX_PACKS; idx++)
+    {
+        if (!bq_pack(idx))
+        {
+            continue;
+        }
+        const bq_poll_pack_t *p = &s_packs[idx];
+        bq_sample_t s;
+        if (!bq_poll_last(idx, &s))
+        {
+            printf("%-4d  %s\n", idx, "not attached");
+            continue;
+        }
+        printf("%-4d  %04X    %04X  %-8" PRIu32 "  %-6" PRIu32 "  %-7" PRIu32 "  %5u ms  %3" PRIu32 ".%02" PRIu32
+               " Hz  %-10" PRIu32 "  %5u mV  %5d mA\n",
+               idx, p->info.serial, p->info.mfg_date, p->samples, p->errors, s.read_us, s.interval_ms,
+               p->rate_mhz / 1000, p->rate_mhz % 1000 / 10, p->transients, s.voltage_mv, s.current_ma);
+    }
+    return 0;
+}
+
+static void register_bq_poll_commands(void)
+{
+    bq_poll_args.on = arg_lit0(NULL, "on", "Start polling");
+    bq_poll_args.off = arg_lit0(NULL, "off", "Stop polling (keeps the bus free for manual access)");
+    bq_poll_args.period = arg_int0("i", "interval", "<ms>", "Poll every pack at this fixed interval");
+    bq_poll_args.adaptive = arg_lit0("a", "adaptive", "Adapt each pack's interval to its signal dynamics (default)");
+    bq_poll_args.min = arg_int0(NULL, "min", "<ms>", "Adaptive: interval during transients");
+    bq_poll_args.max = arg_int0(NULL, "max", "<ms>", "Adaptive: interval at rest");
+    bq_poll_args.budget = arg_int0("b", "budget", "<%>", "Adaptive: share of the bus time all packs may use");
+    bq_poll_args.end = arg_end(7);
+
+    const esp_console_cmd_t poll_cmd = {
+        .command = "bq_poll",
+        .help = "Show or control background sampling of all packs",
+        .hint = NULL,
+        .func = &cmd_bq_poll,
+        .argtable = &bq_poll_args,
+    };
+    ESP_ERROR_CHECK(esp_console_cmd_register(&poll_cmd));
+}
+
+void bq_poll_start(void)
+{
+    bq_poll_load();
+    register_bq_poll_commands();
+    xTaskCreate(bq_poll_task, "bq_poll", BQ_POLL_TASK_STACK, NULL, BQ_POLL_TASK_PRIO, NULL);
+}
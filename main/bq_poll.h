@@ -0,0 +1,70 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "timebase.h"
+
+// ──────────────────────────────────────────────────────────────────────────────
+//  Background pack poller
+// ──────────────────────────────────────────────────────────────────────────────
+/**
+ * A single task samples every configured pack (see `bq_pack`) at a fixed rate
+ * and hands each sample to the registered sinks. Estimators and loggers hook
+ * in as sinks instead of issuing their own bus reads.
+ *
+ * Sinks run in the poller task, one pack after the other, and must not block.
+ * Register them from the start functions before `bq_poll_start()`.
+ *
+ * By default every pack is sampled at its own adaptive interval: fast while
+ * current or voltage change or the charge state flips, backing off to a slow
+ * rate at rest. The sum over all packs is held within a bus time budget.
+ * Intervals vary, so sinks must use `ts` rather than assume a fixed rate.
+ */
+
+#define BQ_POLL_CELLS 4
+#define BQ_POLL_PERIOD_MS 100
+#define BQ_POLL_MIN_MS 20
+#define BQ_POLL_MAX_MS 1000
+/// Share of the bus time the poller may use, in %
+#define BQ_POLL_BUDGET_PCT 50
+#define BQ_POLL_MAX_SINKS 8
+
+typedef struct
+{
+    uint8_t pack;              ///< pack slot
+    tb_stamp_t ts;             ///< taken right before the first read
+    uint32_t read_us;          ///< bus time spent on this sample
+    uint16_t interval_ms;      ///< interval the next sample of this pack is scheduled at
+    uint16_t voltage_mv;       ///< Voltage()
+    int16_t current_ma;        ///< Current(), positive while charging
+    uint16_t temp_dk;          ///< Temperature() in 0.1 K
+    uint16_t cell_mv[BQ_POLL_CELLS]; ///< CellVoltage1..4(), 0 for unused cells
+    uint8_t rsoc;              ///< RelativeStateOfCharge() in %
+    uint16_t battery_status;   ///< BatteryStatus()
+    uint32_t operation_status; ///< OperationStatus()
+    uint32_t safety_alert;     ///< SafetyAlert()
+    uint32_t safety_status;    ///< SafetyStatus()
+} bq_sample_t;
+
+/// Identity and capacity of an attached pack, read at attach and refreshed periodically
+typedef struct
+{
+    uint16_t serial;
+    uint16_t mfg_date;
+    uint16_t design_capacity_mah;
+    uint16_t full_charge_capacity_mah;
+    uint16_t cycle_count;
+    uint8_t soh; ///< StateOfHealth() in %
+} bq_pack_info_t;
+
+typedef void (*bq_sample_sink_t)(const bq_sample_t *sample, void *ctx);
+/// `info` is NULL when the pack went away
+typedef void (*bq_attach_sink_t)(int pack, const bq_pack_info_t *info, void *ctx);
+
+int bq_poll_add_sink(bq_sample_sink_t fn, void *ctx);
+int bq_poll_add_attach_sink(bq_attach_sink_t fn, void *ctx);
+
+const bq_pack_info_t *bq_poll_info(int pack);
+bool bq_poll_last(int pack, bq_sample_t *out);
+
+void bq_poll_start(void);
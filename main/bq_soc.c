@@ -0,0 +1,346 @@
+// bq_soc.c – per-pack extended Kalman filter SOC estimate, independent of the gauge
+//
+// State:       x = SOC (0..1), variance P
+// Prediction:  x += I·dt / C               (coulomb counting, I > 0 charging)
+//              P += (σI·dt / C)² + q·dt    (current offset, capacity error)
+// Measurement: z = mean cell voltage
+//              h(x) = OCV(x) + I·R0,  H = dOCV/dx from the table segment
+//              R = (σrest + |I|·σI + σrelax·(1 - rest/relaxed))²
+//
+// Everything is single precision and one table lookup per update, so the
+// filter costs a few microseconds per sample even with soft-float.
+//
+// SPDX-License-Identifier: MIT
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <inttypes.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_console.h"
+#include "esp_log.h"
+#include "port.h"
+#include "argtable3/argtable3.h"
+#include "bq.h"
+#include "bq_poll.h"
+#include "bq_soc.h"
+
+// ──────────────────────────────────────────────────────────────────────────────
+//  Model parameters
+// ──────────────────────────────────────────────────────────────────────────────
+
+/// Per-cell ohmic resistance incl. interconnects, mΩ (A · mΩ = mV)
+#define BQ_SOC_R0_MOHM 40.0f
+/// Below this current the pack counts as resting
+#define BQ_SOC_REST_MA 50
+/// Rest time after which the cell voltage is considered relaxed to OCV
+#define BQ_SOC_RELAXED_MS (10 * 60 * 1000)
+/// Measurement noise terms, mV
+#define BQ_SOC_SIGMA_REST_MV 8.0f
+#define BQ_SOC_SIGMA_PER_A_MV 60.0f
+#define BQ_SOC_SIGMA_RELAX_MV 40.0f
+/// Current sensor offset assumed per prediction step, A
+#define BQ_SOC_SIGMA_CURRENT_A 0.02f
+/// SOC variance growth per second (capacity / model error)
+#define BQ_SOC_DRIFT_VAR_PER_S 1e-8f
+/// Floor for dOCV/dSOC in mV per unit SOC, keeps the flat plateau observable
+#define BQ_SOC_MIN_SLOPE_MV 100.0f
+/// Initial variance when starting from the OCV or from the gauge
+#define BQ_SOC_INIT_VAR_OCV (0.05f * 0.05f)
+#define BQ_SOC_INIT_VAR_GAUGE (0.15f * 0.15f)
+/// Samples further apart than this only inflate the variance instead of integrating
+#define BQ_SOC_MAX_GAP_US 5000000LL
+#define BQ_SOC_GAP_VAR (0.05f * 0.05f)
+/// Capacity used if the gauge reports none
+#define BQ_SOC_DEFAULT_CAPACITY_MAH 2000
+/// Cells reading below this are not populated
+#define BQ_SOC_CELL_MIN_MV 1000
+
+static const char *TAG = "bq_soc";
+
+/// Generic Li-ion (LCO/NMC) per-cell OCV, 0 % .. 100 % in 5 % steps
+static const bq_ocv_table_t s_default_ocv = {
+    .mv = {3300, 3480, 3600, 3650, 3690, 3715, 3740, 3760, 3780, 3805, 3830,
+           3860, 3890, 3925, 3960, 4000, 4040, 4075, 4110, 4150, 4190},
+};
+
+typedef struct
+{
+    bq_soc_estimate_t est;
+    float var;
+    int64_t last_us;
+    uint64_t cycles_sum;
+    bq_ocv_table_t ocv;
+    bool ocv_learned;
+} bq_soc_pack_t;
+
+static bq_soc_pack_t s_soc[BQ_MAX_PACKS];
+static portMUX_TYPE s_soc_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// ──────────────────────────────────────────────────────────────────────────────
+//  OCV table helpers
+// ──────────────────────────────────────────────────────────────────────────────
+static float bq_soc_ocv(const bq_ocv_table_t *t, float soc, float *slope)
+{
+    float x = soc * (BQ_OCV_POINTS - 1);
+    int k = (int)x;
+
+    if (k < 0)
+    {
+        k = 0;
+    }
+    if (k > BQ_OCV_POINTS - 2)
+    {
+        k = BQ_OCV_POINTS - 2;
+    }
+
+    float lo = t->mv[k];
+    float hi = t->mv[k + 1];
+    *slope = (hi - lo) * (BQ_OCV_POINTS - 1);
+    return lo + (hi - lo) * (x - k);
+}
+
+static float bq_soc_from_ocv(const bq_ocv_table_t *t, float mv)
+{
+    if (mv <= t->mv[0])
+    {
+        return 0.0f;
+    }
+    for (int k = 0; k < BQ_OCV_POINTS - 1; k++)
+    {
+        if (mv < t->mv[k + 1])
+        {
+            float frac = (mv - t->mv[k]) / (float)(t->mv[k + 1] - t->mv[k]);
+            return (k + frac) / (BQ_OCV_POINTS - 1);
+        }
+    }
+    return 1.0f;
+}
+
+const bq_ocv_table_t *bq_soc_default_ocv(void)
+{
+    return &s_default_ocv;
+}
+
+/**
+ * @brief Use `table` as OCV curve for `pack` (NULL = generic default).
+ */
+void bq_soc_set_ocv(int pack, const bq_ocv_table_t *table)
+{
+    if (pack < 0 || pack >= BQ_MAX_PACKS)
+    {
+        return;
+    }
+    taskENTER_CRITICAL(&s_soc_lock);
+    s_soc[pack].ocv = table ? *table : s_default_ocv;
+    s_soc[pack].ocv_learned = table != NULL;
+    taskEXIT_CRITICAL(&s_soc_lock);
+}
+
+bool bq_soc_get(int pack, bq_soc_estimate_t *out)
+{
+    float var;
+
+    if (pack < 0 || pack >= BQ_MAX_PACKS)
+    {
+        return false;
+    }
+    taskENTER_CRITICAL(&s_soc_lock);
+    *out = s_soc[pack].est;
+    var = s_soc[pack].var;
+    out->ocv_learned = s_soc[pack].ocv_learned;
+    taskEXIT_CRITICAL(&s_soc_lock);
+
+    out->sigma = sqrtf(var);
+    return out->valid;
+}
+
+// ──────────────────────────────────────────────────────────────────────────────
+//  Filter
+// ──────────────────────────────────────────────────────────────────────────────
+static void bq_soc_on_sample(const bq_sample_t *s, void *ctx)
+{
+    (void)ctx;
+    uint32_t t0 = port_cycles();
+    bq_soc_pack_t *p = &s_soc[s->pack];
+    bq_ocv_table_t ocv;
+    uint32_t sum = 0;
+    int cells = 0;
+
+    for (int i = 0; i < BQ_POLL_CELLS; i++)
+    {
+        if (s->cell_mv[i] >= BQ_SOC_CELL_MIN_MV)
+        {
+            sum += s->cell_mv[i];
+            cells++;
+        }
+    }
+    if (!cells)
+    {
+        return;
+    }
+
+    const bq_pack_info_t *info = bq_poll_info(s->pack);
+    uint32_t cap_mah = 0;
+    if (info)
+    {
+        cap_mah = info->full_charge_capacity_mah ? info->full_charge_capacity_mah : info->design_capacity_mah;
+    }
+    if (!cap_mah)
+    {
+        cap_mah = BQ_SOC_DEFAULT_CAPACITY_MAH;
+    }
+
+    taskENTER_CRITICAL(&s_soc_lock);
+    ocv = p->ocv;
+    taskEXIT_CRITICAL(&s_soc_lock);
+
+    bq_soc_estimate_t est = p->est;
+    float var = p->var;
+    float z = (float)sum / cells;
+    float amps = s->current_ma * 0.001f;
+    float cap_as = cap_mah * 3.6f;
+    int64_t dt_us = s->ts.mono_us - p->last_us;
+    bool resting = abs(s->current_ma) < BQ_SOC_REST_MA;
+
+    if (!est.valid)
+    {
+        if (resting)
+        {
+            est.soc = bq_soc_from_ocv(&ocv, z);
+            var = BQ_SOC_INIT_VAR_OCV;
+        }
+        else
+        {
+            est.soc = s->rsoc * 0.01f;
+            var = BQ_SOC_INIT_VAR_GAUGE;
+        }
+        est.rest_ms = 0;
+        est.valid = true;
+        dt_us = 0;
+    }
+    else if (dt_us > BQ_SOC_MAX_GAP_US || dt_us < 0)
+    {
+        var += BQ_SOC_GAP_VAR;
+        dt_us = 0;
+    }
+
+    est.rest_ms = resting ? est.rest_ms + (uint32_t)(dt_us / 1000) : 0;
+
+    /* predict */
+    float dt = dt_us * 1e-6f;
+    float e = BQ_SOC_SIGMA_CURRENT_A * dt / cap_as;
+    est.soc += amps * dt / cap_as;
+    var += e * e + BQ_SOC_DRIFT_VAR_PER_S * dt;
+
+    /* correct */
+    float slope;
+    float h = bq_soc_ocv(&ocv, est.soc, &slope) + amps * BQ_SOC_R0_MOHM;
+    if (slope < BQ_SOC_MIN_SLOPE_MV)
+    {
+        slope = BQ_SOC_MIN_SLOPE_MV;
+    }
+    float relax = est.rest_ms >= BQ_SOC_RELAXED_MS ? 0.0f : 1.0f - (float)est.rest_ms / BQ_SOC_RELAXED_MS;
+    float sigma_mv = BQ_SOC_SIGMA_REST_MV + fabsf(amps) * BQ_SOC_SIGMA_PER_A_MV + relax * BQ_SOC_SIGMA_RELAX_MV;
+    float pht = var * slope;
+    float k = pht / (slope * pht + sigma_mv * sigma_mv);
+
+    est.residual_mv = z - h;
+    est.soc += k * est.residual_mv;
+    var -= k * pht;
+
+    if (est.soc < 0.0f)
+    {
+        est.soc = 0.0f;
+    }
+    if (est.soc > 1.0f)
+    {
+        est.soc = 1.0f;
+    }
+    if (var < 1e-8f)
+    {
+        var = 1e-8f;
+    }
+
+    uint32_t cycles = port_cycles() - t0;
+    est.gauge_rsoc = s->rsoc;
+    est.updates++;
+    p->cycles_sum += cycles;
+    est.cycles_avg = (uint32_t)(p->cycles_sum / est.updates);
+    if (cycles > est.cycles_max)
+    {
+        est.cycles_max = cycles;
+    }
+
+    taskENTER_CRITICAL(&s_soc_lock);
+    p->est = est;
+    p->var = var;
+    p->last_us = s->ts.mono_us;
+    taskEXIT_CRITICAL(&s_soc_lock);
+}
+
+/* Start over whenever a pack (re)appears in a slot */
+static void bq_soc_on_attach(int pack, const bq_pack_info_t *info, void *ctx)
+{
+    (void)info;
+    (void)ctx;
+
+    taskENTER_CRITICAL(&s_soc_lock);
+    s_soc[pack].est = (bq_soc_estimate_t){0};
+    s_soc[pack].cycles_sum = 0;
+    s_soc[pack].ocv = s_default_ocv;
+    s_soc[pack].ocv_learned = false;
+    taskEXIT_CRITICAL(&s_soc_lock);
+}
+
+// ──────────────────────────────────────────────────────────────────────────────
+//  Console command
+// ──────────────────────────────────────────────────────────────────────────────
+static int cmd_bq_soc(int argc, char **argv)
+{
+    (void)argc;
+    (void)argv;
+
+    printf("Pack  EKF SOC    ±1σ     Gauge  Diff    Residual   Rest s  OCV      Updates   CPU/update\n");
+    for (int idx = 0; idx < BQ_MAX_PACKS; idx++)
+    {
+        bq_soc_estimate_t est;
+        if (!bq_pack(idx))
+        {
+            continue;
+        }
+        if (!bq_soc_get(idx, &est))
+        {
+            printf("%-4d  %s\n", idx, "no estimate (pack not attached or polling off)");
+            continue;
+        }
+        printf("%-4d  %6.1f %%  %5.1f %%  %3u %%  %+5.1f  %+7.1f mV  %6" PRIu32 "  %-7s  %-8" PRIu32 "  %" PRIu32
+               " us (max %" PRIu32 " us)\n",
+               idx, est.soc * 100.0f, est.sigma * 100.0f, est.gauge_rsoc, est.soc * 100.0f - est.gauge_rsoc,
+               est.residual_mv, est.rest_ms / 1000, est.ocv_learned ? "learned" : "default", est.updates, est.cycles_avg / PORT_CPU_MHZ,
+               est.cycles_max / PORT_CPU_MHZ);
+    }
+    return 0;
+}
+
+void bq_soc_start(void)
+{
+    for (int idx = 0; idx < BQ_MAX_PACKS; idx++)
+    {
+        s_soc[idx].ocv = s_default_ocv;
+    }
+    if (bq_poll_add_sink(bq_soc_on_sample, NULL) || bq_poll_add_attach_sink(bq_soc_on_attach, NULL))
+    {
+        ESP_LOGE(TAG, "No free poller sink");
+        return;
+    }
+
+    const esp_console_cmd_t soc_cmd = {
+        .command = "bq_soc",
+        .help = "Compare the on-device EKF state of charge with the gauge RelativeStateOfCharge()",
+        .hint = NULL,
+        .func = &cmd_bq_soc,
+        .argtable = NULL,
+    };
+    ESP_ERROR_CHECK(esp_console_cmd_register(&soc_cmd));
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// ──────────────────────────────────────────────────────────────────────────────
+//  Gauge-independent SOC estimator
+// ──────────────────────────────────────────────────────────────────────────────
+/**
+ * Scalar extended Kalman filter per pack, fed by the poller. The state is the
+ * SOC, predicted by coulomb counting and corrected with the mean cell voltage
+ * against an OCV(SOC) curve plus an ohmic R0 term. The voltage measurement is
+ * trusted less the higher the current and the shorter the pack has rested, so
+ * under load the filter mostly integrates and at rest it pulls to the OCV.
+ */
+
+/// OCV table points, uniformly spaced from 0 % to 100 % SOC
+#define BQ_OCV_POINTS 21
+
+typedef struct
+{
+    uint16_t mv[BQ_OCV_POINTS]; ///< per-cell open circuit voltage
+} bq_ocv_table_t;
+
+typedef struct
+{
+    bool valid;
+    float soc;           ///< 0..1
+    float sigma;         ///< one standard deviation of `soc`
+    uint8_t gauge_rsoc;  ///< RelativeStateOfCharge() of the same sample
+    float residual_mv;   ///< last voltage innovation
+    uint32_t rest_ms;    ///< time the pack has been below the rest current
+    bool ocv_learned;    ///< running on a learned OCV table instead of the default
+    uint32_t updates;
+    uint32_t cycles_avg; ///< CPU cycles per filter update
+    uint32_t cycles_max;
+} bq_soc_estimate_t;
+
+const bq_ocv_table_t *bq_soc_default_ocv(void);
+void bq_soc_set_ocv(int pack, const bq_ocv_table_t *table);
+bool bq_soc_get(int pack, bq_soc_estimate_t *out);
+void bq_soc_start(void);
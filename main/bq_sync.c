@@ -0,0 +1,404 @@
+// bq_sync.c – timer-triggered simultaneous sampling of all packs
+//
+// The ESP32-C3 has a single I2C controller, so "simultaneous" means as close
+// together as the bus allows: a GPTimer alarm wakes a high priority task
+// that takes the bus lock once and reads register after register over all
+// packs. The packs are ordered by mux channel and walked back and forth
+// (serpentine), so consecutive reads of one register never wait for more
+// than one mux switch and the turn between registers needs none.
+//
+// SPDX-License-Identifier: MIT
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <sys/param.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "sdkconfig.h"
+#if !CONFIG_IDF_TARGET_LINUX
+#include "driver/gptimer.h"
+#endif
+#include "esp_attr.h"
+#include "esp_console.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "argtable3/argtable3.h"
+#include "bq.h"
+#include "bq_sync.h"
+#include "i2c.h"
+
+// ──────────────────────────────────────────────────────────────────────────────
+//  Configuration
+// ──────────────────────────────────────────────────────────────────────────────
+
+static const char *TAG = "bq_sync";
+
+#define BQ_SYNC_PERIOD_MS 100
+#define BQ_SYNC_MIN_PERIOD_MS 20
+#define BQ_SYNC_TASK_STACK 4096
+/// Above the poller, a burst must not be preempted by it
+#define BQ_SYNC_TASK_PRIO 6
+
+/// Read in this order; Current() first as it is what current sharing is about
+static const uint8_t s_regs[BQ_SYNC_REGS] = {
+    BQ40Z555_CMD_CURRENT,
+    BQ40Z555_CMD_VOLTAGE,
+};
+
+static TaskHandle_t s_task;
+static volatile int64_t s_alarm_us;
+static bool s_running;
+static uint32_t s_period_ms = BQ_SYNC_PERIOD_MS;
+
+/// Completed sets, written by the task only
+static bq_sync_set_t s_sets[BQ_SYNC_SETS];
+static uint32_t s_seq;
+
+static struct
+{
+    uint32_t bursts;
+    uint32_t missed;     ///< alarms that fired while a burst was still running
+    uint32_t failed;     ///< reads that failed
+    uint32_t latency_us; ///< alarm to first read of the last burst
+    uint32_t latency_max_us;
+    uint32_t burst_us;
+    uint32_t skew_us;
+    uint64_t skew_sum_us;
+    uint32_t skew_max_us;
+} s_stats;
+
+// ──────────────────────────────────────────────────────────────────────────────
+//  Trigger
+// ──────────────────────────────────────────────────────────────────────────────
+#if CONFIG_IDF_TARGET_LINUX
+static esp_timer_handle_t s_timer;
+
+/// No GPTimer in the native build, an esp_timer callback notifies the task instead
+static void bq_sync_on_alarm(void *arg)
+{
+    (void)arg;
+
+    s_alarm_us = esp_timer_get_time();
+    xTaskNotifyGive(s_task);
+}
+
+static esp_err_t bq_sync_timer_create(void)
+{
+    const esp_timer_create_args_t args = {
+        .callback = bq_sync_on_alarm,
+        .name = "bq_sync",
+    };
+    return esp_timer_create(&args, &s_timer);
+}
+
+static esp_err_t bq_sync_timer_run(bool run)
+{
+    return run ? esp_timer_start_periodic(s_timer, s_period_ms * 1000ULL) : esp_timer_stop(s_timer);
+}
+#else
+static gptimer_handle_t s_timer;
+
+static bool IRAM_ATTR bq_sync_on_alarm(gptimer_handle_t timer, const gptimer_alarm_event_data_t *edata, void *ctx)
+{
+    (void)timer;
+    (void)edata;
+    (void)ctx;
+    BaseType_t woken = pdFALSE;
+
+    s_alarm_us = esp_timer_get_time();
+    vTaskNotifyGiveFromISR(s_task, &woken);
+    return woken == pdTRUE;
+}
+
+static esp_err_t bq_sync_timer_create(void)
+{
+    gptimer_config_t cfg = {
+        .clk_src = GPTIMER_CLK_SRC_DEFAULT,
+        .direction = GPTIMER_COUNT_UP,
+        .resolution_hz = 1000000,
+    };
+    gptimer_event_callbacks_t cbs = {
+        .on_alarm = bq_sync_on_alarm,
+    };
+
+    esp_err_t err = gptimer_new_timer(&cfg, &s_timer);
+    return err ? err : gptimer_register_event_callbacks(s_timer, &cbs, NULL);
+}
+
+static esp_err_t bq_sync_timer_run(bool run)
+{
+    if (!run)
+    {
+        gptimer_stop(s_timer);
+        return gptimer_disable(s_timer);
+    }
+
+    gptimer_alarm_config_t alarm = {
+        .alarm_count = s_period_ms * 1000ULL,
+        .reload_count = 0,
+        .flags.auto_reload_on_alarm = true,
+    };
+    esp_err_t err = gptimer_set_alarm_action(s_timer, &alarm);
+    err = err ? err : gptimer_set_raw_count(s_timer, 0);
+    err = err ? err : gptimer_enable(s_timer);
+    return err ? err : gptimer_start(s_timer);
+}
+#endif
+
+// ──────────────────────────────────────────────────────────────────────────────
+//  Burst
+// ──────────────────────────────────────────────────────────────────────────────
+static int bq_sync_cmp_channel(const void *a, const void *b)
+{
+    const bq_dev_t *da = bq_pack(*(const uint8_t *)a);
+    const bq_dev_t *db = bq_pack(*(const uint8_t *)b);
+    return da->mux_channel - db->mux_channel;
+}
+
+static int bq_sync_order(uint8_t *order)
+{
+    int count = 0;
+
+    for (int idx = 0; idx < BQ_MAX_PACKS; idx++)
+    {
+        if (bq_pack(idx))
+        {
+            order[count++] = (uint8_t)idx;
+        }
+    }
+    qsort(order, count, sizeof(order[0]), bq_sync_cmp_channel);
+    return count;
+}
+
+static void bq_sync_burst(bq_sync_set_t *set, int64_t alarm_us)
+{
+    uint8_t order[BQ_MAX_PACKS];
+    int packs = bq_sync_order(order);
+    int32_t mid_min = INT32_MAX;
+    int32_t mid_max = INT32_MIN;
+
+    set->alarm_us = alarm_us;
+    set->count = 0;
+
+    i2c_lock();
+    for (int r = 0; r < BQ_SYNC_REGS; r++)
+    {
+        for (int i = 0; i < packs; i++)
+        {
+            /* serpentine: odd registers walk the packs backwards */
+            int idx = order[(r & 1) ? packs - 1 - i : i];
+            bq_sync_read_t *rd = &set->reads[set->count++];
+            uint8_t buf[2] = {0};
+
+            int64_t start = esp_timer_get_time();
+            rd->ok = !bq_read(bq_pack(idx), s_regs[r], buf, sizeof(buf));
+            int64_t end = esp_timer_get_time();
+
+            uint16_t raw = (uint16_t)buf[0] | ((uint16_t)buf[1] << 8);
+            rd->pack = (uint8_t)idx;
+            rd->reg = s_regs[r];
+            rd->value = s_regs[r] == BQ40Z555_CMD_CURRENT ? (int16_t)raw : raw;
+            rd->start_us = (uint16_t)MIN(start - alarm_us, UINT16_MAX);
+            rd->end_us = (uint16_t)MIN(end - alarm_us, UINT16_MAX);
+            if (!rd->ok)
+            {
+                s_stats.failed++;
+            }
+            else if (r == 0)
+            {
+                int32_t mid = (rd->start_us + rd->end_us) / 2;
+                mid_min = MIN(mid_min, mid);
+                mid_max = MAX(mid_max, mid);
+            }
+        }
+    }
+    i2c_unlock();
+
+    set->skew_us = mid_max > mid_min ? (uint16_t)(mid_max - mid_min) : 0;
+    if (set->count)
+    {
+        s_stats.latency_us = set->reads[0].start_us;
+        s_stats.latency_max_us = MAX(s_stats.latency_max_us, s_stats.latency_us);
+        s_stats.burst_us = set->reads[set->count - 1].end_us - set->reads[0].start_us;
+    }
+    s_stats.skew_us = set->skew_us;
+    s_stats.skew_sum_us += set->skew_us;
+    s_stats.skew_max_us = MAX(s_stats.skew_max_us, set->skew_us);
+    s_stats.bursts++;
+}
+
+static void bq_sync_task(void *arg)
+{
+    (void)arg;
+
+    for (;;)
+    {
+        uint32_t alarms = ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        int64_t alarm_us = s_alarm_us;
+
+        if (!s_running)
+        {
+            continue;
+        }
+        if (alarms > 1)
+        {
+            s_stats.missed += alarms - 1;
+        }
+        bq_sync_set_t *set = &s_sets[s_seq % BQ_SYNC_SETS];
+        bq_sync_burst(set, alarm_us);
+        set->seq = s_seq++;
+    }
+}
+
+// ──────────────────────────────────────────────────────────────────────────────
+//  Timer
+// ──────────────────────────────────────────────────────────────────────────────
+static esp_err_t bq_sync_run(bool run)
+{
+    if (run == s_running)
+    {
+        return ESP_OK;
+    }
+    if (!run)
+    {
+        s_running = false;
+        return bq_sync_timer_run(false);
+    }
+
+    memset(&s_stats, 0, sizeof(s_stats));
+    esp_err_t err = bq_sync_timer_run(true);
+    s_running = err == ESP_OK;
+    return err;
+}
+
+// ──────────────────────────────────────────────────────────────────────────────
+//  Console command
+// ──────────────────────────────────────────────────────────────────────────────
+static struct
+{
+    struct arg_lit *start;
+    struct arg_lit *stop;
+    struct arg_int *period;
+    struct arg_lit *dump;
+    struct arg_end *end;
+} bq_sync_args;
+
+/* CSV, one line per read, oldest set first */
+static void bq_sync_dump(void)
+{
+    uint32_t first = s_seq > BQ_SYNC_SETS ? s_seq - BQ_SYNC_SETS : 0;
+
+    printf("seq,alarm_us,pack,reg,start_us,end_us,value,ok\n");
+    for (uint32_t seq = first; seq < s_seq; seq++)
+    {
+        const bq_sync_set_t *set = &s_sets[seq % BQ_SYNC_SETS];
+        for (int i = 0; i < set->count; i++)
+        {
+            const bq_sync_read_t *rd = &set->reads[i];
+            printf("%" PRIu32 ",%" PRId64 ",%u,0x%02X,%u,%u,%" PRId32 ",%d\n", set->seq, set->alarm_us, rd->pack,
+                   rd->reg, rd->start_us, rd->end_us, rd->value, rd->ok);
+        }
+    }
+}
+
+static void bq_sync_print_last(void)
+{
+    if (!s_seq)
+    {
+        return;
+    }
+    const bq_sync_set_t *set = &s_sets[(s_seq - 1) % BQ_SYNC_SETS];
+    printf("\nSet %" PRIu32 ":\nPack  Reg   Start us  End us  Value\n", set->seq);
+    for (int i = 0; i < set->count; i++)
+    {
+        const bq_sync_read_t *rd = &set->reads[i];
+        printf("%-4u  0x%02X  %8u  %6u  ", rd->pack, rd->reg, rd->start_us, rd->end_us);
+        if (rd->ok)
+        {
+            printf("%" PRId32 " %s\n", rd->value, rd->reg == BQ40Z555_CMD_CURRENT ? "mA" : "mV");
+        }
+        else
+        {
+            printf("failed\n");
+        }
+    }
+}
+
+static int cmd_bq_sync(int argc, char **argv)
+{
+    int nerrors = arg_parse(argc, argv, (void **)&bq_sync_args);
+    if (nerrors != 0)
+    {
+        arg_print_errors(stderr, bq_sync_args.end, argv[0]);
+        return 1;
+    }
+
+    if (bq_sync_args.period->count)
+    {
+        int period = bq_sync_args.period->ival[0];
+        if (period < BQ_SYNC_MIN_PERIOD_MS || period > 60000)
+        {
+            printf("Period must be %d..60000 ms\n", BQ_SYNC_MIN_PERIOD_MS);
+            return 1;
+        }
+        bool was_running = s_running;
+        bq_sync_run(false);
+        s_period_ms = (uint32_t)period;
+        if (was_running)
+        {
+            bq_sync_run(true);
+        }
+    }
+    if (bq_sync_args.start->count || bq_sync_args.stop->count)
+    {
+        esp_err_t err = bq_sync_run(bq_sync_args.start->count > 0);
+        if (err != ESP_OK)
+        {
+            printf("Failed: %s\n", esp_err_to_name(err));
+            return 1;
+        }
+    }
+    if (bq_sync_args.dump->count)
+    {
+        bq_sync_dump();
+        return 0;
+    }
+
+    printf("%-20s: %s, every %" PRIu32 " ms\n", "Sync sampling", s_running ? "running" : "stopped", s_period_ms);
+    printf("%-20s: %" PRIu32 " (missed alarms %" PRIu32 ", failed reads %" PRIu32 ")\n", "Bursts", s_stats.bursts,
+           s_stats.missed, s_stats.failed);
+    printf("%-20s: %" PRIu32 " us (max %" PRIu32 " us)\n", "Alarm to first read", s_stats.latency_us,
+           s_stats.latency_max_us);
+    printf("%-20s: %" PRIu32 " us\n", "Burst time", s_stats.burst_us);
+    printf("%-20s: %" PRIu32 " us (avg %" PRIu32 " us, max %" PRIu32 " us)\n", "Current skew", s_stats.skew_us,
+           s_stats.bursts ? (uint32_t)(s_stats.skew_sum_us / s_stats.bursts) : 0, s_stats.skew_max_us);
+    bq_sync_print_last();
+    return 0;
+}
+
+void bq_sync_start(void)
+{
+    xTaskCreate(bq_sync_task, "bq_sync", BQ_SYNC_TASK_STACK, NULL, BQ_SYNC_TASK_PRIO, &s_task);
+    if (bq_sync_timer_create() != ESP_OK)
+    {
+        ESP_LOGE(TAG, "No timer for synchronized sampling");
+        return;
+    }
+
+    bq_sync_args.start = arg_lit0(NULL, "start", "Start timer-triggered sampling of all packs");
+    bq_sync_args.stop = arg_lit0(NULL, "stop", "Stop it");
+    bq_sync_args.period = arg_int0("i", "interval", "<ms>", "Timer period");
+    bq_sync_args.dump = arg_lit0("d", "dump", "Print the recent sets as CSV with per-read timestamps");
+    bq_sync_args.end = arg_end(4);
+
+    const esp_console_cmd_t sync_cmd = {
+        .command = "bq_sync",
+        .help = "Synchronized Current()/Voltage() sampling of all packs, with per-read timestamps and skew",
+        .hint = NULL,
+        .func = &cmd_bq_sync,
+        .argtable = &bq_sync_args,
+    };
+    ESP_ERROR_CHECK(esp_console_cmd_register(&sync_cmd));
+}
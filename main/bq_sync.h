@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "bq.h"
+
+// ──────────────────────────────────────────────────────────────────────────────
+//  Synchronized multi-pack sampling
+// ──────────────────────────────────────────────────────────────────────────────
+/**
+ * For packs wired in parallel: a hardware timer triggers one burst per
+ * period in which Current() and Voltage() of all packs are read back to back
+ * with the bus held. Every read keeps its own start and end time relative to
+ * the timer alarm so host tools can interpolate to a common instant.
+ */
+
+#define BQ_SYNC_REGS 2
+#define BQ_SYNC_SETS 32
+
+typedef struct
+{
+    uint8_t pack;
+    uint8_t reg;       ///< SBS command
+    bool ok;
+    int32_t value;     ///< mV or mA
+    uint16_t start_us; ///< read start after the alarm
+    uint16_t end_us;   ///< read end after the alarm
+} bq_sync_read_t;
+
+typedef struct
+{
+    uint32_t seq;
+    int64_t alarm_us;  ///< monotonic time of the timer alarm
+    uint8_t count;
+    uint16_t skew_us;  ///< spread of the Current() read midpoints over the packs
+    bq_sync_read_t reads[BQ_MAX_PACKS * BQ_SYNC_REGS];
+} bq_sync_set_t;
+
+void bq_sync_start(void);
@@ -0,0 +1,828 @@
+// bq_telem.c – binary sample stream: framing, COBS, CRC and the outputs
+//
+// The poller sink turns each sample into its wire record and queues it
+// without waiting; nothing is queued while no output is enabled. The
+// telemetry task batches the records of all packs into one frame until it
+// is full or the oldest record waited `flush` ms, encodes it once and hands
+// the same bytes to every enabled output.
+//
+// Events (pack attach/detach, anomalies) share the queue; the task sends
+// the samples batched so far and then the event, so the stream keeps the
+// order things happened in.
+//
+// The multicast output sends each frame as one UDP datagram to a group, so
+// any number of dashboards and loggers listen at the cost of one send. The
+// resumable TCP stream lives in bq_telem_stream.c.
+//
+// SPDX-License-Identifier: MIT
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <inttypes.h>
+#include <sys/param.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_console.h"
+#include "esp_log.h"
+#include "esp_rom_crc.h"
+#include "nvs.h"
+#include "argtable3/argtable3.h"
+#include "sdkconfig.h"
+#if CONFIG_IDF_TARGET_LINUX
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#else
+#include "lwip/sockets.h"
+#include "soc/soc_caps.h"
+#if SOC_USB_SERIAL_JTAG_SUPPORTED
+#include "driver/usb_serial_jtag.h"
+#endif
+#endif
+#include "bq_poll.h"
+#include "bq_telem.h"
+#include "bq_telem_stream.h"
+
+// ──────────────────────────────────────────────────────────────────────────────
+//  Configuration
+// ──────────────────────────────────────────────────────────────────────────────
+
+static const char *TAG = "bq_telem";
+
+/// Records waiting for the telemetry task
+#define BQ_TELEM_QUEUE_LEN 64
+#define BQ_TELEM_FLUSH_MS 50
+#define BQ_TELEM_MAX_FLUSH_MS 5000
+/// The task also spills the stream's replay buffer to flash
+#define BQ_TELEM_TASK_STACK 4096
+#define BQ_TELEM_TASK_PRIO 3
+
+#define BQ_TELEM_PAYLOAD_MAX (BQ_TELEM_MAX_RECORDS * sizeof(bq_telem_sample_t))
+
+/// Frame sequence numbers are reserved in NVS this many at a time
+#define BQ_TELEM_SEQ_BLOCK 65536
+
+/// Whether an output is on is stored under its name
+#define BQ_TELEM_NVS_NAMESPACE "bq_telem"
+#define BQ_TELEM_NVS_KEY_SEQ "seq"
+#define BQ_TELEM_NVS_KEY_GROUP "group"
+#define BQ_TELEM_NVS_KEY_PORT "port"
+#define BQ_TELEM_NVS_KEY_TTL "ttl"
+
+/// Organization-local scope (RFC 2365), stays inside the lab network
+#define BQ_TELEM_MCAST_GROUP "239.255.66.1"
+#define BQ_TELEM_MCAST_PORT 5566
+#define BQ_TELEM_MCAST_TTL 1
+/// IPv4 payload of one 1500 byte Ethernet frame
+#define BQ_TELEM_MCAST_MTU 1472
+
+#if !CONFIG_IDF_TARGET_LINUX && SOC_USB_SERIAL_JTAG_SUPPORTED
+#define BQ_TELEM_HAVE_USB 1
+/// Writes go out in USB packet sized pieces, the driver's buffer may be small
+#define BQ_TELEM_USB_CHUNK 64
+#define BQ_TELEM_USB_TIMEOUT_MS 20
+#define BQ_TELEM_USB_BUF 2048
+#else
+#define BQ_TELEM_HAVE_USB 0
+#endif
+
+typedef struct
+{
+    const char *name;
+    bq_telem_write_t write;
+    bq_telem_switch_t on_switch;
+    void *ctx;
+    atomic_bool enabled;
+    uint32_t frames;
+    uint32_t dropped; ///< frames the output could not take whole
+    uint64_t bytes;
+} bq_telem_output_t;
+
+static bq_telem_output_t s_outputs[BQ_TELEM_MAX_OUTPUTS];
+static atomic_int s_noutputs;
+static atomic_int s_enabled; ///< enabled outputs, the sink idles at 0
+
+/// Multicast destination; socket and address change under the lock
+static struct
+{
+    SemaphoreHandle_t lock;
+    int sock;
+    struct sockaddr_in dest;
+    uint8_t ttl;
+} s_mcast = {.sock = -1};
+
+/// What the sink and bq_telem_event() queue for the task
+typedef struct
+{
+    uint8_t type; ///< BQ_TELEM_SAMPLES or BQ_TELEM_EVENTS
+    union
+    {
+        bq_telem_sample_t sample;
+        bq_telem_event_t event;
+    };
+} bq_telem_item_t;
+
+static QueueHandle_t s_queue;
+static atomic_uint_least32_t s_flush_ms = BQ_TELEM_FLUSH_MS;
+static atomic_uint_least32_t s_overruns; ///< records the queue had no room for
+static atomic_uint_least32_t s_seq;
+static uint32_t s_seq_reserved; ///< first number not reserved in NVS yet
+static uint32_t s_boot_seq;
+static uint32_t s_records;
+static uint32_t s_events;
+
+/// Only used by the telemetry task
+static uint8_t s_payload[BQ_TELEM_PAYLOAD_MAX];
+static uint8_t s_frame[BQ_TELEM_FRAME_MAX(BQ_TELEM_PAYLOAD_MAX)];
+
+_Static_assert(sizeof(s_frame) <= BQ_TELEM_MCAST_MTU, "a frame must fit one datagram without fragmentation");
+
+// ──────────────────────────────────────────────────────────────────────────────
+//  Encoder
+// ──────────────────────────────────────────────────────────────────────────────
+
+/// COBS encoder state, input may arrive in pieces
+typedef struct
+{
+    uint8_t *out;
+    size_t len;     ///< bytes written incl. the open block's code byte
+    size_t code_at; ///< position of the open block's code byte
+    uint8_t code;   ///< 1 + data bytes in the open block
+} bq_cobs_t;
+
+static void bq_cobs_begin(bq_cobs_t *c, uint8_t *out)
+{
+    *c = (bq_cobs_t){.out = out, .len = 1, .code = 1};
+}
+
+static void bq_cobs_put(bq_cobs_t *c, const uint8_t *in, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        if (in[i])
+        {
+            c->out[c->len++] = in[i];
+            c->code++;
+        }
+        /* a zero closes the block, so does a full one (254 data bytes) */
+        if (!in[i] || c->code == 0xFF)
+        {
+            c->out[c->code_at] = c->code;
+            c->code = 1;
+            c->code_at = c->len++;
+        }
+    }
+}
+
+static size_t bq_cobs_end(bq_cobs_t *c)
+{
+    c->out[c->code_at] = c->code;
+    return c->len;
+}
+
+size_t bq_telem_cobs(const uint8_t *in, size_t len, uint8_t *out)
+{
+    bq_cobs_t c;
+
+    bq_cobs_begin(&c, out);
+    bq_cobs_put(&c, in, len);
+    return bq_cobs_end(&c);
+}
+
+size_t bq_telem_encode(uint8_t type, uint32_t seq, uint16_t count, const void *payload, size_t len, uint8_t *out)
+{
+    bq_telem_hdr_t hdr = {
+        .version = BQ_TELEM_VERSION,
+        .type = type,
+        .count = count,
+        .seq = seq,
+    };
+    uint32_t crc = esp_rom_crc32_le(0, (const uint8_t *)&hdr, sizeof(hdr));
+    crc = esp_rom_crc32_le(crc, payload, len);
+    uint8_t crc_le[4] = {(uint8_t)crc, (uint8_t)(crc >> 8), (uint8_t)(crc >> 16), (uint8_t)(crc >> 24)};
+    bq_cobs_t c;
+
+    out[0] = 0;
+    bq_cobs_begin(&c, &out[1]);
+    bq_cobs_put(&c, (const uint8_t *)&hdr, sizeof(hdr));
+    bq_cobs_put(&c, payload, len);
+    bq_cobs_put(&c, crc_le, sizeof(crc_le));
+    size_t n = 1 + bq_cobs_end(&c);
+    out[n++] = 0;
+    return n;
+}
+
+// ──────────────────────────────────────────────────────────────────────────────
+//  Outputs
+// ──────────────────────────────────────────────────────────────────────────────
+
+int bq_telem_add_output(const char *name, bq_telem_write_t fn, bq_telem_switch_t on_switch, void *ctx)
+{
+    int id = atomic_load(&s_noutputs);
+
+    if (id >= BQ_TELEM_MAX_OUTPUTS)
+    {
+        return -1;
+    }
+    s_outputs[id] = (bq_telem_output_t){.name = name, .write = fn, .on_switch = on_switch, .ctx = ctx};
+    atomic_store(&s_noutputs, id + 1);
+    return id;
+}
+
+esp_err_t bq_telem_enable(int id, bool on)
+{
+    if (id < 0 || id >= atomic_load(&s_noutputs))
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    bq_telem_output_t *out = &s_outputs[id];
+    if (atomic_load(&out->enabled) == on)
+    {
+        return ESP_OK;
+    }
+    if (on && out->on_switch)
+    {
+        esp_err_t err = out->on_switch(true, out->ctx);
+        if (err != ESP_OK)
+        {
+            return err;
+        }
+    }
+    atomic_store(&out->enabled, on);
+    atomic_fetch_add(&s_enabled, on ? 1 : -1);
+    if (!on && out->on_switch)
+    {
+        out->on_switch(false, out->ctx);
+    }
+    return ESP_OK;
+}
+
+uint32_t bq_telem_seq(void)
+{
+    return atomic_load(&s_seq);
+}
+
+uint32_t bq_telem_boot_seq(void)
+{
+    return s_boot_seq;
+}
+
+/*
+ * The first number of the next block is stored before any of the block is
+ * used, so after a restart numbering continues above everything sent.
+ */
+static void bq_telem_seq_reserve(void)
+{
+    nvs_handle_t handle;
+
+    s_seq_reserved = atomic_load(&s_seq) + BQ_TELEM_SEQ_BLOCK;
+    if (nvs_open(BQ_TELEM_NVS_NAMESPACE, NVS_READWRITE, &handle) == ESP_OK)
+    {
+        nvs_set_u32(handle, BQ_TELEM_NVS_KEY_SEQ, s_seq_reserved);
+        nvs_commit(handle);
+        nvs_close(handle);
+    }
+}
+
+static void bq_telem_publish(uint8_t type, uint16_t count, const void *payload, size_t len)
+{
+    uint32_t seq = atomic_load(&s_seq);
+
+    if (seq == s_seq_reserved)
+    {
+        bq_telem_seq_reserve();
+    }
+    size_t n = bq_telem_encode(type, seq, count, payload, len, s_frame);
+    /* outputs may ask for the next number while they take this frame */
+    atomic_store(&s_seq, seq + 1);
+
+    for (int i = 0; i < atomic_load(&s_noutputs); i++)
+    {
+        bq_telem_output_t *out = &s_outputs[i];
+
+        if (!atomic_load(&out->enabled))
+        {
+            continue;
+        }
+        if (out->write(seq, s_frame, n, out->ctx) == 0)
+        {
+            out->frames++;
+            out->bytes += n;
+        }
+        else
+        {
+            out->dropped++;
+        }
+    }
+}
+
+#if BQ_TELEM_HAVE_USB
+/// Console log handler below ours, and whether USB output keeps it quiet
+static vprintf_like_t s_usb_log_prev;
+static atomic_bool s_usb_quiet;
+
+/*
+ * Log lines share the port with the frames and would cut into them, so
+ * they are dropped while USB output is on. Installed before telnet_start(),
+ * this sits below the telnet redirect: a telnet client still gets them.
+ */
+static int bq_telem_usb_log(const char *format, va_list args)
+{
+    if (atomic_load(&s_usb_quiet))
+    {
+        return 0;
+    }
+    return s_usb_log_prev(format, args);
+}
+
+/*
+ * The console REPL keeps running on the port but only writes when someone
+ * types, and the reader drops what fails the CRC. That is also the way back
+ * out: type `bq_telem --off usb` blind on the port, or run it from telnet.
+ */
+static int bq_telem_usb_write(uint32_t seq, const uint8_t *frame, size_t len, void *ctx)
+{
+    (void)seq;
+    (void)ctx;
+    for (size_t off = 0; off < len;)
+    {
+        int n = usb_serial_jtag_write_bytes(&frame[off], MIN(len - off, BQ_TELEM_USB_CHUNK),
+                                            pdMS_TO_TICKS(BQ_TELEM_USB_TIMEOUT_MS));
+        if (n <= 0)
+        {
+            /* no host reading, the next frame's leading 0x00 resynchronizes */
+            return ESP_ERR_TIMEOUT;
+        }
+        off += (size_t)n;
+    }
+    return ESP_OK;
+}
+
+static esp_err_t bq_telem_usb_switch(bool on, void *ctx)
+{
+    (void)ctx;
+    if (!on)
+    {
+        atomic_store(&s_usb_quiet, false);
+        ESP_LOGI(TAG, "USB output off, console log back on");
+        return ESP_OK;
+    }
+    if (!usb_serial_jtag_is_driver_installed())
+    {
+        /* the console runs on another port */
+        usb_serial_jtag_driver_config_t cfg = {.tx_buffer_size = BQ_TELEM_USB_BUF, .rx_buffer_size = 64};
+        esp_err_t err = usb_serial_jtag_driver_install(&cfg);
+        if (err != ESP_OK)
+        {
+            return err;
+        }
+    }
+    ESP_LOGI(TAG, "USB output on, console log off until 'bq_telem --off usb'");
+    atomic_store(&s_usb_quiet, true);
+    return ESP_OK;
+}
+#endif
+
+/*
+ * One datagram per frame whatever the number of listeners; they find lost
+ * datagrams from gaps in the frame sequence numbers.
+ */
+static int bq_telem_mcast_write(uint32_t seq, const uint8_t *frame, size_t len, void *ctx)
+{
+    (void)seq;
+    (void)ctx;
+    xSemaphoreTake(s_mcast.lock, portMAX_DELAY);
+    int n = s_mcast.sock < 0 ? -1
+                             : sendto(s_mcast.sock, frame, len, 0, (const struct sockaddr *)&s_mcast.dest,
+                                      sizeof(s_mcast.dest));
+    xSemaphoreGive(s_mcast.lock);
+    return n == (int)len ? ESP_OK : ESP_FAIL;
+}
+
+/* The caller holds the lock */
+static esp_err_t bq_telem_mcast_open(void)
+{
+    if (s_mcast.sock < 0)
+    {
+        s_mcast.sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        if (s_mcast.sock < 0)
+        {
+            return ESP_FAIL;
+        }
+    }
+    setsockopt(s_mcast.sock, IPPROTO_IP, IP_MULTICAST_TTL, &s_mcast.ttl, sizeof(s_mcast.ttl));
+    return ESP_OK;
+}
+
+static esp_err_t bq_telem_mcast_switch(bool on, void *ctx)
+{
+    (void)ctx;
+    if (!on)
+    {
+        return ESP_OK;
+    }
+    xSemaphoreTake(s_mcast.lock, portMAX_DELAY);
+    esp_err_t err = bq_telem_mcast_open();
+    xSemaphoreGive(s_mcast.lock);
+    return err;
+}
+
+static void bq_telem_save(void)
+{
+    nvs_handle_t handle;
+    if (nvs_open(BQ_TELEM_NVS_NAMESPACE, NVS_READWRITE, &handle) == ESP_OK)
+    {
+        for (int i = 0; i < atomic_load(&s_noutputs); i++)
+        {
+            nvs_set_u8(handle, s_outputs[i].name, atomic_load(&s_outputs[i].enabled));
+        }
+        nvs_set_u32(handle, BQ_TELEM_NVS_KEY_GROUP, s_mcast.dest.sin_addr.s_addr);
+        nvs_set_u16(handle, BQ_TELEM_NVS_KEY_PORT, ntohs(s_mcast.dest.sin_port));
+        nvs_set_u8(handle, BQ_TELEM_NVS_KEY_TTL, s_mcast.ttl);
+        nvs_commit(handle);
+        nvs_close(handle);
+    }
+}
+
+/* Settings and sequence numbers; the outputs are switched on by bq_telem_restore() */
+static void bq_telem_load(void)
+{
+    nvs_handle_t handle;
+
+    s_mcast.dest.sin_family = AF_INET;
+    s_mcast.dest.sin_port = htons(BQ_TELEM_MCAST_PORT);
+    inet_aton(BQ_TELEM_MCAST_GROUP, &s_mcast.dest.sin_addr);
+    s_mcast.ttl = BQ_TELEM_MCAST_TTL;
+    if (nvs_open(BQ_TELEM_NVS_NAMESPACE, NVS_READONLY, &handle) == ESP_OK)
+    {
+        uint32_t group;
+        uint16_t port;
+        uint8_t ttl;
+        uint32_t seq;
+        if (nvs_get_u32(handle, BQ_TELEM_NVS_KEY_SEQ, &seq) == ESP_OK)
+        {
+            atomic_store(&s_seq, seq);
+        }
+        if (nvs_get_u32(handle, BQ_TELEM_NVS_KEY_GROUP, &group) == ESP_OK)
+        {
+            s_mcast.dest.sin_addr.s_addr = group;
+        }
+        if (nvs_get_u16(handle, BQ_TELEM_NVS_KEY_PORT, &port) == ESP_OK && port)
+        {
+            s_mcast.dest.sin_port = htons(port);
+        }
+        if (nvs_get_u8(handle, BQ_TELEM_NVS_KEY_TTL, &ttl) == ESP_OK && ttl)
+        {
+            s_mcast.ttl = ttl;
+        }
+        nvs_close(handle);
+    }
+    s_boot_seq = atomic_load(&s_seq);
+    bq_telem_seq_reserve();
+}
+
+/* Switch on the outputs that were on; network sends count as dropped until the link is up */
+static void bq_telem_restore(void)
+{
+    nvs_handle_t handle;
+
+    if (nvs_open(BQ_TELEM_NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK)
+    {
+        return;
+    }
+    for (int i = 0; i < atomic_load(&s_noutputs); i++)
+    {
+        uint8_t on = 0;
+        if (nvs_get_u8(handle, s_outputs[i].name, &on) == ESP_OK && on)
+        {
+            esp_err_t err = bq_telem_enable(i, true);
+            if (err != ESP_OK)
+            {
+                ESP_LOGW(TAG, "Output %s: %s", s_outputs[i].name, esp_err_to_name(err));
+            }
+        }
+    }
+    nvs_close(handle);
+}
+
+// ──────────────────────────────────────────────────────────────────────────────
+//  Sampling
+// ──────────────────────────────────────────────────────────────────────────────
+
+static void bq_telem_on_sample(const bq_sample_t *s, void *ctx)
+{
+    (void)ctx;
+    if (!atomic_load(&s_enabled))
+    {
+        return;
+    }
+
+    bq_telem_item_t item = {.type = BQ_TELEM_SAMPLES};
+    bq_telem_sample_t *rec = &item.sample;
+
+    *rec = (bq_telem_sample_t){
+        .mono_us = s->ts.mono_us,
+        .wall_us = s->ts.wall_us,
+        .pack = s->pack,
+        .rsoc = s->rsoc,
+        .voltage_mv = s->voltage_mv,
+        .current_ma = s->current_ma,
+        .temp_dk = s->temp_dk,
+        .battery_status = s->battery_status,
+        .operation_status = s->operation_status,
+        .safety_alert = s->safety_alert,
+        .safety_status = s->safety_status,
+    };
+    memcpy(rec->cell_mv, s->cell_mv, sizeof(rec->cell_mv));
+    if (xQueueSend(s_queue, &item, 0) != pdTRUE)
+    {
+        atomic_fetch_add(&s_overruns, 1);
+    }
+}
+
+void bq_telem_event(const tb_stamp_t *ts, uint8_t pack, uint8_t kind, const char *fmt, ...)
+{
+    if (!s_queue || !atomic_load(&s_enabled))
+    {
+        return;
+    }
+
+    bq_telem_item_t item = {.type = BQ_TELEM_EVENTS};
+    tb_stamp_t now;
+    va_list ap;
+
+    if (!ts)
+    {
+        tb_now(&now);
+        ts = &now;
+    }
+    item.event.mono_us = ts->mono_us;
+    item.event.wall_us = ts->wall_us;
+    item.event.pack = pack;
+    item.event.kind = kind;
+    va_start(ap, fmt);
+    vsnprintf(item.event.text, sizeof(item.event.text), fmt, ap);
+    va_end(ap);
+    if (xQueueSend(s_queue, &item, 0) != pdTRUE)
+    {
+        atomic_fetch_add(&s_overruns, 1);
+    }
+}
+
+static void bq_telem_on_attach(int pack, const bq_pack_info_t *info, void *ctx)
+{
+    (void)ctx;
+    if (info)
+    {
+        bq_telem_event(NULL, (uint8_t)pack, BQ_TELEM_EV_ATTACH, "SN %04X %u mAh", info->serial,
+                       info->design_capacity_mah);
+    }
+    else
+    {
+        bq_telem_event(NULL, (uint8_t)pack, BQ_TELEM_EV_DETACH, "detached");
+    }
+}
+
+static void bq_telem_task(void *arg)
+{
+    (void)arg;
+    size_t count = 0;
+    TickType_t first = 0;
+
+    for (;;)
+    {
+        TickType_t flush = pdMS_TO_TICKS(atomic_load(&s_flush_ms));
+        TickType_t wait = portMAX_DELAY;
+        bq_telem_item_t item;
+
+        if (count)
+        {
+            TickType_t age = xTaskGetTickCount() - first;
+            wait = age < flush ? flush - age : 0;
+        }
+        bool got = xQueueReceive(s_queue, &item, wait) == pdTRUE;
+        if (got && item.type == BQ_TELEM_SAMPLES)
+        {
+            if (!count)
+            {
+                first = xTaskGetTickCount();
+            }
+            memcpy(&s_payload[count++ * sizeof(item.sample)], &item.sample, sizeof(item.sample));
+            s_records++;
+        }
+        bool event = got && item.type == BQ_TELEM_EVENTS;
+        if (count && (event || count == BQ_TELEM_MAX_RECORDS || xTaskGetTickCount() - first >= flush))
+        {
+            bq_telem_publish(BQ_TELEM_SAMPLES, (uint16_t)count, s_payload, count * sizeof(item.sample));
+            count = 0;
+        }
+        if (event)
+        {
+            bq_telem_publish(BQ_TELEM_EVENTS, 1, &item.event, sizeof(item.event));
+            s_events++;
+        }
+    }
+}
+
+// ──────────────────────────────────────────────────────────────────────────────
+//  Console command
+// ──────────────────────────────────────────────────────────────────────────────
+
+static struct
+{
+    struct arg_str *on;
+    struct arg_str *off;
+    struct arg_int *flush;
+    struct arg_str *group;
+    struct arg_int *port;
+    struct arg_int *ttl;
+    struct arg_end *end;
+} bq_telem_args;
+
+static int bq_telem_find(const char *name)
+{
+    for (int i = 0; i < atomic_load(&s_noutputs); i++)
+    {
+        if (!strcmp(s_outputs[i].name, name))
+        {
+            return i;
+        }
+    }
+    printf("No output '%s'\n", name);
+    return -1;
+}
+
+static void bq_telem_print(void)
+{
+    printf("%-20s: %u bytes, up to %d per frame\n", "Records", (unsigned)sizeof(bq_telem_sample_t),
+           BQ_TELEM_MAX_RECORDS);
+    printf("%-20s: %" PRIu32 " ms\n", "Flush after", (uint32_t)atomic_load(&s_flush_ms));
+    printf("%-20s: %" PRIu32 " samples, %" PRIu32 " events\n", "Sent", s_records, s_events);
+    printf("%-20s: %" PRIu32 "\n", "Next frame", bq_telem_seq());
+    printf("%-20s: %" PRIu32 "\n", "Queue overruns", (uint32_t)atomic_load(&s_overruns));
+    printf("\n%-8s %-4s %10s %12s %8s\n", "output", "", "frames", "bytes", "dropped");
+    for (int i = 0; i < atomic_load(&s_noutputs); i++)
+    {
+        const bq_telem_output_t *out = &s_outputs[i];
+        printf("%-8s %-4s %10" PRIu32 " %12" PRIu64 " %8" PRIu32 "\n", out->name,
+               atomic_load(&out->enabled) ? "on" : "off", out->frames, out->bytes, out->dropped);
+    }
+
+    char ip[16];
+    inet_ntop(AF_INET, &s_mcast.dest.sin_addr, ip, sizeof(ip));
+    printf("\n%-20s: %s:%u, TTL %u\n", "Multicast group", ip, ntohs(s_mcast.dest.sin_port), s_mcast.ttl);
+    bq_telem_stream_print();
+}
+
+/* Apply --group, --port and --ttl; returns -1 on bad values, 1 when something changed */
+static int bq_telem_mcast_config(void)
+{
+    struct sockaddr_in dest = s_mcast.dest;
+    uint8_t ttl = s_mcast.ttl;
+
+    if (bq_telem_args.group->count)
+    {
+        if (!inet_aton(bq_telem_args.group->sval[0], &dest.sin_addr) || (ntohl(dest.sin_addr.s_addr) >> 28) != 0xE)
+        {
+            printf("Not a multicast address (224.0.0.0/4): %s\n", bq_telem_args.group->sval[0]);
+            return -1;
+        }
+    }
+    if (bq_telem_args.port->count)
+    {
+        if (bq_telem_args.port->ival[0] < 1 || bq_telem_args.port->ival[0] > 65535)
+        {
+            printf("Port must be 1..65535\n");
+            return -1;
+        }
+        dest.sin_port = htons((uint16_t)bq_telem_args.port->ival[0]);
+    }
+    if (bq_telem_args.ttl->count)
+    {
+        if (bq_telem_args.ttl->ival[0] < 1 || bq_telem_args.ttl->ival[0] > 255)
+        {
+            printf("TTL must be 1..255\n");
+            return -1;
+        }
+        ttl = (uint8_t)bq_telem_args.ttl->ival[0];
+    }
+    if (!bq_telem_args.group->count && !bq_telem_args.port->count && !bq_telem_args.ttl->count)
+    {
+        return 0;
+    }
+
+    xSemaphoreTake(s_mcast.lock, portMAX_DELAY);
+    s_mcast.dest = dest;
+    s_mcast.ttl = ttl;
+    if (s_mcast.sock >= 0)
+    {
+        bq_telem_mcast_open();
+    }
+    xSemaphoreGive(s_mcast.lock);
+    return 1;
+}
+
+static int cmd_bq_telem(int argc, char **argv)
+{
+    int nerrors = arg_parse(argc, argv, (void **)&bq_telem_args);
+    if (nerrors != 0)
+    {
+        arg_print_errors(stderr, bq_telem_args.end, argv[0]);
+        return 1;
+    }
+
+    if (bq_telem_args.flush->count)
+    {
+        int ms = bq_telem_args.flush->ival[0];
+        if (ms < 1 || ms > BQ_TELEM_MAX_FLUSH_MS)
+        {
+            printf("Flush time must be 1..%d ms\n", BQ_TELEM_MAX_FLUSH_MS);
+            return 1;
+        }
+        atomic_store(&s_flush_ms, (uint32_t)ms);
+    }
+    int changed = bq_telem_mcast_config();
+    if (changed < 0)
+    {
+        return 1;
+    }
+    for (int i = 0; i < bq_telem_args.off->count; i++)
+    {
+        int id = bq_telem_find(bq_telem_args.off->sval[i]);
+        if (id < 0)
+        {
+            return 1;
+        }
+        bq_telem_enable(id, false);
+        changed = 1;
+    }
+    for (int i = 0; i < bq_telem_args.on->count; i++)
+    {
+        int id = bq_telem_find(bq_telem_args.on->sval[i]);
+        if (id < 0)
+        {
+            return 1;
+        }
+        esp_err_t err = bq_telem_enable(id, true);
+        if (err != ESP_OK)
+        {
+            printf("%s: %s\n", s_outputs[id].name, esp_err_to_name(err));
+            return 1;
+        }
+        changed = 1;
+    }
+
+    if (changed)
+    {
+        bq_telem_save();
+    }
+    bq_telem_print();
+    return 0;
+}
+
+void bq_telem_start(void)
+{
+    s_queue = xQueueCreate(BQ_TELEM_QUEUE_LEN, sizeof(bq_telem_item_t));
+    if (!s_queue || bq_poll_add_sink(bq_telem_on_sample, NULL) || bq_poll_add_attach_sink(bq_telem_on_attach, NULL))
+    {
+        ESP_LOGE(TAG, "No queue or free poller sink");
+        return;
+    }
+    s_mcast.lock = xSemaphoreCreateMutex();
+    bq_telem_load();
+#if BQ_TELEM_HAVE_USB
+    /* before bq_telem_restore() switches USB output back on */
+    s_usb_log_prev = esp_log_set_vprintf(bq_telem_usb_log);
+    bq_telem_add_output("usb", bq_telem_usb_write, bq_telem_usb_switch, NULL);
+#endif
+    bq_telem_add_output("mcast", bq_telem_mcast_write, bq_telem_mcast_switch, NULL);
+    bq_telem_stream_start();
+    bq_telem_restore();
+    /* the poller has not started, so this is the first frame; dropped if no output is on */
+    bq_telem_event(NULL, BQ_TELEM_NO_PACK, BQ_TELEM_EV_BOOT, "restart, frames from %" PRIu32, s_boot_seq);
+    xTaskCreate(bq_telem_task, "bq_telem", BQ_TELEM_TASK_STACK, NULL, BQ_TELEM_TASK_PRIO, NULL);
+
+    bq_telem_args.on = arg_strn(NULL, "on", "<output>", 0, BQ_TELEM_MAX_OUTPUTS, "Start streaming to an output (usb, mcast, tcp)");
+    bq_telem_args.off = arg_strn(NULL, "off", "<output>", 0, BQ_TELEM_MAX_OUTPUTS, "Stop streaming to an output");
+    bq_telem_args.flush = arg_int0("f", "flush", "<ms>", "Send a frame once its oldest sample waited this long (default 50)");
+    bq_telem_args.group = arg_str0("g", "group", "<ip>", "mcast: group address (default 239.255.66.1)");
+    bq_telem_args.port = arg_int0("p", "port", "<port>", "mcast: UDP port (default 5566)");
+    bq_telem_args.ttl = arg_int0(NULL, "ttl", "<hops>", "mcast: TTL, 1 keeps it on the local network (default 1)");
+    bq_telem_args.end = arg_end(7);
+
+    const esp_console_cmd_t telem_cmd = {
+        .command = "bq_telem",
+        .help = "Binary sample and event stream (COBS frames with CRC) to the USB-Serial-JTAG port, a UDP "
+                "multicast group or a resumable TCP stream",
+        .hint = NULL,
+        .func = &cmd_bq_telem,
+        .argtable = &bq_telem_args,
+    };
+    ESP_ERROR_CHECK(esp_console_cmd_register(&telem_cmd));
+}
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "bq_poll.h"
+
+// ──────────────────────────────────────────────────────────────────────────────
+//  Binary sample stream
+// ──────────────────────────────────────────────────────────────────────────────
+/**
+ * Poller samples are batched into frames and encoded once; every enabled
+ * output (USB-Serial-JTAG, network streams) gets the same bytes. Pack
+ * attach/detach and anomalies go out as event frames in the same stream.
+ *
+ * On the wire a frame is
+ *
+ *     0x00  COBS( bq_telem_hdr_t  payload  CRC-32 )  0x00
+ *
+ * COBS removes all zero bytes from the frame, so a reader resynchronizes on
+ * the next 0x00 no matter what came before (console text, a frame cut short
+ * by a full buffer). The CRC is the usual CRC-32 (zlib, esp_rom_crc32_le with
+ * seed 0) over header and payload. All fields are little-endian.
+ *
+ * Frame sequence numbers keep increasing across restarts, so (seq, record
+ * index) names every sample and event once. At a restart they jump ahead to
+ * the next block reserved in NVS; the first frame after a restart is a
+ * BQ_TELEM_EV_BOOT event, and a gap that ends at it is that jump, not loss.
+ *
+ * `tools/telem.py` decodes the stream on the host.
+ */
+
+#define BQ_TELEM_VERSION 1
+/// Records per frame at most
+#define BQ_TELEM_MAX_RECORDS 16
+#define BQ_TELEM_MAX_OUTPUTS 4
+
+/// Frame types
+enum
+{
+    BQ_TELEM_SAMPLES = 1, ///< payload: `count` bq_telem_sample_t
+    BQ_TELEM_EVENTS = 2,  ///< payload: `count` bq_telem_event_t
+};
+
+/// Event kinds
+enum
+{
+    BQ_TELEM_EV_ATTACH = 1, ///< text: serial number and capacity
+    BQ_TELEM_EV_DETACH = 2,
+    BQ_TELEM_EV_ANOMALY = 3, ///< text: signal, kind and score, see bq_anomaly
+    BQ_TELEM_EV_BOOT = 4,    ///< first frame after a restart, pack BQ_TELEM_NO_PACK
+};
+
+/// `pack` of events that concern no pack
+#define BQ_TELEM_NO_PACK 0xFF
+
+#define BQ_TELEM_EVENT_TEXT 30
+
+typedef struct __attribute__((packed))
+{
+    uint8_t version; ///< BQ_TELEM_VERSION
+    uint8_t type;    ///< BQ_TELEM_SAMPLES, ...
+    uint16_t count;  ///< records in the payload
+    uint32_t seq;    ///< frame sequence number, +1 per frame; gaps are lost frames
+} bq_telem_hdr_t;
+
+/// One bq_sample_t on the wire
+typedef struct __attribute__((packed))
+{
+    int64_t mono_us;
+    int64_t wall_us; ///< 0 until the wall clock is synced
+    uint8_t pack;
+    uint8_t rsoc;
+    uint16_t voltage_mv;
+    int16_t current_ma;
+    uint16_t temp_dk;
+    uint16_t cell_mv[BQ_POLL_CELLS];
+    uint16_t battery_status;
+    uint32_t operation_status;
+    uint32_t safety_alert;
+    uint32_t safety_status;
+} bq_telem_sample_t;
+
+typedef struct __attribute__((packed))
+{
+    int64_t mono_us;
+    int64_t wall_us;
+    uint8_t pack;
+    uint8_t kind; ///< BQ_TELEM_EV_*
+    char text[BQ_TELEM_EVENT_TEXT]; ///< NUL padded
+} bq_telem_event_t;
+
+/// Worst case COBS output for `len` input bytes
+#define BQ_TELEM_COBS_MAX(len) ((len) + (len) / 254 + 1)
+/// Worst case encoded frame for a `len` byte payload, delimiters included
+#define BQ_TELEM_FRAME_MAX(len) (2 + BQ_TELEM_COBS_MAX(sizeof(bq_telem_hdr_t) + (len) + 4))
+
+/// Write one encoded frame; 0 when it went out whole
+typedef int (*bq_telem_write_t)(uint32_t seq, const uint8_t *frame, size_t len, void *ctx);
+/// Called before an output is switched on and after it is switched off; an error keeps it off
+typedef esp_err_t (*bq_telem_switch_t)(bool on, void *ctx);
+
+size_t bq_telem_cobs(const uint8_t *in, size_t len, uint8_t *out);
+/// Encode a frame into `out` (BQ_TELEM_FRAME_MAX(len) bytes), returns its length
+size_t bq_telem_encode(uint8_t type, uint32_t seq, uint16_t count, const void *payload, size_t len, uint8_t *out);
+
+/// Register an output, disabled at first; `on_switch` may be NULL. Returns its id or -1.
+int bq_telem_add_output(const char *name, bq_telem_write_t fn, bq_telem_switch_t on_switch, void *ctx);
+esp_err_t bq_telem_enable(int id, bool on);
+/// Sequence number of the next frame
+uint32_t bq_telem_seq(void);
+/// Sequence number of the first frame since the restart, the BQ_TELEM_EV_BOOT event
+uint32_t bq_telem_boot_seq(void);
+
+/// Queue an event for the stream without waiting; dropped while no output is on. `ts` NULL = now.
+void bq_telem_event(const tb_stamp_t *ts, uint8_t pack, uint8_t kind, const char *fmt, ...)
+    __attribute__((format(printf, 4, 5)));
+
+void bq_telem_start(void);
@@ -0,0 +1,631 @@
+// bq_telem_stream.c – resumable TCP output of the telemetry stream
+//
+// Every frame goes into a RAM ring of (seq, length, frame) entries; the
+// sender task copies what the client has not got out of the ring and
+// sends it, so replayed and live frames leave in one ordered byte stream.
+//
+// When the ring makes room it looks at the frame it drops: one the client
+// (connected or gone) still needs goes to a spill buffer, and full spill
+// buffers are appended to the "telem" partition as one flog record. A
+// client behind the ring is served from flash first. Frames a client
+// already got are never written, so flash only wears while a client is
+// away or slower than the stream.
+//
+// Frame numbers jump ahead at a restart (bq_telem.h). The first frame the
+// stream keeps after a restart is flagged, and a gap ending at it is not
+// counted as lost.
+//
+// Locks: the ring lock is taken before the flog lock (the telemetry task
+// spills while holding the ring), so the flash replay, which runs inside
+// flog_scan(), must not take the ring lock. A replay holds the flog lock
+// while it sends; should the spill buffer fill in that time the telemetry
+// task waits and the sample queue takes up the slack.
+//
+// SPDX-License-Identifier: MIT
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <sys/param.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "sdkconfig.h"
+#if CONFIG_IDF_TARGET_LINUX
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#else
+#include "lwip/sockets.h"
+#endif
+#include "flog.h"
+#include "bq_telem.h"
+#include "bq_telem_stream.h"
+
+// ──────────────────────────────────────────────────────────────────────────────
+//  Configuration
+// ──────────────────────────────────────────────────────────────────────────────
+
+static const char *TAG = "bq_stream";
+
+/// RAM replay ring, allocated while the output is on
+#define BQ_STREAM_RING (16 * 1024)
+#define BQ_STREAM_PARTITION "telem"
+/// All records share one key
+#define BQ_STREAM_INDEX_SLOTS 4
+#define BQ_STREAM_KEY 0x4D4C4554 ///< "TELM"
+/// Frames per send
+#define BQ_STREAM_CHUNK 2048
+#define BQ_STREAM_HELLO_MS 500
+#define BQ_STREAM_SEND_TIMEOUT_MS 5000
+/// Check for a closed connection this often while there is nothing to send
+#define BQ_STREAM_IDLE_MS 1000
+#define BQ_STREAM_TASK_STACK 4096
+/// Below the telemetry task, a replay must not hold up the live stream
+#define BQ_STREAM_TASK_PRIO 2
+
+/// Ring and flash records hold frames behind this header
+typedef struct __attribute__((packed))
+{
+    uint32_t seq;
+    uint16_t len;
+    uint8_t flags; ///< BQ_STREAM_BOOT
+} bq_stream_entry_t;
+
+/// First frame kept since the restart; the numbers below it were never used
+#define BQ_STREAM_BOOT 0x01
+
+_Static_assert(BQ_TELEM_FRAME_MAX(BQ_TELEM_MAX_RECORDS * sizeof(bq_telem_sample_t)) <= BQ_STREAM_CHUNK,
+               "a frame must fit one send");
+
+/// Everything here changes under the lock
+static struct
+{
+    SemaphoreHandle_t lock;
+    uint8_t *ring;       ///< NULL while the output is off
+    size_t tail;         ///< offset of the oldest entry
+    size_t used;
+    uint32_t oldest;     ///< seq of the oldest entry, == end when empty
+    uint32_t end;        ///< seq after the newest entry
+    uint32_t next;       ///< first frame the client has not got
+    bool resumable;      ///< a client came since the output went on, keep what it misses
+    bool connected;
+    uint8_t *spill;      ///< evicted entries on their way to flash
+    size_t spill_len;
+    uint32_t spill_frames;
+    uint32_t sessions;
+    uint32_t spilled;    ///< frames written to flash
+    uint32_t replayed;   ///< frames sent from flash
+    uint32_t lost;       ///< frames a client asked for that were gone
+    bool booted;         ///< a frame was kept since the restart
+    uint32_t boot_seq;   ///< and this was the first one
+} s_stream;
+
+static flog_t s_log;
+static bool s_log_ok;
+static uint16_t s_spill_max;
+static TaskHandle_t s_task;
+
+// ──────────────────────────────────────────────────────────────────────────────
+//  Ring (lock held)
+// ──────────────────────────────────────────────────────────────────────────────
+
+static void bq_stream_read(size_t off, void *dst, size_t len)
+{
+    off %= BQ_STREAM_RING;
+    size_t first = MIN(len, BQ_STREAM_RING - off);
+    memcpy(dst, &s_stream.ring[off], first);
+    memcpy((uint8_t *)dst + first, s_stream.ring, len - first);
+}
+
+static void bq_stream_put(size_t off, const void *src, size_t len)
+{
+    off %= BQ_STREAM_RING;
+    size_t first = MIN(len, BQ_STREAM_RING - off);
+    memcpy(&s_stream.ring[off], src, first);
+    memcpy(s_stream.ring, (const uint8_t *)src + first, len - first);
+}
+
+static void bq_stream_spill_flush(void)
+{
+    if (!s_stream.spill_len)
+    {
+        return;
+    }
+    esp_err_t err = flog_append(&s_log, BQ_STREAM_KEY, s_stream.spill, (uint16_t)s_stream.spill_len);
+    if (err == ESP_OK)
+    {
+        s_stream.spilled += s_stream.spill_frames;
+    }
+    else
+    {
+        ESP_LOGW(TAG, "Spilling %" PRIu32 " frames: %s", s_stream.spill_frames, esp_err_to_name(err));
+    }
+    s_stream.spill_len = 0;
+    s_stream.spill_frames = 0;
+}
+
+static void bq_stream_evict(void)
+{
+    bq_stream_entry_t e;
+    bq_stream_read(s_stream.tail, &e, sizeof(e));
+    size_t n = sizeof(e) + e.len;
+
+    if (s_stream.resumable && s_stream.spill && (int32_t)(e.seq - s_stream.next) >= 0)
+    {
+        if (s_stream.spill_len + n > s_spill_max)
+        {
+            bq_stream_spill_flush();
+        }
+        bq_stream_read(s_stream.tail, &s_stream.spill[s_stream.spill_len], n);
+        s_stream.spill_len += n;
+        s_stream.spill_frames++;
+    }
+    s_stream.tail = (s_stream.tail + n) % BQ_STREAM_RING;
+    s_stream.used -= n;
+    s_stream.oldest = e.seq + 1;
+}
+
+/* Copy the frames from s_stream.next on into `buf`; returns the bytes, `last` the seq of the last one */
+static size_t bq_stream_collect(uint8_t *buf, size_t max, uint32_t *last)
+{
+    size_t off = s_stream.tail;
+    size_t n = 0;
+
+    for (size_t done = 0; done < s_stream.used;)
+    {
+        bq_stream_entry_t e;
+        bq_stream_read(off, &e, sizeof(e));
+        if ((int32_t)(e.seq - s_stream.next) >= 0)
+        {
+            if (n + e.len > max)
+            {
+                break;
+            }
+            bq_stream_read(off + sizeof(e), &buf[n], e.len);
+            n += e.len;
+            *last = e.seq;
+        }
+        off = (off + sizeof(e) + e.len) % BQ_STREAM_RING;
+        done += sizeof(e) + e.len;
+    }
+    return n;
+}
+
+// ──────────────────────────────────────────────────────────────────────────────
+//  Output
+// ──────────────────────────────────────────────────────────────────────────────
+
+/* Runs in the telemetry task: keep the frame and wake the sender */
+static int bq_stream_write(uint32_t seq, const uint8_t *frame, size_t len, void *ctx)
+{
+    (void)ctx;
+    bq_stream_entry_t e = {.seq = seq, .len = (uint16_t)len};
+
+    xSemaphoreTake(s_stream.lock, portMAX_DELAY);
+    if (!s_stream.ring)
+    {
+        xSemaphoreGive(s_stream.lock);
+        return ESP_FAIL;
+    }
+    if (!s_stream.booted)
+    {
+        s_stream.booted = true;
+        s_stream.boot_seq = seq;
+        e.flags = BQ_STREAM_BOOT;
+    }
+    if (seq != s_stream.end)
+    {
+        /* only when switched on while a frame was going out */
+        s_stream.tail = 0;
+        s_stream.used = 0;
+        s_stream.oldest = seq;
+    }
+    while (BQ_STREAM_RING - s_stream.used < sizeof(e) + len)
+    {
+        bq_stream_evict();
+    }
+    size_t head = s_stream.tail + s_stream.used;
+    bq_stream_put(head, &e, sizeof(e));
+    bq_stream_put(head + sizeof(e), frame, len);
+    s_stream.used += sizeof(e) + len;
+    s_stream.end = seq + 1;
+    xSemaphoreGive(s_stream.lock);
+
+    xTaskNotifyGive(s_task);
+    return ESP_OK;
+}
+
+static esp_err_t bq_stream_switch(bool on, void *ctx)
+{
+    (void)ctx;
+    uint8_t *ring = NULL;
+    uint8_t *spill = NULL;
+
+    if (on)
+    {
+        ring = malloc(BQ_STREAM_RING);
+        spill = s_log_ok ? malloc(s_spill_max) : NULL;
+        if (!ring || (s_log_ok && !spill))
+        {
+            free(ring);
+            free(spill);
+            return ESP_ERR_NO_MEM;
+        }
+    }
+
+    xSemaphoreTake(s_stream.lock, portMAX_DELAY);
+    bq_stream_spill_flush();
+    free(s_stream.ring);
+    free(s_stream.spill);
+    s_stream.ring = ring;
+    s_stream.spill = spill;
+    s_stream.tail = 0;
+    s_stream.used = 0;
+    s_stream.oldest = s_stream.end = s_stream.next = bq_telem_seq();
+    s_stream.resumable = false;
+    xSemaphoreGive(s_stream.lock);
+
+    /* switched off: the sender drops its client */
+    xTaskNotifyGive(s_task);
+    return ESP_OK;
+}
+
+// ──────────────────────────────────────────────────────────────────────────────
+//  Sender
+// ──────────────────────────────────────────────────────────────────────────────
+
+typedef struct
+{
+    int sock;
+    uint8_t *buf;   ///< BQ_STREAM_CHUNK
+    size_t len;
+    uint32_t next;  ///< first frame still to send
+    uint32_t until; ///< the ring holds this one and later
+    uint32_t sent;
+    uint32_t lost;
+    bool failed;
+} bq_stream_replay_t;
+
+static bool bq_stream_send(int sock, const uint8_t *buf, size_t len)
+{
+    for (size_t off = 0; off < len;)
+    {
+        int n = send(sock, &buf[off], len - off, 0);
+        if (n <= 0)
+        {
+            return false;
+        }
+        off += (size_t)n;
+    }
+    return true;
+}
+
+/* flog visitor, flog lock held: send the record's frames the client needs */
+static bool bq_stream_replay_record(uint32_t key, uint32_t seq, const void *data, uint16_t len, void *ctx)
+{
+    (void)seq;
+    bq_stream_replay_t *r = ctx;
+    const uint8_t *p = data;
+
+    if (key != BQ_STREAM_KEY)
+    {
+        return true;
+    }
+    for (size_t off = 0; off + sizeof(bq_stream_entry_t) <= len;)
+    {
+        bq_stream_entry_t e;
+        memcpy(&e, &p[off], sizeof(e));
+        off += sizeof(e);
+        if (off + e.len > len)
+        {
+            break;
+        }
+        if ((int32_t)(e.seq - r->next) >= 0 && (int32_t)(e.seq - r->until) < 0)
+        {
+            if (r->len + e.len > BQ_STREAM_CHUNK)
+            {
+                if (!bq_stream_send(r->sock, r->buf, r->len))
+                {
+                    r->failed = true;
+                    return false;
+                }
+                r->len = 0;
+            }
+            memcpy(&r->buf[r->len], &p[off], e.len);
+            r->len += e.len;
+            if (!(e.flags & BQ_STREAM_BOOT))
+            {
+                r->lost += e.seq - r->next;
+            }
+            r->next = e.seq + 1;
+            r->sent++;
+        }
+        off += e.len;
+    }
+    return true;
+}
+
+/*
+ * The client is behind the ring: send what flash has, then skip to the ring.
+ * The ring keeps turning over while a pass sends, and what it drops then is
+ * spilled, so passes repeat from where the last one stopped; only a pass
+ * that finds nothing leaves frames to count as gone.
+ */
+static bool bq_stream_replay(int sock, uint8_t *buf)
+{
+    bq_stream_replay_t r = {.sock = sock, .buf = buf};
+    uint8_t *rec = s_log_ok ? malloc(s_spill_max) : NULL;
+    bool progress = rec != NULL;
+
+    while (progress && !r.failed)
+    {
+        uint32_t sent = r.sent;
+
+        xSemaphoreTake(s_stream.lock, portMAX_DELAY);
+        bq_stream_spill_flush();
+        r.next = s_stream.next;
+        r.until = s_stream.oldest;
+        xSemaphoreGive(s_stream.lock);
+        if ((int32_t)(r.next - r.until) >= 0)
+        {
+            break;
+        }
+
+        flog_scan(&s_log, rec, s_spill_max, bq_stream_replay_record, &r);
+        if (!r.failed && r.len && !bq_stream_send(sock, buf, r.len))
+        {
+            r.failed = true;
+        }
+        r.len = 0;
+        progress = r.sent != sent;
+
+        xSemaphoreTake(s_stream.lock, portMAX_DELAY);
+        s_stream.next = r.next;
+        xSemaphoreGive(s_stream.lock);
+    }
+    free(rec);
+
+    xSemaphoreTake(s_stream.lock, portMAX_DELAY);
+    s_stream.replayed += r.sent;
+    s_stream.lost += r.lost;
+    if (!r.failed && (int32_t)(s_stream.next - s_stream.oldest) < 0)
+    {
+        uint32_t from = s_stream.next;
+        if (s_stream.booted && (int32_t)(s_stream.boot_seq - from) > 0 &&
+            (int32_t)(s_stream.boot_seq - s_stream.oldest) <= 0)
+        {
+            /* numbers skipped at the restart */
+            from = s_stream.boot_seq;
+        }
+        s_stream.lost += s_stream.oldest - from;
+        r.lost += s_stream.oldest - from;
+        s_stream.next = s_stream.oldest;
+    }
+    xSemaphoreGive(s_stream.lock);
+    if (r.sent || r.lost)
+    {
+        ESP_LOGI(TAG, "Replayed %" PRIu32 " frames from flash, %" PRIu32 " gone", r.sent, r.lost);
+    }
+    return !r.failed;
+}
+
+/* Read the optional "resume <seq>" line */
+static bool bq_stream_hello(int sock, uint32_t *seq)
+{
+    struct timeval tv = {.tv_sec = 0, .tv_usec = BQ_STREAM_HELLO_MS * 1000};
+    char line[32];
+    size_t len = 0;
+
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    while (len < sizeof(line) - 1 && recv(sock, &line[len], 1, 0) == 1 && line[len] != '\n')
+    {
+        len++;
+    }
+    line[len] = '\0';
+    return sscanf(line, "resume %" SCNu32, seq) == 1;
+}
+
+/* Whether the client hung up; anything it sends after the hello is ignored */
+static bool bq_stream_closed(int sock)
+{
+    uint8_t buf[32];
+    int n = recv(sock, buf, sizeof(buf), MSG_DONTWAIT);
+    return n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK);
+}
+
+static void bq_stream_serve(int sock, uint8_t *buf)
+{
+    struct timeval tv = {.tv_sec = BQ_STREAM_SEND_TIMEOUT_MS / 1000};
+    uint32_t resume = 0;
+    bool resumed = bq_stream_hello(sock, &resume);
+
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    xSemaphoreTake(s_stream.lock, portMAX_DELAY);
+    if (!s_stream.ring)
+    {
+        xSemaphoreGive(s_stream.lock);
+        return;
+    }
+    /* a number from the future (the device's NVS was erased) starts live */
+    s_stream.next = s_stream.end;
+    if (resumed && (int32_t)(resume + 1 - s_stream.end) < 0)
+    {
+        s_stream.next = resume + 1;
+    }
+    s_stream.resumable = true;
+    s_stream.connected = true;
+    s_stream.sessions++;
+    uint32_t from = s_stream.next;
+    xSemaphoreGive(s_stream.lock);
+    ESP_LOGI(TAG, "Client connected, from frame %" PRIu32 "%s", from, resumed ? "" : " (live)");
+
+    for (;;)
+    {
+        uint32_t last = 0;
+        size_t n = 0;
+        bool behind = false;
+
+        xSemaphoreTake(s_stream.lock, portMAX_DELAY);
+        if (!s_stream.ring)
+        {
+            xSemaphoreGive(s_stream.lock);
+            break;
+        }
+        behind = (int32_t)(s_stream.next - s_stream.oldest) < 0;
+        if (!behind)
+        {
+            n = bq_stream_collect(buf, BQ_STREAM_CHUNK, &last);
+        }
+        xSemaphoreGive(s_stream.lock);
+
+        if (behind)
+        {
+            if (!bq_stream_replay(sock, buf))
+            {
+                break;
+            }
+            continue;
+        }
+        if (n)
+        {
+            if (!bq_stream_send(sock, buf, n))
+            {
+                break;
+            }
+            xSemaphoreTake(s_stream.lock, portMAX_DELAY);
+            s_stream.next = last + 1;
+            xSemaphoreGive(s_stream.lock);
+            continue;
+        }
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(BQ_STREAM_IDLE_MS));
+        if (bq_stream_closed(sock))
+        {
+            break;
+        }
+    }
+
+    xSemaphoreTake(s_stream.lock, portMAX_DELAY);
+    s_stream.connected = false;
+    from = s_stream.next;
+    xSemaphoreGive(s_stream.lock);
+    ESP_LOGI(TAG, "Client gone, keeping frames from %" PRIu32, from);
+}
+
+static int bq_stream_listen(void)
+{
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(BQ_TELEM_STREAM_PORT),
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+    };
+    int opt = 1;
+    int sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+
+    if (sock < 0)
+    {
+        return -1;
+    }
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(sock, 1) != 0)
+    {
+        ESP_LOGE(TAG, "Port %d: errno %d", BQ_TELEM_STREAM_PORT, errno);
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+static void bq_stream_task(void *arg)
+{
+    (void)arg;
+    uint8_t *buf = malloc(BQ_STREAM_CHUNK);
+    int lsock = -1;
+
+    if (!buf)
+    {
+        ESP_LOGE(TAG, "No memory");
+        vTaskDelete(NULL);
+        return;
+    }
+    for (;;)
+    {
+        if (lsock < 0 && (lsock = bq_stream_listen()) < 0)
+        {
+            vTaskDelay(pdMS_TO_TICKS(BQ_STREAM_IDLE_MS));
+            continue;
+        }
+        int sock = accept(lsock, NULL, NULL);
+        if (sock < 0)
+        {
+            close(lsock);
+            lsock = -1;
+            continue;
+        }
+        bq_stream_serve(sock, buf);
+        close(sock);
+    }
+}
+
+// ──────────────────────────────────────────────────────────────────────────────
+//  Status
+// ──────────────────────────────────────────────────────────────────────────────
+
+void bq_telem_stream_print(void)
+{
+    if (!s_stream.lock)
+    {
+        return;
+    }
+    xSemaphoreTake(s_stream.lock, portMAX_DELAY);
+    bool on = s_stream.ring != NULL;
+    bool connected = s_stream.connected;
+    uint32_t oldest = s_stream.oldest;
+    uint32_t end = s_stream.end;
+    uint32_t next = s_stream.next;
+    size_t used = s_stream.used;
+    uint32_t sessions = s_stream.sessions;
+    uint32_t spilled = s_stream.spilled;
+    uint32_t pending = s_stream.spill_frames;
+    uint32_t replayed = s_stream.replayed;
+    uint32_t lost = s_stream.lost;
+    xSemaphoreGive(s_stream.lock);
+
+    printf("%-20s: port %d, %s, %" PRIu32 " sessions\n", "TCP stream", BQ_TELEM_STREAM_PORT,
+           !on ? "off" : connected ? "client connected" : "no client", sessions);
+    if (on)
+    {
+        printf("%-20s: frames %" PRIu32 "..%" PRIu32 ", %u of %u bytes; client at %" PRIu32 "\n", "Replay buffer",
+               oldest, end - 1, (unsigned)used, BQ_STREAM_RING, next);
+    }
+    if (s_log_ok)
+    {
+        printf("%-20s: %" PRIu32 " frames spilled, %" PRIu32 " pending, %" PRIu32 " replayed, %" PRIu32 " gone\n",
+               "Flash '" BQ_STREAM_PARTITION "'", spilled, pending, replayed, lost);
+    }
+    else
+    {
+        printf("%-20s: partition '%s' not available, %" PRIu32 " frames gone\n", "Flash", BQ_STREAM_PARTITION, lost);
+    }
+}
+
+void bq_telem_stream_start(void)
+{
+    s_stream.lock = xSemaphoreCreateMutex();
+    s_log_ok = flog_open(&s_log, BQ_STREAM_PARTITION, BQ_STREAM_INDEX_SLOTS) == ESP_OK;
+    if (s_log_ok)
+    {
+        s_spill_max = (uint16_t)MIN(flog_max_record(&s_log), UINT16_MAX);
+    }
+    if (!s_stream.lock ||
+        xTaskCreate(bq_stream_task, "bq_stream", BQ_STREAM_TASK_STACK, NULL, BQ_STREAM_TASK_PRIO, &s_task) != pdPASS)
+    {
+        ESP_LOGE(TAG, "No memory");
+        return;
+    }
+    bq_telem_add_output("tcp", bq_stream_write, bq_stream_switch, NULL);
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+// ──────────────────────────────────────────────────────────────────────────────
+//  Resumable telemetry stream
+// ──────────────────────────────────────────────────────────────────────────────
+/**
+ * The "tcp" output of bq_telem: the frame stream over a TCP connection on
+ * BQ_TELEM_STREAM_PORT, one client at a time.
+ *
+ * Within half a second of connecting the client may send
+ *
+ *     resume <seq>\n
+ *
+ * with the sequence number of the last frame it holds. It then gets every
+ * later frame still kept, back to back, followed by the live stream; without
+ * the line it starts with the next live frame. Frames are kept in a RAM ring
+ * and, once a client has been served, frames it has not got yet are spilled
+ * to the "telem" partition before they leave the ring, so a client that is
+ * away for hours catches up without gaps.
+ */
+
+#define BQ_TELEM_STREAM_PORT 5567
+
+/// Registers the "tcp" output and starts the server; called by bq_telem_start()
+void bq_telem_stream_start(void);
+void bq_telem_stream_print(void);
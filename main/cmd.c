@@ -5,10 +5,16 @@
 #include "esp_system.h"
 #include "esp_log.h"
 #include "esp_console.h"
+#include "sdkconfig.h"
 
+#if CONFIG_IDF_TARGET_LINUX
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#else
 #include "cmd_system.h"
 #include "cmd_wifi.h"
 #include "cmd_nvs.h"
+#endif
 
 
 #define PROMPT_STR CONFIG_IDF_TARGET
@@ -20,6 +26,63 @@
  * hence not very useful for interactive console applications. If you encounter this warning, consider disabling
  * the secondary serial console in menuconfig unless you know what you are doing.
  */
+#if CONFIG_IDF_TARGET_LINUX
+#define CMD_STDIN_TASK_STACK 8192
+#define CMD_STDIN_TASK_PRIO 2
+
+/*
+ * Native build: commands are read line by line from stdin (a terminal, a
+ * pipe or a script); the system / wifi / nvs commands need the ESP32.
+ */
+static void cmd_stdin_task(void *arg)
+{
+    (void)arg;
+    char line[CONSOLE_MAX_COMMAND_LINE_LENGTH];
+
+    for (;;)
+    {
+        printf(PROMPT_STR "> ");
+        fflush(stdout);
+        if (!fgets(line, sizeof(line), stdin))
+        {
+            /* end of input: keep serving telnet */
+            break;
+        }
+        line[strcspn(line, "\r\n")] = '\0';
+        if (!line[0])
+        {
+            continue;
+        }
+
+        int ret;
+        esp_err_t err = esp_console_run(line, &ret);
+        if (err == ESP_ERR_NOT_FOUND)
+        {
+            printf("Unrecognized command\n");
+        }
+        else if (err == ESP_OK && ret != ESP_OK)
+        {
+            printf("Command returned non-zero error code: 0x%x (%s)\n", ret, esp_err_to_name(ret));
+        }
+        else if (err != ESP_OK && err != ESP_ERR_INVALID_ARG)
+        {
+            printf("Internal error: %s\n", esp_err_to_name(err));
+        }
+    }
+    vTaskDelete(NULL);
+}
+
+void cmd_start()
+{
+    esp_console_config_t console_config = ESP_CONSOLE_CONFIG_DEFAULT();
+
+    console_config.max_cmdline_length = CONSOLE_MAX_COMMAND_LINE_LENGTH;
+    ESP_ERROR_CHECK(esp_console_init(&console_config));
+    esp_console_register_help_command();
+    xTaskCreate(cmd_stdin_task, "console", CMD_STDIN_TASK_STACK, NULL, CMD_STDIN_TASK_PRIO, NULL);
+}
+#else
+
 #if SOC_USB_SERIAL_JTAG_SUPPORTED
 #if !CONFIG_ESP_CONSOLE_SECONDARY_NONE
 #warning "A secondary serial console is not useful when using the console component. Please disable it in menuconfig."
@@ -60,3 +123,4 @@ void cmd_start()
 
     ESP_ERROR_CHECK(esp_console_start_repl(repl));
 }
+#endif
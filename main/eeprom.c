@@ -0,0 +1,659 @@
+/* eeprom.c - 24Cxx I2C EEPROM dump and programming commands, see eeprom.h */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <inttypes.h>
+#include <sys/param.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_console.h"
+#include "esp_partition.h"
+#include "argtable3/argtable3.h"
+
+#include "eeprom.h"
+#include "i2c.h"
+
+#define EEPROM_PARTITION "eeprom"
+#define EEPROM_MAX_PAGE 256
+#define EEPROM_CHUNK 256            /* read burst, ~23 ms at 100 kHz, well within the transfer timeout */
+#define EEPROM_WRITE_TIMEOUT_US 20000 /* tWR is 5 ms on most parts, 10 ms on old ones */
+#define EEPROM_MAX_HEX_ARGS 32
+
+static const char *TAG = "eeprom";
+
+typedef struct
+{
+    const char *name;
+    uint32_t size;
+    uint16_t page;
+    uint8_t addr_bytes;
+} eeprom_type_t;
+
+static const eeprom_type_t s_types[] = {
+    {"24c01", 128, 8, 1},
+    {"24c02", 256, 8, 1},
+    {"24c04", 512, 16, 1},
+    {"24c08", 1024, 16, 1},
+    {"24c16", 2048, 16, 1},
+    {"24c32", 4096, 32, 2},
+    {"24c64", 8192, 32, 2},
+    {"24c128", 16384, 64, 2},
+    {"24c256", 32768, 64, 2},
+    {"24c512", 65536, 128, 2},
+    {"24c1024", 131072, 256, 2},
+};
+
+/* Transfer statistics of the current command */
+static struct
+{
+    uint32_t pages;
+    uint32_t polls;
+    uint32_t cycle_max_us;
+    uint64_t cycle_sum_us;
+    uint64_t wire_bits;     /* bits clocked, incl. ACKs, START and STOP */
+} s_stats;
+
+/* Device address for `off`, and the memory address bytes into `hdr` */
+static uint8_t eeprom_header(const eeprom_t *ee, uint32_t off, uint8_t *hdr)
+{
+    if (ee->addr_bytes == 2)
+    {
+        hdr[0] = (uint8_t)(off >> 8);
+        hdr[1] = (uint8_t)off;
+    }
+    else
+    {
+        hdr[0] = (uint8_t)off;
+    }
+    return ee->addr | ((off >> (8 * ee->addr_bytes)) & 0x07);
+}
+
+/* Bytes from `off` up to the next change of the device address block bits */
+static uint32_t eeprom_block_left(const eeprom_t *ee, uint32_t off)
+{
+    uint32_t block = 1UL << (8 * ee->addr_bytes);
+    return block - (off & (block - 1));
+}
+
+/* Sequential read; bursts never cross a block, the part would wrap inside it */
+int eeprom_read(const eeprom_t *ee, uint32_t off, uint8_t *data, size_t len)
+{
+    uint8_t hdr[2];
+
+    while (len)
+    {
+        size_t n = MIN(MIN(len, EEPROM_CHUNK), eeprom_block_left(ee, off));
+        uint8_t dev = eeprom_header(ee, off, hdr);
+
+        int err = i2c_write_read(dev, hdr, ee->addr_bytes, data, n);
+        if (err)
+        {
+            ESP_LOGE(TAG, "Read at 0x%05" PRIX32 " failed (err=%d)", off, err);
+            return err;
+        }
+        s_stats.wire_bits += 9 * (1 + ee->addr_bytes) + 9 * (1 + n) + 3;
+        off += n;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Poll the part with address-only writes until it ACKs, i.e. the write cycle is over */
+static int eeprom_ack_poll(uint8_t dev)
+{
+    int64_t start = esp_timer_get_time();
+
+    for (;;)
+    {
+        s_stats.polls++;
+        s_stats.wire_bits += 9 + 2;
+        int err = i2c_probe(dev);
+        int64_t elapsed = esp_timer_get_time() - start;
+        if (!err)
+        {
+            s_stats.cycle_sum_us += elapsed;
+            s_stats.cycle_max_us = MAX(s_stats.cycle_max_us, (uint32_t)elapsed);
+            return 0;
+        }
+        if (elapsed > EEPROM_WRITE_TIMEOUT_US)
+        {
+            return ESP_ERR_TIMEOUT;
+        }
+    }
+}
+
+/* Page writes, each split at the page boundary and followed by ACK polling */
+int eeprom_write(const eeprom_t *ee, uint32_t off, const uint8_t *data, size_t len)
+{
+    uint8_t buf[2 + EEPROM_MAX_PAGE];
+
+    while (len)
+    {
+        size_t n = MIN(len, ee->page - off % ee->page);
+        uint8_t dev = eeprom_header(ee, off, buf);
+
+        memcpy(&buf[ee->addr_bytes], data, n);
+        int err = i2c_write(dev, buf, ee->addr_bytes + n);
+        if (!err)
+        {
+            s_stats.pages++;
+            s_stats.wire_bits += 9 * (1 + ee->addr_bytes + n) + 2;
+            err = eeprom_ack_poll(dev);
+        }
+        if (err)
+        {
+            ESP_LOGE(TAG, "Write at 0x%05" PRIX32 " failed (err=%d)", off, err);
+            return err;
+        }
+        off += n;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* ---- shared argument handling ---- */
+
+typedef struct
+{
+    struct arg_int *addr;
+    struct arg_str *type;
+    struct arg_int *size;
+    struct arg_int *width;
+    struct arg_int *page;
+    struct arg_int *khz;
+} eeprom_part_args_t;
+
+static void eeprom_part_args_init(eeprom_part_args_t *a)
+{
+    a->addr = arg_int1(NULL, NULL, "<addr>", "Device address (e.g. 0x50), block bits are added as needed");
+    a->type = arg_str0("t", "type", "<24cXX>", "Part type, 24c01 .. 24c1024");
+    a->size = arg_int0("s", "size", "<bytes>", "Part size, instead of -t");
+    a->width = arg_int0("w", "width", "<1|2>", "Address bytes (default: by size)");
+    a->page = arg_int0("p", "page", "<bytes>", "Page size (default: by type)");
+    a->khz = arg_int0(NULL, "khz", "<100..400>", "Bus clock while accessing the part (holds the bus)");
+}
+
+static int eeprom_part_from_args(const eeprom_part_args_t *a, eeprom_t *ee, uint32_t *hz)
+{
+    const eeprom_type_t *type = NULL;
+
+    memset(ee, 0, sizeof(*ee));
+    ee->addr = (uint8_t)a->addr->ival[0];
+    if (a->type->count)
+    {
+        for (int pos = 0; pos < sizeof(s_types) / sizeof(s_types[0]); pos++)
+        {
+            if (!strcasecmp(a->type->sval[0], s_types[pos].name))
+            {
+                type = &s_types[pos];
+            }
+        }
+        if (!type)
+        {
+            printf("Unknown part type '%s'\n", a->type->sval[0]);
+            return 1;
+        }
+    }
+    else if (a->size->count)
+    {
+        for (int pos = 0; pos < sizeof(s_types) / sizeof(s_types[0]); pos++)
+        {
+            if (s_types[pos].size == (uint32_t)a->size->ival[0])
+            {
+                type = &s_types[pos];
+            }
+        }
+        ee->size = (uint32_t)a->size->ival[0];
+    }
+    else
+    {
+        printf("Give the part type (-t 24c256) or size (-s 32768)\n");
+        return 1;
+    }
+
+    if (type)
+    {
+        ee->size = type->size;
+        ee->page = type->page;
+        ee->addr_bytes = type->addr_bytes;
+    }
+    if (a->width->count)
+    {
+        ee->addr_bytes = (uint8_t)a->width->ival[0];
+    }
+    if (a->page->count)
+    {
+        ee->page = (uint16_t)a->page->ival[0];
+    }
+    if (!ee->addr_bytes)
+    {
+        ee->addr_bytes = ee->size > 2048 ? 2 : 1;
+    }
+    if (!ee->page)
+    {
+        ee->page = 8;
+    }
+
+    if (ee->addr < 0x08 || ee->addr > 0x77 || ee->addr_bytes < 1 || ee->addr_bytes > 2 || !ee->size ||
+        ee->size > (0x08UL << (8 * ee->addr_bytes)) || ee->page > EEPROM_MAX_PAGE || (ee->page & (ee->page - 1)))
+    {
+        printf("Invalid part: addr 0x%02X, %" PRIu32 " bytes, %d address byte(s), %d byte pages\n", ee->addr,
+               ee->size, ee->addr_bytes, ee->page);
+        return 1;
+    }
+
+    /* below 100 kHz a full EEPROM_CHUNK read outlasts the transfer timeout */
+    if (a->khz->count && (a->khz->ival[0] < 100 || a->khz->ival[0] > 400))
+    {
+        printf("Bus clock must be 100..400 kHz\n");
+        return 1;
+    }
+    *hz = a->khz->count ? (uint32_t)a->khz->ival[0] * 1000 : I2C_SPEED_HZ;
+    return 0;
+}
+
+/* Take the bus at another clock for the whole command, the gauges only see it idle */
+static void eeprom_bus_begin(uint32_t hz)
+{
+    memset(&s_stats, 0, sizeof(s_stats));
+    if (hz != I2C_SPEED_HZ)
+    {
+        i2c_lock();
+        i2c_set_speed(hz);
+    }
+}
+
+static void eeprom_bus_end(uint32_t hz)
+{
+    if (hz != I2C_SPEED_HZ)
+    {
+        i2c_set_speed(0);
+        i2c_unlock();
+    }
+}
+
+static void eeprom_print_stats(uint32_t bytes, int64_t elapsed_us, uint32_t hz)
+{
+    uint32_t ms = (uint32_t)(elapsed_us / 1000);
+
+    printf("%" PRIu32 " bytes in %" PRIu32 " ms (%" PRIu32 " B/s), wire time %" PRIu32 " ms at %" PRIu32 " kHz\n",
+           bytes, ms, ms ? (uint32_t)(bytes * 1000ULL / ms) : bytes, (uint32_t)(s_stats.wire_bits * 1000 / hz),
+           hz / 1000);
+    if (s_stats.pages)
+    {
+        printf("%" PRIu32 " page writes, write cycle avg %" PRIu32 " us, max %" PRIu32 " us, %" PRIu32 " ACK polls\n",
+               s_stats.pages, (uint32_t)(s_stats.cycle_sum_us / s_stats.pages), s_stats.cycle_max_us, s_stats.polls);
+    }
+}
+
+static const esp_partition_t *eeprom_partition(void)
+{
+    const esp_partition_t *part =
+        esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, EEPROM_PARTITION);
+    if (!part)
+    {
+        printf("No '%s' partition, flash the partition table\n", EEPROM_PARTITION);
+    }
+    return part;
+}
+
+/* ---- eeprom_dump ---- */
+
+static struct
+{
+    eeprom_part_args_t part;
+    struct arg_int *offset;
+    struct arg_int *len;
+    struct arg_lit *save;
+    struct arg_lit *quiet;
+    struct arg_end *end;
+} eeprom_dump_args;
+
+static void eeprom_print_lines(uint32_t off, const uint8_t *data, size_t len)
+{
+    for (size_t line = 0; line < len; line += 16)
+    {
+        size_t n = MIN(16, len - line);
+
+        printf("%05" PRIX32 ": ", (uint32_t)(off + line));
+        for (size_t pos = 0; pos < 16; pos++)
+        {
+            if (pos < n)
+            {
+                printf("%02X ", data[line + pos]);
+            }
+            else
+            {
+                printf("   ");
+            }
+        }
+        printf("|");
+        for (size_t pos = 0; pos < n; pos++)
+        {
+            uint8_t c = data[line + pos];
+            putchar((c < 0x20 || c >= 0x7F) ? '.' : c);
+        }
+        printf("|\n");
+    }
+}
+
+static int cmd_eeprom_dump(int argc, char **argv)
+{
+    int nerrors = arg_parse(argc, argv, (void **)&eeprom_dump_args);
+    if (nerrors != 0)
+    {
+        arg_print_errors(stderr, eeprom_dump_args.end, argv[0]);
+        return 1;
+    }
+
+    eeprom_t ee;
+    uint32_t hz;
+    if (eeprom_part_from_args(&eeprom_dump_args.part, &ee, &hz))
+    {
+        return 1;
+    }
+    uint32_t off = eeprom_dump_args.offset->count ? (uint32_t)eeprom_dump_args.offset->ival[0] : 0;
+    uint32_t len = eeprom_dump_args.len->count ? (uint32_t)eeprom_dump_args.len->ival[0] : ee.size - MIN(off, ee.size);
+    if (off >= ee.size || !len || len > ee.size - off)
+    {
+        printf("Range 0x%05" PRIX32 "+%" PRIu32 " is outside the %" PRIu32 " byte part\n", off, len, ee.size);
+        return 1;
+    }
+
+    const esp_partition_t *part = NULL;
+    if (eeprom_dump_args.save->count)
+    {
+        part = eeprom_partition();
+        if (!part)
+        {
+            return 1;
+        }
+        if (off + len > part->size)
+        {
+            printf("Partition holds only %" PRIu32 " bytes\n", (uint32_t)part->size);
+            return 1;
+        }
+        /* the image keeps the part's offsets, erase the sectors touched */
+        uint32_t from = off & ~(part->erase_size - 1);
+        uint32_t to = (off + len + part->erase_size - 1) & ~(part->erase_size - 1);
+        esp_err_t err = esp_partition_erase_range(part, from, to - from);
+        if (err)
+        {
+            printf("Erasing the partition failed: %s\n", esp_err_to_name(err));
+            return 1;
+        }
+    }
+
+    uint8_t buf[EEPROM_CHUNK];
+    int ret = 0;
+    uint32_t done = 0;
+    int64_t start = esp_timer_get_time();
+
+    eeprom_bus_begin(hz);
+    while (done < len)
+    {
+        uint32_t n = MIN(len - done, sizeof(buf));
+        int err = eeprom_read(&ee, off + done, buf, n);
+        if (err)
+        {
+            ret = 1;
+            break;
+        }
+        /* stream each burst out right away, a dump never sits in RAM as a whole */
+        if (!eeprom_dump_args.quiet->count)
+        {
+            eeprom_print_lines(off + done, buf, n);
+            fflush(stdout);
+        }
+        if (part && esp_partition_write(part, off + done, buf, n) != ESP_OK)
+        {
+            printf("Writing the partition failed\n");
+            ret = 1;
+            break;
+        }
+        done += n;
+    }
+    eeprom_bus_end(hz);
+
+    eeprom_print_stats(done, esp_timer_get_time() - start, hz);
+    if (part && !ret)
+    {
+        printf("Saved 0x%05" PRIX32 "+%" PRIu32 " to the '%s' partition\n", off, len, EEPROM_PARTITION);
+    }
+    return ret;
+}
+
+/* ---- eeprom_write ---- */
+
+static struct
+{
+    eeprom_part_args_t part;
+    struct arg_int *offset;
+    struct arg_str *data;
+    struct arg_int *fill;
+    struct arg_int *len;
+    struct arg_lit *image;
+    struct arg_lit *verify;
+    struct arg_end *end;
+} eeprom_write_args;
+
+typedef enum
+{
+    EEPROM_SRC_HEX,
+    EEPROM_SRC_FILL,
+    EEPROM_SRC_IMAGE,
+} eeprom_src_kind_t;
+
+typedef struct
+{
+    eeprom_src_kind_t kind;
+    const uint8_t *hex;     /* EEPROM_SRC_HEX */
+    uint8_t fill;           /* EEPROM_SRC_FILL */
+    const esp_partition_t *part; /* EEPROM_SRC_IMAGE, at the part's offsets */
+} eeprom_src_t;
+
+/* Source bytes for part offset `off`, `pos` bytes into the write */
+static int eeprom_src_read(const eeprom_src_t *src, uint32_t off, uint32_t pos, uint8_t *buf, size_t n)
+{
+    switch (src->kind)
+    {
+    case EEPROM_SRC_HEX:
+        memcpy(buf, src->hex + pos, n);
+        return 0;
+    case EEPROM_SRC_FILL:
+        memset(buf, src->fill, n);
+        return 0;
+    default:
+        return esp_partition_read(src->part, off, buf, n);
+    }
+}
+
+/* "DEADBEEF", "0x12" or "de ad" style arguments into bytes, returns the count or -1 */
+static int eeprom_parse_hex(struct arg_str *args, uint8_t *out, size_t max)
+{
+    size_t count = 0;
+
+    for (int arg = 0; arg < args->count; arg++)
+    {
+        const char *p = args->sval[arg];
+        if (p[0] == '0' && (p[1] == 'x' || p[1] == 'X'))
+        {
+            p += 2;
+        }
+        size_t digits = strlen(p);
+        if (!digits || (digits & 1))
+        {
+            return -1;
+        }
+        for (size_t pos = 0; pos < digits; pos += 2)
+        {
+            char byte[3] = {p[pos], p[pos + 1], 0};
+            if (!isxdigit((unsigned char)byte[0]) || !isxdigit((unsigned char)byte[1]) || count >= max)
+            {
+                return -1;
+            }
+            if (out)
+            {
+                out[count] = (uint8_t)strtoul(byte, NULL, 16);
+            }
+            count++;
+        }
+    }
+    return (int)count;
+}
+
+static int cmd_eeprom_write(int argc, char **argv)
+{
+    int nerrors = arg_parse(argc, argv, (void **)&eeprom_write_args);
+    if (nerrors != 0)
+    {
+        arg_print_errors(stderr, eeprom_write_args.end, argv[0]);
+        return 1;
+    }
+
+    eeprom_t ee;
+    uint32_t hz;
+    if (eeprom_part_from_args(&eeprom_write_args.part, &ee, &hz))
+    {
+        return 1;
+    }
+    uint32_t off = eeprom_write_args.offset->count ? (uint32_t)eeprom_write_args.offset->ival[0] : 0;
+
+    eeprom_src_t src = {0};
+    uint8_t *hex = NULL;
+    uint32_t len;
+    int sources = (eeprom_write_args.data->count > 0) + (eeprom_write_args.fill->count > 0) +
+                  (eeprom_write_args.image->count > 0);
+    if (sources != 1)
+    {
+        printf("Give exactly one of: hex data, --fill <byte> or --image\n");
+        return 1;
+    }
+    if (eeprom_write_args.data->count)
+    {
+        int count = eeprom_parse_hex(eeprom_write_args.data, NULL, ee.size);
+        if (count <= 0)
+        {
+            printf("Data must be pairs of hex digits\n");
+            return 1;
+        }
+        hex = malloc(count);
+        if (!hex)
+        {
+            return 1;
+        }
+        eeprom_parse_hex(eeprom_write_args.data, hex, count);
+        src.kind = EEPROM_SRC_HEX;
+        src.hex = hex;
+        len = (uint32_t)count;
+    }
+    else if (eeprom_write_args.fill->count)
+    {
+        src.kind = EEPROM_SRC_FILL;
+        src.fill = (uint8_t)eeprom_write_args.fill->ival[0];
+        len = eeprom_write_args.len->count ? (uint32_t)eeprom_write_args.len->ival[0] : ee.size - MIN(off, ee.size);
+    }
+    else
+    {
+        src.kind = EEPROM_SRC_IMAGE;
+        src.part = eeprom_partition();
+        if (!src.part)
+        {
+            return 1;
+        }
+        len = eeprom_write_args.len->count ? (uint32_t)eeprom_write_args.len->ival[0] : ee.size - MIN(off, ee.size);
+        if (off + len > src.part->size)
+        {
+            printf("Partition holds only %" PRIu32 " bytes\n", (uint32_t)src.part->size);
+            return 1;
+        }
+    }
+    if (off >= ee.size || !len || len > ee.size - off)
+    {
+        printf("Range 0x%05" PRIX32 "+%" PRIu32 " is outside the %" PRIu32 " byte part\n", off, len, ee.size);
+        free(hex);
+        return 1;
+    }
+
+    uint8_t buf[EEPROM_CHUNK];
+    uint8_t check[EEPROM_CHUNK];
+    int ret = 0;
+    uint32_t done = 0;
+    uint32_t mismatches = 0;
+    int64_t start = esp_timer_get_time();
+
+    eeprom_bus_begin(hz);
+    /* chunks are page multiples apart from the first, so no page gets written twice */
+    while (done < len && !ret)
+    {
+        uint32_t n = MIN(len - done, sizeof(buf) - (off + done) % sizeof(buf));
+        ret = eeprom_src_read(&src, off + done, done, buf, n) || eeprom_write(&ee, off + done, buf, n);
+        done += ret ? 0 : n;
+    }
+    int64_t elapsed = esp_timer_get_time() - start;
+
+    if (!ret && eeprom_write_args.verify->count)
+    {
+        for (uint32_t pos = 0; pos < len && !ret; pos += sizeof(buf))
+        {
+            uint32_t n = MIN(len - pos, sizeof(buf));
+            ret = eeprom_src_read(&src, off + pos, pos, buf, n) || eeprom_read(&ee, off + pos, check, n);
+            for (uint32_t i = 0; i < n && !ret; i++)
+            {
+                if (buf[i] != check[i] && mismatches++ < 8)
+                {
+                    printf("Mismatch at 0x%05" PRIX32 ": wrote %02X, read %02X\n", off + pos + i, buf[i], check[i]);
+                }
+            }
+        }
+    }
+    eeprom_bus_end(hz);
+    free(hex);
+
+    eeprom_print_stats(done, elapsed, hz);
+    if (eeprom_write_args.verify->count && !ret)
+    {
+        printf("Verify: %s (%" PRIu32 " mismatches)\n", mismatches ? "FAILED" : "ok", mismatches);
+    }
+    return ret || mismatches;
+}
+
+void eeprom_start(void)
+{
+    eeprom_part_args_init(&eeprom_dump_args.part);
+    eeprom_dump_args.offset = arg_int0("o", "offset", "<addr>", "First byte (default 0)");
+    eeprom_dump_args.len = arg_int0("n", "len", "<bytes>", "Bytes to dump (default: to the end)");
+    eeprom_dump_args.save = arg_lit0(NULL, "save", "Also store the bytes in the eeprom partition");
+    eeprom_dump_args.quiet = arg_lit0("q", "quiet", "Do not print, e.g. with --save");
+    eeprom_dump_args.end = arg_end(4);
+
+    const esp_console_cmd_t dump_cmd = {
+        .command = "eeprom_dump",
+        .help = "Dump a 24Cxx EEPROM as hex, streamed in bursts. Usage: eeprom_dump <addr> -t <24cXX> [-o <addr>] [-n <len>] [--save]",
+        .hint = NULL,
+        .func = &cmd_eeprom_dump,
+        .argtable = &eeprom_dump_args,
+    };
+    ESP_ERROR_CHECK(esp_console_cmd_register(&dump_cmd));
+
+    eeprom_part_args_init(&eeprom_write_args.part);
+    eeprom_write_args.offset = arg_int0("o", "offset", "<addr>", "First byte to write (default 0)");
+    eeprom_write_args.data = arg_strn(NULL, NULL, "<hex>", 0, EEPROM_MAX_HEX_ARGS, "Data as hex, e.g. DEADBEEF or 0x12 0x34");
+    eeprom_write_args.fill = arg_int0(NULL, "fill", "<byte>", "Write this byte instead of data");
+    eeprom_write_args.len = arg_int0("n", "len", "<bytes>", "Bytes for --fill / --image (default: to the end)");
+    eeprom_write_args.image = arg_lit0(NULL, "image", "Write back the image saved with eeprom_dump --save");
+    eeprom_write_args.verify = arg_lit0(NULL, "verify", "Read back and compare afterwards");
+    eeprom_write_args.end = arg_end(EEPROM_MAX_HEX_ARGS + 4);
+
+    const esp_console_cmd_t write_cmd = {
+        .command = "eeprom_write",
+        .help = "Program a 24Cxx EEPROM in page writes with ACK polling. Usage: eeprom_write <addr> -t <24cXX> [-o <addr>] <hex>... | --fill <byte> | --image [--verify]",
+        .hint = NULL,
+        .func = &cmd_eeprom_write,
+        .argtable = &eeprom_write_args,
+    };
+    ESP_ERROR_CHECK(esp_console_cmd_register(&write_cmd));
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * eeprom - 24Cxx I2C EEPROM dump and programming.
+ *
+ * Parts with 1 address byte (24C01..24C16) and 2 address bytes (24C32 and
+ * up) are supported; address bits beyond those bytes go into the low bits
+ * of the device address, as on the 24C04..24C16 and 24C1024. Reads are
+ * sequential in bursts, writes are split at page boundaries and the end of
+ * each write cycle is detected by ACK polling.
+ *
+ * The "eeprom" partition holds one image: `eeprom_dump --save` stores the
+ * part there and `eeprom_write --image` programs it back, e.g. to clone a
+ * part or to restore it after a failed fix.
+ */
+
+typedef struct
+{
+    uint8_t addr;       /* base device address, block bits are ORed in */
+    uint8_t addr_bytes; /* 1 or 2 */
+    uint16_t page;      /* write page size */
+    uint32_t size;
+} eeprom_t;
+
+int eeprom_read(const eeprom_t *ee, uint32_t off, uint8_t *data, size_t len);
+int eeprom_write(const eeprom_t *ee, uint32_t off, const uint8_t *data, size_t len);
+
+void eeprom_start(void);
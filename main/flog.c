@@ -0,0 +1,422 @@
+/* flog.c - append-only keyed record log with RAM hash index, see flog.h */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <sys/param.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_rom_crc.h"
+
+#include "flog.h"
+
+#define FLOG_SECTOR_MAGIC 0x474F4C46 /* "FLOG" */
+#define FLOG_REC_MAGIC 0xF10A
+#define FLOG_ALIGN(x) (((x) + 3u) & ~3u)
+
+static const char *TAG = "flog";
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t seq;
+} flog_sector_hdr_t;
+
+typedef struct
+{
+    uint16_t magic;
+    uint16_t len;
+    uint32_t key;
+    uint32_t seq;
+    uint32_t prev;
+    uint32_t crc;
+} flog_rec_hdr_t;
+
+/* ---- RAM index (open addressing, linear probing) ---- */
+
+static flog_index_entry_t *flog_index_slot(flog_t *log, uint32_t key)
+{
+    uint32_t mask = log->index_slots - 1;
+    uint32_t pos = (key * 2654435761u) & mask;
+
+    for (uint32_t n = 0; n < log->index_slots; n++)
+    {
+        flog_index_entry_t *e = &log->index[pos];
+        if (e->addr == FLOG_NONE || e->key == key)
+        {
+            return e;
+        }
+        pos = (pos + 1) & mask;
+    }
+    return NULL;
+}
+
+static void flog_index_put(flog_t *log, uint32_t key, uint32_t addr)
+{
+    flog_index_entry_t *e = flog_index_slot(log, key);
+
+    if (e && e->addr == FLOG_NONE)
+    {
+        /* keep the load factor at 3/4 so probing stays short */
+        if (log->keys + 1 > log->index_slots / 4 * 3)
+        {
+            log->index_full = true;
+            return;
+        }
+        log->keys++;
+    }
+    if (!e)
+    {
+        log->index_full = true;
+        return;
+    }
+    e->key = key;
+    e->addr = addr;
+}
+
+static uint32_t flog_index_get(flog_t *log, uint32_t key)
+{
+    flog_index_entry_t *e = flog_index_slot(log, key);
+    return e ? e->addr : FLOG_NONE;
+}
+
+/* ---- flash access ---- */
+
+static bool flog_sector_valid(flog_t *log, uint32_t sector, uint32_t *seq)
+{
+    flog_sector_hdr_t hdr;
+
+    if (esp_partition_read(log->part, sector * log->sector_size, &hdr, sizeof(hdr)) != ESP_OK)
+    {
+        return false;
+    }
+    *seq = hdr.seq;
+    return hdr.magic == FLOG_SECTOR_MAGIC;
+}
+
+static uint32_t flog_rec_crc(const flog_rec_hdr_t *hdr)
+{
+    flog_rec_hdr_t tmp = *hdr;
+    tmp.crc = 0;
+    return esp_rom_crc32_le(0, (const uint8_t *)&tmp, sizeof(tmp));
+}
+
+/*
+ * Read and check the record at `addr`. With `payload` set, up to `max` bytes
+ * of it are copied there; the CRC is always checked over the full payload.
+ */
+static bool flog_read_rec(flog_t *log, uint32_t addr, flog_rec_hdr_t *hdr, void *payload, uint16_t max)
+{
+    uint8_t chunk[128];
+
+    if (esp_partition_read(log->part, addr, hdr, sizeof(*hdr)) != ESP_OK || hdr->magic != FLOG_REC_MAGIC)
+    {
+        return false;
+    }
+    if ((addr % log->sector_size) + FLOG_ALIGN(sizeof(*hdr) + hdr->len) > log->sector_size)
+    {
+        return false;
+    }
+
+    uint32_t crc = flog_rec_crc(hdr);
+    for (uint32_t pos = 0; pos < hdr->len; pos += sizeof(chunk))
+    {
+        uint32_t n = MIN(sizeof(chunk), hdr->len - pos);
+        if (esp_partition_read(log->part, addr + sizeof(*hdr) + pos, chunk, n) != ESP_OK)
+        {
+            return false;
+        }
+        crc = esp_rom_crc32_le(crc, chunk, n);
+        if (payload && pos < max)
+        {
+            memcpy((uint8_t *)payload + pos, chunk, MIN(n, max - pos));
+        }
+    }
+    return crc == hdr->crc;
+}
+
+/*
+ * Walk the records of one sector. Returns the offset behind the last good
+ * record, or the sector size if a torn record closed the sector.
+ */
+static uint32_t flog_walk_sector(flog_t *log, uint32_t sector, void *buf, uint16_t max, flog_visit_t fn, void *ctx,
+                                 bool *stop)
+{
+    uint32_t base = sector * log->sector_size;
+    uint32_t off = sizeof(flog_sector_hdr_t);
+
+    while (off + sizeof(flog_rec_hdr_t) <= log->sector_size)
+    {
+        flog_rec_hdr_t hdr;
+        if (!flog_read_rec(log, base + off, &hdr, buf, max))
+        {
+            uint16_t magic;
+            esp_partition_read(log->part, base + off, &magic, sizeof(magic));
+            return magic == 0xFFFF ? off : log->sector_size;
+        }
+        if (fn && !*stop && !fn(hdr.key, hdr.seq, buf, MIN(hdr.len, max), ctx))
+        {
+            *stop = true;
+        }
+        if (!fn)
+        {
+            flog_index_put(log, hdr.key, base + off);
+            log->records++;
+            log->next_seq = MAX(log->next_seq, hdr.seq + 1);
+        }
+        off += FLOG_ALIGN(sizeof(hdr) + hdr.len);
+    }
+    return off;
+}
+
+/* Visit all sectors oldest first; with `fn` == NULL the index is rebuilt instead */
+static void flog_walk(flog_t *log, void *buf, uint16_t max, flog_visit_t fn, void *ctx)
+{
+    bool stop = false;
+
+    for (uint32_t i = 1; i <= log->sectors && !stop; i++)
+    {
+        uint32_t sector = (log->head_sector + i) % log->sectors;
+        uint32_t seq;
+        if (!flog_sector_valid(log, sector, &seq))
+        {
+            continue;
+        }
+        uint32_t end = flog_walk_sector(log, sector, buf, max, fn, ctx, &stop);
+        if (!fn && sector == log->head_sector)
+        {
+            log->head_offset = end;
+        }
+    }
+}
+
+static void flog_rebuild(flog_t *log)
+{
+    for (uint32_t i = 0; i < log->index_slots; i++)
+    {
+        log->index[i].addr = FLOG_NONE;
+    }
+    log->keys = 0;
+    log->records = 0;
+    log->index_full = false;
+    flog_walk(log, NULL, 0, NULL, NULL);
+}
+
+static esp_err_t flog_start_sector(flog_t *log, uint32_t sector)
+{
+    flog_sector_hdr_t hdr = {.magic = FLOG_SECTOR_MAGIC, .seq = log->sector_seq + 1};
+    uint32_t seq;
+    bool reused = flog_sector_valid(log, sector, &seq);
+
+    esp_err_t err = esp_partition_erase_range(log->part, sector * log->sector_size, log->sector_size);
+    if (err == ESP_OK)
+    {
+        err = esp_partition_write(log->part, sector * log->sector_size, &hdr, sizeof(hdr));
+    }
+    if (err != ESP_OK)
+    {
+        return err;
+    }
+
+    log->sector_seq = hdr.seq;
+    log->head_sector = sector;
+    log->head_offset = sizeof(hdr);
+    if (reused)
+    {
+        /* the oldest records are gone, drop their index entries */
+        flog_rebuild(log);
+    }
+    return ESP_OK;
+}
+
+/* ---- API ---- */
+
+/**
+ * Mount the data partition `label` and build the index. `index_slots` is
+ * rounded up to a power of two and should be ~1.5x the number of keys.
+ */
+esp_err_t flog_open(flog_t *log, const char *label, uint32_t index_slots)
+{
+    memset(log, 0, sizeof(*log));
+    log->part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, label);
+    if (!log->part)
+    {
+        ESP_LOGE(TAG, "Partition '%s' not found", label);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    log->sector_size = log->part->erase_size;
+    log->sectors = log->part->size / log->sector_size;
+    log->index_slots = 1;
+    while (log->index_slots < index_slots)
+    {
+        log->index_slots <<= 1;
+    }
+    log->index = calloc(log->index_slots, sizeof(*log->index));
+    log->lock = xSemaphoreCreateMutex();
+    if (!log->index || !log->lock || log->sectors < 2)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+
+    /* head = valid sector with the highest sequence number */
+    bool found = false;
+    for (uint32_t s = 0; s < log->sectors; s++)
+    {
+        uint32_t seq;
+        if (flog_sector_valid(log, s, &seq) && (!found || (int32_t)(seq - log->sector_seq) > 0))
+        {
+            found = true;
+            log->head_sector = s;
+            log->sector_seq = seq;
+        }
+    }
+    if (!found)
+    {
+        esp_err_t err = flog_start_sector(log, 0);
+        flog_rebuild(log);
+        return err;
+    }
+
+    int64_t start = esp_timer_get_time();
+    flog_rebuild(log);
+    ESP_LOGI(TAG, "%s: %" PRIu32 " records, %" PRIu32 " keys, indexed in %" PRIu32 " ms", label, log->records,
+             log->keys, (uint32_t)((esp_timer_get_time() - start) / 1000));
+    return ESP_OK;
+}
+
+/** Largest payload a single record can hold */
+uint32_t flog_max_record(const flog_t *log)
+{
+    return log->sector_size - sizeof(flog_sector_hdr_t) - sizeof(flog_rec_hdr_t);
+}
+
+esp_err_t flog_append(flog_t *log, uint32_t key, const void *data, uint16_t len)
+{
+    uint32_t size = FLOG_ALIGN(sizeof(flog_rec_hdr_t) + len);
+    esp_err_t err = ESP_OK;
+
+    if (len > flog_max_record(log))
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    xSemaphoreTake(log->lock, portMAX_DELAY);
+    if (log->head_offset + size > log->sector_size)
+    {
+        err = flog_start_sector(log, (log->head_sector + 1) % log->sectors);
+    }
+    if (err == ESP_OK)
+    {
+        uint32_t addr = log->head_sector * log->sector_size + log->head_offset;
+        flog_rec_hdr_t hdr = {
+            .magic = FLOG_REC_MAGIC,
+            .len = len,
+            .key = key,
+            .seq = log->next_seq,
+            .prev = flog_index_get(log, key),
+        };
+        hdr.crc = esp_rom_crc32_le(flog_rec_crc(&hdr), data, len);
+
+        err = esp_partition_write(log->part, addr, &hdr, sizeof(hdr));
+        if (err == ESP_OK)
+        {
+            err = esp_partition_write(log->part, addr + sizeof(hdr), data, len);
+        }
+        /* never write over a half written record */
+        log->head_offset += size;
+        log->next_seq++;
+        if (err == ESP_OK)
+        {
+            log->records++;
+            flog_index_put(log, key, addr);
+        }
+    }
+    xSemaphoreGive(log->lock);
+    return err;
+}
+
+typedef struct
+{
+    uint32_t key;
+    flog_visit_t fn;
+    void *ctx;
+    int count;
+} flog_filter_t;
+
+static bool flog_filter(uint32_t key, uint32_t seq, const void *data, uint16_t len, void *ctx)
+{
+    flog_filter_t *f = ctx;
+    if (key != f->key)
+    {
+        return true;
+    }
+    f->count++;
+    return f->fn(key, seq, data, len, f->ctx);
+}
+
+/**
+ * Visit all records of `key`, newest first, following the back-pointers from
+ * the index. Only if the index overflowed the partition is scanned (oldest
+ * first). Payloads are copied to `buf` (truncated to `max`). `fn` runs with
+ * the log locked and must not call back into it. Returns the records visited.
+ */
+int flog_find(flog_t *log, uint32_t key, void *buf, uint16_t max, flog_visit_t fn, void *ctx)
+{
+    int count = 0;
+
+    xSemaphoreTake(log->lock, portMAX_DELAY);
+    uint32_t addr = flog_index_get(log, key);
+    if (addr == FLOG_NONE && log->index_full)
+    {
+        flog_filter_t filter = {.key = key, .fn = fn, .ctx = ctx};
+        flog_walk(log, buf, max, flog_filter, &filter);
+        xSemaphoreGive(log->lock);
+        return filter.count;
+    }
+
+    uint32_t last_seq = log->next_seq;
+    while (addr != FLOG_NONE)
+    {
+        flog_rec_hdr_t hdr;
+        /* a back-pointer into a recycled sector ends the chain */
+        if (!flog_read_rec(log, addr, &hdr, buf, max) || hdr.key != key || (int32_t)(hdr.seq - last_seq) >= 0)
+        {
+            break;
+        }
+        count++;
+        last_seq = hdr.seq;
+        if (!fn(key, hdr.seq, buf, MIN(hdr.len, max), ctx))
+        {
+            break;
+        }
+        addr = hdr.prev;
+    }
+    xSemaphoreGive(log->lock);
+    return count;
+}
+
+/** Visit every record, oldest first. Same rules for `fn` as flog_find(). */
+int flog_scan(flog_t *log, void *buf, uint16_t max, flog_visit_t fn, void *ctx)
+{
+    xSemaphoreTake(log->lock, portMAX_DELAY);
+    uint32_t records = log->records;
+    flog_walk(log, buf, max, fn, ctx);
+    xSemaphoreGive(log->lock);
+    return (int)records;
+}
+
+esp_err_t flog_erase(flog_t *log)
+{
+    xSemaphoreTake(log->lock, portMAX_DELAY);
+    esp_err_t err = esp_partition_erase_range(log->part, 0, log->sectors * log->sector_size);
+    if (err == ESP_OK)
+    {
+        log->sector_seq = 0;
+        log->next_seq = 0;
+        err = flog_start_sector(log, 0);
+        flog_rebuild(log);
+    }
+    xSemaphoreGive(log->lock);
+    return err;
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "esp_partition.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+/*
+ * flog - append-only keyed record log on a raw flash partition.
+ *
+ * Records are appended sector by sector and the partition is used as a ring:
+ * when it is full the oldest sector is erased. Each record carries a 32 bit
+ * key and a back-pointer to the previous record with the same key, and a
+ * RAM hash index maps every key to its newest record. Looking up all records
+ * of a key therefore reads only those records, newest first, instead of
+ * scanning the partition.
+ *
+ * Each record is written header first with a CRC over header and payload; a
+ * record torn by a reset fails the CRC on mount and closes its sector.
+ */
+
+#define FLOG_NONE UINT32_MAX
+
+typedef struct
+{
+    uint32_t key;
+    uint32_t addr; /* newest record of the key, FLOG_NONE = empty slot */
+} flog_index_entry_t;
+
+typedef struct
+{
+    const esp_partition_t *part;
+    SemaphoreHandle_t lock;
+    uint32_t sector_size;
+    uint32_t sectors;
+    uint32_t head_sector;   /* sector currently appended to */
+    uint32_t head_offset;   /* next free byte in the head sector */
+    uint32_t sector_seq;    /* sequence number of the head sector */
+    uint32_t next_seq;      /* sequence number of the next record */
+    flog_index_entry_t *index;
+    uint32_t index_slots;   /* power of two */
+    uint32_t keys;
+    uint32_t records;
+    bool index_full;        /* some keys did not fit, lookups fall back to scanning */
+} flog_t;
+
+/* Return false to stop the iteration */
+typedef bool (*flog_visit_t)(uint32_t key, uint32_t seq, const void *data, uint16_t len, void *ctx);
+
+esp_err_t flog_open(flog_t *log, const char *label, uint32_t index_slots);
+esp_err_t flog_append(flog_t *log, uint32_t key, const void *data, uint16_t len);
+int flog_find(flog_t *log, uint32_t key, void *buf, uint16_t max, flog_visit_t fn, void *ctx);
+int flog_scan(flog_t *log, void *buf, uint16_t max, flog_visit_t fn, void *ctx);
+esp_err_t flog_erase(flog_t *log);
+uint32_t flog_max_record(const flog_t *log);
@@ -1,11 +1,8 @@
-#include "driver/gpio.h"
-#include "driver/i2c.h"
-
 #include "esp_log.h"
 #include "esp_console.h"
 
 #include "i2c.h"
-#include "gpio_config.h"
+#include "i2c_bus.h"
 
 #include <stdio.h>
 #include <string.h>
@@ -14,10 +11,24 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 
+#if configTASK_NOTIFICATION_ARRAY_ENTRIES <= I2C_NOTIFY_INDEX
+#error "i2c_wait() needs CONFIG_FREERTOS_TASK_NOTIFICATION_ARRAY_ENTRIES >= 2"
+#endif
+#include "freertos/semphr.h"
+#include "freertos/queue.h"
+
 #define MAX_I2C_WRITE_BYTES 256
+#define I2C_QUEUE_DEPTH 16
+#define I2C_WORKER_STACK 3072
+/* above the poller that submits most of the work */
+#define I2C_WORKER_PRIO 5
 
 static const char *TAG = "i2c_cmd"; /* Added for ESP_LOG */
 
+/* Serializes the console, the poller and anything else sharing I2C_NUM_0 */
+static SemaphoreHandle_t i2c_mutex;
+static QueueHandle_t i2c_queue;
+
 static struct
 {
     struct arg_int *start;
@@ -65,14 +76,7 @@ static int do_i2cscan(int argc, char **argv)
 
     for (int addr = start_addr; addr <= end_addr; ++addr)
     {
-        i2c_cmd_handle_t cmd = i2c_cmd_link_create();
-        i2c_master_start(cmd);
-        i2c_master_write_byte(cmd, (addr << 1) | I2C_MASTER_WRITE, 1);
-        i2c_master_stop(cmd);
-        esp_err_t ret = i2c_master_cmd_begin(I2C_NUM_0, cmd, 100 / portTICK_PERIOD_MS);
-        i2c_cmd_link_delete(cmd);
-
-        if (ret == ESP_OK)
+        if (i2c_probe(addr) == ESP_OK)
         {
             ESP_LOGI(TAG, "Found device at 0x%02X", addr);
         }
@@ -406,84 +410,150 @@ void register_i2c_commands(void) /* Renamed from register_i2cscan_command */
     ESP_ERROR_CHECK(esp_console_cmd_register(&i2c_rw_cmd_config));
 }
 
+/* Recursive, so callers can hold the bus across several transfers (e.g. mux select + access) */
+void i2c_lock(void)
+{
+    xSemaphoreTakeRecursive(i2c_mutex, portMAX_DELAY);
+}
+
+void i2c_unlock(void)
+{
+    xSemaphoreGiveRecursive(i2c_mutex);
+}
+
+/* Run one transaction of up to I2C_MAX_MSGS messages on the bus backend */
+int i2c_transfer(const i2c_msg_t *msgs, size_t count)
+{
+    if (!count || count > I2C_MAX_MSGS)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    i2c_lock();
+    int ret = i2c_bus_transfer(msgs, count);
+    i2c_unlock();
+    return ret;
+}
+
 int i2c_write(uint8_t addr, const uint8_t *data, size_t len)
 {
-    i2c_cmd_handle_t cmd = i2c_cmd_link_create();
-    i2c_master_start(cmd);
-    i2c_master_write_byte(cmd, (addr << 1) | I2C_MASTER_WRITE, 1);
-    i2c_master_write(cmd, (uint8_t *)data, len, 1);
-    i2c_master_stop(cmd);
-    esp_err_t ret = i2c_master_cmd_begin(I2C_NUM_0, cmd, 100 / portTICK_PERIOD_MS);
-    i2c_cmd_link_delete(cmd);
-    return ret == ESP_OK ? 0 : -1;
+    i2c_msg_t msg = {.addr = addr, .buf = (uint8_t *)data, .len = len};
+    return i2c_transfer(&msg, 1);
+}
+
+/* Address-only write (SMBus quick command), used for scanning and waking devices */
+int i2c_probe(uint8_t addr)
+{
+    i2c_msg_t msg = {.addr = addr};
+    return i2c_transfer(&msg, 1);
 }
 
 int i2c_write_partial(uint8_t addr, const uint8_t *data, size_t len, bool stop)
 {
-    i2c_cmd_handle_t cmd = i2c_cmd_link_create();
-    i2c_master_start(cmd);
-    i2c_master_write_byte(cmd, (addr << 1) | I2C_MASTER_WRITE, 1);
-    i2c_master_write(cmd, (uint8_t *)data, len, 1);
     if (stop)
     {
-        i2c_master_stop(cmd);
+        return i2c_write(addr, data, len);
     }
-    esp_err_t ret = i2c_master_cmd_begin(I2C_NUM_0, cmd, 100 / portTICK_PERIOD_MS);
-    i2c_cmd_link_delete(cmd);
-    return ret == ESP_OK ? 0 : -1;
+    i2c_lock();
+    int ret = i2c_bus_write_nostop(addr, data, len);
+    i2c_unlock();
+    return ret;
 }
 
 int i2c_read(uint8_t addr, uint8_t *data, size_t len)
 {
-    i2c_cmd_handle_t cmd = i2c_cmd_link_create();
-    i2c_master_start(cmd);
-    i2c_master_write_byte(cmd, (addr << 1) | I2C_MASTER_READ, 1);
-    if (len > 1)
+    i2c_msg_t msg = {.addr = addr, .read = true, .buf = data, .len = len};
+    return i2c_transfer(&msg, 1);
+}
+
+int i2c_write_read(uint8_t addr, const uint8_t *wdata, size_t wlen, uint8_t *rdata, size_t rlen)
+{
+    i2c_msg_t msgs[2] = {
+        {.addr = addr, .buf = (uint8_t *)wdata, .len = wlen},
+        {.addr = addr, .read = true, .buf = rdata, .len = rlen},
+    };
+    return i2c_transfer(msgs, 2);
+}
+
+/*
+ * Asynchronous transfers: a worker task drains the queue, so the submitter
+ * can decode the previous response while this one is on the bus.
+ */
+static void i2c_worker(void *arg)
+{
+    (void)arg;
+    i2c_xfer_t *xfer;
+
+    for (;;)
     {
-        i2c_master_read(cmd, data, len - 1, I2C_MASTER_ACK);
+        if (xQueueReceive(i2c_queue, &xfer, portMAX_DELAY) != pdTRUE)
+        {
+            continue;
+        }
+
+        i2c_lock();
+        int err = xfer->prepare ? xfer->prepare(xfer->prepare_ctx) : 0;
+        if (!err)
+        {
+            err = xfer->rlen ? i2c_write_read(xfer->addr, xfer->wdata, xfer->wlen, xfer->rdata, xfer->rlen)
+                             : i2c_write(xfer->addr, xfer->wdata, xfer->wlen);
+        }
+        i2c_unlock();
+
+        /* the submitter may reuse the struct as soon as busy is cleared */
+        TaskHandle_t notify = xfer->notify;
+        xfer->err = err;
+        if (xfer->done)
+        {
+            xfer->done(xfer);
+        }
+        __atomic_store_n(&xfer->busy, false, __ATOMIC_RELEASE);
+        if (notify)
+        {
+            xTaskNotifyGiveIndexed(notify, I2C_NOTIFY_INDEX);
+        }
     }
-    i2c_master_read_byte(cmd, data + len - 1, I2C_MASTER_NACK);
-    i2c_master_stop(cmd);
-    esp_err_t ret = i2c_master_cmd_begin(I2C_NUM_0, cmd, 100 / portTICK_PERIOD_MS);
-    i2c_cmd_link_delete(cmd);
-    return ret == ESP_OK ? 0 : -1;
 }
 
-int i2c_write_read(uint8_t addr, const uint8_t *wdata, size_t wlen, uint8_t *rdata, size_t rlen)
+/* Blocks while the queue is full: a deep pipeline waits for the bus instead of failing */
+int i2c_submit(i2c_xfer_t *xfer)
 {
-    i2c_cmd_handle_t cmd = i2c_cmd_link_create();
-    i2c_master_start(cmd);
-    i2c_master_write_byte(cmd, (addr << 1) | I2C_MASTER_WRITE, 1);
-    if (wlen > 0)
+    xfer->busy = true;
+    xfer->err = ESP_ERR_INVALID_STATE;
+    if (xQueueSend(i2c_queue, &xfer, portMAX_DELAY) != pdTRUE)
     {
-        i2c_master_write(cmd, (uint8_t *)wdata, wlen, 1);
+        xfer->busy = false;
+        return ESP_ERR_NO_MEM;
     }
-    i2c_master_start(cmd);
-    i2c_master_write_byte(cmd, (addr << 1) | I2C_MASTER_READ, 1);
-    if (rlen > 1)
+    return ESP_OK;
+}
+
+/* Block on the caller's I2C_NOTIFY_INDEX notification until `xfer` (submitted with notify = this task) completed */
+int i2c_wait(i2c_xfer_t *xfer)
+{
+    while (__atomic_load_n(&xfer->busy, __ATOMIC_ACQUIRE))
     {
-        i2c_master_read(cmd, rdata, rlen - 1, I2C_MASTER_ACK);
+        ulTaskNotifyTakeIndexed(I2C_NOTIFY_INDEX, pdTRUE, pdMS_TO_TICKS(100));
     }
-    i2c_master_read_byte(cmd, rdata + rlen - 1, I2C_MASTER_NACK);
-    i2c_master_stop(cmd);
-    
-    esp_err_t ret = i2c_master_cmd_begin(I2C_NUM_0, cmd, 100 / portTICK_PERIOD_MS);
-    i2c_cmd_link_delete(cmd);
-    return ret == ESP_OK ? 0 : -1;
+    return xfer->err;
+}
+
+/*
+ * Change the bus clock, 0 = back to I2C_SPEED_HZ. The gauges are SMBus
+ * devices, so hold i2c_lock() for as long as the bus runs at another speed.
+ */
+int i2c_set_speed(uint32_t hz)
+{
+    i2c_lock();
+    esp_err_t ret = i2c_bus_set_speed(hz ? hz : I2C_SPEED_HZ);
+    i2c_unlock();
+    return ret;
 }
 
 void i2c_init()
 {
-    /* Configure I2C parameters */
-    i2c_config_t conf = {
-        .mode = I2C_MODE_MASTER,
-        .sda_io_num = GPIO_I2C_SDA,
-        .scl_io_num = GPIO_I2C_SCL,
-        .sda_pullup_en = 1,
-        .scl_pullup_en = 1,
-        .master.clk_speed = 100000,
-        .clk_flags = 0};
-    i2c_param_config(I2C_NUM_0, &conf);
-    i2c_driver_install(I2C_NUM_0, conf.mode, 0, 0, 0);
+    i2c_mutex = xSemaphoreCreateRecursiveMutex();
+    i2c_bus_init();
+    i2c_queue = xQueueCreate(I2C_QUEUE_DEPTH, sizeof(i2c_xfer_t *));
+    xTaskCreate(i2c_worker, "i2c", I2C_WORKER_STACK, NULL, I2C_WORKER_PRIO, NULL);
     register_i2c_commands(); 
 }
@@ -1,7 +1,78 @@
 #pragma once
 
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * All transfer helpers return the esp_err_t of the transaction: ESP_OK,
+ * ESP_FAIL when the slave NACKed, ESP_ERR_TIMEOUT when the bus timed out
+ * (e.g. clock stretched for too long).
+ */
+
+/* SMBus clock the gauges run at */
+#define I2C_SPEED_HZ 100000
+
+/*
+ * One message of a transaction. The messages are joined by repeated starts
+ * and the transaction ends with a stop; a write of zero bytes is an
+ * address-only access (quick command).
+ */
+typedef struct
+{
+    uint8_t addr;
+    bool read;
+    uint8_t *buf;
+    size_t len;
+} i2c_msg_t;
+
+#define I2C_MAX_MSGS 2
+
 void i2c_init();
+int i2c_set_speed(uint32_t hz);
+void i2c_lock(void);
+void i2c_unlock(void);
+int i2c_transfer(const i2c_msg_t *msgs, size_t count);
+int i2c_probe(uint8_t addr);
 int i2c_write(uint8_t addr, const uint8_t *data, size_t len);
 int i2c_write_partial(uint8_t addr, const uint8_t *data, size_t len, bool stop);
 int i2c_read(uint8_t addr, uint8_t *data, size_t len);
 int i2c_write_read(uint8_t addr, const uint8_t *wdata, size_t wlen, uint8_t *rdata, size_t rlen);
+
+/*
+ * Asynchronous transfers. i2c_submit() queues the transfer and returns at
+ * once, unless the queue (16 transfers) is full: then it blocks until the
+ * worker has taken one. An I2C worker task runs the transfer and
+ * then calls `done` (from the worker task, must not block) and/or gives
+ * `notify` a task notification on index I2C_NOTIFY_INDEX, so the waiter
+ * does not eat the task's other (index 0) notifications.
+ * Transfers run in submission order. The struct and its buffers belong to
+ * the bus until `busy` is cleared.
+ *
+ * `prepare` runs under the bus lock right before the transfer, e.g. to
+ * select a mux channel; a non-zero return fails the transfer with it.
+ */
+typedef struct i2c_xfer i2c_xfer_t;
+
+/* Needs CONFIG_FREERTOS_TASK_NOTIFICATION_ARRAY_ENTRIES >= 2 */
+#define I2C_NOTIFY_INDEX 1
+
+struct i2c_xfer
+{
+    uint8_t addr;
+    uint8_t wbuf[4];          /* small writes can live here, point wdata at it */
+    const uint8_t *wdata;
+    size_t wlen;
+    uint8_t *rdata;           /* rlen == 0: plain write */
+    size_t rlen;
+    int (*prepare)(void *ctx);
+    void *prepare_ctx;
+    void (*done)(i2c_xfer_t *xfer);
+    void *ctx;
+    void *notify;             /* TaskHandle_t to notify, NULL = none */
+    volatile bool busy;
+    int err;
+};
+
+int i2c_submit(i2c_xfer_t *xfer);
+int i2c_wait(i2c_xfer_t *xfer);
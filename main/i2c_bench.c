@@ -0,0 +1,421 @@
+/* i2c_bench.c - I2C throughput benchmark command, see i2c_bench.h */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <sys/param.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_console.h"
+#include "argtable3/argtable3.h"
+
+#include "i2c.h"
+#include "i2c_bench.h"
+#include "smbus.h"
+
+#define BENCH_DEFAULT_MS 500
+#define BENCH_DEFAULT_DEPTH 4
+#define BENCH_MAX_DEPTH 8
+#define BENCH_MAX_SPEEDS 4
+#define BENCH_MAX_WRITE 8
+#define BENCH_MAX_READ (1 + SMBUS_BLOCK_MAX + 1)
+#define BENCH_SAMPLES 1024 /* latency reservoir per run */
+
+static const char *TAG = "i2c_bench";
+
+typedef enum
+{
+    BENCH_WORD = 0,
+    BENCH_BLOCK,
+    BENCH_WRITE_READ,
+    BENCH_SHAPES,
+} bench_shape_t;
+
+typedef enum
+{
+    BENCH_BLOCKING = 0,
+    BENCH_SMBUS,
+    BENCH_ASYNC,
+    BENCH_PATHS,
+} bench_path_t;
+
+static const char *const s_shape_names[BENCH_SHAPES] = {"word", "block", "wr"};
+static const char *const s_path_names[BENCH_PATHS] = {"blocking", "smbus", "async"};
+
+/* One transaction shape as it goes on the wire */
+typedef struct
+{
+    bench_shape_t shape;
+    uint8_t addr;
+    bool pec;
+    uint8_t wlen; /* bytes written, the command first */
+    uint8_t rlen; /* bytes clocked in */
+    uint8_t wdata[BENCH_MAX_WRITE];
+} bench_cfg_t;
+
+typedef struct
+{
+    uint32_t ok;
+    uint32_t errors;
+    uint32_t max_us;
+    uint32_t rng;
+    int64_t elapsed_us;
+    uint32_t *lat_us; /* BENCH_SAMPLES, uniform sample of all latencies */
+} bench_run_t;
+
+/* ---- measurement ---- */
+
+static void bench_record(bench_run_t *run, int err, uint32_t us)
+{
+    if (err)
+    {
+        run->errors++;
+        return;
+    }
+
+    uint32_t slot = run->ok++;
+    if (slot >= BENCH_SAMPLES)
+    {
+        /* reservoir sampling keeps the percentiles unbiased on long runs */
+        run->rng = run->rng * 1664525u + 1013904223u;
+        slot = run->rng % run->ok;
+    }
+    if (slot < BENCH_SAMPLES)
+    {
+        run->lat_us[slot] = us;
+    }
+    run->max_us = MAX(run->max_us, us);
+}
+
+static int bench_cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Bits on the wire incl. START, repeated START, ACKs and STOP */
+static uint32_t bench_wire_bits(const bench_cfg_t *cfg)
+{
+    return 1 + 9 * (1 + cfg->wlen) + (cfg->rlen ? 1 + 9 * (1 + cfg->rlen) : 0) + 1;
+}
+
+static void bench_print(const bench_cfg_t *cfg, bench_path_t path, bench_run_t *run, uint32_t hz)
+{
+    uint32_t total = run->ok + run->errors;
+    uint32_t n = MIN(run->ok, BENCH_SAMPLES);
+    double secs = run->elapsed_us / 1e6;
+    double tps = secs > 0 ? run->ok / secs : 0;
+
+    qsort(run->lat_us, n, sizeof(run->lat_us[0]), bench_cmp_u32);
+    printf("%-6s %-9s %8.0f %9.0f %6" PRIu32 " %6" PRIu32 " %6" PRIu32 " %6" PRIu32 " %6.2f%% %5.0f%%\n",
+           s_shape_names[cfg->shape], s_path_names[path], tps, tps * (cfg->wlen + cfg->rlen),
+           n ? run->lat_us[n / 2] : 0, n ? run->lat_us[n * 9 / 10] : 0, n ? run->lat_us[n * 99 / 100] : 0,
+           run->max_us, total ? run->errors * 100.0 / total : 0.0, tps * bench_wire_bits(cfg) * 100.0 / hz);
+}
+
+/* ---- transfer paths ---- */
+
+/* blocking and smbus: back to back from this task, the caller holds the bus */
+static void bench_sync(const bench_cfg_t *cfg, bench_path_t path, int64_t duration_us, bench_run_t *run)
+{
+    smbus_xfer_t x = {
+        .op = cfg->shape == BENCH_WORD ? SMBUS_READ_WORD : SMBUS_BLOCK_READ,
+        .addr = cfg->addr,
+        .cmd = cfg->wdata[0],
+        .pec = cfg->pec,
+        .rmax = SMBUS_BLOCK_MAX,
+    };
+    uint8_t rbuf[BENCH_MAX_READ];
+    int64_t start = esp_timer_get_time();
+    int64_t now = start;
+
+    while (now - start < duration_us)
+    {
+        int err = path == BENCH_SMBUS ? smbus_run(&x)
+                                      : i2c_write_read(cfg->addr, cfg->wdata, cfg->wlen, rbuf, cfg->rlen);
+        int64_t end = esp_timer_get_time();
+        bench_record(run, err, (uint32_t)(end - now));
+        now = end;
+    }
+    run->elapsed_us = now - start;
+}
+
+static void bench_async_done(i2c_xfer_t *xfer)
+{
+    *(int64_t *)xfer->ctx = esp_timer_get_time();
+}
+
+/* async: keep `depth` transfers queued on the I2C worker */
+static void bench_async(const bench_cfg_t *cfg, int depth, int64_t duration_us, bench_run_t *run)
+{
+    i2c_xfer_t xfers[BENCH_MAX_DEPTH];
+    uint8_t rbuf[BENCH_MAX_DEPTH][BENCH_MAX_READ];
+    int64_t submitted[BENCH_MAX_DEPTH];
+    int64_t done[BENCH_MAX_DEPTH];
+    int64_t start = esp_timer_get_time();
+    int inflight = 0;
+
+    for (int i = 0; i < depth; i++)
+    {
+        xfers[i] = (i2c_xfer_t){
+            .addr = cfg->addr,
+            .wdata = cfg->wdata,
+            .wlen = cfg->wlen,
+            .rdata = rbuf[i],
+            .rlen = cfg->rlen,
+            .done = bench_async_done,
+            .ctx = &done[i],
+            .notify = xTaskGetCurrentTaskHandle(),
+        };
+        submitted[i] = esp_timer_get_time();
+        if (i2c_submit(&xfers[i]) == ESP_OK)
+        {
+            inflight++;
+        }
+        else
+        {
+            submitted[i] = 0;
+            bench_record(run, ESP_ERR_NO_MEM, 0);
+        }
+    }
+
+    while (inflight)
+    {
+        ulTaskNotifyTakeIndexed(I2C_NOTIFY_INDEX, pdTRUE, pdMS_TO_TICKS(100));
+        for (int i = 0; i < depth; i++)
+        {
+            if (!submitted[i] || __atomic_load_n(&xfers[i].busy, __ATOMIC_ACQUIRE))
+            {
+                continue;
+            }
+            bench_record(run, xfers[i].err, (uint32_t)(done[i] - submitted[i]));
+            inflight--;
+            submitted[i] = 0;
+
+            int64_t now = esp_timer_get_time();
+            if (now - start < duration_us)
+            {
+                submitted[i] = now;
+                if (i2c_submit(&xfers[i]) == ESP_OK)
+                {
+                    inflight++;
+                }
+                else
+                {
+                    submitted[i] = 0;
+                    bench_record(run, ESP_ERR_NO_MEM, 0);
+                }
+            }
+        }
+    }
+    run->elapsed_us = esp_timer_get_time() - start;
+}
+
+/* ---- console command ---- */
+
+static struct
+{
+    struct arg_int *addr;
+    struct arg_str *shape;
+    struct arg_str *path;
+    struct arg_int *cmd;
+    struct arg_int *wlen;
+    struct arg_int *rlen;
+    struct arg_int *khz;
+    struct arg_int *time;
+    struct arg_int *depth;
+    struct arg_lit *pec;
+    struct arg_end *end;
+} i2c_bench_args;
+
+static int bench_lookup(struct arg_str *arg, const char *const *names, int count, bool *sel)
+{
+    for (int i = 0; i < count; i++)
+    {
+        sel[i] = arg->count == 0;
+    }
+    for (int a = 0; a < arg->count; a++)
+    {
+        int i = 0;
+        while (i < count && strcmp(arg->sval[a], names[i]) != 0)
+        {
+            i++;
+        }
+        if (i == count)
+        {
+            printf("Unknown '%s'\n", arg->sval[a]);
+            return 1;
+        }
+        sel[i] = true;
+    }
+    return 0;
+}
+
+static void bench_shape(const bench_cfg_t *base, bench_shape_t shape, bench_cfg_t *cfg)
+{
+    *cfg = *base;
+    cfg->shape = shape;
+    if (shape == BENCH_WORD)
+    {
+        cfg->wlen = 1;
+        cfg->rlen = 2 + cfg->pec;
+    }
+    else if (shape == BENCH_BLOCK)
+    {
+        cfg->wlen = 1;
+        cfg->rlen = 1 + SMBUS_BLOCK_MAX + cfg->pec;
+    }
+    else
+    {
+        /* not an SMBus protocol, the PEC does not apply */
+        cfg->pec = false;
+    }
+}
+
+static int cmd_i2c_bench(int argc, char **argv)
+{
+    int nerrors = arg_parse(argc, argv, (void **)&i2c_bench_args);
+    if (nerrors != 0)
+    {
+        arg_print_errors(stderr, i2c_bench_args.end, argv[0]);
+        return 1;
+    }
+
+    bool shapes[BENCH_SHAPES];
+    bool paths[BENCH_PATHS];
+    if (bench_lookup(i2c_bench_args.shape, s_shape_names, BENCH_SHAPES, shapes) ||
+        bench_lookup(i2c_bench_args.path, s_path_names, BENCH_PATHS, paths))
+    {
+        return 1;
+    }
+
+    bench_cfg_t base = {
+        .addr = (uint8_t)i2c_bench_args.addr->ival[0],
+        .pec = i2c_bench_args.pec->count > 0,
+        .wlen = (uint8_t)(i2c_bench_args.wlen->count ? i2c_bench_args.wlen->ival[0] : 2),
+        .rlen = (uint8_t)(i2c_bench_args.rlen->count ? i2c_bench_args.rlen->ival[0] : 8),
+    };
+    base.wdata[0] = (uint8_t)(i2c_bench_args.cmd->count ? i2c_bench_args.cmd->ival[0] : 0x09);
+    int64_t duration_us = (i2c_bench_args.time->count ? i2c_bench_args.time->ival[0] : BENCH_DEFAULT_MS) * 1000LL;
+    int depth = i2c_bench_args.depth->count ? i2c_bench_args.depth->ival[0] : BENCH_DEFAULT_DEPTH;
+
+    if (base.addr < 0x08 || base.addr > 0x77 || base.wlen < 1 || base.wlen > BENCH_MAX_WRITE || base.rlen < 1 ||
+        base.rlen > BENCH_MAX_READ || duration_us <= 0 || depth < 1 || depth > BENCH_MAX_DEPTH)
+    {
+        printf("Invalid address, -w (1..%d), -r (1..%d), -t or -d (1..%d)\n", BENCH_MAX_WRITE, BENCH_MAX_READ,
+               BENCH_MAX_DEPTH);
+        return 1;
+    }
+
+    uint32_t speeds[BENCH_MAX_SPEEDS] = {100000, 400000};
+    int nspeeds = 2;
+    if (i2c_bench_args.khz->count)
+    {
+        nspeeds = i2c_bench_args.khz->count;
+        for (int i = 0; i < nspeeds; i++)
+        {
+            if (i2c_bench_args.khz->ival[i] < 10 || i2c_bench_args.khz->ival[i] > 400)
+            {
+                printf("--khz must be 10..400\n");
+                return 1;
+            }
+            speeds[i] = (uint32_t)i2c_bench_args.khz->ival[i] * 1000;
+        }
+    }
+
+    bench_run_t run = {.rng = (uint32_t)esp_timer_get_time()};
+    run.lat_us = malloc(BENCH_SAMPLES * sizeof(run.lat_us[0]));
+    if (!run.lat_us)
+    {
+        ESP_LOGE(TAG, "No memory for latency samples");
+        return 1;
+    }
+
+    for (int s = 0; s < nspeeds; s++)
+    {
+        uint32_t hz = speeds[s];
+        bool other_clock = hz != I2C_SPEED_HZ;
+
+        printf("\n0x%02X at %" PRIu32 " kHz, %" PRId64 " ms per run%s\n", base.addr, hz / 1000, duration_us / 1000,
+               base.pec ? ", PEC" : "");
+        printf("%-6s %-9s %8s %9s %6s %6s %6s %6s %7s %6s\n", "shape", "path", "tx/s", "B/s", "p50us", "p90us",
+               "p99us", "maxus", "errors", "wire");
+
+        for (int shape = 0; shape < BENCH_SHAPES; shape++)
+        {
+            bench_cfg_t cfg;
+
+            if (!shapes[shape])
+            {
+                continue;
+            }
+            bench_shape(&base, shape, &cfg);
+            for (int path = 0; path < BENCH_PATHS; path++)
+            {
+                if (!paths[path] || (path == BENCH_SMBUS && shape == BENCH_WRITE_READ))
+                {
+                    continue;
+                }
+                if (path == BENCH_ASYNC && other_clock)
+                {
+                    /* the worker cannot get the bus while it is held at this clock */
+                    printf("%-6s %-9s skipped, only at %d kHz\n", s_shape_names[shape], s_path_names[path],
+                           I2C_SPEED_HZ / 1000);
+                    continue;
+                }
+
+                run.ok = run.errors = run.max_us = 0;
+                if (path == BENCH_ASYNC)
+                {
+                    bench_async(&cfg, depth, duration_us, &run);
+                }
+                else
+                {
+                    /* the gauges only see the bus idle while it runs at another clock */
+                    i2c_lock();
+                    if (other_clock)
+                    {
+                        i2c_set_speed(hz);
+                    }
+                    bench_sync(&cfg, path, duration_us, &run);
+                    if (other_clock)
+                    {
+                        i2c_set_speed(0);
+                    }
+                    i2c_unlock();
+                }
+                bench_print(&cfg, path, &run, hz);
+            }
+        }
+    }
+
+    free(run.lat_us);
+    return 0;
+}
+
+void i2c_bench_start(void)
+{
+    i2c_bench_args.addr = arg_int1(NULL, NULL, "<addr>", "Target address, e.g. 0x0b");
+    i2c_bench_args.shape = arg_strn("s", "shape", "<word|block|wr>", 0, BENCH_SHAPES, "Transaction shapes (default: all)");
+    i2c_bench_args.path = arg_strn("p", "path", "<blocking|smbus|async>", 0, BENCH_PATHS, "Transfer paths (default: all)");
+    i2c_bench_args.cmd = arg_int0("c", "cmd", "<cmd>", "Command / first byte written (default 0x09, Voltage())");
+    i2c_bench_args.wlen = arg_int0("w", "wlen", "<bytes>", "wr: bytes written incl. the command (default 2)");
+    i2c_bench_args.rlen = arg_int0("r", "rlen", "<bytes>", "wr: bytes read (default 8)");
+    i2c_bench_args.khz = arg_intn(NULL, "khz", "<10..400>", 0, BENCH_MAX_SPEEDS, "Bus clocks to run at (default 100 and 400)");
+    i2c_bench_args.time = arg_int0("t", "time", "<ms>", "Duration of each run (default 500)");
+    i2c_bench_args.depth = arg_int0("d", "depth", "<n>", "async: transfers kept queued (default 4)");
+    i2c_bench_args.pec = arg_lit0(NULL, "pec", "Clock in (and for smbus: check) the SMBus PEC");
+    i2c_bench_args.end = arg_end(10);
+
+    const esp_console_cmd_t bench_cmd = {
+        .command = "i2c_bench",
+        .help = "Measure transactions/s, bytes/s, latency and errors per bus clock, transaction shape and transfer path",
+        .hint = NULL,
+        .func = &cmd_i2c_bench,
+        .argtable = &i2c_bench_args,
+    };
+    ESP_ERROR_CHECK(esp_console_cmd_register(&bench_cmd));
+}
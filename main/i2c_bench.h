@@ -0,0 +1,17 @@
+#pragma once
+
+/*
+ * i2c_bench - what a fixture's bus can sustain.
+ *
+ * Runs transaction shapes (word read, 32 byte SBS block read, a generic
+ * write-read) against one address for a fixed time per bus clock and per
+ * transfer path:
+ *
+ *   blocking  i2c_write_read(), one call per transaction
+ *   smbus     smbus_run() on a reused transaction (word / block only, PEC optional)
+ *   async     i2c_submit() with several transfers queued on the I2C worker
+ *
+ * and reports transactions/s, payload bytes/s, latency percentiles, error
+ * rate and the share of the bus time the transactions used on the wire.
+ */
+void i2c_bench_start(void);
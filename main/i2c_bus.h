@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "i2c.h"
+
+/*
+ * Bus backends behind i2c.c: i2c_esp.c drives I2C_NUM_0 on the ESP32,
+ * i2c_linux.c a /dev/i2c-N adapter (or the simulator in i2c_sim.c) in the
+ * native Linux build. i2c.c holds i2c_lock() around every call.
+ */
+esp_err_t i2c_bus_init(void);
+esp_err_t i2c_bus_set_speed(uint32_t hz);
+int i2c_bus_transfer(const i2c_msg_t *msgs, size_t count);
+int i2c_bus_write_nostop(uint8_t addr, const uint8_t *data, size_t len);
@@ -0,0 +1,76 @@
+/* i2c_esp.c - I2C_NUM_0 backend of i2c.c on the ESP32, see i2c_bus.h */
+#include "driver/gpio.h"
+#include "driver/i2c.h"
+#include "freertos/FreeRTOS.h"
+
+#include "i2c.h"
+#include "i2c_bus.h"
+#include "gpio_config.h"
+
+#define I2C_TIMEOUT_MS 100
+
+/* Command link of the running transaction, only touched under i2c_lock() */
+static uint8_t s_link[I2C_LINK_RECOMMENDED_SIZE(I2C_MAX_MSGS)];
+
+static esp_err_t i2c_esp_run(const i2c_msg_t *msgs, size_t count, bool stop)
+{
+    i2c_cmd_handle_t cmd = i2c_cmd_link_create_static(s_link, sizeof(s_link));
+    if (!cmd)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        const i2c_msg_t *msg = &msgs[i];
+
+        i2c_master_start(cmd);
+        i2c_master_write_byte(cmd, (uint8_t)(msg->addr << 1) | (msg->read ? I2C_MASTER_READ : I2C_MASTER_WRITE), true);
+        if (msg->len && msg->read)
+        {
+            i2c_master_read(cmd, msg->buf, msg->len, I2C_MASTER_LAST_NACK);
+        }
+        else if (msg->len)
+        {
+            i2c_master_write(cmd, msg->buf, msg->len, true);
+        }
+    }
+    if (stop)
+    {
+        i2c_master_stop(cmd);
+    }
+
+    esp_err_t ret = i2c_master_cmd_begin(I2C_NUM_0, cmd, pdMS_TO_TICKS(I2C_TIMEOUT_MS));
+    i2c_cmd_link_delete_static(cmd);
+    return ret;
+}
+
+int i2c_bus_transfer(const i2c_msg_t *msgs, size_t count)
+{
+    return i2c_esp_run(msgs, count, true);
+}
+
+int i2c_bus_write_nostop(uint8_t addr, const uint8_t *data, size_t len)
+{
+    i2c_msg_t msg = {.addr = addr, .buf = (uint8_t *)data, .len = len};
+    return i2c_esp_run(&msg, 1, false);
+}
+
+esp_err_t i2c_bus_set_speed(uint32_t hz)
+{
+    i2c_config_t conf = {
+        .mode = I2C_MODE_MASTER,
+        .sda_io_num = GPIO_I2C_SDA,
+        .scl_io_num = GPIO_I2C_SCL,
+        .sda_pullup_en = 1,
+        .scl_pullup_en = 1,
+        .master.clk_speed = hz,
+        .clk_flags = 0};
+    return i2c_param_config(I2C_NUM_0, &conf);
+}
+
+esp_err_t i2c_bus_init(void)
+{
+    i2c_bus_set_speed(I2C_SPEED_HZ);
+    return i2c_driver_install(I2C_NUM_0, I2C_MODE_MASTER, 0, 0, 0);
+}
@@ -0,0 +1,242 @@
+/* i2c_linux.c - backend of i2c.c for the native Linux build, see i2c_bus.h */
+#include <errno.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+
+#include "esp_log.h"
+
+#include "i2c.h"
+#include "i2c_bus.h"
+#include "i2c_sim.h"
+#include "smbus.h"
+
+/*
+ * The adapter comes from the I2C_DEV environment variable, e.g.
+ * I2C_DEV=/dev/i2c-1. Without it (or with I2C_DEV=sim) the simulated bus of
+ * i2c_sim.c is used.
+ *
+ * A transaction goes out as one I2C_RDWR ioctl, so the repeated start of a
+ * write-read stays on the wire and each access costs one system call.
+ * Adapters without plain I2C support (SMBus controllers, the i2c-stub
+ * module) get the matching SMBus ioctl instead.
+ */
+
+static const char *TAG = "i2c_linux";
+
+static int s_fd = -1;         /* -1: simulated bus */
+static bool s_smbus_only;
+static int s_slave = -1;      /* address set with I2C_SLAVE for the SMBus ioctls */
+static bool s_pec;            /* I2C_PEC set: the adapter appends and checks PECs */
+
+static int i2c_linux_err(int err)
+{
+    /* adapters report a NACK as ENXIO, EREMOTEIO or EIO depending on the driver */
+    return err == ETIMEDOUT ? ESP_ERR_TIMEOUT : err == EBADMSG ? ESP_ERR_INVALID_CRC : ESP_FAIL;
+}
+
+static int i2c_linux_set_pec(bool on)
+{
+    if (s_pec != on)
+    {
+        if (ioctl(s_fd, I2C_PEC, on ? 1UL : 0UL) < 0)
+        {
+            return i2c_linux_err(errno);
+        }
+        s_pec = on;
+    }
+    return ESP_OK;
+}
+
+static int i2c_linux_smbus(uint8_t addr, char rw, uint8_t cmd, int size, union i2c_smbus_data *data)
+{
+    if (s_slave != addr)
+    {
+        if (ioctl(s_fd, I2C_SLAVE, addr) < 0)
+        {
+            return i2c_linux_err(errno);
+        }
+        s_slave = addr;
+    }
+
+    struct i2c_smbus_ioctl_data args = {.read_write = rw, .command = cmd, .size = size, .data = data};
+    return ioctl(s_fd, I2C_SMBUS, &args) < 0 ? i2c_linux_err(errno) : ESP_OK;
+}
+
+/*
+ * Map a transaction onto the SMBus ioctls. Writes of 3 bytes and more and
+ * write-reads of more than 2 bytes go out as "I2C block" transfers, which
+ * put the same bytes on the wire as a word or SBS block access.
+ *
+ * Reads longer than an I2C block can only be SBS block reads sized for the
+ * longest block: the count byte, 32 data bytes and, with 34 bytes, the PEC.
+ * They go out as SMBus block reads, whose length the adapter takes from the
+ * count byte. The adapter checks the PEC, so the PEC byte handed back is
+ * rebuilt from the bytes on the wire for the caller to check again.
+ */
+static int i2c_linux_smbus_xfer(const i2c_msg_t *msgs, size_t count)
+{
+    const i2c_msg_t *w = &msgs[0];
+    union i2c_smbus_data data;
+
+    /* only an SBS block read asks for a PEC, the other accesses carry their own */
+    int err = i2c_linux_set_pec(count == 2 && msgs[1].len > 1 + I2C_SMBUS_BLOCK_MAX);
+    if (err)
+    {
+        return err;
+    }
+
+    if (count == 1 && !w->len)
+    {
+        return i2c_linux_smbus(w->addr, w->read ? I2C_SMBUS_READ : I2C_SMBUS_WRITE, 0, I2C_SMBUS_QUICK, NULL);
+    }
+    if (count == 1 && w->read)
+    {
+        if (w->len != 1)
+        {
+            return ESP_ERR_NOT_SUPPORTED;
+        }
+        err = i2c_linux_smbus(w->addr, I2C_SMBUS_READ, 0, I2C_SMBUS_BYTE, &data);
+        w->buf[0] = data.byte;
+        return err;
+    }
+    if (count == 1)
+    {
+        if (w->len == 1)
+        {
+            return i2c_linux_smbus(w->addr, I2C_SMBUS_WRITE, w->buf[0], I2C_SMBUS_BYTE, NULL);
+        }
+        if (w->len - 1 > I2C_SMBUS_BLOCK_MAX)
+        {
+            return ESP_ERR_NOT_SUPPORTED;
+        }
+        if (w->len == 2)
+        {
+            data.byte = w->buf[1];
+            return i2c_linux_smbus(w->addr, I2C_SMBUS_WRITE, w->buf[0], I2C_SMBUS_BYTE_DATA, &data);
+        }
+        data.block[0] = (uint8_t)(w->len - 1);
+        memcpy(&data.block[1], &w->buf[1], w->len - 1);
+        return i2c_linux_smbus(w->addr, I2C_SMBUS_WRITE, w->buf[0], I2C_SMBUS_I2C_BLOCK_DATA, &data);
+    }
+
+    const i2c_msg_t *r = &msgs[1];
+    if (w->read || !r->read || w->len != 1 || r->addr != w->addr || !r->len || r->len > 1 + I2C_SMBUS_BLOCK_MAX + 1)
+    {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    if (r->len > I2C_SMBUS_BLOCK_MAX)
+    {
+        err = i2c_linux_smbus(w->addr, I2C_SMBUS_READ, w->buf[0], I2C_SMBUS_BLOCK_DATA, &data);
+        if (err)
+        {
+            return err;
+        }
+        size_t n = 1 + (size_t)data.block[0];
+        memcpy(r->buf, data.block, n);
+        memset(&r->buf[n], 0xFF, r->len - n);
+        if (r->len > 1 + I2C_SMBUS_BLOCK_MAX)
+        {
+            uint8_t addr_w = SMBUS_ADDR_W(w->addr);
+            uint8_t addr_r = SMBUS_ADDR_R(w->addr);
+            uint8_t crc = smbus_pec(smbus_pec(0, &addr_w, 1), w->buf, 1);
+            crc = smbus_pec(crc, &addr_r, 1);
+            r->buf[n] = smbus_pec(crc, r->buf, n);
+        }
+        return ESP_OK;
+    }
+    int size = r->len == 1 ? I2C_SMBUS_BYTE_DATA : r->len == 2 ? I2C_SMBUS_WORD_DATA : I2C_SMBUS_I2C_BLOCK_DATA;
+    data.block[0] = (uint8_t)r->len;
+    err = i2c_linux_smbus(w->addr, I2C_SMBUS_READ, w->buf[0], size, &data);
+    if (!err && size == I2C_SMBUS_I2C_BLOCK_DATA)
+    {
+        memcpy(r->buf, &data.block[1], r->len);
+    }
+    else if (!err)
+    {
+        r->buf[0] = (uint8_t)data.word;
+        if (r->len == 2)
+        {
+            r->buf[1] = (uint8_t)(data.word >> 8);
+        }
+    }
+    return err;
+}
+
+int i2c_bus_transfer(const i2c_msg_t *msgs, size_t count)
+{
+    if (s_fd < 0)
+    {
+        return i2c_sim_transfer(msgs, count);
+    }
+    /* most adapters reject zero length messages, a quick command works everywhere */
+    if (s_smbus_only || (count == 1 && !msgs[0].len))
+    {
+        return i2c_linux_smbus_xfer(msgs, count);
+    }
+
+    struct i2c_msg kmsgs[I2C_MAX_MSGS];
+    for (size_t i = 0; i < count; i++)
+    {
+        kmsgs[i] = (struct i2c_msg){
+            .addr = msgs[i].addr,
+            .flags = msgs[i].read ? I2C_M_RD : 0,
+            .len = (uint16_t)msgs[i].len,
+            .buf = msgs[i].buf,
+        };
+    }
+    struct i2c_rdwr_ioctl_data rdwr = {.msgs = kmsgs, .nmsgs = (uint32_t)count};
+    return ioctl(s_fd, I2C_RDWR, &rdwr) < 0 ? i2c_linux_err(errno) : ESP_OK;
+}
+
+/* i2c-dev always ends a transfer with a stop */
+int i2c_bus_write_nostop(uint8_t addr, const uint8_t *data, size_t len)
+{
+    (void)addr;
+    (void)data;
+    (void)len;
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+/* The clock is set by the adapter driver (device tree, module parameter) */
+esp_err_t i2c_bus_set_speed(uint32_t hz)
+{
+    if (s_fd >= 0 && hz != I2C_SPEED_HZ)
+    {
+        ESP_LOGW(TAG, "Bus clock is fixed by the adapter, %" PRIu32 " Hz not applied", hz);
+    }
+    return ESP_OK;
+}
+
+esp_err_t i2c_bus_init(void)
+{
+    const char *dev = getenv("I2C_DEV");
+    unsigned long funcs = 0;
+
+    if (!dev || !*dev || !strcmp(dev, "sim"))
+    {
+        ESP_LOGI(TAG, "No I2C_DEV given, using the simulated bus");
+        i2c_sim_init();
+        return ESP_OK;
+    }
+
+    s_fd = open(dev, O_RDWR);
+    if (s_fd < 0)
+    {
+        ESP_LOGE(TAG, "%s: %s, using the simulated bus", dev, strerror(errno));
+        i2c_sim_init();
+        return ESP_FAIL;
+    }
+    if (ioctl(s_fd, I2C_FUNCS, &funcs) < 0)
+    {
+        funcs = 0;
+    }
+    s_smbus_only = !(funcs & I2C_FUNC_I2C);
+    ESP_LOGI(TAG, "Using %s (%s)", dev, s_smbus_only ? "SMBus ioctls" : "I2C_RDWR");
+    return ESP_OK;
+}
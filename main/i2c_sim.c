@@ -0,0 +1,288 @@
+/* i2c_sim.c - simulated I2C devices for the native Linux build, see i2c_sim.h */
+#include <string.h>
+#include <sys/param.h>
+#include "esp_err.h"
+#include "esp_timer.h"
+
+#include "i2c_sim.h"
+#include "smbus.h"
+#include "bq.h"
+
+#define SIM_GAUGE_ADDR BQ40Z555_I2C_ADDR
+#define SIM_EEPROM_ADDR 0x50
+#define SIM_MUX_ADDR BQ_MUX_I2C_ADDR
+
+#define SIM_TIME_SCALE 60
+#define SIM_CELLS 3
+#define SIM_FCC_MAH 4400
+#define SIM_DSG_MA (-1500)
+#define SIM_CHG_MA 2000
+#define SIM_IR_MOHM 50
+
+#define SIM_EEPROM_SIZE 256
+#define SIM_EEPROM_PAGE 8
+#define SIM_EEPROM_TWR_US 3000
+
+typedef struct
+{
+    uint8_t addr;
+    /* w: bytes after the write address (NULL: no write phase), r: bytes to read */
+    int (*xfer)(const uint8_t *w, size_t wlen, uint8_t *r, size_t rlen);
+} sim_dev_t;
+
+static struct
+{
+    int64_t last_us;
+    float soc;                /* % */
+    bool charging;
+    uint16_t mba;             /* last ManufacturerBlockAccess() sub-command */
+} s_gauge;
+
+static struct
+{
+    uint8_t mem[SIM_EEPROM_SIZE];
+    uint8_t ptr;
+    int64_t busy_until_us;
+} s_eeprom;
+
+static uint8_t s_mux;
+
+/* ---- BQ40Z555 ---- */
+
+static void sim_gauge_update(void)
+{
+    int64_t now = esp_timer_get_time();
+    float hours = (float)(now - s_gauge.last_us) * SIM_TIME_SCALE / 3600e6f;
+
+    s_gauge.last_us = now;
+    s_gauge.soc += (s_gauge.charging ? SIM_CHG_MA : SIM_DSG_MA) * hours * 100.0f / SIM_FCC_MAH;
+    if (s_gauge.soc <= 5.0f)
+    {
+        s_gauge.soc = 5.0f;
+        s_gauge.charging = true;
+    }
+    else if (s_gauge.soc >= 100.0f)
+    {
+        s_gauge.soc = 100.0f;
+        s_gauge.charging = false;
+    }
+}
+
+static int16_t sim_gauge_current(void)
+{
+    return s_gauge.soc >= 100.0f ? 0 : s_gauge.charging ? SIM_CHG_MA : SIM_DSG_MA;
+}
+
+/* roughly linear OCV from 3.0 V to 4.2 V plus the IR drop, cells slightly apart */
+static uint16_t sim_gauge_cell_mv(int cell)
+{
+    static const int8_t spread[SIM_CELLS] = {0, 6, -4};
+    return (uint16_t)(3000 + 12 * s_gauge.soc + sim_gauge_current() * SIM_IR_MOHM / 1000 + spread[cell]);
+}
+
+static size_t sim_put_word(uint8_t *resp, uint16_t val)
+{
+    resp[0] = (uint8_t)val;
+    resp[1] = (uint8_t)(val >> 8);
+    return 2;
+}
+
+static size_t sim_put_block(uint8_t *resp, const void *data, size_t len)
+{
+    resp[0] = (uint8_t)len;
+    memcpy(&resp[1], data, len);
+    return 1 + len;
+}
+
+/* Response of SBS command `cmd`, without PEC */
+static size_t sim_gauge_response(uint8_t cmd, uint8_t *resp)
+{
+    uint16_t rc = (uint16_t)(s_gauge.soc * SIM_FCC_MAH / 100);
+    uint8_t zeros[SMBUS_BLOCK_MAX] = {0};
+    uint32_t opstatus = s_gauge.charging ? BQ40Z555_OPSTATUS_CHG : BQ40Z555_OPSTATUS_DSG;
+
+    switch (cmd)
+    {
+    case BQ40Z555_CMD_TEMPERATURE:
+        return sim_put_word(resp, 2981 + (uint16_t)(s_gauge.charging ? 40 : 20));
+    case BQ40Z555_CMD_VOLTAGE:
+        return sim_put_word(resp, sim_gauge_cell_mv(0) + sim_gauge_cell_mv(1) + sim_gauge_cell_mv(2));
+    case BQ40Z555_CMD_CURRENT:
+    case BQ40Z555_CMD_AVERAGE_CURRENT:
+        return sim_put_word(resp, (uint16_t)sim_gauge_current());
+    case BQ40Z555_CMD_RELATIVE_STATE_OF_CHARGE:
+    case BQ40Z555_CMD_ABSOLUTE_STATE_OF_CHARGE:
+        return sim_put_word(resp, (uint16_t)s_gauge.soc);
+    case BQ40Z555_CMD_REMAINING_CAPACITY:
+        return sim_put_word(resp, rc);
+    case BQ40Z555_CMD_FULL_CHARGE_CAPACITY:
+        return sim_put_word(resp, SIM_FCC_MAH);
+    case BQ40Z555_CMD_DESIGN_CAPACITY:
+        return sim_put_word(resp, 4800);
+    case BQ40Z555_CMD_DESIGN_VOLTAGE:
+        return sim_put_word(resp, 11100);
+    case BQ40Z555_CMD_CYCLE_COUNT:
+        return sim_put_word(resp, 123);
+    case BQ40Z555_CMD_MANUFACTURER_DATE:
+        return sim_put_word(resp, (uint16_t)(((2021 - 1980) << 9) | (6 << 5) | 15));
+    case BQ40Z555_CMD_SERIAL_NUMBER:
+        return sim_put_word(resp, 0x5151);
+    case BQ40Z555_CMD_STATE_OF_HEALTH:
+        return sim_put_word(resp, 92);
+    case BQ40Z555_CMD_BATTERY_STATUS:
+        return sim_put_word(resp, (uint16_t)(s_gauge.charging ? 0 : BQ40Z555_BATTSTATUS_DSG) |
+                                      (s_gauge.soc >= 100.0f ? BQ40Z555_BATTSTATUS_FC : 0) |
+                                      (s_gauge.soc <= 5.0f ? BQ40Z555_BATTSTATUS_FD : 0));
+    case BQ40Z555_CMD_CELL_VOLTAGE1:
+    case BQ40Z555_CMD_CELL_VOLTAGE2:
+    case BQ40Z555_CMD_CELL_VOLTAGE3:
+        return sim_put_word(resp, sim_gauge_cell_mv(BQ40Z555_CMD_CELL_VOLTAGE1 - cmd));
+    case BQ40Z555_CMD_MANUFACTURER_NAME:
+        return sim_put_block(resp, "SIM", 3);
+    case BQ40Z555_CMD_DEVICE_NAME:
+        return sim_put_block(resp, "bq40z555-sim", 12);
+    case BQ40Z555_CMD_DEVICE_CHEMISTRY:
+        return sim_put_block(resp, "LION", 4);
+    case BQ40Z555_CMD_OPERATION_STATUS:
+        return sim_put_block(resp, &opstatus, sizeof(opstatus));
+    case BQ40Z555_CMD_MANUFACTURER_DATA:
+        return sim_put_block(resp, zeros, SMBUS_BLOCK_MAX);
+    case BQ40Z555_CMD_MANUFACTURER_BLOCK_ACCESS:
+        sim_put_word(zeros, s_gauge.mba);
+        return sim_put_block(resp, zeros, SMBUS_BLOCK_MAX);
+    default:
+        break;
+    }
+
+    /* everything else reads as zeros of the size bq.c expects */
+    const bq_entry *entry = bq_find_entry(cmd);
+    if (!entry || entry->read_len <= 2)
+    {
+        return sim_put_word(resp, 0);
+    }
+    return sim_put_block(resp, zeros, MIN(entry->read_len - 1, SMBUS_BLOCK_MAX));
+}
+
+static int sim_gauge_xfer(const uint8_t *w, size_t wlen, uint8_t *r, size_t rlen)
+{
+    uint8_t resp[1 + SMBUS_BLOCK_MAX + 1];
+
+    if (!wlen)
+    {
+        /* quick command (wake) or receive byte */
+        if (r)
+        {
+            memset(r, 0xFF, rlen);
+        }
+        return ESP_OK;
+    }
+
+    sim_gauge_update();
+    if (!r)
+    {
+        if (w[0] == BQ40Z555_CMD_MANUFACTURER_BLOCK_ACCESS && wlen >= 4 && w[1] >= 2)
+        {
+            s_gauge.mba = (uint16_t)(w[2] | (w[3] << 8));
+        }
+        return ESP_OK;
+    }
+
+    /* the gauge always sends the PEC, the master decides whether it clocks it in */
+    size_t n = sim_gauge_response(w[0], resp);
+    uint8_t addr_w = SMBUS_ADDR_W(SIM_GAUGE_ADDR);
+    uint8_t addr_r = SMBUS_ADDR_R(SIM_GAUGE_ADDR);
+    uint8_t crc = smbus_pec(smbus_pec(0, &addr_w, 1), w, wlen);
+    crc = smbus_pec(smbus_pec(crc, &addr_r, 1), resp, n);
+    resp[n++] = crc;
+
+    memcpy(r, resp, MIN(n, rlen));
+    if (rlen > n)
+    {
+        memset(&r[n], 0xFF, rlen - n);
+    }
+    return ESP_OK;
+}
+
+/* ---- 24C02 and TCA9548A ---- */
+
+static int sim_eeprom_xfer(const uint8_t *w, size_t wlen, uint8_t *r, size_t rlen)
+{
+    int64_t now = esp_timer_get_time();
+
+    if (now < s_eeprom.busy_until_us)
+    {
+        return ESP_FAIL;
+    }
+    if (wlen)
+    {
+        s_eeprom.ptr = w[0];
+        if (!r && wlen > 1)
+        {
+            /* the address rolls over within the page */
+            uint8_t page = s_eeprom.ptr & (uint8_t)~(SIM_EEPROM_PAGE - 1);
+            for (size_t i = 1; i < wlen; i++)
+            {
+                s_eeprom.mem[page | ((s_eeprom.ptr + i - 1) & (SIM_EEPROM_PAGE - 1))] = w[i];
+            }
+            s_eeprom.busy_until_us = now + SIM_EEPROM_TWR_US;
+        }
+    }
+    for (size_t i = 0; r && i < rlen; i++)
+    {
+        r[i] = s_eeprom.mem[s_eeprom.ptr++];
+    }
+    return ESP_OK;
+}
+
+static int sim_mux_xfer(const uint8_t *w, size_t wlen, uint8_t *r, size_t rlen)
+{
+    if (wlen)
+    {
+        s_mux = w[wlen - 1];
+    }
+    if (r)
+    {
+        memset(r, s_mux, rlen);
+    }
+    return ESP_OK;
+}
+
+static const sim_dev_t s_devs[] = {
+    {SIM_GAUGE_ADDR, sim_gauge_xfer},
+    {SIM_EEPROM_ADDR, sim_eeprom_xfer},
+    {SIM_MUX_ADDR, sim_mux_xfer},
+};
+
+/* ---- Bus ---- */
+
+int i2c_sim_transfer(const i2c_msg_t *msgs, size_t count)
+{
+    const sim_dev_t *dev = NULL;
+
+    for (size_t i = 0; i < sizeof(s_devs) / sizeof(s_devs[0]); i++)
+    {
+        if (s_devs[i].addr == msgs[0].addr)
+        {
+            dev = &s_devs[i];
+        }
+    }
+    if (!dev)
+    {
+        return ESP_FAIL;
+    }
+    if (count > 1 && (msgs[1].addr != msgs[0].addr || msgs[0].read || !msgs[1].read))
+    {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+
+    const i2c_msg_t *w = msgs[0].read ? NULL : &msgs[0];
+    const i2c_msg_t *r = msgs[count - 1].read ? &msgs[count - 1] : NULL;
+    return dev->xfer(w ? w->buf : NULL, w ? w->len : 0, r ? r->buf : NULL, r ? r->len : 0);
+}
+
+void i2c_sim_init(void)
+{
+    s_gauge.last_us = esp_timer_get_time();
+    s_gauge.soc = 80.0f;
+    memset(s_eeprom.mem, 0xFF, sizeof(s_eeprom.mem));
+}
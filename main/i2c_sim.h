@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stddef.h>
+#include "i2c.h"
+
+/*
+ * Simulated I2C bus for the native Linux build (i2c_linux.c without I2C_DEV).
+ *
+ *   0x0B  BQ40Z555 gauge: 3 cells discharging at 1.5 A and recharging at
+ *         2 A, 60 times faster than real time. Blocks are sized from the
+ *         bq.c command table, ManufacturerAccess / ManufacturerBlockAccess
+ *         answer with zeros, and every read is followed by its PEC.
+ *   0x50  24C02 EEPROM, 8 byte pages, 3 ms write cycle (NACKs meanwhile)
+ *   0x70  TCA9548A mux, all channels lead to the same gauge
+ */
+void i2c_sim_init(void);
+int i2c_sim_transfer(const i2c_msg_t *msgs, size_t count);
@@ -11,19 +11,30 @@
 #include <string.h>
 #include "esp_system.h"
 #include "esp_log.h"
-#include "esp_wifi.h"
 #include "nvs.h"
 #include "nvs_flash.h"
-#include "i2c.h"
+#include "sdkconfig.h"
+#if !CONFIG_IDF_TARGET_LINUX
+#include "esp_netif.h"
+#include "esp_event.h"
 #include "wifi.h"
+#endif
+#include "i2c.h"
+#include "i2c_bench.h"
+#include "eeprom.h"
+#include "regmap.h"
+#include "nettest.h"
 #include "telnet.h"
 #include "cmd.h"
 #include "bq.h"
+#include "timebase.h"
 
 void app_main(void)
 {
+#if !CONFIG_IDF_TARGET_LINUX
     ESP_ERROR_CHECK_WITHOUT_ABORT(esp_netif_init());
     ESP_ERROR_CHECK_WITHOUT_ABORT(esp_event_loop_create_default());
+#endif
 
     /* init NVS */
     esp_err_t err = nvs_flash_init();
@@ -34,8 +45,16 @@ void app_main(void)
     }
 
     i2c_init();
+    i2c_bench_start();
+    eeprom_start();
+    regmap_start();
+#if !CONFIG_IDF_TARGET_LINUX
+    /* the native build uses the host's network */
     wifi_start();
+#endif
     cmd_start();
+    timebase_start();
     bq_start();
     telnet_start();
+    nettest_start();
 }
@@ -0,0 +1,812 @@
+/* nettest.c - iperf compatible throughput / latency test command, see nettest.h */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <sys/param.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_console.h"
+#include "argtable3/argtable3.h"
+#include "sdkconfig.h"
+
+#if CONFIG_IDF_TARGET_LINUX
+/* Native build: host sockets */
+#include <netdb.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#else
+#include "esp_wifi.h"
+#include "lwip/sockets.h"
+#include "lwip/netdb.h"
+#include "lwip/stats.h"
+#endif
+
+#include "nettest.h"
+
+#define NETTEST_PORT 5001           /* iperf 2 default */
+#define NETTEST_DEFAULT_S 10
+#define NETTEST_WAIT_S 60           /* server: how long to wait for a client */
+#define NETTEST_INTERVAL_S 1
+#define NETTEST_TCP_LEN 4096
+#define NETTEST_MAX_TCP_LEN 65536
+#define NETTEST_UDP_LEN 1470        /* iperf 2 default, one Ethernet frame */
+#define NETTEST_MAX_UDP_LEN 1472
+#define NETTEST_UDP_KBPS 1000       /* iperf 2 default */
+#define NETTEST_PINGS 10
+#define NETTEST_MAX_PINGS 100
+#define NETTEST_PING_GAP_MS 100
+#define NETTEST_PING_TIMEOUT_MS 1000
+#define NETTEST_FIN_TRIES 10
+#define NETTEST_FIN_WAIT_MS 250
+#define NETTEST_IDLE_MS 2000        /* server: the client is gone */
+#define NETTEST_SEND_TIMEOUT_MS 5000
+
+#define NETTEST_HEADER_VERSION1 0x80000000u
+
+static const char *TAG = "nettest";
+
+/* Start of every iperf 2 UDP datagram, network byte order */
+typedef struct
+{
+    int32_t id;      /* sequence number, negative on the final datagrams */
+    uint32_t tv_sec; /* send time, any clock: only differences are used */
+    uint32_t tv_usec;
+    uint32_t id2;    /* upper half of 64 bit sequence numbers, unused */
+} nettest_udp_hdr_t;
+
+/* iperf 2 server report, the answer to a final datagram after its header */
+typedef struct
+{
+    uint32_t flags;
+    uint32_t total_len1; /* bytes received, upper half */
+    uint32_t total_len2;
+    uint32_t stop_sec;   /* first to last datagram */
+    uint32_t stop_usec;
+    uint32_t error_cnt;  /* datagrams lost */
+    uint32_t outorder_cnt;
+    uint32_t datagrams;
+    uint32_t jitter1;    /* seconds */
+    uint32_t jitter2;    /* microseconds */
+} nettest_report_t;
+
+/* ICMP echo request / reply */
+typedef struct
+{
+    uint8_t type;
+    uint8_t code;
+    uint16_t csum;
+    uint16_t id;
+    uint16_t seq;
+} nettest_icmp_t;
+
+typedef struct
+{
+    struct sockaddr_in peer;
+    bool udp;
+    int64_t duration_us; /* server: wait for a client */
+    int64_t interval_us; /* 0: no interval reports */
+    size_t len;
+    uint32_t kbps;
+} nettest_cfg_t;
+
+/* Byte counter with interval reports */
+typedef struct
+{
+    int64_t interval_us;
+    int64_t start_us;
+    int64_t last_us;
+    uint64_t bytes;
+    uint64_t last_bytes;
+} nettest_meter_t;
+
+/* ---- reporting ---- */
+
+static void nettest_print_line(const char *label, int64_t from_us, int64_t to_us, uint64_t bytes)
+{
+    double secs = (to_us - from_us) / 1e6;
+
+    printf("%-6s %5.1f-%5.1f s %10.1f KB %8.3f Mbit/s\n", label, from_us / 1e6, to_us / 1e6, bytes / 1024.0,
+           secs > 0 ? bytes * 8 / secs / 1e6 : 0.0);
+}
+
+static void nettest_meter_init(nettest_meter_t *m, int64_t interval_us)
+{
+    *m = (nettest_meter_t){.interval_us = interval_us};
+    m->start_us = m->last_us = esp_timer_get_time();
+}
+
+static void nettest_meter_tick(nettest_meter_t *m, int64_t now)
+{
+    if (!m->interval_us || now - m->last_us < m->interval_us)
+    {
+        return;
+    }
+    nettest_print_line("", m->last_us - m->start_us, now - m->start_us, m->bytes - m->last_bytes);
+    m->last_us = now;
+    m->last_bytes = m->bytes;
+}
+
+static int nettest_cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* ---- platform ---- */
+
+static void nettest_set_timeout(int sock, int optname, int ms)
+{
+    struct timeval tv = {.tv_sec = ms / 1000, .tv_usec = (ms % 1000) * 1000};
+    setsockopt(sock, SOL_SOCKET, optname, &tv, sizeof(tv));
+}
+
+/* Station RSSI in dBm; on Linux the first interface in /proc/net/wireless */
+static bool nettest_rssi(int *dbm)
+{
+#if CONFIG_IDF_TARGET_LINUX
+    FILE *f = fopen("/proc/net/wireless", "r");
+    char line[160];
+    float level;
+    bool ok = false;
+
+    if (!f)
+    {
+        return false;
+    }
+    /* two header lines, then "wlan0: 0000   54.  -56.  -256 ..." */
+    for (int i = 0; !ok && fgets(line, sizeof(line), f); i++)
+    {
+        ok = i >= 2 && sscanf(line, " %*[^:]: %*x %*f %f", &level) == 1;
+    }
+    fclose(f);
+    if (ok)
+    {
+        *dbm = (int)level;
+    }
+    return ok;
+#else
+    wifi_ap_record_t ap;
+
+    if (esp_wifi_sta_get_ap_info(&ap) != ESP_OK)
+    {
+        return false;
+    }
+    *dbm = ap.rssi;
+    return true;
+#endif
+}
+
+/*
+ * TCP retransmits so far, -1 if unknown. Linux counts them per socket, lwIP
+ * only for the whole stack and only with MIB2 statistics enabled; the client
+ * reports the difference over its run.
+ */
+static int32_t nettest_retrans(int sock)
+{
+#if CONFIG_IDF_TARGET_LINUX
+    struct tcp_info ti;
+    socklen_t len = sizeof(ti);
+    return getsockopt(sock, IPPROTO_TCP, TCP_INFO, &ti, &len) == 0 ? (int32_t)ti.tcpi_total_retrans : -1;
+#elif LWIP_STATS && MIB2_STATS
+    (void)sock;
+    return (int32_t)lwip_stats.mib2.tcpretranssegs;
+#else
+    (void)sock;
+    return -1;
+#endif
+}
+
+/* ---- ICMP round trip time ---- */
+
+static uint16_t nettest_csum(const uint8_t *data, size_t len)
+{
+    uint32_t sum = 0;
+
+    for (size_t i = 0; i + 1 < len; i += 2)
+    {
+        sum += (uint32_t)(data[i] << 8 | data[i + 1]);
+    }
+    if (len & 1)
+    {
+        sum += (uint32_t)data[len - 1] << 8;
+    }
+    while (sum >> 16)
+    {
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    }
+    return htons((uint16_t)~sum);
+}
+
+static void nettest_ping(const struct sockaddr_in *peer, int count)
+{
+    uint32_t rtt_us[NETTEST_MAX_PINGS];
+    uint16_t id = (uint16_t)esp_timer_get_time();
+    int sent = 0;
+    int received = 0;
+
+#if CONFIG_IDF_TARGET_LINUX
+    /* unprivileged ping socket (net.ipv4.ping_group_range), the kernel picks the id */
+    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_ICMP);
+#else
+    int sock = socket(AF_INET, SOCK_RAW, IPPROTO_ICMP);
+#endif
+    if (sock < 0)
+    {
+        printf("RTT: no ICMP socket (errno %d)\n", errno);
+        return;
+    }
+    nettest_set_timeout(sock, SO_RCVTIMEO, NETTEST_PING_TIMEOUT_MS);
+
+    for (int seq = 0; seq < count; seq++)
+    {
+        uint8_t pkt[sizeof(nettest_icmp_t) + 8] = {0};
+        nettest_icmp_t *req = (nettest_icmp_t *)pkt;
+
+        req->type = 8;
+        req->id = htons(id);
+        req->seq = htons((uint16_t)seq);
+        req->csum = nettest_csum(pkt, sizeof(pkt));
+
+        int64_t start = esp_timer_get_time();
+        if (sendto(sock, pkt, sizeof(pkt), 0, (const struct sockaddr *)peer, sizeof(*peer)) < 0)
+        {
+            continue;
+        }
+        sent++;
+
+        /* skip replies to other pings */
+        while (esp_timer_get_time() - start < NETTEST_PING_TIMEOUT_MS * 1000LL)
+        {
+            uint8_t rx[64];
+            int n = recv(sock, rx, sizeof(rx), 0);
+            size_t off = 0;
+
+            if (n < 0)
+            {
+                break;
+            }
+#if !CONFIG_IDF_TARGET_LINUX
+            /* raw sockets deliver the IP header */
+            off = (size_t)(rx[0] & 0x0F) * 4;
+#endif
+            const nettest_icmp_t *reply = (const nettest_icmp_t *)&rx[off];
+            bool ours = (size_t)n >= off + sizeof(*reply) && reply->type == 0 && reply->seq == req->seq;
+#if !CONFIG_IDF_TARGET_LINUX
+            /* a raw socket also gets the replies to other tasks' pings; ping sockets filter by id themselves */
+            ours = ours && reply->id == req->id;
+#endif
+            if (ours)
+            {
+                rtt_us[received++] = (uint32_t)(esp_timer_get_time() - start);
+                break;
+            }
+        }
+        vTaskDelay(pdMS_TO_TICKS(NETTEST_PING_GAP_MS));
+    }
+    close(sock);
+
+    printf("RTT (ICMP, idle link): %d sent, %d lost", sent, sent - received);
+    if (received)
+    {
+        qsort(rtt_us, received, sizeof(rtt_us[0]), nettest_cmp_u32);
+        printf(", min/p50/p90/p99/max %.1f/%.1f/%.1f/%.1f/%.1f ms", rtt_us[0] / 1e3, rtt_us[received / 2] / 1e3,
+               rtt_us[received * 9 / 10] / 1e3, rtt_us[received * 99 / 100] / 1e3, rtt_us[received - 1] / 1e3);
+    }
+    printf("\n");
+}
+
+/* ---- TCP ---- */
+
+static int nettest_tcp_client(const nettest_cfg_t *cfg)
+{
+    nettest_meter_t m;
+    int ret = 0;
+
+    int sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (sock < 0)
+    {
+        ESP_LOGE(TAG, "socket: errno %d", errno);
+        return 1;
+    }
+    if (connect(sock, (const struct sockaddr *)&cfg->peer, sizeof(cfg->peer)) != 0)
+    {
+        printf("connect: errno %d\n", errno);
+        close(sock);
+        return 1;
+    }
+    nettest_set_timeout(sock, SO_SNDTIMEO, NETTEST_SEND_TIMEOUT_MS);
+
+    /* all zeros: the iperf 2 header at the start of the stream asks for nothing extra */
+    uint8_t *buf = calloc(1, cfg->len);
+    if (!buf)
+    {
+        close(sock);
+        return 1;
+    }
+
+    int32_t retrans = nettest_retrans(sock);
+    nettest_meter_init(&m, cfg->interval_us);
+    int64_t now = m.start_us;
+    while (now - m.start_us < cfg->duration_us)
+    {
+        int n = send(sock, buf, cfg->len, 0);
+        if (n <= 0)
+        {
+            printf("send: errno %d\n", errno);
+            ret = 1;
+            break;
+        }
+        m.bytes += n;
+        now = esp_timer_get_time();
+        nettest_meter_tick(&m, now);
+    }
+    if (retrans >= 0)
+    {
+        retrans = nettest_retrans(sock) - retrans;
+    }
+    close(sock);
+    free(buf);
+
+    nettest_print_line("total", 0, now - m.start_us, m.bytes);
+    if (retrans >= 0)
+    {
+        printf("TCP retransmits: %" PRId32 "\n", retrans);
+    }
+    else
+    {
+        printf("TCP retransmits: n/a\n");
+    }
+    return ret;
+}
+
+static int nettest_listen(const nettest_cfg_t *cfg, int type)
+{
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = cfg->peer.sin_port,
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+    };
+    int opt = 1;
+
+    int sock = socket(AF_INET, type, type == SOCK_STREAM ? IPPROTO_TCP : IPPROTO_UDP);
+    if (sock < 0)
+    {
+        ESP_LOGE(TAG, "socket: errno %d", errno);
+        return -1;
+    }
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 || (type == SOCK_STREAM && listen(sock, 1) != 0))
+    {
+        printf("Port %u: errno %d\n", ntohs(addr.sin_port), errno);
+        close(sock);
+        return -1;
+    }
+    nettest_set_timeout(sock, SO_RCVTIMEO, (int)(cfg->duration_us / 1000));
+    printf("Waiting %" PRId64 " s for a %s client on port %u\n", cfg->duration_us / 1000000,
+           type == SOCK_STREAM ? "TCP" : "UDP", ntohs(addr.sin_port));
+    return sock;
+}
+
+static int nettest_tcp_server(const nettest_cfg_t *cfg)
+{
+    struct sockaddr_in from;
+    socklen_t fromlen = sizeof(from);
+    char ip[16];
+    nettest_meter_t m;
+
+    int lsock = nettest_listen(cfg, SOCK_STREAM);
+    if (lsock < 0)
+    {
+        return 1;
+    }
+    int sock = accept(lsock, (struct sockaddr *)&from, &fromlen);
+    close(lsock);
+    if (sock < 0)
+    {
+        printf("No client\n");
+        return 1;
+    }
+
+    uint8_t *buf = malloc(cfg->len);
+    if (!buf)
+    {
+        close(sock);
+        return 1;
+    }
+    inet_ntop(AF_INET, &from.sin_addr, ip, sizeof(ip));
+    printf("Client %s:%u\n", ip, ntohs(from.sin_port));
+    nettest_set_timeout(sock, SO_RCVTIMEO, NETTEST_IDLE_MS);
+
+    nettest_meter_init(&m, cfg->interval_us);
+    int64_t now = m.start_us;
+    for (;;)
+    {
+        int n = recv(sock, buf, cfg->len, 0);
+        if (n <= 0)
+        {
+            if (n < 0)
+            {
+                printf("recv: errno %d\n", errno);
+            }
+            break;
+        }
+        m.bytes += n;
+        now = esp_timer_get_time();
+        nettest_meter_tick(&m, now);
+    }
+    close(sock);
+    free(buf);
+
+    nettest_print_line("total", 0, now - m.start_us, m.bytes);
+    return 0;
+}
+
+/* ---- UDP ---- */
+
+/* iperf before 2.0.10 has a 12 byte datagram header, the report follows right after it */
+static bool nettest_parse_report(const uint8_t *rx, int n, nettest_report_t *report)
+{
+    for (size_t off = 12; off <= sizeof(nettest_udp_hdr_t); off += 4)
+    {
+        if ((size_t)n >= off + sizeof(*report))
+        {
+            memcpy(report, &rx[off], sizeof(*report));
+            if (ntohl(report->flags) & NETTEST_HEADER_VERSION1)
+            {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+static void nettest_udp_stamp(nettest_udp_hdr_t *hdr, int32_t id)
+{
+    int64_t now = esp_timer_get_time();
+
+    hdr->id = (int32_t)htonl((uint32_t)id);
+    hdr->tv_sec = htonl((uint32_t)(now / 1000000));
+    hdr->tv_usec = htonl((uint32_t)(now % 1000000));
+}
+
+static int nettest_udp_client(const nettest_cfg_t *cfg)
+{
+    nettest_meter_t m;
+    nettest_report_t report;
+    bool have_report = false;
+    uint32_t send_errors = 0;
+    int32_t id = 0;
+
+    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock < 0)
+    {
+        ESP_LOGE(TAG, "socket: errno %d", errno);
+        return 1;
+    }
+    if (connect(sock, (const struct sockaddr *)&cfg->peer, sizeof(cfg->peer)) != 0)
+    {
+        printf("connect: errno %d\n", errno);
+        close(sock);
+        return 1;
+    }
+    uint8_t *buf = calloc(1, cfg->len);
+    if (!buf)
+    {
+        close(sock);
+        return 1;
+    }
+    nettest_udp_hdr_t *hdr = (nettest_udp_hdr_t *)buf;
+
+    /* paced per tick: the datagrams due within one tick go out back to back */
+    int64_t gap_us = (int64_t)cfg->len * 8000 / cfg->kbps;
+    int64_t tick_us = portTICK_PERIOD_MS * 1000LL;
+    nettest_meter_init(&m, cfg->interval_us);
+    int64_t next = m.start_us;
+    int64_t now = m.start_us;
+    while (now - m.start_us < cfg->duration_us)
+    {
+        if (next - now >= tick_us)
+        {
+            vTaskDelay((TickType_t)((next - now) / tick_us));
+        }
+        nettest_udp_stamp(hdr, id);
+        if (send(sock, buf, cfg->len, 0) < 0)
+        {
+            /* lwIP runs out of buffers before the link does */
+            send_errors++;
+        }
+        else
+        {
+            id++;
+            m.bytes += cfg->len;
+        }
+        next += gap_us;
+        now = esp_timer_get_time();
+        nettest_meter_tick(&m, now);
+    }
+    int64_t elapsed_us = now - m.start_us;
+
+    /* repeat the final datagram until the server reports */
+    nettest_set_timeout(sock, SO_RCVTIMEO, NETTEST_FIN_WAIT_MS);
+    for (int i = 0; i < NETTEST_FIN_TRIES && !have_report; i++)
+    {
+        uint8_t rx[sizeof(nettest_udp_hdr_t) + sizeof(nettest_report_t)];
+
+        nettest_udp_stamp(hdr, -id);
+        send(sock, buf, cfg->len, 0);
+        int n = recv(sock, rx, sizeof(rx), 0);
+        have_report = n > 0 && nettest_parse_report(rx, n, &report);
+    }
+    close(sock);
+    free(buf);
+
+    nettest_print_line("sent", 0, elapsed_us, m.bytes);
+    printf("%" PRId32 " datagrams of %u bytes, %" PRIu32 " send errors\n", id, (unsigned)cfg->len, send_errors);
+    if (!have_report)
+    {
+        printf("No server report\n");
+        return 1;
+    }
+
+    uint64_t bytes = (uint64_t)ntohl(report.total_len1) << 32 | ntohl(report.total_len2);
+    uint32_t datagrams = ntohl(report.datagrams);
+    uint32_t lost = ntohl(report.error_cnt);
+    nettest_print_line("recv", 0, ntohl(report.stop_sec) * 1000000LL + ntohl(report.stop_usec), bytes);
+    printf("Lost %" PRIu32 "/%" PRIu32 " (%.2f%%), %" PRIu32 " out of order, jitter %.3f ms\n", lost, datagrams,
+           datagrams ? lost * 100.0 / datagrams : 0.0, ntohl(report.outorder_cnt),
+           ntohl(report.jitter1) * 1e3 + ntohl(report.jitter2) / 1e3);
+    return 0;
+}
+
+static int nettest_udp_server(const nettest_cfg_t *cfg)
+{
+    struct sockaddr_in from;
+    socklen_t fromlen;
+    char ip[16];
+    nettest_meter_t m;
+    uint32_t received = 0;
+    uint32_t outorder = 0;
+    int32_t expected = 0;
+    int64_t last_transit = 0;
+    double jitter_us = 0;
+    int fins = 0;
+
+    int sock = nettest_listen(cfg, SOCK_DGRAM);
+    if (sock < 0)
+    {
+        return 1;
+    }
+    uint8_t *buf = malloc(NETTEST_MAX_UDP_LEN);
+    if (!buf)
+    {
+        close(sock);
+        return 1;
+    }
+    const nettest_udp_hdr_t *hdr = (const nettest_udp_hdr_t *)buf;
+
+    nettest_meter_init(&m, cfg->interval_us);
+    int64_t now = m.start_us;
+    for (;;)
+    {
+        fromlen = sizeof(from);
+        int n = recvfrom(sock, buf, NETTEST_MAX_UDP_LEN, 0, (struct sockaddr *)&from, &fromlen);
+        if (n < 0)
+        {
+            if (!fins)
+            {
+                printf(received ? "Client gone without a final datagram\n" : "No client\n");
+            }
+            break;
+        }
+        if (n < 12)
+        {
+            continue;
+        }
+        int64_t arrival = esp_timer_get_time();
+        int32_t id = (int32_t)ntohl((uint32_t)hdr->id);
+
+        if (id < 0)
+        {
+            /* answer every final datagram, the client repeats it until a report arrives */
+            uint8_t tx[sizeof(nettest_udp_hdr_t) + sizeof(nettest_report_t)] = {0};
+            int64_t stop_us = now - m.start_us;
+            uint32_t lost = expected > (int32_t)received ? (uint32_t)expected - received : 0;
+            nettest_report_t report = {
+                .flags = htonl(NETTEST_HEADER_VERSION1),
+                .total_len1 = htonl((uint32_t)(m.bytes >> 32)),
+                .total_len2 = htonl((uint32_t)m.bytes),
+                .stop_sec = htonl((uint32_t)(stop_us / 1000000)),
+                .stop_usec = htonl((uint32_t)(stop_us % 1000000)),
+                .error_cnt = htonl(lost),
+                .outorder_cnt = htonl(outorder),
+                .datagrams = htonl((uint32_t)expected),
+                .jitter1 = htonl((uint32_t)(jitter_us / 1e6)),
+                .jitter2 = htonl((uint32_t)((int64_t)jitter_us % 1000000)),
+            };
+
+            memcpy(tx, buf, MIN((size_t)n, sizeof(nettest_udp_hdr_t)));
+            memcpy(&tx[sizeof(nettest_udp_hdr_t)], &report, sizeof(report));
+            sendto(sock, tx, sizeof(tx), 0, (struct sockaddr *)&from, fromlen);
+            if (!fins++)
+            {
+                nettest_print_line("total", 0, stop_us, m.bytes);
+                printf("Lost %" PRIu32 "/%" PRId32 " (%.2f%%), %" PRIu32 " out of order, jitter %.3f ms\n", lost,
+                       expected, expected ? lost * 100.0 / expected : 0.0, outorder, jitter_us / 1e3);
+                nettest_set_timeout(sock, SO_RCVTIMEO, NETTEST_FIN_WAIT_MS * 2);
+            }
+            continue;
+        }
+
+        if (!received)
+        {
+            inet_ntop(AF_INET, &from.sin_addr, ip, sizeof(ip));
+            printf("Client %s:%u\n", ip, ntohs(from.sin_port));
+            nettest_meter_init(&m, cfg->interval_us);
+            nettest_set_timeout(sock, SO_RCVTIMEO, NETTEST_IDLE_MS);
+        }
+        received++;
+        m.bytes += n;
+        now = arrival;
+        if (id < expected)
+        {
+            outorder++;
+        }
+        expected = MAX(expected, id + 1);
+
+        /* RFC 3550 interarrival jitter, the clock offset between the hosts cancels out */
+        int64_t sent = ntohl(hdr->tv_sec) * 1000000LL + ntohl(hdr->tv_usec);
+        int64_t transit = arrival - sent;
+        if (received > 1)
+        {
+            jitter_us += (llabs(transit - last_transit) - jitter_us) / 16;
+        }
+        last_transit = transit;
+        nettest_meter_tick(&m, now);
+    }
+    close(sock);
+    free(buf);
+    return 0;
+}
+
+/* ---- console command ---- */
+
+static struct
+{
+    struct arg_str *client;
+    struct arg_lit *server;
+    struct arg_lit *udp;
+    struct arg_int *port;
+    struct arg_int *time;
+    struct arg_int *interval;
+    struct arg_int *len;
+    struct arg_int *kbps;
+    struct arg_int *pings;
+    struct arg_end *end;
+} nettest_args;
+
+static int nettest_resolve(const char *host, struct sockaddr_in *addr)
+{
+    struct addrinfo hints = {.ai_family = AF_INET};
+    struct addrinfo *res = NULL;
+
+    if (getaddrinfo(host, NULL, &hints, &res) != 0 || !res)
+    {
+        return -1;
+    }
+    addr->sin_family = AF_INET;
+    addr->sin_addr = ((struct sockaddr_in *)res->ai_addr)->sin_addr;
+    freeaddrinfo(res);
+    return 0;
+}
+
+static void nettest_print_rssi(const char *when)
+{
+    int dbm;
+
+    if (nettest_rssi(&dbm))
+    {
+        printf("RSSI %s: %d dBm\n", when, dbm);
+    }
+    else
+    {
+        printf("RSSI %s: n/a\n", when);
+    }
+}
+
+static int cmd_nettest(int argc, char **argv)
+{
+    int nerrors = arg_parse(argc, argv, (void **)&nettest_args);
+    if (nerrors != 0)
+    {
+        arg_print_errors(stderr, nettest_args.end, argv[0]);
+        return 1;
+    }
+
+    bool server = nettest_args.server->count > 0;
+    if (server == (nettest_args.client->count > 0))
+    {
+        printf("Give either -c <host> or -s\n");
+        return 1;
+    }
+
+    nettest_cfg_t cfg = {
+        .udp = nettest_args.udp->count > 0,
+        .duration_us = (nettest_args.time->count ? nettest_args.time->ival[0]
+                                                 : server ? NETTEST_WAIT_S : NETTEST_DEFAULT_S) * 1000000LL,
+        .interval_us = (nettest_args.interval->count ? nettest_args.interval->ival[0] : NETTEST_INTERVAL_S) * 1000000LL,
+    };
+    int kbps = nettest_args.kbps->count ? nettest_args.kbps->ival[0] : NETTEST_UDP_KBPS;
+    int port = nettest_args.port->count ? nettest_args.port->ival[0] : NETTEST_PORT;
+    int len = nettest_args.len->count ? nettest_args.len->ival[0] : cfg.udp ? NETTEST_UDP_LEN : NETTEST_TCP_LEN;
+    int max_len = cfg.udp ? NETTEST_MAX_UDP_LEN : NETTEST_MAX_TCP_LEN;
+    int pings = nettest_args.pings->count ? nettest_args.pings->ival[0] : NETTEST_PINGS;
+
+    if (port < 1 || port > 65535 || cfg.duration_us <= 0 || cfg.interval_us < 0 || len < (int)sizeof(nettest_udp_hdr_t) ||
+        len > max_len || kbps < 1 || pings < 0 || pings > NETTEST_MAX_PINGS)
+    {
+        printf("Invalid -p, -t, -i, -b, -r (0..%d) or -l (%u..%d)\n", NETTEST_MAX_PINGS,
+               (unsigned)sizeof(nettest_udp_hdr_t), max_len);
+        return 1;
+    }
+    cfg.len = (size_t)len;
+    cfg.kbps = (uint32_t)kbps;
+    cfg.peer.sin_port = htons((uint16_t)port);
+
+    if (server)
+    {
+        return cfg.udp ? nettest_udp_server(&cfg) : nettest_tcp_server(&cfg);
+    }
+
+    if (nettest_resolve(nettest_args.client->sval[0], &cfg.peer) != 0)
+    {
+        printf("Cannot resolve %s\n", nettest_args.client->sval[0]);
+        return 1;
+    }
+    printf("%s to %s:%d for %" PRId64 " s", cfg.udp ? "UDP" : "TCP", nettest_args.client->sval[0], port,
+           cfg.duration_us / 1000000);
+    if (cfg.udp)
+    {
+        printf(" at %" PRIu32 " kbit/s", cfg.kbps);
+    }
+    printf(", %d byte writes\n", len);
+
+    nettest_print_rssi("before");
+    if (pings)
+    {
+        nettest_ping(&cfg.peer, pings);
+    }
+    int ret = cfg.udp ? nettest_udp_client(&cfg) : nettest_tcp_client(&cfg);
+    nettest_print_rssi("after");
+    return ret;
+}
+
+void nettest_start(void)
+{
+    nettest_args.client = arg_str0("c", "client", "<host>", "Send to an iperf 2 server (iperf -s [-u])");
+    nettest_args.server = arg_lit0("s", "server", "Serve one test of an iperf 2 client (iperf -c <ip> [-u])");
+    nettest_args.udp = arg_lit0("u", "udp", "UDP instead of TCP");
+    nettest_args.port = arg_int0("p", "port", "<port>", "Port (default 5001)");
+    nettest_args.time = arg_int0("t", "time", "<s>", "Client: test time (default 10), server: wait for a client (default 60)");
+    nettest_args.interval = arg_int0("i", "interval", "<s>", "Interval reports, 0 for none (default 1)");
+    nettest_args.len = arg_int0("l", "len", "<bytes>", "Bytes per write or datagram (default 4096 TCP, 1470 UDP)");
+    nettest_args.kbps = arg_int0("b", "bandwidth", "<kbit/s>", "UDP client: send rate (default 1000)");
+    nettest_args.pings = arg_int0("r", "rtt", "<count>", "Client: ICMP echos for the RTT before the test, 0 for none (default 10)");
+    nettest_args.end = arg_end(10);
+
+    const esp_console_cmd_t nettest_cmd = {
+        .command = "nettest",
+        .help = "TCP/UDP throughput test against iperf 2 with RTT distribution, retransmits and RSSI",
+        .hint = NULL,
+        .func = &cmd_nettest,
+        .argtable = &nettest_args,
+    };
+    ESP_ERROR_CHECK(esp_console_cmd_register(&nettest_cmd));
+}
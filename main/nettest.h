@@ -0,0 +1,17 @@
+#pragma once
+
+/*
+ * nettest - what the link to a host sustains, for sizing telemetry streams.
+ *
+ * Client and server speak the iperf 2 wire format, so either end can be a
+ * stock `iperf -s` / `iperf -c` (iperf 2.0.10 and later, not iperf3):
+ *
+ *   TCP  one connection, the client streams zeros for the test time
+ *   UDP  paced datagrams with iperf's sequence number and send time; the
+ *        server answers the final datagram with its loss / jitter report
+ *
+ * Around a client run the command also measures the ICMP echo round trip
+ * time distribution, and it reports TCP retransmits and the station RSSI
+ * where the platform provides them.
+ */
+void nettest_start(void);
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdint.h>
+#include "sdkconfig.h"
+
+/*
+ * The few things shared code needs that differ between the ESP32 and the
+ * native Linux build.
+ */
+#if CONFIG_IDF_TARGET_LINUX
+#include "esp_timer.h"
+
+/* No cycle counter on the host: count microseconds at a nominal 1 MHz */
+#define PORT_CPU_MHZ 1
+
+static inline uint32_t port_cycles(void)
+{
+    return (uint32_t)esp_timer_get_time();
+}
+#else
+#include "esp_cpu.h"
+
+#define PORT_CPU_MHZ CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ
+
+static inline uint32_t port_cycles(void)
+{
+    return esp_cpu_get_cycle_count();
+}
+#endif
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Stackless coroutines (protothreads) built on the switch/case trick.
+ *
+ * A protothread is a plain function that returns whenever it has to wait and
+ * continues at the same spot on its next call. The only state kept across a
+ * wait is the resume point in pt_t; everything else the thread needs after a
+ * wait must live in its context struct, not in locals. switch statements
+ * must not span a wait.
+ *
+ * Resume points are numbered with __COUNTER__, so waits may be wrapped in
+ * macros and several may sit on one source line.
+ *
+ *   static PT_THREAD(blink(op_t *op))
+ *   {
+ *       PT_BEGIN(&op->pt);
+ *       for (op->n = 0; op->n < 3; op->n++)
+ *       {
+ *           start_io(op);
+ *           PT_WAIT_UNTIL(&op->pt, op->io_done);
+ *       }
+ *       PT_END(&op->pt);
+ *   }
+ */
+
+typedef struct
+{
+    uint16_t lc; /* resume point, 0 = start */
+} pt_t;
+
+#define PT_WAITING 0
+#define PT_YIELDED 1
+#define PT_EXITED 2
+#define PT_ENDED 3
+
+/* True once a protothread returned PT_EXITED or PT_ENDED */
+#define PT_DONE(ret) ((ret) >= PT_EXITED)
+
+#define PT_THREAD(decl) int decl
+
+#define PT_INIT(pt) ((pt)->lc = 0)
+
+#define PT_BEGIN(pt)                  \
+    {                                 \
+        int pt_yielded_ = 1;          \
+        (void)pt_yielded_;            \
+        switch ((pt)->lc)             \
+        {                             \
+        case 0:
+
+#define PT_END(pt)                    \
+        }                             \
+        PT_INIT(pt);                  \
+        return PT_ENDED;              \
+    }
+
+#define PT_WAIT_UNTIL(pt, cond) PT_WAIT_UNTIL_((pt), (cond), __COUNTER__ + 1)
+#define PT_WAIT_UNTIL_(pt, cond, n)   \
+    do                                \
+    {                                 \
+        (pt)->lc = (n);               \
+    case (n):                         \
+        if (!(cond))                  \
+            return PT_WAITING;        \
+    } while (0)
+
+#define PT_WAIT_WHILE(pt, cond) PT_WAIT_UNTIL((pt), !(cond))
+
+/* Give the other protothreads a turn, continue on the next call */
+#define PT_YIELD(pt) PT_YIELD_((pt), __COUNTER__ + 1)
+#define PT_YIELD_(pt, n)              \
+    do                                \
+    {                                 \
+        pt_yielded_ = 0;              \
+        (pt)->lc = (n);               \
+    case (n):                         \
+        if (!pt_yielded_)             \
+            return PT_YIELDED;        \
+    } while (0)
+
+#define PT_EXIT(pt)                   \
+    do                                \
+    {                                 \
+        PT_INIT(pt);                  \
+        return PT_EXITED;             \
+    } while (0)
@@ -0,0 +1,527 @@
+/* regmap.c - flash-resident register maps of arbitrary I2C devices, see regmap.h */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <sys/param.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_console.h"
+#include "esp_partition.h"
+#include "esp_rom_crc.h"
+#include "argtable3/argtable3.h"
+
+#include "regmap.h"
+#include "i2c.h"
+#include "timebase.h"
+
+#define REGMAP_PARTITION "regmap"
+#define REGMAP_MAX_SELECT 16
+
+static const char *TAG = "regmap";
+
+static SemaphoreHandle_t s_lock;
+static const esp_partition_t *s_part;
+static esp_partition_mmap_handle_t s_handle;
+static const uint8_t *s_image;     /* mapped image, NULL = not loaded */
+static uint32_t s_size;
+static regmap_device_t *s_devices; /* loaded devices, newest first */
+
+/* ---- image access, every offset is checked against the image ---- */
+
+static const void *regmap_at(uint32_t off, uint32_t len)
+{
+    if (off > s_size || len > s_size - off || (off & 3))
+    {
+        return NULL;
+    }
+    return s_image + off;
+}
+
+static const char *regmap_str(uint32_t off)
+{
+    if (!off)
+    {
+        return "";
+    }
+    if (off >= s_size || !memchr(s_image + off, 0, s_size - off))
+    {
+        return NULL;
+    }
+    return (const char *)s_image + off;
+}
+
+static void regmap_free_devices(void)
+{
+    while (s_devices)
+    {
+        regmap_device_t *next = s_devices->next;
+        free(s_devices);
+        s_devices = next;
+    }
+}
+
+esp_err_t regmap_open(void)
+{
+    esp_err_t err = ESP_OK;
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    if (s_image)
+    {
+        goto out;
+    }
+    s_part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, REGMAP_PARTITION);
+    if (!s_part)
+    {
+        err = ESP_ERR_NOT_FOUND;
+        goto out;
+    }
+    const void *ptr;
+    err = esp_partition_mmap(s_part, 0, s_part->size, ESP_PARTITION_MMAP_DATA, &ptr, &s_handle);
+    if (err)
+    {
+        goto out;
+    }
+
+    const regmap_hdr_t *hdr = ptr;
+    if (hdr->magic != REGMAP_MAGIC || hdr->version != REGMAP_VERSION || hdr->size < sizeof(*hdr) ||
+        hdr->size > s_part->size)
+    {
+        err = ESP_ERR_INVALID_VERSION;
+    }
+    else if (esp_rom_crc32_le(0, (const uint8_t *)ptr + sizeof(*hdr), hdr->size - sizeof(*hdr)) != hdr->crc)
+    {
+        err = ESP_ERR_INVALID_CRC;
+    }
+    if (err)
+    {
+        esp_partition_munmap(s_handle);
+        goto out;
+    }
+    s_image = ptr;
+    s_size = hdr->size;
+    ESP_LOGI(TAG, "%u device(s) in %" PRIu32 " bytes", hdr->devices, s_size);
+
+out:
+    xSemaphoreGive(s_lock);
+    return err;
+}
+
+/* Unmap the image, e.g. after a new one was written; devices looked up before become invalid */
+void regmap_close(void)
+{
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    regmap_free_devices();
+    if (s_image)
+    {
+        esp_partition_munmap(s_handle);
+        s_image = NULL;
+        s_size = 0;
+    }
+    xSemaphoreGive(s_lock);
+}
+
+/*
+ * Build the bq_entry table of one device in a single allocation. Names,
+ * units and descriptions stay in the mapped flash.
+ */
+static regmap_device_t *regmap_load(const regmap_dev_t *d, const char *name)
+{
+    const regmap_reg_t *regs = regmap_at(d->regs, d->reg_count * sizeof(regmap_reg_t));
+    size_t bits = 0;
+
+    if (!regs || d->reg_width < 1 || d->reg_width > 2)
+    {
+        return NULL;
+    }
+    for (int pos = 0; pos < d->reg_count; pos++)
+    {
+        bits += regs[pos].bits_count;
+    }
+
+    size_t size = sizeof(regmap_device_t) + d->reg_count * (sizeof(bq_entry) + sizeof(uint16_t)) +
+                  bits * sizeof(bq_bit_desc_t);
+    regmap_device_t *dev = calloc(1, size);
+    if (!dev)
+    {
+        return NULL;
+    }
+    bq_entry *entries = (bq_entry *)(dev + 1);
+    bq_bit_desc_t *bit_descs = (bq_bit_desc_t *)(entries + d->reg_count);
+    uint16_t *addrs = (uint16_t *)(bit_descs + bits);
+
+    for (int pos = 0; pos < d->reg_count; pos++)
+    {
+        const regmap_reg_t *r = &regs[pos];
+        const regmap_bit_t *b = regmap_at(r->bits, r->bits_count * sizeof(regmap_bit_t));
+        bq_entry *e = &entries[pos];
+
+        e->reg = (uint8_t)r->reg;
+        e->name = regmap_str(r->name);
+        e->unit = regmap_str(r->unit);
+        e->scaling = r->scaling;
+        e->offset = r->offset;
+        e->type = (bq_data_type)r->type;
+        e->read_len = r->size;
+        e->flags = r->flags;
+        if (!e->name || !e->unit || !b || !r->size || r->size > REGMAP_MAX_REG_SIZE + 1 ||
+            r->type > BQ40Z555_TYPE_BLOCK_BITS)
+        {
+            ESP_LOGE(TAG, "%s: register %d is corrupt", name, pos);
+            free(dev);
+            return NULL;
+        }
+        e->bits = bit_descs;
+        e->bits_count = r->bits_count;
+        for (int n = 0; n < r->bits_count; n++)
+        {
+            bit_descs->bit = b[n].bit;
+            bit_descs->width = b[n].width;
+            bit_descs->desc = regmap_str(b[n].desc);
+            bit_descs->long_desc = regmap_str(b[n].long_desc);
+            if (!bit_descs->desc || !bit_descs->long_desc || b[n].width < 1 || b[n].width > 32)
+            {
+                ESP_LOGE(TAG, "%s: bitfield %d of %s is corrupt", name, n, e->name);
+                free(dev);
+                return NULL;
+            }
+            bit_descs++;
+        }
+        bq_entry_bind(e);
+        addrs[pos] = r->reg;
+    }
+
+    dev->name = name;
+    dev->addr = d->addr;
+    dev->reg_width = d->reg_width;
+    dev->count = d->reg_count;
+    dev->regs = addrs;
+    dev->entries = entries;
+    return dev;
+}
+
+/* Look up a device by name, loading it from the image on first use */
+const regmap_device_t *regmap_device(const char *name)
+{
+    if (regmap_open())
+    {
+        return NULL;
+    }
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    regmap_device_t *dev;
+    for (dev = s_devices; dev; dev = dev->next)
+    {
+        if (!strcasecmp(dev->name, name))
+        {
+            goto out;
+        }
+    }
+
+    const regmap_hdr_t *hdr = (const regmap_hdr_t *)s_image;
+    const regmap_dev_t *d = regmap_at(sizeof(*hdr), hdr->devices * sizeof(regmap_dev_t));
+    for (int pos = 0; d && pos < hdr->devices; pos++)
+    {
+        const char *dev_name = regmap_str(d[pos].name);
+        if (dev_name && !strcasecmp(dev_name, name))
+        {
+            dev = regmap_load(&d[pos], dev_name);
+            if (dev)
+            {
+                dev->next = s_devices;
+                s_devices = dev;
+            }
+            break;
+        }
+    }
+
+out:
+    xSemaphoreGive(s_lock);
+    return dev;
+}
+
+/* Read register `idx` of `dev` at `addr` into data (entries[idx].read_len bytes) */
+int regmap_read(const regmap_device_t *dev, uint8_t addr, int idx, uint8_t *data)
+{
+    uint8_t w[2];
+    uint16_t reg = dev->regs[idx];
+
+    if (dev->reg_width == 2)
+    {
+        w[0] = (uint8_t)(reg >> 8);
+        w[1] = (uint8_t)reg;
+    }
+    else
+    {
+        w[0] = (uint8_t)reg;
+    }
+    return i2c_write_read(addr, w, dev->reg_width, data, dev->entries[idx].read_len);
+}
+
+/* ---- console command ---- */
+
+static struct
+{
+    struct arg_str *device;
+    struct arg_int *addr;
+    struct arg_str *reg;
+    struct arg_lit *watch;
+    struct arg_lit *csv;
+    struct arg_int *interval;
+    struct arg_int *count;
+    struct arg_lit *reload;
+    struct arg_end *end;
+} regmap_args;
+
+static void regmap_list(void)
+{
+    const regmap_hdr_t *hdr = (const regmap_hdr_t *)s_image;
+    const regmap_dev_t *d = regmap_at(sizeof(*hdr), hdr->devices * sizeof(regmap_dev_t));
+
+    printf("%-20s %-6s %s\n", "Device", "Addr", "Registers");
+    for (int pos = 0; d && pos < hdr->devices; pos++)
+    {
+        const char *name = regmap_str(d[pos].name);
+        printf("%-20s 0x%02X   %u\n", name ? name : "?", d[pos].addr, d[pos].reg_count);
+    }
+}
+
+/* Indices of the registers given with -r (by name or address), all when none */
+static int regmap_select(const regmap_device_t *dev, uint16_t *sel)
+{
+    if (!regmap_args.reg->count)
+    {
+        for (int pos = 0; pos < dev->count; pos++)
+        {
+            sel[pos] = (uint16_t)pos;
+        }
+        return dev->count;
+    }
+
+    int count = 0;
+    for (int arg = 0; arg < regmap_args.reg->count; arg++)
+    {
+        const char *want = regmap_args.reg->sval[arg];
+        char *end;
+        long reg = strtol(want, &end, 0);
+        int found = -1;
+
+        for (int pos = 0; pos < dev->count && found < 0; pos++)
+        {
+            if (!strcasecmp(dev->entries[pos].name, want) || (!*end && dev->regs[pos] == reg))
+            {
+                found = pos;
+            }
+        }
+        if (found < 0)
+        {
+            printf("%s has no register '%s'\n", dev->name, want);
+            return -1;
+        }
+        /* a register given twice is read once, so `sel` (dev->count entries) cannot overflow */
+        bool dup = false;
+        for (int n = 0; n < count && !dup; n++)
+        {
+            dup = sel[n] == found;
+        }
+        if (!dup)
+        {
+            sel[count++] = (uint16_t)found;
+        }
+    }
+    return count;
+}
+
+/* One CSV field per register: the number, or the raw bytes as hex */
+static void regmap_csv_value(const bq_entry *e, const uint8_t *data)
+{
+    bq_value_t v;
+
+    e->decode(e, data, e->read_len, &v);
+    switch (e->type)
+    {
+    case BQ40Z555_TYPE_WORD_FLOAT:
+        printf(",%.4f", v.val);
+        break;
+    case BQ40Z555_TYPE_WORD_INTEGER:
+        printf(",%" PRId32, (e->flags & BQ_ENTRY_SIGNED) ? v.sval : (int32_t)v.raw);
+        break;
+    case BQ40Z555_TYPE_BLOCK_ASCII:
+        printf(",");
+        for (int pos = 0; pos < v.block.len; pos++)
+        {
+            uint8_t c = v.block.data[pos];
+            putchar((c < 0x20 || c >= 0x7F || c == ',') ? '.' : c);
+        }
+        break;
+    case BQ40Z555_TYPE_BLOCK_HEX:
+    case BQ40Z555_TYPE_BLOCK_BITS:
+        printf(",");
+        for (int pos = v.block.len - 1; pos >= 0; pos--)
+        {
+            printf("%02X", v.block.data[pos]);
+        }
+        break;
+    default:
+        printf(",0x%04X", v.raw);
+        break;
+    }
+}
+
+static int cmd_regmap(int argc, char **argv)
+{
+    int nerrors = arg_parse(argc, argv, (void **)&regmap_args);
+    if (nerrors != 0)
+    {
+        arg_print_errors(stderr, regmap_args.end, argv[0]);
+        return 1;
+    }
+
+    if (regmap_args.reload->count)
+    {
+        regmap_close();
+    }
+    esp_err_t err = regmap_open();
+    if (err)
+    {
+        printf("No register maps: %s (write one with tools/regmap.py and parttool.py)\n", esp_err_to_name(err));
+        return 1;
+    }
+    if (!regmap_args.device->count)
+    {
+        regmap_list();
+        return 0;
+    }
+
+    const regmap_device_t *dev = regmap_device(regmap_args.device->sval[0]);
+    if (!dev)
+    {
+        printf("Unknown or corrupt device '%s'\n", regmap_args.device->sval[0]);
+        return 1;
+    }
+    uint8_t addr = regmap_args.addr->count ? (uint8_t)regmap_args.addr->ival[0] : dev->addr;
+    bool watch = regmap_args.watch->count || regmap_args.csv->count;
+    int interval = regmap_args.interval->count ? regmap_args.interval->ival[0] : 1000;
+    int count = regmap_args.count->count ? regmap_args.count->ival[0] : (watch ? 10 : 1);
+    if (interval < 10 || count < 1)
+    {
+        printf("Interval must be >= 10 ms, count >= 1\n");
+        return 1;
+    }
+
+    uint16_t *sel = malloc(dev->count * sizeof(uint16_t));
+    uint8_t *prev = calloc(dev->count, REGMAP_MAX_REG_SIZE + 1);
+    uint8_t *data = malloc(REGMAP_MAX_REG_SIZE + 1);
+    int ret = 0;
+    int selected = (sel && prev && data) ? regmap_select(dev, sel) : -1;
+    if (selected < 0)
+    {
+        ret = 1;
+        goto out;
+    }
+
+    if (regmap_args.csv->count)
+    {
+        printf("mono_ms,wall");
+        for (int n = 0; n < selected; n++)
+        {
+            printf(",%s", dev->entries[sel[n]].name);
+        }
+        printf("\n");
+    }
+
+    TickType_t last_wake = xTaskGetTickCount();
+    for (int round = 0; round < count; round++)
+    {
+        tb_stamp_t ts;
+        char iso[40];
+
+        if (round)
+        {
+            vTaskDelayUntil(&last_wake, pdMS_TO_TICKS(interval));
+        }
+        tb_now(&ts);
+        tb_format(ts.wall_us, iso, sizeof(iso));
+        if (regmap_args.csv->count)
+        {
+            printf("%" PRId64 ",%s", ts.mono_us / 1000, iso);
+        }
+        else if (!round || !watch)
+        {
+            printf("%-32s: %s @0x%02X, %s\n", "Device", dev->name, addr, iso);
+        }
+
+        for (int n = 0; n < selected; n++)
+        {
+            const bq_entry *e = &dev->entries[sel[n]];
+            uint8_t *last = &prev[sel[n] * (REGMAP_MAX_REG_SIZE + 1)];
+
+            err = regmap_read(dev, addr, sel[n], data);
+            if (regmap_args.csv->count)
+            {
+                if (err)
+                {
+                    printf(",");
+                }
+                else
+                {
+                    regmap_csv_value(e, data);
+                }
+                continue;
+            }
+            if (err)
+            {
+                printf("%-32s: read failed (err=%d)\n", e->name, err);
+                continue;
+            }
+            /* watching: after the first round only registers that changed */
+            if (round && !memcmp(last, data, e->read_len))
+            {
+                continue;
+            }
+            if (round)
+            {
+                printf("[%s] ", iso);
+            }
+            bq_print_entry(e, data, e->read_len);
+            memcpy(last, data, e->read_len);
+        }
+        if (regmap_args.csv->count)
+        {
+            printf("\n");
+        }
+        fflush(stdout);
+    }
+
+out:
+    free(sel);
+    free(prev);
+    free(data);
+    return ret;
+}
+
+void regmap_start(void)
+{
+    s_lock = xSemaphoreCreateMutex();
+
+    regmap_args.device = arg_str0(NULL, NULL, "<device>", "Device name from the register maps, none = list them");
+    regmap_args.addr = arg_int0("a", "addr", "<addr>", "I2C address (default: from the map)");
+    regmap_args.reg = arg_strn("r", "reg", "<name|reg>", 0, REGMAP_MAX_SELECT, "Only these registers");
+    regmap_args.watch = arg_lit0("w", "watch", "Repeat, printing only registers that changed");
+    regmap_args.csv = arg_lit0(NULL, "csv", "Repeat, logging one CSV line per round");
+    regmap_args.interval = arg_int0("i", "interval", "<ms>", "Time between rounds (default 1000)");
+    regmap_args.count = arg_int0("n", "count", "<n>", "Rounds (default 10 when watching or logging)");
+    regmap_args.reload = arg_lit0(NULL, "reload", "Map the partition again after writing a new image");
+    regmap_args.end = arg_end(4);
+
+    const esp_console_cmd_t regmap_cmd = {
+        .command = "regmap",
+        .help = "Dump, watch or log any I2C device described in the regmap partition",
+        .hint = NULL,
+        .func = &cmd_regmap,
+        .argtable = &regmap_args,
+    };
+    ESP_ERROR_CHECK(esp_console_cmd_register(&regmap_cmd));
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "bq.h"
+
+/*
+ * regmap - register maps of arbitrary I2C devices, loaded from flash.
+ *
+ * The "regmap" partition holds an image built by tools/regmap.py from JSON
+ * descriptions (registers, sizes, scaling, units, bitfields). It is memory
+ * mapped on first use; looking up a device turns its descriptors into
+ * bq_entry tables, so dumping and decoding goes through the same code as
+ * the BQ40Z555 table. Loaded devices stay read-only until `regmap --reload`.
+ *
+ * Image layout, little endian, offsets from the start of the image, string
+ * offset 0 = empty string:
+ *
+ *   regmap_hdr_t                     crc over everything after the header
+ *   regmap_dev_t[devices]
+ *   regmap_reg_t[], regmap_bit_t[]   referenced by the devices / registers
+ *   strings                          NUL terminated
+ */
+
+#define REGMAP_MAGIC 0x50414D52 /* "RMAP" */
+#define REGMAP_VERSION 1
+#define REGMAP_MAX_REG_SIZE 32
+
+typedef struct
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t devices;
+    uint32_t size;
+    uint32_t crc;
+} regmap_hdr_t;
+
+typedef struct
+{
+    uint32_t name;
+    uint32_t regs;      /* first regmap_reg_t */
+    uint16_t reg_count;
+    uint8_t addr;       /* default 7-bit address */
+    uint8_t reg_width;  /* register address bytes, 1 or 2 (MSB first) */
+} regmap_dev_t;
+
+typedef struct
+{
+    uint32_t name;
+    uint32_t unit;
+    float scaling;
+    float offset;
+    uint32_t bits;      /* first regmap_bit_t */
+    uint16_t reg;
+    uint8_t type;       /* bq_data_type */
+    uint8_t size;       /* bytes read, incl. the length byte of SBS blocks */
+    uint8_t flags;      /* BQ_ENTRY_* */
+    uint8_t bits_count;
+    uint16_t reserved;
+} regmap_reg_t;
+
+typedef struct
+{
+    uint32_t desc;
+    uint32_t long_desc;
+    uint8_t bit;
+    uint8_t width;
+    uint16_t reserved;
+} regmap_bit_t;
+
+/* A device loaded from the image */
+typedef struct regmap_device
+{
+    struct regmap_device *next;
+    const char *name;
+    uint8_t addr;
+    uint8_t reg_width;
+    uint16_t count;
+    const uint16_t *regs;    /* register addresses, entries[i].reg holds the low byte only */
+    const bq_entry *entries;
+} regmap_device_t;
+
+esp_err_t regmap_open(void);
+void regmap_close(void);
+const regmap_device_t *regmap_device(const char *name);
+int regmap_read(const regmap_device_t *dev, uint8_t addr, int idx, uint8_t *data);
+
+void regmap_start(void);
@@ -0,0 +1,270 @@
+/* smbus.c - SMBus transactions with optional PEC, see smbus.h */
+#include <string.h>
+#include <sys/param.h>
+#include "esp_err.h"
+
+#include "i2c.h"
+#include "smbus.h"
+
+/* CRC-8, polynomial x^8 + x^2 + x + 1, over every byte on the wire incl. address bytes */
+uint8_t smbus_pec(uint8_t crc, const uint8_t *data, size_t len)
+{
+    for (size_t pos = 0; pos < len; pos++)
+    {
+        crc ^= data[pos];
+        for (int bit = 0; bit < 8; bit++)
+        {
+            crc = (crc & 0x80) ? (uint8_t)((crc << 1) ^ 0x07) : (uint8_t)(crc << 1);
+        }
+    }
+    return crc;
+}
+
+static bool smbus_reads(smbus_op_t op)
+{
+    switch (op)
+    {
+    case SMBUS_RECEIVE_BYTE:
+    case SMBUS_READ_BYTE:
+    case SMBUS_READ_WORD:
+    case SMBUS_BLOCK_READ:
+    case SMBUS_PROCESS_CALL:
+    case SMBUS_BLOCK_PROCESS_CALL:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/* Fixed payload sizes of the byte / word operations */
+static void smbus_sizes(smbus_xfer_t *x)
+{
+    switch (x->op)
+    {
+    case SMBUS_QUICK:
+        x->wlen = 0;
+        x->rmax = 0;
+        break;
+    case SMBUS_SEND_BYTE:
+    case SMBUS_WRITE_BYTE:
+        x->wlen = 1;
+        x->rmax = 0;
+        break;
+    case SMBUS_RECEIVE_BYTE:
+    case SMBUS_READ_BYTE:
+        x->wlen = 0;
+        x->rmax = 1;
+        break;
+    case SMBUS_WRITE_WORD:
+        x->wlen = 2;
+        x->rmax = 0;
+        break;
+    case SMBUS_READ_WORD:
+        x->wlen = 0;
+        x->rmax = 2;
+        break;
+    case SMBUS_PROCESS_CALL:
+        x->wlen = 2;
+        x->rmax = 2;
+        break;
+    case SMBUS_BLOCK_WRITE:
+        x->rmax = 0;
+        break;
+    case SMBUS_BLOCK_READ:
+        x->wlen = 0;
+        break;
+    default:
+        break;
+    }
+}
+
+int smbus_run(smbus_xfer_t *x)
+{
+    bool reads = smbus_reads(x->op);
+    bool block_in = x->op == SMBUS_BLOCK_READ || x->op == SMBUS_BLOCK_PROCESS_CALL;
+    bool block_out = x->op == SMBUS_BLOCK_WRITE || x->op == SMBUS_BLOCK_PROCESS_CALL;
+    uint8_t addr_w = SMBUS_ADDR_W(x->addr);
+    uint8_t addr_r = SMBUS_ADDR_R(x->addr);
+    size_t tlen = 0;
+
+    smbus_sizes(x);
+    x->rlen = 0;
+    if (x->wlen > SMBUS_BLOCK_MAX || x->rmax > SMBUS_BLOCK_MAX || (reads && !x->rmax))
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    /* everything after the write address goes out in one buffer */
+    if (x->op != SMBUS_QUICK && x->op != SMBUS_SEND_BYTE && x->op != SMBUS_RECEIVE_BYTE)
+    {
+        x->tx[tlen++] = x->cmd;
+    }
+    if (block_out)
+    {
+        x->tx[tlen++] = x->wlen;
+    }
+    memcpy(&x->tx[tlen], x->wdata, x->wlen);
+    tlen += x->wlen;
+    if (x->pec && !reads && x->op != SMBUS_QUICK)
+    {
+        x->tx[tlen] = smbus_pec(smbus_pec(0, &addr_w, 1), x->tx, tlen);
+        tlen++;
+    }
+    size_t rx_len = reads ? (block_in ? 1 : 0) + x->rmax + (x->pec ? 1 : 0) : 0;
+
+    i2c_msg_t msgs[2];
+    size_t nmsgs = 0;
+    if (x->op != SMBUS_RECEIVE_BYTE)
+    {
+        msgs[nmsgs++] = (i2c_msg_t){.addr = x->addr, .buf = x->tx, .len = tlen};
+    }
+    if (reads)
+    {
+        msgs[nmsgs++] = (i2c_msg_t){.addr = x->addr, .read = true, .buf = x->rx, .len = rx_len};
+    }
+    int err = i2c_transfer(msgs, nmsgs);
+    if (err || !reads)
+    {
+        return err;
+    }
+
+    const uint8_t *payload = block_in ? &x->rx[1] : x->rx;
+    size_t count = block_in ? x->rx[0] : x->rmax;
+    if (count > x->rmax)
+    {
+        /* the rest was never clocked in, and neither was the PEC */
+        if (x->pec)
+        {
+            return ESP_ERR_INVALID_SIZE;
+        }
+        count = x->rmax;
+    }
+    if (x->pec)
+    {
+        uint8_t crc = 0;
+        if (x->op != SMBUS_RECEIVE_BYTE)
+        {
+            crc = smbus_pec(crc, &addr_w, 1);
+            crc = smbus_pec(crc, x->tx, tlen);
+        }
+        crc = smbus_pec(crc, &addr_r, 1);
+        crc = smbus_pec(crc, x->rx, (size_t)(payload - x->rx) + count);
+        if (crc != payload[count])
+        {
+            return ESP_ERR_INVALID_CRC;
+        }
+    }
+    memcpy(x->rdata, payload, count);
+    x->rlen = (uint8_t)count;
+    return ESP_OK;
+}
+
+/* ---- typed helpers ---- */
+
+static void smbus_setup(smbus_xfer_t *x, smbus_op_t op, uint8_t addr, uint8_t cmd)
+{
+    x->op = op;
+    x->addr = addr;
+    x->cmd = cmd;
+}
+
+int smbus_quick(smbus_xfer_t *x, uint8_t addr)
+{
+    smbus_setup(x, SMBUS_QUICK, addr, 0);
+    return smbus_run(x);
+}
+
+int smbus_read_byte(smbus_xfer_t *x, uint8_t addr, uint8_t cmd, uint8_t *val)
+{
+    smbus_setup(x, SMBUS_READ_BYTE, addr, cmd);
+    int err = smbus_run(x);
+    if (!err)
+    {
+        *val = x->rdata[0];
+    }
+    return err;
+}
+
+int smbus_write_byte(smbus_xfer_t *x, uint8_t addr, uint8_t cmd, uint8_t val)
+{
+    smbus_setup(x, SMBUS_WRITE_BYTE, addr, cmd);
+    x->wdata[0] = val;
+    return smbus_run(x);
+}
+
+int smbus_read_word(smbus_xfer_t *x, uint8_t addr, uint8_t cmd, uint16_t *val)
+{
+    smbus_setup(x, SMBUS_READ_WORD, addr, cmd);
+    int err = smbus_run(x);
+    if (!err)
+    {
+        *val = (uint16_t)x->rdata[0] | ((uint16_t)x->rdata[1] << 8);
+    }
+    return err;
+}
+
+int smbus_write_word(smbus_xfer_t *x, uint8_t addr, uint8_t cmd, uint16_t val)
+{
+    smbus_setup(x, SMBUS_WRITE_WORD, addr, cmd);
+    x->wdata[0] = (uint8_t)val;
+    x->wdata[1] = (uint8_t)(val >> 8);
+    return smbus_run(x);
+}
+
+int smbus_block_read(smbus_xfer_t *x, uint8_t addr, uint8_t cmd, uint8_t *data, size_t max, uint8_t *len)
+{
+    smbus_setup(x, SMBUS_BLOCK_READ, addr, cmd);
+    x->rmax = (uint8_t)MIN(max, SMBUS_BLOCK_MAX);
+    int err = smbus_run(x);
+    if (!err)
+    {
+        memcpy(data, x->rdata, x->rlen);
+        *len = x->rlen;
+    }
+    return err;
+}
+
+int smbus_block_write(smbus_xfer_t *x, uint8_t addr, uint8_t cmd, const uint8_t *data, size_t len)
+{
+    if (len > SMBUS_BLOCK_MAX)
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    smbus_setup(x, SMBUS_BLOCK_WRITE, addr, cmd);
+    memcpy(x->wdata, data, len);
+    x->wlen = (uint8_t)len;
+    return smbus_run(x);
+}
+
+int smbus_process_call(smbus_xfer_t *x, uint8_t addr, uint8_t cmd, uint16_t in, uint16_t *out)
+{
+    smbus_setup(x, SMBUS_PROCESS_CALL, addr, cmd);
+    x->wdata[0] = (uint8_t)in;
+    x->wdata[1] = (uint8_t)(in >> 8);
+    int err = smbus_run(x);
+    if (!err)
+    {
+        *out = (uint16_t)x->rdata[0] | ((uint16_t)x->rdata[1] << 8);
+    }
+    return err;
+}
+
+int smbus_block_process_call(smbus_xfer_t *x, uint8_t addr, uint8_t cmd, const uint8_t *wdata, size_t wlen,
+                             uint8_t *rdata, size_t rmax, uint8_t *rlen)
+{
+    if (wlen > SMBUS_BLOCK_MAX)
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    smbus_setup(x, SMBUS_BLOCK_PROCESS_CALL, addr, cmd);
+    memcpy(x->wdata, wdata, wlen);
+    x->wlen = (uint8_t)wlen;
+    x->rmax = (uint8_t)MIN(rmax, SMBUS_BLOCK_MAX);
+    int err = smbus_run(x);
+    if (!err)
+    {
+        memcpy(rdata, x->rdata, x->rlen);
+        *rlen = x->rlen;
+    }
+    return err;
+}
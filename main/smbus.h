@@ -0,0 +1,83 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * SMBus 3.x protocol layer on top of the I2C bus.
+ *
+ * Every operation is one bus transaction (i2c_transfer()) built in a
+ * caller-owned smbus_xfer_t, so nothing is allocated per transfer. With `pec` set, a packet error code is appended to writes and
+ * checked on reads (ESP_ERR_INVALID_CRC on mismatch).
+ *
+ * The I2C controller needs the read length up front. Block reads therefore
+ * clock `rmax` payload bytes (plus PEC), and the count byte then tells how
+ * many of them are valid; set `rmax` to the longest block the command
+ * returns so the PEC is inside the bytes read.
+ *
+ * Wire sequences (S start, Sr repeated start, P stop, [PEC] optional):
+ *
+ *   quick               S addr|W P
+ *   send byte           S addr|W data [PEC] P
+ *   receive byte        S addr|R data [PEC] P
+ *   write byte / word   S addr|W cmd data.. [PEC] P
+ *   read byte / word    S addr|W cmd Sr addr|R data.. [PEC] P
+ *   block write         S addr|W cmd count data.. [PEC] P
+ *   block read          S addr|W cmd Sr addr|R count data.. [PEC] P
+ *   process call        S addr|W cmd lo hi Sr addr|R lo hi [PEC] P
+ *   block process call  S addr|W cmd count data.. Sr addr|R count data.. [PEC] P
+ */
+
+#define SMBUS_BLOCK_MAX 32
+/* Address bytes as they go on the wire, the PEC covers them */
+#define SMBUS_ADDR_W(addr) ((uint8_t)((addr) << 1))
+#define SMBUS_ADDR_R(addr) ((uint8_t)(((addr) << 1) | 1))
+
+typedef enum
+{
+    SMBUS_QUICK = 0,
+    SMBUS_SEND_BYTE,
+    SMBUS_RECEIVE_BYTE,
+    SMBUS_WRITE_BYTE,
+    SMBUS_READ_BYTE,
+    SMBUS_WRITE_WORD,
+    SMBUS_READ_WORD,
+    SMBUS_BLOCK_WRITE,
+    SMBUS_BLOCK_READ,
+    SMBUS_PROCESS_CALL,
+    SMBUS_BLOCK_PROCESS_CALL,
+} smbus_op_t;
+
+typedef struct
+{
+    smbus_op_t op;
+    uint8_t addr;
+    uint8_t cmd;
+    bool pec;
+    uint8_t wlen;                     /* payload to write, without count byte */
+    uint8_t wdata[SMBUS_BLOCK_MAX];
+    uint8_t rmax;                     /* payload bytes to clock in (byte / word: set by the op) */
+    uint8_t rlen;                     /* valid payload bytes received */
+    uint8_t rdata[SMBUS_BLOCK_MAX];
+    /* internal */
+    uint8_t tx[2 + SMBUS_BLOCK_MAX + 1];
+    uint8_t rx[1 + SMBUS_BLOCK_MAX + 1];
+} smbus_xfer_t;
+
+uint8_t smbus_pec(uint8_t crc, const uint8_t *data, size_t len);
+
+/* Run the transaction described by `x`, the caller may hold i2c_lock() */
+int smbus_run(smbus_xfer_t *x);
+
+/* Typed helpers, each filling `x` and running it */
+int smbus_quick(smbus_xfer_t *x, uint8_t addr);
+int smbus_read_byte(smbus_xfer_t *x, uint8_t addr, uint8_t cmd, uint8_t *val);
+int smbus_write_byte(smbus_xfer_t *x, uint8_t addr, uint8_t cmd, uint8_t val);
+int smbus_read_word(smbus_xfer_t *x, uint8_t addr, uint8_t cmd, uint16_t *val);
+int smbus_write_word(smbus_xfer_t *x, uint8_t addr, uint8_t cmd, uint16_t val);
+int smbus_block_read(smbus_xfer_t *x, uint8_t addr, uint8_t cmd, uint8_t *data, size_t max, uint8_t *len);
+int smbus_block_write(smbus_xfer_t *x, uint8_t addr, uint8_t cmd, const uint8_t *data, size_t len);
+int smbus_process_call(smbus_xfer_t *x, uint8_t addr, uint8_t cmd, uint16_t in, uint16_t *out);
+int smbus_block_process_call(smbus_xfer_t *x, uint8_t addr, uint8_t cmd, const uint8_t *wdata, size_t wlen,
+                             uint8_t *rdata, size_t rmax, uint8_t *rlen);
@@ -1,10 +1,25 @@
 /* telnet.c */
 #include <string.h>
+#include <inttypes.h>
 #include <sys/param.h> /* For MIN/MAX */
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "freertos/stream_buffer.h"
 #include "esp_system.h"
 #include "esp_log.h"
+#include "sdkconfig.h"
+
+#if CONFIG_IDF_TARGET_LINUX
+/* Native build: host sockets */
+#include <errno.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#define inet_ntoa_r(addr, buf, len) inet_ntop(AF_INET, &(addr), (buf), (len))
+#else
 #include "esp_netif.h" /* For esp_netif_init, if not done elsewhere */
 #include "esp_event.h" /* For esp_event_loop_create_default, if not done elsewhere */
 
@@ -12,12 +27,14 @@
 #include "lwip/sockets.h"
 #include "lwip/sys.h"
 #include <lwip/netdb.h>
+#endif
 
 /* Added for ESP Console integration */
 #include "esp_console.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h> /* Required for va_list, va_copy, etc. */
+#include "zlib.h"     /* MCCP2 output compression */
 
 /* Telnet Command Definitions */
 #define TELNET_IAC 255  /* Interpret As Command */
@@ -36,13 +53,18 @@
 #define TELNET_OPT_TTYPE 24       /* Terminal Type */
 #define TELNET_OPT_NAWS 31        /* Negotiate About Window Size */
 #define TELNET_OPT_LINEMODE 34    /* Linemode */
+#define TELNET_OPT_COMPRESS2 86   /* MCCP2: everything the server sends after IAC SB COMPRESS2 IAC SE is a zlib stream */
 
 /* Static variable for the current Telnet client socket, -1 if none. */
 static int s_telnet_client_sock = -1;
 /* Static variable to store the original vprintf log handler. */
 static vprintf_like_t s_original_vprintf_handler = NULL;
 
+#if CONFIG_IDF_TARGET_LINUX
+#define TELNET_PORT 2323 /* unprivileged port on the host */
+#else
 #define TELNET_PORT 23
+#endif
 #define TELNET_KEEPALIVE_IDLE 5     /* Keepalive idle time (seconds) */
 #define TELNET_KEEPALIVE_INTERVAL 5 /* Keepalive interval time (seconds) */
 #define TELNET_KEEPALIVE_COUNT 3    /* Keepalive packet retry count */
@@ -50,53 +72,283 @@ static vprintf_like_t s_original_vprintf_handler = NULL;
 #define TELNET_TASK_STACK_SIZE 6188
 #define TELNET_TASK_PRIORITY 5
 #define TELNET_MAX_CONNECTIONS 1 /* Max simultaneous connections (listen backlog) */
+#define TELNET_LOG_LINE_SIZE 256
+#define TELNET_LOG_BUFFER_SIZE 2048 /* log text waiting for the telnet task */
+#define TELNET_LOG_POLL_MS 50       /* how often an idle session looks for new log text */
+
+/*
+ * MCCP2 deflate state. Most of what repeats in a dump (colour codes, padding,
+ * bit names) repeats within a few lines, which a 2 kB window already finds;
+ * larger windows gain a few percent. With a level 4 hash deflate needs about
+ * 8 kB + 8 kB + 6 kB of heap per session instead of zlib's default 256 kB.
+ */
+#define TELNET_MCCP_WINDOW_BITS 11
+#define TELNET_MCCP_MEM_LEVEL 4
+#define TELNET_MCCP_LEVEL 6
+#define TELNET_MCCP_OUT_SIZE 512
 
 static const char *TAG_TELNET = "telnet_server";
 
 /*
- * Custom vprintf implementation that redirects log output to the Telnet socket
- * in addition to calling the original vprintf handler.
+ * Everything sent to the client goes through telnet_send(), on the telnet
+ * task only; the lock keeps the compressed stream consistent while
+ * telnet_compress_end() finishes it.
  */
-static int telnet_vprintf_redirect(const char *format, va_list args)
+static struct
+{
+    SemaphoreHandle_t lock;
+    bool compress;     /* MCCP2 stream running */
+    z_stream zs;
+    uint32_t raw;      /* bytes before and after compression this session */
+    uint32_t sent;
+    uint8_t out[TELNET_MCCP_OUT_SIZE];
+} s_out;
+
+/*
+ * Log lines of other tasks. telnet_vprintf_redirect() copies them here
+ * without blocking and the telnet task sends them, so a slow client or
+ * deflate never costs a logging task more than its format buffer. The
+ * lock only serialises writers; a stream buffer takes a single one.
+ */
+static struct
+{
+    SemaphoreHandle_t lock;
+    StreamBufferHandle_t buf;
+    uint32_t dropped; /* lines that did not fit, reported with the next drain */
+} s_log;
+
+static int send_all(const int sock, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    while (len > 0)
+    {
+        int n = send(sock, p, len, 0);
+        if (n < 0)
+        {
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/* Run input through deflate and send what comes out. Lock held. */
+static int telnet_deflate(const int sock, const void *data, size_t len, int flush)
+{
+    s_out.zs.next_in = (Bytef *)data;
+    s_out.zs.avail_in = len;
+    do
+    {
+        s_out.zs.next_out = s_out.out;
+        s_out.zs.avail_out = sizeof(s_out.out);
+        int ret = deflate(&s_out.zs, flush);
+        if (ret == Z_STREAM_ERROR)
+        {
+            return -1;
+        }
+        size_t n = sizeof(s_out.out) - s_out.zs.avail_out;
+        s_out.sent += n;
+        if (n > 0 && send_all(sock, s_out.out, n) < 0)
+        {
+            return -1;
+        }
+    } while (s_out.zs.avail_out == 0);
+    return 0;
+}
+
+/*
+ * Send to the client, compressed once MCCP2 is on. Every call ends with a
+ * sync flush so the client sees the text right away; callers pass whole
+ * lines or command outputs rather than single characters where they can.
+ */
+static int telnet_send(const int sock, const void *data, size_t len)
+{
+    xSemaphoreTake(s_out.lock, portMAX_DELAY);
+    s_out.raw += len;
+    int ret;
+    if (s_out.compress)
+    {
+        ret = telnet_deflate(sock, data, len, Z_SYNC_FLUSH);
+    }
+    else
+    {
+        s_out.sent += len;
+        ret = send_all(sock, data, len);
+    }
+    xSemaphoreGive(s_out.lock);
+    return ret;
+}
+
+/* Client said DO COMPRESS2: announce the stream and compress from the next byte on */
+static void telnet_compress_start(const int sock)
+{
+    static const unsigned char start[] = {TELNET_IAC, TELNET_SB, TELNET_OPT_COMPRESS2, TELNET_IAC, TELNET_SE};
+    static const unsigned char refuse[] = {TELNET_IAC, TELNET_WONT, TELNET_OPT_COMPRESS2};
+
+    xSemaphoreTake(s_out.lock, portMAX_DELAY);
+    if (s_out.compress)
+    {
+        xSemaphoreGive(s_out.lock);
+        return;
+    }
+    memset(&s_out.zs, 0, sizeof(s_out.zs));
+    int ret = deflateInit2(&s_out.zs, TELNET_MCCP_LEVEL, Z_DEFLATED, TELNET_MCCP_WINDOW_BITS, TELNET_MCCP_MEM_LEVEL,
+                           Z_DEFAULT_STRATEGY);
+    if (ret == Z_OK)
+    {
+        s_out.compress = send_all(sock, start, sizeof(start)) == 0;
+        if (!s_out.compress)
+        {
+            deflateEnd(&s_out.zs);
+        }
+    }
+    else
+    {
+        /* no heap for the deflate state: stay uncompressed */
+        send_all(sock, refuse, sizeof(refuse));
+    }
+    xSemaphoreGive(s_out.lock);
+
+    if (ret == Z_OK)
+    {
+        ESP_LOGI(TAG_TELNET, "MCCP2 compression on");
+    }
+    else
+    {
+        ESP_LOGW(TAG_TELNET, "MCCP2 refused, deflateInit2: %d", ret);
+    }
+}
+
+/*
+ * Finish the zlib stream (the client then reads plain text again) on
+ * DONT COMPRESS2 or when the session ends; `sock` < 0 just frees the state.
+ */
+static void telnet_compress_end(const int sock)
 {
-    int ret = 0;
+    xSemaphoreTake(s_out.lock, portMAX_DELAY);
+    bool was_on = s_out.compress;
+    if (s_out.compress)
+    {
+        if (sock >= 0)
+        {
+            telnet_deflate(sock, NULL, 0, Z_FINISH);
+        }
+        deflateEnd(&s_out.zs);
+        s_out.compress = false;
+    }
+    uint32_t raw = s_out.raw;
+    uint32_t sent = s_out.sent;
+    xSemaphoreGive(s_out.lock);
 
-    /* Call the original vprintf handler to output to UART/default log. */
+    if (was_on && sent > 0)
+    {
+        ESP_LOGI(TAG_TELNET, "MCCP2 off: %" PRIu32 " bytes sent as %" PRIu32 " (%.1fx)", raw, sent,
+                 (double)raw / sent);
+    }
+}
 
-    /* If a Telnet client is connected, send the log to them. */
+/*
+ * Custom vprintf implementation that queues log output for the Telnet client
+ * in addition to calling the original vprintf handler.
+ */
+static int telnet_vprintf_redirect(const char *format, va_list args)
+{
+    /* If a Telnet client is connected, queue the log for them. */
     if (s_telnet_client_sock == -1)
     {
         return s_original_vprintf_handler(format, args);
     }
 
-    char temp_buffer[256]; /* Buffer for the formatted log line. */
-    int len = vsnprintf(temp_buffer, sizeof(temp_buffer), format, args);
+    char line[TELNET_LOG_LINE_SIZE]; /* Buffer for the formatted log line. */
+    int len = vsnprintf(line, sizeof(line), format, args);
+    if (len <= 0)
+    {
+        return 0;
+    }
+    len = MIN(len, (int)sizeof(line) - 1);
 
-    if (len > 0)
+    /* Whole lines or nothing: \n becomes \r\n for Telnet on the way in. */
+    size_t need = (size_t)len;
+    for (int i = 0; i < len; ++i)
+    {
+        need += line[i] == '\n';
+    }
+    xSemaphoreTake(s_log.lock, portMAX_DELAY);
+    if (xStreamBufferSpacesAvailable(s_log.buf) < need)
     {
-        /* Send character by character, converting \n to \r\n for Telnet. */
-        for (int i = 0; i < len && i < sizeof(temp_buffer) - 1; ++i)
+        s_log.dropped++;
+    }
+    else
+    {
+        int start = 0;
+        for (int i = 0; i < len; ++i)
         {
-            if (temp_buffer[i] == '\n')
+            if (line[i] == '\n')
             {
-                if (send(s_telnet_client_sock, "\r\n", 2, 0) < 0)
-                {
-                    /* Error sending, client might have disconnected abruptly. */
-                    /* No easy way to fully handle this here without more state. */
-                    break;
-                }
+                xStreamBufferSend(s_log.buf, &line[start], i - start, 0);
+                xStreamBufferSend(s_log.buf, "\r\n", 2, 0);
+                start = i + 1;
             }
-            else
+        }
+        xStreamBufferSend(s_log.buf, &line[start], len - start, 0);
+    }
+    xSemaphoreGive(s_log.lock);
+
+    return 0;
+}
+
+/* Send queued log text to the client. Telnet task only. */
+static int telnet_drain_log(const int sock)
+{
+    static char chunk[TELNET_LOG_LINE_SIZE];
+    size_t n;
+
+    while ((n = xStreamBufferReceive(s_log.buf, chunk, sizeof(chunk), 0)) > 0)
+    {
+        if (telnet_send(sock, chunk, n) < 0)
+        {
+            return -1;
+        }
+    }
+    xSemaphoreTake(s_log.lock, portMAX_DELAY);
+    uint32_t dropped = s_log.dropped;
+    s_log.dropped = 0;
+    xSemaphoreGive(s_log.lock);
+    if (dropped > 0)
+    {
+        int len = snprintf(chunk, sizeof(chunk), "[%" PRIu32 " log lines dropped]\r\n", dropped);
+        return telnet_send(sock, chunk, len);
+    }
+    return 0;
+}
+
+/*
+ * recv() exactly `len` bytes. The socket has a receive timeout, so an idle
+ * session wakes every TELNET_LOG_POLL_MS to pass queued log text on.
+ */
+static int telnet_recv(const int sock, void *buf, size_t len)
+{
+    uint8_t *p = buf;
+    size_t got = 0;
+    while (got < len)
+    {
+        int n = recv(sock, p + got, len - got, 0);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            if (telnet_drain_log(sock) < 0)
             {
-                if (send(s_telnet_client_sock, &temp_buffer[i], 1, 0) < 0)
-                {
-                    break;
-                }
+                return -1;
             }
+            continue;
+        }
+        if (n <= 0)
+        {
+            return n;
         }
+        got += (size_t)n;
     }
-
-    return ret;
+    return (int)got;
 }
 
 /* Helper to send Telnet command sequences */
@@ -106,7 +358,7 @@ static void send_telnet_iac(const int sock, unsigned char command, unsigned char
     seq[0] = TELNET_IAC;
     seq[1] = command;
     seq[2] = option;
-    if (send(sock, seq, 3, 0) < 0)
+    if (telnet_send(sock, seq, 3) < 0)
     {
         ESP_LOGE(TAG_TELNET, "Error sending IAC command %u %u: errno %d", command, option, errno);
     }
@@ -132,26 +384,37 @@ static void handle_telnet_client_connection(const int sock)
     FILE *original_stdout = stdout; /* Store original stdout */
 
     ESP_LOGI(TAG_TELNET, "New client connection, attempting to set character mode.");
+    xSemaphoreTake(s_log.lock, portMAX_DELAY);
+    xStreamBufferReset(s_log.buf); /* Nothing from before this session */
+    s_log.dropped = 0;
+    xSemaphoreGive(s_log.lock);
     s_telnet_client_sock = sock; /* Set the active telnet socket for logging */
+    s_out.raw = 0;
+    s_out.sent = 0;
+
+    struct timeval tv = {.tv_sec = 0, .tv_usec = TELNET_LOG_POLL_MS * 1000};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
 
     /* Negotiate Telnet options: Server WILL ECHO, Server WILL SGA */
     /* This tells the client that the server will handle echoing and suppress go-ahead prompts */
     send_telnet_iac(sock, TELNET_WILL, TELNET_OPT_ECHO);
     send_telnet_iac(sock, TELNET_WILL, TELNET_OPT_SGA);
+    /* Offer MCCP2; clients without it answer DONT (or nothing) and get plain output */
+    send_telnet_iac(sock, TELNET_WILL, TELNET_OPT_COMPRESS2);
     /* Optionally, ask client to DO SGA and DO ECHO if we want to confirm client state, */
     /* but for simplicity, we assume client will adapt or server-side handling is sufficient. */
     /* send_telnet_iac(sock, TELNET_DO, TELNET_OPT_SGA); */
     /* send_telnet_iac(sock, TELNET_DO, TELNET_OPT_ECHO); // If we want client to also echo, usually not with server echo */
 
     /* Send welcome message */
-    if (send(sock, welcome_msg, strlen(welcome_msg), 0) < 0)
+    if (telnet_send(sock, welcome_msg, strlen(welcome_msg)) < 0)
     {
         ESP_LOGE(TAG_TELNET, "Error sending welcome message: errno %d", errno);
         goto close_socket_cleanup;
     }
 
     /* Send initial prompt */
-    if (send(sock, prompt, strlen(prompt), 0) < 0)
+    if (telnet_send(sock, prompt, strlen(prompt)) < 0)
     {
         ESP_LOGE(TAG_TELNET, "Error sending initial prompt: errno %d", errno);
         goto close_socket_cleanup;
@@ -162,7 +425,7 @@ static void handle_telnet_client_connection(const int sock)
 
     do
     {
-        int len_recv = recv(sock, input_char_buf, 1, 0);
+        int len_recv = telnet_recv(sock, input_char_buf, 1);
 
         if (len_recv < 0)
         {
@@ -180,7 +443,7 @@ static void handle_telnet_client_connection(const int sock)
         if (c == TELNET_IAC)
         {
             unsigned char iac_cmd_buf[2];
-            int iac_len = recv(sock, iac_cmd_buf, 2, 0);
+            int iac_len = telnet_recv(sock, iac_cmd_buf, 2);
             if (iac_len == 2)
             {
                 unsigned char iac_command = iac_cmd_buf[0];
@@ -196,6 +459,14 @@ static void handle_telnet_client_connection(const int sock)
                     /* This is more advanced, for now just acknowledge by sending WONT */
                     send_telnet_iac(sock, TELNET_WONT, TELNET_OPT_TTYPE);
                 }
+                else if (iac_command == TELNET_DO && iac_option == TELNET_OPT_COMPRESS2)
+                {
+                    telnet_compress_start(sock);
+                }
+                else if (iac_command == TELNET_DONT && iac_option == TELNET_OPT_COMPRESS2)
+                {
+                    telnet_compress_end(sock);
+                }
             }
             else
             {
@@ -210,7 +481,7 @@ static void handle_telnet_client_connection(const int sock)
         { /* Carriage return */
             /* Typically followed by \n (from client) or client sends \r as Enter */
             line_buffer[line_len] = 0; /* Null-terminate */
-            if (send(sock, "\r\n", 2, 0) < 0)
+            if (telnet_send(sock, "\r\n", 2) < 0)
             {
                 break;
             } /* Echo CR LF */
@@ -220,7 +491,7 @@ static void handle_telnet_client_connection(const int sock)
             if (strcmp(line_buffer, "exit") == 0)
             {
                 ESP_LOGI(TAG_TELNET, "Client requested exit");
-                if (send(sock, "Goodbye!\r\n", strlen("Goodbye!\r\n"), 0) < 0)
+                if (telnet_send(sock, "Goodbye!\r\n", strlen("Goodbye!\r\n")) < 0)
                 { /* Ignore error on exit */
                 }
                 break;
@@ -231,7 +502,7 @@ static void handle_telnet_client_connection(const int sock)
                 if (!temp_stdout)
                 {
                     ESP_LOGE(TAG_TELNET, "Failed to open memstream");
-                    if (send(sock, "Error: Internal server error (memstream)\r\n", strlen("Error: Internal server error (memstream)\r\n"), 0) < 0)
+                    if (telnet_send(sock, "Error: Internal server error (memstream)\r\n", strlen("Error: Internal server error (memstream)\r\n")) < 0)
                     {
                         break;
                     }
@@ -249,14 +520,14 @@ static void handle_telnet_client_connection(const int sock)
 
                     if (exec_ret == ESP_ERR_NOT_FOUND)
                     {
-                        if (send(sock, "Error: Command not found\r\n", strlen("Error: Command not found\r\n"), 0) < 0)
+                        if (telnet_send(sock, "Error: Command not found\r\n", strlen("Error: Command not found\r\n")) < 0)
                         {
                             break;
                         }
                     }
                     else if (exec_ret == ESP_ERR_INVALID_ARG)
                     {
-                        if (send(sock, "Error: Invalid arguments\r\n", strlen("Error: Invalid arguments\r\n"), 0) < 0)
+                        if (telnet_send(sock, "Error: Invalid arguments\r\n", strlen("Error: Invalid arguments\r\n")) < 0)
                         {
                             break;
                         }
@@ -265,7 +536,7 @@ static void handle_telnet_client_connection(const int sock)
                     {
                         char err_msg[80];
                         snprintf(err_msg, sizeof(err_msg), "Error: Command failed (err %d)\r\n", exec_ret);
-                        if (send(sock, err_msg, strlen(err_msg), 0) < 0)
+                        if (telnet_send(sock, err_msg, strlen(err_msg)) < 0)
                         {
                             break;
                         }
@@ -273,14 +544,14 @@ static void handle_telnet_client_connection(const int sock)
 
                     if (output_buffer && output_buffer_size > 0)
                     {
-                        if (send(sock, output_buffer, output_buffer_size, 0) < 0)
+                        if (telnet_send(sock, output_buffer, output_buffer_size) < 0)
                         {
                             break;
                         }
                         /* Ensure CRLF if not present, common for console output */
                         if (output_buffer_size > 0 && output_buffer[output_buffer_size - 1] != '\n')
                         {
-                            if (send(sock, "\r\n", 2, 0) < 0)
+                            if (telnet_send(sock, "\r\n", 2) < 0)
                             {
                                 break;
                             }
@@ -289,7 +560,7 @@ static void handle_telnet_client_connection(const int sock)
                     else if (exec_ret == ESP_OK && cmd_ret_code == ESP_OK)
                     {
                         /* If command was successful but produced no output, still send a CRLF for neatness */
-                        if (send(sock, "\r\n", 2, 0) < 0)
+                        if (telnet_send(sock, "\r\n", 2) < 0)
                         {
                             break;
                         }
@@ -307,10 +578,10 @@ static void handle_telnet_client_connection(const int sock)
                 /* send(sock, "\r\n", 2, 0); // Already sent CR LF above */
             }
 
-            /* Reset line buffer and send prompt for next command */
+            /* Reset line buffer and send prompt for next command, after what the command logged */
             memset(line_buffer, 0, sizeof(line_buffer));
             line_len = 0;
-            if (send(sock, prompt, strlen(prompt), 0) < 0)
+            if (telnet_drain_log(sock) < 0 || telnet_send(sock, prompt, strlen(prompt)) < 0)
             {
                 break;
             }
@@ -330,7 +601,7 @@ static void handle_telnet_client_connection(const int sock)
                 line_len--;
                 line_buffer[line_len] = 0; /* Effectively delete char */
                 /* Echo backspace, space, backspace to erase on client terminal */
-                if (send(sock, "\b \b", 3, 0) < 0)
+                if (telnet_send(sock, "\b \b", 3) < 0)
                 {
                     break;
                 }
@@ -343,7 +614,7 @@ static void handle_telnet_client_connection(const int sock)
                 line_buffer[line_len++] = c;
                 line_buffer[line_len] = 0; /* Keep null-terminated */
                 /* Echo character back to client */
-                if (send(sock, &c, 1, 0) < 0)
+                if (telnet_send(sock, &c, 1) < 0)
                 {
                     break;
                 }
@@ -360,6 +631,7 @@ static void handle_telnet_client_connection(const int sock)
 close_socket_cleanup:
     ESP_LOGI(TAG_TELNET, "Shutting down client socket and closing connection");
     s_telnet_client_sock = -1; /* Clear the active telnet socket for logging */
+    telnet_compress_end(sock); /* Ends the zlib stream cleanly if the client is still there */
 
     /* Ensure stdout is restored if loop broken unexpectedly while redirected */
     if (stdout != original_stdout)
@@ -514,6 +786,9 @@ void telnet_start(void) /* Renamed to avoid conflict with potential framework st
      * It's assumed that network interface (Wi-Fi or Ethernet) has been initialized
      * and the device is connected to the network before this function is called.
      */
+    s_out.lock = xSemaphoreCreateMutex();
+    s_log.lock = xSemaphoreCreateMutex();
+    s_log.buf = xStreamBufferCreate(TELNET_LOG_BUFFER_SIZE, 1);
     BaseType_t xReturned = xTaskCreate(telnet_server_main_task, /* Task function */
                                        "telnet_srv_task",       /* Name of task */
                                        TELNET_TASK_STACK_SIZE,  /* Stack size of task */
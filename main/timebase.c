@@ -0,0 +1,365 @@
+/* timebase.c - monotonic sample time base with SNTP-disciplined wall clock */
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <inttypes.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_console.h"
+#include "sdkconfig.h"
+#if CONFIG_IDF_TARGET_LINUX
+#include <sys/time.h>
+#else
+#include "esp_netif_sntp.h"
+#include "esp_sntp.h"
+#endif
+#include "nvs.h"
+#include "argtable3/argtable3.h"
+
+#include "timebase.h"
+
+#define TB_NVS_NAMESPACE "timebase"
+#define TB_NVS_KEY_SERVER "ntp_server"
+#define TB_DEFAULT_SERVER "pool.ntp.org"
+#define TB_SERVER_MAX_LEN 64
+
+#define TB_SNTP_INTERVAL_MS 64000   /* SNTP poll interval, lwIP minimum is 15 s */
+#define TB_SLEW_MAX_PPM 500         /* max phase correction rate, keeps wall time strictly increasing */
+#define TB_DRIFT_MAX_PPB 500000     /* clamp of the frequency correction (±500 ppm) */
+#define TB_FLL_MIN_INTERVAL_US 10000000LL /* ignore frequency updates from closely spaced syncs */
+#define TB_FLL_GAIN_DIV 2           /* apply half of the observed frequency error per update */
+
+static const char *TAG = "timebase";
+
+static portMUX_TYPE s_tb_lock = portMUX_INITIALIZER_UNLOCKED;
+static char s_tb_server[TB_SERVER_MAX_LEN] = TB_DEFAULT_SERVER;
+static bool s_tb_sntp_running = false;
+
+/*
+ * Discipline state. The applied offset at mono time t is
+ *
+ *   offset(t) = ref_offset + (t - ref_mono) * drift + slew(t - ref_mono)
+ *
+ * where slew() moves `slew_remaining` in at no more than TB_SLEW_MAX_PPM.
+ * On every SNTP update the reference is moved to "now" with the offset that
+ * was applied at that instant, so the wall clock stays continuous.
+ */
+static struct
+{
+    bool synced;
+    int64_t ref_mono_us;
+    int64_t ref_offset_us;
+    int64_t slew_remaining_us;
+    int32_t drift_ppb;
+
+    uint32_t sync_count;
+    int64_t last_error_us;
+    int64_t last_sync_mono_us;
+} s_tb;
+
+static int64_t tb_slew_applied(int64_t remaining_us, int64_t dt_us)
+{
+    int64_t max_us = dt_us * TB_SLEW_MAX_PPM / 1000000LL;
+    if (remaining_us >= 0)
+    {
+        return remaining_us < max_us ? remaining_us : max_us;
+    }
+    return -remaining_us < max_us ? remaining_us : -max_us;
+}
+
+/* Caller must hold s_tb_lock */
+static int64_t tb_offset_locked(int64_t mono_us)
+{
+    int64_t dt = mono_us - s_tb.ref_mono_us;
+    if (dt < 0)
+    {
+        dt = 0;
+    }
+    return s_tb.ref_offset_us + dt * s_tb.drift_ppb / 1000000000LL + tb_slew_applied(s_tb.slew_remaining_us, dt);
+}
+
+int64_t tb_mono_us(void)
+{
+    return esp_timer_get_time();
+}
+
+int64_t tb_wall_from_mono(int64_t mono_us)
+{
+    int64_t wall = 0;
+
+    portENTER_CRITICAL(&s_tb_lock);
+    if (s_tb.synced)
+    {
+        wall = mono_us + tb_offset_locked(mono_us);
+    }
+    portEXIT_CRITICAL(&s_tb_lock);
+
+    return wall;
+}
+
+void tb_now(tb_stamp_t *ts)
+{
+    ts->mono_us = esp_timer_get_time();
+    ts->wall_us = tb_wall_from_mono(ts->mono_us);
+}
+
+bool tb_synced(void)
+{
+    return s_tb.synced;
+}
+
+void tb_get_metrics(tb_metrics_t *m)
+{
+    int64_t now = esp_timer_get_time();
+
+    portENTER_CRITICAL(&s_tb_lock);
+    m->synced = s_tb.synced;
+    m->sync_count = s_tb.sync_count;
+    m->offset_us = s_tb.synced ? tb_offset_locked(now) : 0;
+    m->last_error_us = s_tb.last_error_us;
+    m->slew_remaining_us = s_tb.slew_remaining_us - tb_slew_applied(s_tb.slew_remaining_us, now - s_tb.ref_mono_us);
+    m->drift_ppb = s_tb.drift_ppb;
+    m->last_sync_mono_us = s_tb.last_sync_mono_us;
+    portEXIT_CRITICAL(&s_tb_lock);
+}
+
+int tb_format(int64_t wall_us, char *buf, size_t len)
+{
+    if (wall_us <= 0)
+    {
+        return snprintf(buf, len, "-");
+    }
+
+    time_t secs = (time_t)(wall_us / 1000000LL);
+    int ms = (int)((wall_us / 1000LL) % 1000LL);
+    struct tm tm;
+    gmtime_r(&secs, &tm);
+
+    size_t pos = strftime(buf, len, "%Y-%m-%dT%H:%M:%S", &tm);
+    return pos + snprintf(buf + pos, len - pos, ".%03dZ", ms);
+}
+
+/*
+ * Called from the lwIP SNTP client with the server time of the reply.
+ * The system clock is handled by lwIP itself (smooth mode), we only use the
+ * measurement to discipline our own mono→wall mapping.
+ */
+static void tb_sntp_sync_cb(struct timeval *tv)
+{
+    int64_t now = esp_timer_get_time();
+    int64_t measured = (int64_t)tv->tv_sec * 1000000LL + tv->tv_usec - now;
+
+    portENTER_CRITICAL(&s_tb_lock);
+    if (!s_tb.synced)
+    {
+        /* First fix: nothing has been stamped with wall time yet, so set it directly */
+        s_tb.ref_mono_us = now;
+        s_tb.ref_offset_us = measured;
+        s_tb.slew_remaining_us = 0;
+        s_tb.drift_ppb = 0;
+        s_tb.last_error_us = 0;
+        s_tb.synced = true;
+    }
+    else
+    {
+        int64_t dt = now - s_tb.ref_mono_us;
+        int64_t applied = tb_offset_locked(now);
+        /* where the clock is converging to if the old slew had completed */
+        int64_t target = s_tb.ref_offset_us + s_tb.slew_remaining_us + dt * s_tb.drift_ppb / 1000000000LL;
+        int64_t interval = now - s_tb.last_sync_mono_us;
+
+        if (interval >= TB_FLL_MIN_INTERVAL_US)
+        {
+            int64_t drift = s_tb.drift_ppb + (measured - target) * 1000000000LL / interval / TB_FLL_GAIN_DIV;
+            if (drift > TB_DRIFT_MAX_PPB)
+            {
+                drift = TB_DRIFT_MAX_PPB;
+            }
+            else if (drift < -TB_DRIFT_MAX_PPB)
+            {
+                drift = -TB_DRIFT_MAX_PPB;
+            }
+            s_tb.drift_ppb = (int32_t)drift;
+        }
+
+        s_tb.ref_mono_us = now;
+        s_tb.ref_offset_us = applied;
+        s_tb.slew_remaining_us = measured - applied;
+        s_tb.last_error_us = measured - applied;
+    }
+    s_tb.sync_count++;
+    s_tb.last_sync_mono_us = now;
+    portEXIT_CRITICAL(&s_tb_lock);
+
+    ESP_LOGI(TAG, "SNTP update #%" PRIu32 ": error %" PRId64 " us, drift %+" PRId32 " ppb",
+             s_tb.sync_count, s_tb.last_error_us, s_tb.drift_ppb);
+}
+
+#if CONFIG_IDF_TARGET_LINUX
+/*
+ * Native build: the host clock is already disciplined (ntpd, chrony), so it
+ * is sampled in place of the SNTP replies and the server setting is unused.
+ */
+static void tb_host_sample(void *arg)
+{
+    (void)arg;
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    tb_sntp_sync_cb(&tv);
+}
+
+static void tb_sntp_restart(void)
+{
+    static esp_timer_handle_t timer;
+    const esp_timer_create_args_t args = {
+        .callback = tb_host_sample,
+        .name = "tb_host",
+    };
+
+    if (!s_tb_sntp_running && esp_timer_create(&args, &timer) == ESP_OK)
+    {
+        esp_timer_start_periodic(timer, TB_SNTP_INTERVAL_MS * 1000ULL);
+        s_tb_sntp_running = true;
+    }
+    tb_host_sample(NULL);
+}
+#else
+static void tb_sntp_restart(void)
+{
+    if (s_tb_sntp_running)
+    {
+        esp_netif_sntp_deinit();
+        s_tb_sntp_running = false;
+    }
+
+    esp_sntp_config_t config = ESP_NETIF_SNTP_DEFAULT_CONFIG(s_tb_server);
+    config.smooth_sync = true;
+    config.sync_cb = tb_sntp_sync_cb;
+    esp_err_t err = esp_netif_sntp_init(&config);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "SNTP init failed: %s", esp_err_to_name(err));
+        return;
+    }
+    s_tb_sntp_running = true;
+    sntp_set_sync_interval(TB_SNTP_INTERVAL_MS);
+    ESP_LOGI(TAG, "SNTP client using server '%s'", s_tb_server);
+}
+#endif
+
+// ──────────────────────────────────────────────────────────────────────────────
+//  Console commands
+// ──────────────────────────────────────────────────────────────────────────────
+
+static struct
+{
+    struct arg_str *server;
+    struct arg_end *end_arg;
+} time_server_args;
+
+static int cmd_time_status(int argc, char **argv)
+{
+    (void)argc;
+    (void)argv;
+
+    tb_stamp_t ts;
+    tb_metrics_t m;
+    char iso[40];
+
+    tb_now(&ts);
+    tb_get_metrics(&m);
+    tb_format(ts.wall_us, iso, sizeof(iso));
+
+    printf("%-20s: %" PRId64 " us\n", "Monotonic", ts.mono_us);
+    printf("%-20s: %s\n", "Wall clock", iso);
+    printf("%-20s: %s\n", "NTP server", s_tb_server);
+    printf("%-20s: %s\n", "Synced", m.synced ? "yes" : "no");
+    printf("%-20s: %" PRIu32 "\n", "Updates", m.sync_count);
+    if (m.synced)
+    {
+        printf("%-20s: %" PRId64 " s ago\n", "Last update", (ts.mono_us - m.last_sync_mono_us) / 1000000LL);
+        printf("%-20s: %" PRId64 " us\n", "Offset", m.offset_us);
+        printf("%-20s: %" PRId64 " us\n", "Last error", m.last_error_us);
+        printf("%-20s: %" PRId64 " us\n", "Slew remaining", m.slew_remaining_us);
+        printf("%-20s: %+.3f ppm\n", "Drift", m.drift_ppb / 1000.0f);
+    }
+    return 0;
+}
+
+static int cmd_time_server(int argc, char **argv)
+{
+    int nerrors = arg_parse(argc, argv, (void **)&time_server_args);
+    if (nerrors != 0)
+    {
+        arg_print_errors(stderr, time_server_args.end_arg, argv[0]);
+        return 1;
+    }
+
+    if (time_server_args.server->count == 0)
+    {
+        printf("NTP server: %s\n", s_tb_server);
+        return 0;
+    }
+
+    const char *server = time_server_args.server->sval[0];
+    if (strlen(server) >= sizeof(s_tb_server))
+    {
+        ESP_LOGE(TAG, "Server name too long (max %d chars).", TB_SERVER_MAX_LEN - 1);
+        return 1;
+    }
+    strcpy(s_tb_server, server);
+
+    nvs_handle_t handle;
+    if (nvs_open(TB_NVS_NAMESPACE, NVS_READWRITE, &handle) == ESP_OK)
+    {
+        nvs_set_str(handle, TB_NVS_KEY_SERVER, s_tb_server);
+        nvs_commit(handle);
+        nvs_close(handle);
+    }
+
+    tb_sntp_restart();
+    return 0;
+}
+
+static void register_time_commands(void)
+{
+    const esp_console_cmd_t status_cmd = {
+        .command = "time_status",
+        .help = "Show time base: monotonic/wall clock, SNTP offset, error and drift",
+        .hint = NULL,
+        .func = &cmd_time_status,
+        .argtable = NULL,
+    };
+    ESP_ERROR_CHECK(esp_console_cmd_register(&status_cmd));
+
+    time_server_args.server = arg_str0(NULL, NULL, "<host>", "NTP server name or IP (e.g. a local NTP server)");
+    time_server_args.end_arg = arg_end(1);
+
+    const esp_console_cmd_t server_cmd = {
+        .command = "time_server",
+        .help = "Show or set (and persist) the NTP server used to discipline the wall clock",
+        .hint = NULL,
+        .func = &cmd_time_server,
+        .argtable = &time_server_args,
+    };
+    ESP_ERROR_CHECK(esp_console_cmd_register(&server_cmd));
+}
+
+void timebase_start(void)
+{
+    nvs_handle_t handle;
+    if (nvs_open(TB_NVS_NAMESPACE, NVS_READONLY, &handle) == ESP_OK)
+    {
+        size_t len = sizeof(s_tb_server);
+        if (nvs_get_str(handle, TB_NVS_KEY_SERVER, s_tb_server, &len) != ESP_OK)
+        {
+            strcpy(s_tb_server, TB_DEFAULT_SERVER);
+        }
+        nvs_close(handle);
+    }
+
+    tb_sntp_restart();
+    register_time_commands();
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Station time base.
+ *
+ * Every sample, trace record and event is stamped with the monotonic 64-bit
+ * esp_timer time (µs since boot) plus the wall clock derived from it. The wall
+ * clock is `mono + offset`, where the offset is disciplined by SNTP: phase
+ * errors are slewed out at a bounded rate and the esp_timer crystal drift is
+ * compensated, so wall time never steps once it has been set.
+ */
+typedef struct
+{
+    int64_t mono_us; /* esp_timer_get_time(), monotonic since boot */
+    int64_t wall_us; /* disciplined wall clock, µs since Unix epoch (0 = not synced yet) */
+} tb_stamp_t;
+
+typedef struct
+{
+    bool synced;               /* wall clock has been set at least once */
+    uint32_t sync_count;       /* number of SNTP updates processed */
+    int64_t offset_us;         /* currently applied wall - mono offset */
+    int64_t last_error_us;     /* measured offset minus applied offset at last update */
+    int64_t slew_remaining_us; /* phase error still being slewed in */
+    int32_t drift_ppb;         /* esp_timer frequency correction in parts per billion */
+    int64_t last_sync_mono_us; /* mono time of the last SNTP update */
+} tb_metrics_t;
+
+void timebase_start(void);
+
+int64_t tb_mono_us(void);
+int64_t tb_wall_from_mono(int64_t mono_us);
+void tb_now(tb_stamp_t *ts);
+bool tb_synced(void);
+void tb_get_metrics(tb_metrics_t *m);
+
+/* Format a wall time as ISO 8601 UTC with milliseconds, "-" if not synced. */
+int tb_format(int64_t wall_us, char *buf, size_t len);
@@ -0,0 +1,144 @@
+#!/usr/bin/env python3
+"""Build the register map image for the "regmap" partition.
+
+Each JSON file describes one device:
+
+    {
+      "name": "bq24725a", "addr": "0x09", "reg_width": 1, "big_endian": false,
+      "registers": [
+        {"reg": "0x15", "name": "ChargeVoltage", "size": 2, "type": "int", "unit": "mV"},
+        {"reg": "0x12", "name": "ChargeOption", "size": 2, "type": "bits",
+         "bits": [{"bit": 0, "width": 1, "desc": "INHIBIT", "long": "Charge inhibit"}]}
+      ]
+    }
+
+Register types: "int" (unscaled, "signed": true for two's complement),
+"float" ("scaling", "offset"), "hex", "ascii", "block" (hex bytes) and
+"bits". "size" is the number of bytes read, 1..32; "smbus_block": true
+reads an SBS-style block with a leading length byte (size then includes
+it). "big_endian" may be set per device or per register.
+
+    tools/regmap.py tools/regmap/*.json -o regmap.bin
+    parttool.py write_partition --partition-name regmap --input regmap.bin
+
+then `regmap --reload` on the device.
+"""
+
+import argparse
+import json
+import struct
+import sys
+import zlib
+
+MAGIC = 0x50414D52
+VERSION = 1
+HDR = struct.Struct("<IHHII")
+DEV = struct.Struct("<IIHBB")
+REG = struct.Struct("<IIffIHBBBBH")
+BIT = struct.Struct("<IIBBH")
+
+# bq_data_type
+TYPES = {"int": 2, "float": 1, "hex": 3, "ascii": 4, "block": 5, "bits": 6}
+BLOCK_TYPES = ("ascii", "block", "bits")
+
+# BQ_ENTRY_* flags
+SIGNED, BIG_ENDIAN, RAW_BLOCK = 0x01, 0x02, 0x04
+MAX_REG_SIZE = 32
+
+
+def num(v):
+    return int(v, 0) if isinstance(v, str) else int(v)
+
+
+class Strings:
+    def __init__(self):
+        self.data = bytearray()
+        self.index = {}
+
+    def add(self, s):
+        if not s:
+            return None
+        if s not in self.index:
+            self.index[s] = len(self.data)
+            self.data += s.encode("utf-8") + b"\0"
+        return self.index[s]
+
+
+def build(devices):
+    strings = Strings()
+    regs, bits = [], []
+    dev_recs = []
+
+    for dev in devices:
+        reg_width = num(dev.get("reg_width", 1))
+        if reg_width not in (1, 2):
+            raise ValueError(f"{dev['name']}: reg_width must be 1 or 2")
+        first_reg = len(regs)
+        for r in dev["registers"]:
+            kind = r.get("type", "hex")
+            if kind not in TYPES:
+                raise ValueError(f"{dev['name']}.{r['name']}: unknown type {kind}")
+            size = num(r.get("size", 2 if kind not in BLOCK_TYPES else MAX_REG_SIZE))
+            smbus = r.get("smbus_block", False)
+            limit = MAX_REG_SIZE + 1 if smbus else (MAX_REG_SIZE if kind in BLOCK_TYPES else 2)
+            if not 1 <= size <= limit:
+                raise ValueError(f"{dev['name']}.{r['name']}: size must be 1..{limit}")
+            flags = 0
+            if r.get("signed"):
+                flags |= SIGNED
+            if r.get("big_endian", dev.get("big_endian", False)):
+                flags |= BIG_ENDIAN
+            if kind in BLOCK_TYPES and not smbus:
+                flags |= RAW_BLOCK
+            first_bit = len(bits)
+            for b in r.get("bits", []):
+                bits.append((b.get("desc"), b.get("long"), num(b["bit"]), num(b.get("width", 1))))
+            regs.append((r["name"], r.get("unit"), float(r.get("scaling", 1.0)), float(r.get("offset", 0.0)),
+                         first_bit, len(bits) - first_bit, num(r["reg"]), TYPES[kind], size, flags))
+        dev_recs.append((dev["name"], first_reg, len(regs) - first_reg, num(dev["addr"]), reg_width))
+
+    regs_off = HDR.size + DEV.size * len(dev_recs)
+    regs_off = (regs_off + 3) & ~3
+    bits_off = regs_off + REG.size * len(regs)
+    str_off = bits_off + BIT.size * len(bits)
+
+    def s(text):
+        off = strings.add(text)
+        return 0 if off is None else str_off + off
+
+    body = bytearray()
+    for name, first, count, addr, width in dev_recs:
+        body += DEV.pack(s(name), regs_off + REG.size * first, count, addr, width)
+    body += b"\0" * (regs_off - HDR.size - len(body))
+    for name, unit, scaling, offset, first_bit, nbits, reg, kind, size, flags in regs:
+        body += REG.pack(s(name), s(unit), scaling, offset, bits_off + BIT.size * first_bit, reg, kind, size,
+                         flags, nbits, 0)
+    for desc, long_desc, bit, width in bits:
+        body += BIT.pack(s(desc or f"b{bit}"), s(long_desc), bit, width, 0)
+    body += strings.data
+
+    size = HDR.size + len(body)
+    return HDR.pack(MAGIC, VERSION, len(dev_recs), size, zlib.crc32(body)) + body
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("json", nargs="+", help="device descriptions")
+    parser.add_argument("-o", "--output", required=True, help="image to write")
+    parser.add_argument("--max", type=lambda v: int(v, 0), default=0x10000, help="partition size")
+    args = parser.parse_args()
+
+    devices = []
+    for path in args.json:
+        with open(path) as f:
+            devices.append(json.load(f))
+    image = build(devices)
+    if len(image) > args.max:
+        sys.exit(f"image is {len(image)} bytes, partition holds {args.max}")
+    with open(args.output, "wb") as f:
+        f.write(image)
+    print(f"{len(devices)} device(s), {len(image)} bytes")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,200 @@
+#!/usr/bin/env python3
+"""Decode the binary sample stream of `bq_telem` into CSV.
+
+Frames are COBS encoded and delimited by zero bytes, see main/bq_telem.h:
+
+    0x00  COBS( header  payload  CRC-32 )  0x00
+
+    tools/telem.py /dev/ttyACM0              # USB-Serial-JTAG (needs pyserial)
+    tools/telem.py udp://239.255.66.1:5566   # multicast group
+    tools/telem.py tcp://192.168.1.50:5567   # resumable stream
+    tools/telem.py capture.bin > samples.csv
+
+Start the stream on the device with `bq_telem --on usb`, `--on mcast` or
+`--on tcp`. Console text on the same port is skipped, and frames that fail
+the CRC are counted and dropped. Gaps in the frame sequence numbers (lost
+datagrams on multicast) are reported on stderr, and so are events (pack
+attach/detach, anomalies, restarts). The numbers jump ahead at a device
+restart; a gap that ends at the restart event is reported as such.
+
+On tcp:// the connection is reopened whenever it drops, asking the device
+to resume after the last frame received, so a capture has no gaps as long
+as the device still holds the frames.
+"""
+
+import argparse
+import os
+import socket
+import stat
+import struct
+import sys
+import time
+import zlib
+
+VERSION = 1
+HDR = struct.Struct("<BBHI")
+SAMPLE = struct.Struct("<qqBBHhH4HHIII")
+EVENT = struct.Struct("<qqBB30s")
+
+# frame types
+SAMPLES = 1
+EVENTS = 2
+
+BOOT = 4
+EVENT_KINDS = {1: "attach", 2: "detach", 3: "anomaly", BOOT: "boot"}
+RECONNECT_S = 2
+
+COLUMNS = ("seq", "mono_us", "wall_us", "pack", "rsoc", "voltage_mv", "current_ma", "temp_dk",
+           "cell1_mv", "cell2_mv", "cell3_mv", "cell4_mv", "battery_status", "operation_status",
+           "safety_alert", "safety_status")
+
+
+def cobs_decode(data):
+    out = bytearray()
+    i = 0
+    while i < len(data):
+        code = data[i]
+        if code == 0 or i + code > len(data):
+            return None
+        out += data[i + 1:i + code]
+        i += code
+        if code < 0xFF and i < len(data):
+            out.append(0)
+    return bytes(out)
+
+
+def frames(stream):
+    """Yield the raw bytes between zero delimiters."""
+    buf = bytearray()
+    while True:
+        chunk = stream.read(4096)
+        if not chunk:
+            return
+        buf += chunk
+        parts = buf.split(b"\0")
+        buf = parts.pop()
+        for part in parts:
+            if part:
+                yield bytes(part)
+
+
+class TcpReader:
+    """Reconnects when the connection drops and resumes after `last_seq`."""
+
+    def __init__(self, host, port):
+        self.addr = (host, int(port))
+        self.last_seq = None
+        self.sock = None
+
+    def connect(self):
+        while True:
+            try:
+                sock = socket.create_connection(self.addr, timeout=10)
+                sock.settimeout(None)
+                if self.last_seq is not None:
+                    sock.sendall(f"resume {self.last_seq}\n".encode())
+                return sock
+            except OSError as e:
+                print(f"{self.addr[0]}:{self.addr[1]}: {e}, retrying", file=sys.stderr)
+                time.sleep(RECONNECT_S)
+
+    def read(self, n):
+        while True:
+            if self.sock is None:
+                self.sock = self.connect()
+                # ends a frame cut short by the drop, the CRC rejects it
+                return b"\0"
+            try:
+                data = self.sock.recv(n)
+            except OSError:
+                data = b""
+            if data:
+                return data
+            print("connection lost, resuming", file=sys.stderr)
+            self.sock.close()
+            self.sock = None
+            time.sleep(RECONNECT_S)
+
+
+def open_input(path):
+    if path.startswith("tcp://"):
+        host, port = path[6:].rsplit(":", 1)
+        return TcpReader(host, port)
+    if path.startswith("udp://"):
+        group, port = path[6:].rsplit(":", 1)
+        sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM, socket.IPPROTO_UDP)
+        sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        sock.bind(("", int(port)))
+        mreq = struct.pack("4s4s", socket.inet_aton(group), socket.inet_aton("0.0.0.0"))
+        sock.setsockopt(socket.IPPROTO_IP, socket.IP_ADD_MEMBERSHIP, mreq)
+
+        class Reader:
+            def read(self, n):
+                return sock.recv(65536)
+
+        return Reader()
+    if stat.S_ISCHR(os.stat(path).st_mode):
+        import serial  # pyserial
+        port = serial.Serial(path, timeout=1)
+
+        class Reader:
+            def read(self, n):
+                while True:
+                    data = port.read(n)
+                    if data:
+                        return data
+
+        return Reader()
+    return open(path, "rb")
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    ap.add_argument("input", help="serial port, udp://<group>:<port>, tcp://<host>:<port> or capture file")
+    args = ap.parse_args()
+
+    bad = 0
+    last_seq = None
+    source = open_input(args.input)
+    print(",".join(COLUMNS))
+    try:
+        for raw in frames(source):
+            frame = cobs_decode(raw)
+            if frame is None or len(frame) < HDR.size + 4 or \
+                    zlib.crc32(frame[:-4]) != struct.unpack_from("<I", frame, len(frame) - 4)[0]:
+                bad += 1
+                continue
+            version, ftype, count, seq = HDR.unpack_from(frame)
+            if version != VERSION:
+                bad += 1
+                continue
+            if last_seq is not None and seq != (last_seq + 1) & 0xFFFFFFFF:
+                # the numbers jump ahead at a restart, the boot event is the first frame after it
+                if ftype == EVENTS and count and EVENT.unpack_from(frame, HDR.size)[3] == BOOT:
+                    print(f"device restarted, frames continue at {seq}", file=sys.stderr)
+                else:
+                    print(f"frames {last_seq + 1}..{seq - 1} lost", file=sys.stderr)
+            last_seq = seq
+            if isinstance(source, TcpReader):
+                source.last_seq = seq
+            if ftype == EVENTS:
+                for i in range(count):
+                    mono_us, wall_us, pack, kind, text = EVENT.unpack_from(frame, HDR.size + i * EVENT.size)
+                    text = text.rstrip(b"\0").decode(errors="replace")
+                    print(f"event {seq} {mono_us} {wall_us} pack {pack} {EVENT_KINDS.get(kind, kind)}: {text}",
+                          file=sys.stderr)
+                continue
+            if ftype != SAMPLES:
+                continue
+            for i in range(count):
+                rec = SAMPLE.unpack_from(frame, HDR.size + i * SAMPLE.size)
+                print(",".join(str(v) for v in (seq,) + rec))
+            sys.stdout.flush()
+    except KeyboardInterrupt:
+        pass
+    if bad:
+        print(f"{bad} damaged frames or console text skipped", file=sys.stderr)
+
+
+if __name__ == "__main__":
+    main()